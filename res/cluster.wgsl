@@ -0,0 +1,85 @@
+// Bins the point/spot lights into a froxel grid (screen tiles x exponential depth slices), one invocation per cluster
+
+// Must match ClusteredLighting.hpp
+const CLUSTER_X = 16u;
+const CLUSTER_Y = 9u;
+const CLUSTER_Z = 24u;
+const CLUSTER_COUNT = CLUSTER_X * CLUSTER_Y * CLUSTER_Z;
+const MAX_LIGHTS_PER_CLUSTER = 127u;
+const CLUSTER_STRIDE = MAX_LIGHTS_PER_CLUSTER + 1u; // Count first, then the light indices
+
+struct PointLight {
+	positionRange: vec4f,
+	colorIntensity: vec4f,
+	directionCone: vec4f,
+}
+
+struct ClusterUniforms {
+	inverseProjection: mat4x4f,
+	viewMatrix: mat4x4f,
+	screenSize: vec2f,
+	zNear: f32,
+	zFar: f32,
+	lightCount: u32,
+}
+
+@group(0) @binding(0) var<uniform> u_cluster: ClusterUniforms;
+@group(0) @binding(1) var<storage, read> u_lights: array<PointLight>;
+@group(0) @binding(2) var<storage, read_write> u_clusterLights: array<u32>;
+@group(0) @binding(3) var<storage, read_write> u_overflow: atomic<u32>; // Clusters that dropped lights, cleared before every dispatch
+
+// Pixel on the near plane to view space (the camera looks down +Z)
+fn screenToView(screen: vec2f) -> vec3f {
+	let ndc = vec2f(screen.x / u_cluster.screenSize.x * 2.0 - 1.0, 1.0 - screen.y / u_cluster.screenSize.y * 2.0);
+	let view = u_cluster.inverseProjection * vec4f(ndc, 0.0, 1.0);
+	return view.xyz / view.w;
+}
+
+fn sliceDepth(slice: u32) -> f32 {
+	return u_cluster.zNear * pow(u_cluster.zFar / u_cluster.zNear, f32(slice) / f32(CLUSTER_Z));
+}
+
+@compute @workgroup_size(64)
+fn cs_main(@builtin(global_invocation_id) id: vec3u) {
+	let clusterIndex = id.x;
+	if (clusterIndex >= CLUSTER_COUNT) {
+		return;
+	}
+	let x = clusterIndex % CLUSTER_X;
+	let y = (clusterIndex / CLUSTER_X) % CLUSTER_Y;
+	let z = clusterIndex / (CLUSTER_X * CLUSTER_Y);
+
+	// Tile corners on the near plane, pushed out along their rays to both ends of the slice
+	let tileSize = u_cluster.screenSize / vec2f(f32(CLUSTER_X), f32(CLUSTER_Y));
+	let cornerA = screenToView(vec2f(f32(x), f32(y)) * tileSize);
+	let cornerB = screenToView(vec2f(f32(x + 1u), f32(y + 1u)) * tileSize);
+	let nearDepth = sliceDepth(z);
+	let farDepth = sliceDepth(z + 1u);
+	let a = cornerA * (nearDepth / cornerA.z);
+	let b = cornerB * (nearDepth / cornerB.z);
+	let c = cornerA * (farDepth / cornerA.z);
+	let d = cornerB * (farDepth / cornerB.z);
+	let aabbMin = min(min(a, b), min(c, d));
+	let aabbMax = max(max(a, b), max(c, d));
+
+	// Sphere vs AABB, lights stay in index order so the result matches brute force shading. A full cluster keeps counting,
+	// so dropping lights doesn't go unnoticed
+	let offset = clusterIndex * CLUSTER_STRIDE;
+	var count = 0u;
+	for (var i = 0u; i < u_cluster.lightCount; i++) {
+		let light = u_lights[i];
+		let center = (u_cluster.viewMatrix * vec4f(light.positionRange.xyz, 1.0)).xyz;
+		let closest = clamp(center, aabbMin, aabbMax);
+		let delta = closest - center;
+		if (dot(delta, delta) <= light.positionRange.w * light.positionRange.w) {
+			if (count < MAX_LIGHTS_PER_CLUSTER) {
+				u_clusterLights[offset + 1u + count] = i;
+			}
+			count++;
+		}
+	}
+	u_clusterLights[offset] = min(count, MAX_LIGHTS_PER_CLUSTER);
+	if (count > MAX_LIGHTS_PER_CLUSTER) {
+		atomicAdd(&u_overflow, 1u);
+	}
+}
@@ -7,67 +7,309 @@ struct MyUniforms { // Total size of the struct has to be a multiple of the alig
 	modelMatrix: mat4x4f,
 	color: vec4f,
 	time: f32,
+	frame: u32,
 };
 
+struct ObjectData {
+	modelMatrix: mat4x4f,
+}
+
+struct MaterialUniforms {
+	baseColor: vec4f, // Alpha is the opacity
+	virtualTexture: vec4u, // Pages per side at mip 0, mip count, first feedback page (see VirtualTextureCache::GetShaderParameters)
+}
+
+struct MaterialData { // TEXTURE_ARRAY: every material in one storage buffer
+	baseColor: vec4f,
+	uvTransform: vec4f, // Where the texture is in its layer: scale xy, offset zw
+	layer: u32,
+}
+
 struct LightingUniforms {
 	directions: array<vec4f, 2>,
 	colors: array<vec4f, 2>,
 }
 
+struct PointLight {
+	positionRange: vec4f, // xyz position, w range
+	colorIntensity: vec4f, // rgb color, w intensity
+	directionCone: vec4f, // xyz spot direction, w cosine of the outer angle (-2 for point lights)
+}
+
+struct ClusterUniforms {
+	inverseProjection: mat4x4f,
+	viewMatrix: mat4x4f,
+	screenSize: vec2f,
+	zNear: f32,
+	zFar: f32,
+	lightCount: u32,
+}
+
+struct ShadowUniforms {
+	viewProjections: array<mat4x4f, 4>, // Per cascade
+	splits: vec4f, // Far view depth of each cascade
+	texelSizes: vec4f,
+}
+
+// Must match CascadedShadows.hpp
+const SHADOW_CASCADE_COUNT = 4u;
+const SHADOW_MAP_SIZE = 2048.0;
+
+// Must match ClusteredLighting.hpp (and res/cluster.wgsl)
+const CLUSTER_X = 16u;
+const CLUSTER_Y = 9u;
+const CLUSTER_Z = 24u;
+const MAX_LIGHTS_PER_CLUSTER = 127u;
+const CLUSTER_STRIDE = MAX_LIGHTS_PER_CLUSTER + 1u;
+
+// Must match VirtualTexture.hpp
+const VT_TILE_SIZE = 128.0;
+const VT_TILE_BORDER = 4.0;
+const VT_PADDED_TILE_SIZE = 136.0;
+
 const pi = 3.14159265359;
+
+// Permutations: the C++ side picks a pipeline per material (see PipelineKey in Main.hpp), so each draw only runs what it needs.
+// Overrides are set per pipeline, #ifdef blocks change the interface and need their own shader module
+override DIRECTIONAL_LIGHT_COUNT: u32 = 2u; // At most 2 (LightingUniforms)
+override POINT_LIGHTS: bool = true;
+override BRUTE_FORCE_LIGHTS: bool = false; // Shade with every light instead of the cluster's list (reference for validation)
+override USE_TEXTURE: bool = true;
+override ALPHA_TEST: bool = false;
+override ALPHA_CUTOFF: f32 = 0.5;
+override SHADOWS: bool = true; // Directional light #0 only
+override COUNT_FRAGMENTS: bool = false; // Adds every invocation to u_fragmentCount (RunPrepassBenchmark)
 @group(0) @binding(0) var<uniform> u_myUniforms: MyUniforms;
-@group(0) @binding(1) var u_baseColorTexture: texture_2d<f32>;
 @group(0) @binding(2) var u_textureSampler: sampler;
 @group(0) @binding(3) var<uniform> u_lighting: LightingUniforms;
+@group(0) @binding(4) var<storage, read> u_objects: array<ObjectData>; // Indexed by the draw's first instance
+@group(0) @binding(5) var<storage, read> u_lights: array<PointLight>;
+@group(0) @binding(6) var<storage, read> u_clusterLights: array<u32>; // Filled by res/cluster.wgsl
+@group(0) @binding(7) var<uniform> u_cluster: ClusterUniforms;
+@group(0) @binding(8) var u_shadowMap: texture_depth_2d_array;
+@group(0) @binding(9) var u_shadowSampler: sampler_comparison;
+@group(0) @binding(10) var<uniform> u_shadow: ShadowUniforms;
+@group(0) @binding(13) var<storage, read_write> u_fragmentCount: atomic<u32>;
+#ifdef TEXTURE_ARRAY
+@group(0) @binding(12) var<storage, read> u_drawInstances: array<vec2u>; // Object, material. Indexed by the instance, see encodeRenderQueue
+@group(1) @binding(0) var u_textureArray: texture_2d_array<f32>;
+@group(1) @binding(1) var<storage, read> u_materials: array<MaterialData>;
+#else
+@group(1) @binding(0) var u_baseColorTexture: texture_2d<f32>;
+@group(1) @binding(1) var<uniform> u_material: MaterialUniforms;
+#endif
+#ifdef VIRTUAL_TEXTURE
+@group(0) @binding(11) var<storage, read_write> u_feedback: array<atomic<u32>>; // One bit per page, read back by VirtualTextureCache
+@group(1) @binding(2) var u_pageTable: texture_2d<f32>; // u_baseColorTexture is the tile cache then
+#endif
 
 // The struct passed to the vertex assembler stage
 struct VertexInput {
 	@location(0) position: vec3f,
 	@location(1) normal: vec3f,
+#ifdef VERTEX_COLOR
 	@location(2) color: vec3f,
+#endif
 	@location(3) uv: vec2f,
 };
 
 // Cannot directly send struct to fragment through C++, must return it from vertex shader
 struct VertexOutput {
-	@builtin(position) position: vec4f, // @builtin(position) is required by the rasterizer
-	@location(0) color: vec3f,
+	@invariant @builtin(position) position: vec4f, // @builtin(position) is required by the rasterizer. Invariant so the depth matches vs_depth exactly
 	@location(1) normal: vec3f,
 	@location(2) uv: vec2f,
+	@location(3) worldPosition: vec3f,
+#ifdef VERTEX_COLOR
+	@location(0) color: vec3f,
+#endif
+#ifdef TEXTURE_ARRAY
+	@location(4) @interpolate(flat) material: u32,
+#endif
 };
 
 @vertex
-fn vs_main(v_in: VertexInput) -> VertexOutput {
+fn vs_main(v_in: VertexInput, @builtin(instance_index) instanceIndex: u32) -> VertexOutput {
 	var v_out: VertexOutput;
+#ifdef TEXTURE_ARRAY
+	let objectIndex = u_drawInstances[instanceIndex].x;
+	v_out.material = u_drawInstances[instanceIndex].y;
+#else
+	let objectIndex = instanceIndex;
+#endif
+	let modelMatrix = u_myUniforms.modelMatrix * u_objects[objectIndex].modelMatrix;
 	v_out.position =
 		u_myUniforms.projectionMatrix *
 		u_myUniforms.viewMatrix *
-		u_myUniforms.modelMatrix *
+		modelMatrix *
 		vec4f(
 			v_in.position,
 			1.0
 		);
-	v_out.normal = (u_myUniforms.modelMatrix * vec4f(v_in.normal, 0.0)).xyz;
+	v_out.normal = (modelMatrix * vec4f(v_in.normal, 0.0)).xyz;
+	v_out.worldPosition = (modelMatrix * vec4f(v_in.position, 1.0)).xyz;
+#ifdef VERTEX_COLOR
 	v_out.color = v_in.color;
+#endif
 	v_out.uv = v_in.uv;
 	return v_out;
 }
 
+// Depth pre-pass (position-only stream, no fragment stage). Must compute the position exactly like vs_main, the main pass tests with Equal
+@vertex
+fn vs_depth(@location(0) position: vec3f, @builtin(instance_index) instanceIndex: u32) -> @invariant @builtin(position) vec4f {
+	let modelMatrix = u_myUniforms.modelMatrix * u_objects[instanceIndex].modelMatrix;
+	return
+		u_myUniforms.projectionMatrix *
+		u_myUniforms.viewMatrix *
+		modelMatrix *
+		vec4f(
+			position,
+			1.0
+		);
+}
+
+// Same froxels as cs_main: pixel tile and exponential view depth slice
+fn clusterIndex(fragCoord: vec2f, viewDepth: f32) -> u32 {
+	let tile = min(vec2u(fragCoord / u_cluster.screenSize * vec2f(f32(CLUSTER_X), f32(CLUSTER_Y))), vec2u(CLUSTER_X - 1u, CLUSTER_Y - 1u));
+	let slice = log(max(viewDepth, u_cluster.zNear) / u_cluster.zNear) / log(u_cluster.zFar / u_cluster.zNear) * f32(CLUSTER_Z);
+	return tile.x + tile.y * CLUSTER_X + min(u32(slice), CLUSTER_Z - 1u) * CLUSTER_X * CLUSTER_Y;
+}
+
+// 0 in shadow, 1 lit. Picks the first cascade that covers the view depth, past the last one everything is lit
+fn shadowFactor(worldPosition: vec3f, normal: vec3f, viewDepth: f32) -> f32 {
+	var cascade = SHADOW_CASCADE_COUNT;
+	for (var i = 0u; i < SHADOW_CASCADE_COUNT; i++) {
+		if (viewDepth <= u_shadow.splits[i]) {
+			cascade = i;
+			break;
+		}
+	}
+	if (cascade == SHADOW_CASCADE_COUNT) {
+		return 1.0;
+	}
+
+	// Normal offset against acne, then 3x3 taps of 2x2 hardware PCF
+	let offsetPosition = worldPosition + normal * u_shadow.texelSizes[cascade] * 1.5;
+	let clip = u_shadow.viewProjections[cascade] * vec4f(offsetPosition, 1.0);
+	let uv = clip.xy * vec2f(0.5, -0.5) + 0.5;
+	let texel = 1.0 / SHADOW_MAP_SIZE;
+	var lit = 0.0;
+	for (var y = -1; y <= 1; y++) {
+		for (var x = -1; x <= 1; x++) {
+			lit += textureSampleCompareLevel(u_shadowMap, u_shadowSampler, uv + vec2f(f32(x), f32(y)) * texel, cascade, clip.z);
+		}
+	}
+	return lit / 9.0;
+}
+
+// Windowed inverse square falloff (exactly zero at the range, so culling changes nothing)
+fn pointLightShading(light: PointLight, position: vec3f, normal: vec3f) -> vec3f {
+	let toLight = light.positionRange.xyz - position;
+	let lightDistance = length(toLight);
+	let direction = toLight / max(lightDistance, 1e-4);
+	let falloff = clamp(1.0 - pow(lightDistance / light.positionRange.w, 4.0), 0.0, 1.0);
+	var attenuation = falloff * falloff / (lightDistance * lightDistance + 1.0);
+	// Spot cone (point lights have a cosine below -1, so this is 1)
+	let cosOuter = light.directionCone.w;
+	attenuation *= smoothstep(cosOuter, cosOuter + 0.05, dot(-direction, light.directionCone.xyz));
+	return max(0.0, dot(direction, normal)) * attenuation * light.colorIntensity.rgb * light.colorIntensity.w;
+}
+
+#ifdef VIRTUAL_TEXTURE
+// Asks for the page at the mip the hardware would pick (one fragment of each 4x4 block per frame, taking turns) and samples
+// whatever the page table has for it, which may be a coarser mip until the tile streams in
+fn sampleVirtualTexture(uv: vec2f, fragCoord: vec2f) -> vec4f {
+	let params = u_material.virtualTexture;
+	let texelCoord = uv * f32(params.x) * VT_TILE_SIZE;
+	let dx = dpdx(texelCoord);
+	let dy = dpdy(texelCoord);
+	let lod = 0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1.0));
+	let mip = min(u32(lod), params.y - 1u);
+	let wrappedUv = fract(uv);
+	let pages = params.x >> mip;
+	let page = min(vec2u(wrappedUv * f32(pages)), vec2u(pages - 1u));
+
+	let pixel = vec2u(fragCoord);
+	if ((pixel.x & 3u) + (pixel.y & 3u) * 4u == u_myUniforms.frame % 16u) {
+		var bit = params.z;
+		for (var i = 0u; i < mip; i++) {
+			bit += (params.x >> i) * (params.x >> i);
+		}
+		bit += page.y * pages + page.x;
+		atomicOr(&u_feedback[bit / 32u], 1u << (bit % 32u));
+	}
+
+	// Tile x, tile y, mip of the tile
+	let entry = vec3u(round(textureLoad(u_pageTable, page, i32(mip)).xyz * 255.0));
+	let tileUv = fract(wrappedUv * f32(params.x >> entry.z));
+	let cacheCoord = vec2f(entry.xy) * VT_PADDED_TILE_SIZE + VT_TILE_BORDER + tileUv * VT_TILE_SIZE;
+	return textureSampleLevel(u_baseColorTexture, u_textureSampler, cacheCoord / vec2f(textureDimensions(u_baseColorTexture)), 0.0);
+}
+#endif
+
 @fragment
 fn fs_main(f_in: VertexOutput) -> @location(0) vec4f {
+	if (COUNT_FRAGMENTS) {
+		atomicAdd(&u_fragmentCount, 1u);
+	}
 	let normal = normalize(f_in.normal);
+	let viewDepth = (u_myUniforms.viewMatrix * vec4f(f_in.worldPosition, 1.0)).z;
 	var shading = vec3f(0.0);
-	for (var i: i32 = 0; i < 2; i++) {
+	for (var i = 0u; i < min(DIRECTIONAL_LIGHT_COUNT, 2u); i++) {
 		let direction = normalize(u_lighting.directions[i].xyz);
-		let color = u_lighting.colors[i].rgb;
+		var color = u_lighting.colors[i].rgb;
+		if (SHADOWS && i == 0u) {
+			color *= shadowFactor(f_in.worldPosition, normal, viewDepth);
+		}
 		shading += max(0.0, dot(direction, normal)) * color;
 	}
 
-	// Sample texture
-	let baseColor = textureSample(u_baseColorTexture, u_textureSampler, f_in.uv).rgb;
+	// Sample texture (before the loops below, whose trip count varies per fragment)
+#ifdef TEXTURE_ARRAY
+	let material = u_materials[f_in.material];
+#else
+	let material = u_material;
+#endif
+	var texel = vec4f(1.0);
+	if (USE_TEXTURE) {
+#ifdef TEXTURE_ARRAY
+		// Only the first mip, so the derivatives jumping at the fract() seam don't matter
+		texel = textureSample(u_textureArray, u_textureSampler, fract(f_in.uv) * material.uvTransform.xy + material.uvTransform.zw, material.layer);
+#else
+#ifdef VIRTUAL_TEXTURE
+		texel = sampleVirtualTexture(f_in.uv, f_in.position.xy);
+#else
+		texel = textureSample(u_baseColorTexture, u_textureSampler, f_in.uv);
+#endif
+#endif
+	}
+	var baseColor = texel.rgb * material.baseColor.rgb;
+#ifdef VERTEX_COLOR
+	baseColor *= f_in.color;
+#endif
+	let alpha = u_myUniforms.color.a * material.baseColor.a * texel.a;
+	if (ALPHA_TEST && alpha < ALPHA_CUTOFF) {
+		discard;
+	}
+
+	// Point and spot lights
+	if (POINT_LIGHTS) {
+		if (BRUTE_FORCE_LIGHTS) {
+			for (var i = 0u; i < u_cluster.lightCount; i++) {
+				shading += pointLightShading(u_lights[i], f_in.worldPosition, normal);
+			}
+		} else {
+			let offset = clusterIndex(f_in.position.xy, viewDepth) * CLUSTER_STRIDE;
+			let count = min(u_clusterLights[offset], MAX_LIGHTS_PER_CLUSTER);
+			for (var i = 0u; i < count; i++) {
+				shading += pointLightShading(u_lights[u_clusterLights[offset + 1u + i]], f_in.worldPosition, normal);
+			}
+		}
+	}
+
 	let color = baseColor * shading;
 
 	// Gamma correction (Not needed)
 	// let linear_color = pow(color, vec3f(2.2));
-	return vec4f(color, u_myUniforms.color.a);
+	return vec4f(color, alpha);
 }
\ No newline at end of file
@@ -0,0 +1,17 @@
+// Depth-only pass of the cascaded shadow maps (see CascadedShadows)
+
+struct ObjectData {
+	modelMatrix: mat4x4f,
+}
+
+struct CascadeUniforms {
+	viewProjection: mat4x4f, // The light's view projection times the global model matrix
+}
+
+@group(0) @binding(0) var<uniform> u_cascade: CascadeUniforms;
+@group(0) @binding(1) var<storage, read> u_objects: array<ObjectData>; // Indexed by the draw's instance
+
+@vertex
+fn vs_main(@location(0) position: vec3f, @builtin(instance_index) instanceIndex: u32) -> @builtin(position) vec4f {
+	return u_cascade.viewProjection * u_objects[instanceIndex].modelMatrix * vec4f(position, 1.0);
+}
@@ -0,0 +1,30 @@
+// Stretches the dynamic resolution scene target over the swap chain (bilinear)
+
+struct UpscaleUniforms {
+	uvScale: vec2f, // Rendered part of the target, in UVs
+	uvMax: vec2f, // Half a texel inside of it, so the filter never reads past the rendered pixels
+};
+
+@group(0) @binding(0) var u_scene: texture_2d<f32>;
+@group(0) @binding(1) var u_sampler: sampler;
+@group(0) @binding(2) var<uniform> u_upscale: UpscaleUniforms;
+
+struct VertexOutput {
+	@builtin(position) position: vec4f,
+	@location(0) uv: vec2f,
+};
+
+// One triangle covering the screen, no vertex buffer
+@vertex
+fn vs_main(@builtin(vertex_index) vertexIndex: u32) -> VertexOutput {
+	let corner = vec2f(f32((vertexIndex << 1u) & 2u), f32(vertexIndex & 2u));
+	var v_out: VertexOutput;
+	v_out.position = vec4f(corner * vec2f(2.0, -2.0) + vec2f(-1.0, 1.0), 0.0, 1.0);
+	v_out.uv = corner * u_upscale.uvScale;
+	return v_out;
+}
+
+@fragment
+fn fs_main(f_in: VertexOutput) -> @location(0) vec4f {
+	return textureSampleLevel(u_scene, u_sampler, min(f_in.uv, u_upscale.uvMax), 0.0);
+}
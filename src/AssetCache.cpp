@@ -0,0 +1,261 @@
+#include <chrono>
+#include <algorithm>
+
+#include <spdlog/spdlog.h>
+#include <imgui/imgui.h>
+
+#include "AssetCache.hpp"
+#include "ResourceManager.hpp"
+#include "Trace.hpp"
+#include "Stats.hpp"
+
+void AssetCache::Handle::addRef()
+{
+	if (m_asset && m_asset->refCount++ == 0 && m_asset->lruPosition != m_asset->cache->m_unreferenced.end()) {
+		m_asset->cache->m_unreferenced.erase(m_asset->lruPosition);
+		m_asset->lruPosition = m_asset->cache->m_unreferenced.end();
+	}
+}
+
+void AssetCache::Handle::Reset()
+{
+	if (m_asset && --m_asset->refCount == 0) {
+		m_asset->cache->release(*m_asset);
+	}
+	m_asset = nullptr;
+}
+
+void AssetCache::Init(WGPUDevice device)
+{
+	m_device = device;
+}
+
+void AssetCache::Terminate()
+{
+	for (auto& [key, asset] : m_assets) {
+		if (asset->refCount > 0) {
+			SPDLOG_WARN("Asset \"{}\" is still referenced {} times", asset->path.string(), asset->refCount);
+		}
+		unload(*asset);
+	}
+	m_assets.clear();
+	m_unreferenced.clear();
+}
+
+AssetCache::Handle AssetCache::LoadTexture(const std::filesystem::path& path)
+{
+	return acquire(AssetType::Texture, path, {});
+}
+
+AssetCache::Handle AssetCache::LoadShaderModule(const std::filesystem::path& path, const std::vector<std::string>& defines)
+{
+	return acquire(AssetType::ShaderModule, path, defines);
+}
+
+void AssetCache::SetBudget(uint64_t budgetBytes)
+{
+	m_budget = budgetBytes;
+	enforceBudget();
+}
+
+AssetCache::Handle AssetCache::acquire(AssetType type, const std::filesystem::path& path, const std::vector<std::string>& defines)
+{
+	// The same file through a different relative path (or "..") is the same asset
+	std::error_code error;
+	std::filesystem::path canonicalPath = std::filesystem::weakly_canonical(path, error);
+	if (error) {
+		canonicalPath = path.lexically_normal();
+	}
+	std::string key = std::to_string(static_cast<uint32_t>(type)) + "|" + canonicalPath.string();
+	for (const std::string& define : defines) {
+		key += "|" + define;
+	}
+
+	std::unique_ptr<Asset>& asset = m_assets[key];
+	if (!asset) {
+		asset = std::make_unique<Asset>();
+		asset->cache = this;
+		asset->type = type;
+		asset->path = canonicalPath;
+		asset->defines = defines;
+		asset->lruPosition = m_unreferenced.end();
+	}
+	bool resident = asset->texture || asset->shaderModule;
+	if (resident) {
+		++m_hitCount;
+	} else if (!load(*asset)) {
+		return {};
+	}
+	Handle handle(asset.get());
+	if (!resident) {
+		enforceBudget(); // After taking the reference, so the new asset isn't the one evicted
+	}
+	return handle;
+}
+
+bool AssetCache::load(Asset& asset)
+{
+	TRACE_ZONE("AssetCache::load");
+	if (asset.type == AssetType::Texture) {
+		// LoadTexture exits on a file it can't read, a missing one is left to the caller
+		if (!std::filesystem::exists(asset.path)) {
+			SPDLOG_ERROR("Texture \"{}\" not found", asset.path.string());
+			return false;
+		}
+		asset.texture = ResourceManager::LoadTexture(asset.path, m_device, &asset.textureView);
+		asset.bytes = 4ull * wgpuTextureGetWidth(asset.texture) * wgpuTextureGetHeight(asset.texture); // As tracked by LoadTexture
+	} else {
+		asset.shaderModule = ResourceManager::LoadShaderModule(asset.path, m_device, asset.defines);
+		asset.bytes = 0;
+	}
+	if (!asset.texture && !asset.shaderModule) {
+		return false;
+	}
+	if (asset.loadCount++ > 0) {
+		++m_reloadCount;
+		SPDLOG_INFO("Reloaded evicted asset \"{}\"", asset.path.string());
+	}
+	m_residentBytes += asset.bytes;
+	++m_residentCounts[static_cast<uint32_t>(asset.type)];
+	return true;
+}
+
+void AssetCache::unload(Asset& asset)
+{
+	if (!asset.texture && !asset.shaderModule) {
+		return;
+	}
+	if (asset.texture) {
+		wgpuTextureViewRelease(asset.textureView);
+		wgpuTextureDestroy(asset.texture);
+		wgpuTextureRelease(asset.texture);
+		Stats::TrackGpuMemory(Stats::MemoryCategory::Textures, -static_cast<int64_t>(asset.bytes));
+		asset.texture = nullptr;
+		asset.textureView = nullptr;
+	}
+	if (asset.shaderModule) {
+		wgpuShaderModuleRelease(asset.shaderModule);
+		asset.shaderModule = nullptr;
+	}
+	m_residentBytes -= asset.bytes;
+	--m_residentCounts[static_cast<uint32_t>(asset.type)];
+	if (asset.lruPosition != m_unreferenced.end()) {
+		m_unreferenced.erase(asset.lruPosition);
+		asset.lruPosition = m_unreferenced.end();
+	}
+}
+
+void AssetCache::release(Asset& asset)
+{
+	m_unreferenced.push_front(&asset);
+	asset.lruPosition = m_unreferenced.begin();
+	enforceBudget();
+}
+
+void AssetCache::enforceBudget()
+{
+	if (m_budget == 0) {
+		return;
+	}
+	auto trackedBytes = []()
+	{
+		int64_t total = 0;
+		for (uint32_t i = 0; i < static_cast<uint32_t>(Stats::MemoryCategory::Count); ++i) {
+			total += Stats::GetGpuMemory(static_cast<Stats::MemoryCategory>(i));
+		}
+		return static_cast<uint64_t>(std::max<int64_t>(total, 0));
+	};
+	// Shader modules are free, only evicting something with bytes gets us under the budget
+	for (auto it = m_unreferenced.end(); it != m_unreferenced.begin() && trackedBytes() > m_budget;) {
+		Asset* asset = *--it;
+		if (asset->bytes > 0) {
+			it = m_unreferenced.erase(it);
+			asset->lruPosition = m_unreferenced.end();
+			unload(*asset);
+			++m_evictionCount;
+		}
+	}
+}
+
+void AssetCache::RunBenchmark(uint32_t textureCount, uint32_t size)
+{
+	// Noise, so every texture is a distinct file of the full size
+	std::filesystem::path directory = std::filesystem::temp_directory_path() / "asset_benchmark";
+	std::filesystem::create_directories(directory);
+	std::vector<std::filesystem::path> paths;
+	std::vector<uint8_t> pixels(4ull * size * size);
+	uint32_t state = 1;
+	for (uint32_t i = 0; i < textureCount; ++i) {
+		for (uint8_t& value : pixels) {
+			state = state * 1664525u + 1013904223u;
+			value = static_cast<uint8_t>(state >> 24);
+		}
+		paths.push_back(directory / ("texture_" + std::to_string(i) + ".png"));
+		ResourceManager::SavePng(paths.back(), pixels.data(), size, size);
+	}
+
+	// Milliseconds to load every texture, the handles are dropped right after unless kept
+	std::vector<Handle> kept;
+	auto loadAll = [&](bool keep)
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (const std::filesystem::path& path : paths) {
+			Handle handle = LoadTexture(path);
+			if (!handle) {
+				SPDLOG_ERROR("Could not load \"{}\".", path.string());
+			}
+			if (keep) {
+				kept.push_back(std::move(handle));
+			}
+		}
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	};
+	uint64_t previousBudget = m_budget;
+	SetBudget(0);
+	double coldMs = loadAll(false);
+	uint64_t hitCount = m_hitCount;
+	double cachedMs = loadAll(false);
+	hitCount = m_hitCount - hitCount;
+
+	uint64_t evictionCount = m_evictionCount;
+	uint64_t reloadCount = m_reloadCount;
+	SetBudget(1); // Nothing fits, so every unreferenced texture goes
+	evictionCount = m_evictionCount - evictionCount;
+	double reloadMs = loadAll(true); // Held, so they stay through the budget
+	reloadCount = m_reloadCount - reloadCount;
+	bool resident = std::all_of(kept.begin(), kept.end(), [](const Handle& handle) { return handle.GetTexture() != nullptr; });
+
+	SPDLOG_INFO("Asset cache, {} textures of {}x{}: {:.1f} ms cold, {:.3f} ms cached ({} hits), {:.1f} ms after eviction ({} evicted, {} reloaded)",
+		textureCount, size, size, coldMs, cachedMs, hitCount, reloadMs, evictionCount, reloadCount);
+	if (hitCount < textureCount || evictionCount < textureCount || reloadCount < textureCount || !resident) {
+		SPDLOG_ERROR("The asset cache didn't evict and reload every benchmark texture.");
+	}
+
+	kept.clear();
+	SetBudget(previousBudget);
+	std::error_code error;
+	std::filesystem::remove_all(directory, error);
+}
+
+void AssetCache::DrawImGui()
+{
+	ImGui::Begin("Assets");
+	ImGui::Text("Resident: %zu textures (%.1f MB), %zu shader modules", GetResidentCount(AssetType::Texture), m_residentBytes / (1024.0 * 1024.0),
+		GetResidentCount(AssetType::ShaderModule));
+	ImGui::Text("Unreferenced: %zu", m_unreferenced.size());
+	ImGui::Text("Cache hits: %llu, reloads: %llu, evictions: %llu", (unsigned long long)m_hitCount, (unsigned long long)m_reloadCount,
+		(unsigned long long)m_evictionCount);
+	int budgetMB = static_cast<int>(m_budget >> 20);
+	if (ImGui::SliderInt("GPU memory budget (MB)", &budgetMB, 0, 4096)) {
+		SetBudget(static_cast<uint64_t>(budgetMB) << 20);
+	}
+	if (ImGui::TreeNode("Assets")) {
+		for (const auto& [key, asset] : m_assets) {
+			bool resident = asset->texture || asset->shaderModule;
+			ImGui::Text("%s%s: %u refs, %.2f MB%s", asset->path.filename().string().c_str(), asset->defines.empty() ? "" : " (variant)", asset->refCount,
+				asset->bytes / (1024.0 * 1024.0), resident ? "" : ", evicted");
+		}
+		ImGui::TreePop();
+	}
+	ImGui::End();
+}
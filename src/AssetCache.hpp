@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <filesystem>
+#include <unordered_map>
+
+#include <webgpu/webgpu.h>
+
+// Textures and shader modules loaded once per canonical path and load parameters (the #defines of a shader), handed out as
+// ref-counted handles. Assets nobody holds stay resident, so loading them again is free, until the GPU memory tracked by Stats
+// goes over the budget: then the least recently released ones are destroyed. Loading an evicted asset again reloads it
+class AssetCache
+{
+public:
+	enum class AssetType : uint32_t
+	{
+		Texture,
+		ShaderModule,
+		Count
+	};
+
+private:
+	struct Asset
+	{
+		AssetCache* cache = nullptr;
+		AssetType type = AssetType::Texture;
+		std::filesystem::path path; // Canonical
+		std::vector<std::string> defines; // Shader modules only
+		WGPUTexture texture = nullptr;
+		WGPUTextureView textureView = nullptr;
+		WGPUShaderModule shaderModule = nullptr;
+		uint64_t bytes = 0; // Counted against the budget. Shader modules are 0, their GPU size isn't known
+		uint32_t refCount = 0;
+		uint32_t loadCount = 0; // More than 1 once it was evicted and needed again
+		std::list<Asset*>::iterator lruPosition; // In m_unreferenced while resident with refCount 0
+	};
+
+public:
+	// Keeps its asset resident. Copying adds a reference, the last handle to go makes the asset evictable
+	class Handle
+	{
+	public:
+		Handle() = default;
+		Handle(const Handle& other) : m_asset(other.m_asset) { addRef(); }
+		Handle(Handle&& other) noexcept : m_asset(std::exchange(other.m_asset, nullptr)) {}
+		Handle& operator=(Handle other) noexcept { std::swap(m_asset, other.m_asset); return *this; }
+		~Handle() { Reset(); }
+
+		void Reset();
+		explicit operator bool() const { return m_asset != nullptr; }
+
+		WGPUTexture GetTexture() const { return m_asset ? m_asset->texture : nullptr; }
+		WGPUTextureView GetTextureView() const { return m_asset ? m_asset->textureView : nullptr; }
+		WGPUShaderModule GetShaderModule() const { return m_asset ? m_asset->shaderModule : nullptr; }
+	private:
+		friend class AssetCache;
+		explicit Handle(Asset* asset) : m_asset(asset) { addRef(); }
+		void addRef();
+
+		Asset* m_asset = nullptr;
+	};
+
+	void Init(WGPUDevice device);
+	// Every handle has to be gone by then
+	void Terminate();
+
+	// Empty handles when loading fails
+	Handle LoadTexture(const std::filesystem::path& path);
+	Handle LoadShaderModule(const std::filesystem::path& path, const std::vector<std::string>& defines = {});
+
+	// Total tracked GPU memory (every Stats::MemoryCategory) the cache evicts down to, 0 never evicts
+	void SetBudget(uint64_t budgetBytes);
+	uint64_t GetBudget() const { return m_budget; }
+	size_t GetResidentCount(AssetType type) const { return m_residentCounts[static_cast<uint32_t>(type)]; }
+
+	// Loads generated textures cold, from the cache, and again after a budget of 1 byte evicted them, and checks the eviction
+	// and reload counts (App --bench-assets). The budget is restored afterwards
+	void RunBenchmark(uint32_t textureCount, uint32_t size);
+
+	void DrawImGui();
+private:
+	WGPUDevice m_device = nullptr;
+	std::unordered_map<std::string, std::unique_ptr<Asset>> m_assets; // By type, canonical path and defines. Kept when evicted
+	std::list<Asset*> m_unreferenced; // Resident and not held by any handle, most recently released first
+	uint64_t m_budget = 0;
+	uint64_t m_residentBytes = 0;
+	size_t m_residentCounts[static_cast<uint32_t>(AssetType::Count)] = {};
+
+	// Stats
+	uint64_t m_hitCount = 0; // Loads that found the asset resident
+	uint64_t m_reloadCount = 0;
+	uint64_t m_evictionCount = 0;
+
+	Handle acquire(AssetType type, const std::filesystem::path& path, const std::vector<std::string>& defines);
+	bool load(Asset& asset);
+	void unload(Asset& asset);
+	void release(Asset& asset); // Last handle gone
+	void enforceBudget();
+};
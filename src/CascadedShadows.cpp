@@ -0,0 +1,417 @@
+#include <cmath>
+#include <algorithm>
+
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#define GLM_FORCE_LEFT_HANDED
+#include <glm/ext.hpp>
+
+#include <spdlog/spdlog.h>
+#include <imgui/imgui.h>
+
+#include "CascadedShadows.hpp"
+#include "ResourceManager.hpp"
+#include "Stats.hpp"
+#include "Trace.hpp"
+
+bool CascadedShadows::Init(WGPUDevice device, WGPUQueue queue, uint64_t vertexStride)
+{
+	m_device = device;
+	m_queue = queue;
+
+	// Depth array, one layer per cascade
+	WGPUTextureDescriptor textureDesc = {};
+	textureDesc.nextInChain = nullptr;
+	textureDesc.label = "Shadow map";
+	textureDesc.usage = WGPUTextureUsage_RenderAttachment | WGPUTextureUsage_TextureBinding | WGPUTextureUsage_CopyDst;
+	textureDesc.dimension = WGPUTextureDimension_2D;
+	textureDesc.size = {MAP_SIZE, MAP_SIZE, CASCADE_COUNT};
+	textureDesc.format = DEPTH_FORMAT;
+	textureDesc.mipLevelCount = 1;
+	textureDesc.sampleCount = 1;
+	textureDesc.viewFormatCount = 0;
+	textureDesc.viewFormats = nullptr;
+	m_shadowMap = wgpuDeviceCreateTexture(device, &textureDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::RenderTargets, uint64_t(MAP_SIZE) * MAP_SIZE * 4 * CASCADE_COUNT);
+
+	textureDesc.label = "Static shadow cache";
+	textureDesc.usage = WGPUTextureUsage_RenderAttachment | WGPUTextureUsage_CopySrc;
+	textureDesc.size = {MAP_SIZE, MAP_SIZE, CACHED_CASCADE_COUNT};
+	m_staticCache = wgpuDeviceCreateTexture(device, &textureDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::RenderTargets, uint64_t(MAP_SIZE) * MAP_SIZE * 4 * CACHED_CASCADE_COUNT);
+
+	WGPUTextureViewDescriptor viewDesc = {};
+	viewDesc.nextInChain = nullptr;
+	viewDesc.label = "Shadow map view";
+	viewDesc.format = DEPTH_FORMAT;
+	viewDesc.dimension = WGPUTextureViewDimension_2DArray;
+	viewDesc.baseMipLevel = 0;
+	viewDesc.mipLevelCount = 1;
+	viewDesc.baseArrayLayer = 0;
+	viewDesc.arrayLayerCount = CASCADE_COUNT;
+	viewDesc.aspect = WGPUTextureAspect_DepthOnly;
+	m_shadowMapView = wgpuTextureCreateView(m_shadowMap, &viewDesc);
+
+	viewDesc.dimension = WGPUTextureViewDimension_2D;
+	viewDesc.arrayLayerCount = 1;
+	for (uint32_t cascade = 0; cascade < CASCADE_COUNT; ++cascade) {
+		viewDesc.label = "Shadow cascade view";
+		viewDesc.baseArrayLayer = cascade;
+		m_cascadeViews[cascade] = wgpuTextureCreateView(m_shadowMap, &viewDesc);
+	}
+	for (uint32_t layer = 0; layer < CACHED_CASCADE_COUNT; ++layer) {
+		viewDesc.label = "Static shadow cache view";
+		viewDesc.baseArrayLayer = layer;
+		m_staticCacheViews[layer] = wgpuTextureCreateView(m_staticCache, &viewDesc);
+	}
+
+	// Hardware 2x2 PCF per tap
+	WGPUSamplerDescriptor samplerDesc = {};
+	samplerDesc.nextInChain = nullptr;
+	samplerDesc.label = "Shadow sampler";
+	samplerDesc.addressModeU = WGPUAddressMode_ClampToEdge;
+	samplerDesc.addressModeV = WGPUAddressMode_ClampToEdge;
+	samplerDesc.addressModeW = WGPUAddressMode_ClampToEdge;
+	samplerDesc.magFilter = WGPUFilterMode_Linear;
+	samplerDesc.minFilter = WGPUFilterMode_Linear;
+	samplerDesc.mipmapFilter = WGPUMipmapFilterMode_Nearest;
+	samplerDesc.lodMinClamp = 0.0f;
+	samplerDesc.lodMaxClamp = 1.0f;
+	samplerDesc.compare = WGPUCompareFunction_LessEqual;
+	samplerDesc.maxAnisotropy = 1;
+	m_sampler = wgpuDeviceCreateSampler(device, &samplerDesc);
+
+	WGPUBufferDescriptor bufferDesc = {};
+	bufferDesc.nextInChain = nullptr;
+	bufferDesc.mappedAtCreation = false;
+	bufferDesc.usage = WGPUBufferUsage_CopyDst | WGPUBufferUsage_Uniform;
+
+	bufferDesc.label = "Shadow uniform buffer";
+	bufferDesc.size = sizeof(ShadowUniforms);
+	m_uniformBuffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::UniformBuffers, bufferDesc.size);
+
+	bufferDesc.label = "Shadow cascade uniform buffer";
+	bufferDesc.size = CASCADE_UNIFORM_STRIDE * CASCADE_COUNT;
+	m_cascadeUniformBuffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::UniformBuffers, bufferDesc.size);
+
+	// Caster bind group layout (the bind group itself comes with SetObjectBuffer)
+	std::array<WGPUBindGroupLayoutEntry, 2> layoutEntries = {};
+	layoutEntries[0].nextInChain = nullptr;
+	layoutEntries[0].binding = 0;
+	layoutEntries[0].visibility = WGPUShaderStage_Vertex;
+	layoutEntries[0].buffer.nextInChain = nullptr;
+	layoutEntries[0].buffer.type = WGPUBufferBindingType_Uniform;
+	layoutEntries[0].buffer.hasDynamicOffset = true; // Selects the cascade
+	layoutEntries[0].buffer.minBindingSize = sizeof(glm::mat4x4);
+	layoutEntries[1].nextInChain = nullptr;
+	layoutEntries[1].binding = 1;
+	layoutEntries[1].visibility = WGPUShaderStage_Vertex;
+	layoutEntries[1].buffer.nextInChain = nullptr;
+	layoutEntries[1].buffer.type = WGPUBufferBindingType_ReadOnlyStorage;
+	layoutEntries[1].buffer.hasDynamicOffset = false;
+	layoutEntries[1].buffer.minBindingSize = sizeof(glm::mat4x4);
+	WGPUBindGroupLayoutDescriptor bindGroupLayoutDesc = {};
+	bindGroupLayoutDesc.nextInChain = nullptr;
+	bindGroupLayoutDesc.label = "Shadow caster binding group layout";
+	bindGroupLayoutDesc.entryCount = static_cast<uint32_t>(layoutEntries.size());
+	bindGroupLayoutDesc.entries = layoutEntries.data();
+	m_bindGroupLayout = wgpuDeviceCreateBindGroupLayout(device, &bindGroupLayoutDesc);
+
+	// Depth-only pipeline
+	WGPUShaderModule shaderModule = ResourceManager::LoadShaderModule(RESOURCE_DIR "shadow.wgsl", device);
+	if (!shaderModule) {
+		SPDLOG_ERROR("Failed to create the shadow shader module!");
+		return false;
+	}
+
+	WGPUPipelineLayoutDescriptor layoutDesc = {};
+	layoutDesc.nextInChain = nullptr;
+	layoutDesc.label = "Shadow caster pipeline layout";
+	layoutDesc.bindGroupLayoutCount = 1;
+	layoutDesc.bindGroupLayouts = &m_bindGroupLayout;
+	m_pipelineLayout = wgpuDeviceCreatePipelineLayout(device, &layoutDesc);
+
+	// Positions only (vertexStride apart)
+	WGPUVertexAttribute positionAttrib = {};
+	positionAttrib.format = WGPUVertexFormat_Float32x3;
+	positionAttrib.offset = 0;
+	positionAttrib.shaderLocation = 0;
+	WGPUVertexBufferLayout vertexBufferLayout = {};
+	vertexBufferLayout.arrayStride = vertexStride;
+	vertexBufferLayout.stepMode = WGPUVertexStepMode_Vertex;
+	vertexBufferLayout.attributeCount = 1;
+	vertexBufferLayout.attributes = &positionAttrib;
+
+	WGPUDepthStencilState depthStencilState = {};
+	depthStencilState.nextInChain = nullptr;
+	depthStencilState.format = DEPTH_FORMAT;
+	depthStencilState.depthWriteEnabled = true;
+	depthStencilState.depthCompare = WGPUCompareFunction_Less;
+	depthStencilState.stencilFront.compare = WGPUCompareFunction_Always;
+	depthStencilState.stencilFront.failOp = WGPUStencilOperation_Keep;
+	depthStencilState.stencilFront.depthFailOp = WGPUStencilOperation_Keep;
+	depthStencilState.stencilFront.passOp = WGPUStencilOperation_Keep;
+	depthStencilState.stencilBack = depthStencilState.stencilFront;
+	depthStencilState.stencilReadMask = 0;
+	depthStencilState.stencilWriteMask = 0;
+	// Against acne on surfaces facing away from the light
+	depthStencilState.depthBias = 4;
+	depthStencilState.depthBiasSlopeScale = 2.0f;
+	depthStencilState.depthBiasClamp = 0.0f;
+
+	WGPURenderPipelineDescriptor pipelineDesc = {};
+	pipelineDesc.nextInChain = nullptr;
+	pipelineDesc.label = "Shadow caster pipeline";
+	pipelineDesc.layout = m_pipelineLayout;
+	pipelineDesc.vertex.nextInChain = nullptr;
+	pipelineDesc.vertex.module = shaderModule;
+	pipelineDesc.vertex.entryPoint = "vs_main";
+	pipelineDesc.vertex.constantCount = 0;
+	pipelineDesc.vertex.constants = nullptr;
+	pipelineDesc.vertex.bufferCount = 1;
+	pipelineDesc.vertex.buffers = &vertexBufferLayout;
+	pipelineDesc.primitive.nextInChain = nullptr;
+	pipelineDesc.primitive.topology = WGPUPrimitiveTopology_TriangleList;
+	pipelineDesc.primitive.stripIndexFormat = WGPUIndexFormat_Undefined;
+	pipelineDesc.primitive.frontFace = WGPUFrontFace_CCW;
+	pipelineDesc.primitive.cullMode = WGPUCullMode_None; // Same as the main pipeline, the boat isn't closed
+	pipelineDesc.depthStencil = &depthStencilState;
+	pipelineDesc.multisample.nextInChain = nullptr;
+	pipelineDesc.multisample.count = 1;
+	pipelineDesc.multisample.mask = ~0u;
+	pipelineDesc.multisample.alphaToCoverageEnabled = false;
+	pipelineDesc.fragment = nullptr; // Depth only
+	m_pipeline = wgpuDeviceCreateRenderPipeline(device, &pipelineDesc);
+	wgpuShaderModuleRelease(shaderModule);
+
+	return m_shadowMapView != nullptr && m_pipeline != nullptr;
+}
+
+void CascadedShadows::Terminate()
+{
+	if (m_pipeline) {
+		wgpuRenderPipelineRelease(m_pipeline);
+		wgpuPipelineLayoutRelease(m_pipelineLayout);
+		m_pipeline = nullptr;
+	}
+	if (m_bindGroup) {
+		wgpuBindGroupRelease(m_bindGroup);
+		m_bindGroup = nullptr;
+	}
+	if (m_bindGroupLayout) {
+		wgpuBindGroupLayoutRelease(m_bindGroupLayout);
+		m_bindGroupLayout = nullptr;
+	}
+	for (WGPUBuffer* buffer : {&m_uniformBuffer, &m_cascadeUniformBuffer}) {
+		if (*buffer) {
+			wgpuBufferDestroy(*buffer);
+			wgpuBufferRelease(*buffer);
+			*buffer = nullptr;
+		}
+	}
+	if (m_sampler) {
+		wgpuSamplerRelease(m_sampler);
+		m_sampler = nullptr;
+	}
+	if (m_shadowMap) {
+		for (WGPUTextureView view : m_cascadeViews) {
+			wgpuTextureViewRelease(view);
+		}
+		for (WGPUTextureView view : m_staticCacheViews) {
+			wgpuTextureViewRelease(view);
+		}
+		wgpuTextureViewRelease(m_shadowMapView);
+		wgpuTextureDestroy(m_shadowMap);
+		wgpuTextureRelease(m_shadowMap);
+		wgpuTextureDestroy(m_staticCache);
+		wgpuTextureRelease(m_staticCache);
+		m_shadowMap = nullptr;
+	}
+}
+
+void CascadedShadows::SetObjectBuffer(WGPUBuffer buffer, uint64_t size)
+{
+	if (m_bindGroup) {
+		wgpuBindGroupRelease(m_bindGroup);
+	}
+
+	std::array<WGPUBindGroupEntry, 2> bindings = {};
+	bindings[0].nextInChain = nullptr;
+	bindings[0].binding = 0;
+	bindings[0].buffer = m_cascadeUniformBuffer;
+	bindings[0].offset = 0;
+	bindings[0].size = sizeof(glm::mat4x4);
+	bindings[1].nextInChain = nullptr;
+	bindings[1].binding = 1;
+	bindings[1].buffer = buffer;
+	bindings[1].offset = 0;
+	bindings[1].size = size;
+
+	WGPUBindGroupDescriptor bindGroupDesc = {};
+	bindGroupDesc.nextInChain = nullptr;
+	bindGroupDesc.label = "Shadow caster bind group";
+	bindGroupDesc.layout = m_bindGroupLayout;
+	bindGroupDesc.entryCount = static_cast<uint32_t>(bindings.size());
+	bindGroupDesc.entries = bindings.data();
+	m_bindGroup = wgpuDeviceCreateBindGroup(m_device, &bindGroupDesc);
+}
+
+void CascadedShadows::Update(const glm::mat4x4& viewMatrix, const glm::mat4x4& projectionMatrix, const glm::mat4x4& modelMatrix, glm::vec3 lightDirection,
+	float zNear)
+{
+	// Practical split scheme: a blend of uniform and logarithmic splits
+	std::array<float, CASCADE_COUNT + 1> splits;
+	splits[0] = zNear;
+	for (uint32_t i = 1; i <= CASCADE_COUNT; ++i) {
+		float p = static_cast<float>(i) / CASCADE_COUNT;
+		float logarithmic = zNear * std::pow(m_maxDistance / zNear, p);
+		float uniform = zNear + (m_maxDistance - zNear) * p;
+		splits[i] = glm::mix(uniform, logarithmic, SPLIT_LAMBDA);
+		m_uniforms.splits[i - 1] = splits[i];
+	}
+
+	// Frustum corner rays in view space, scaled so z is 1
+	glm::mat4x4 inverseProjection = glm::inverse(projectionMatrix);
+	glm::mat4x4 inverseView = glm::inverse(viewMatrix);
+	std::array<glm::vec3, 4> rays;
+	for (uint32_t corner = 0; corner < 4; ++corner) {
+		glm::vec4 farCorner = inverseProjection * glm::vec4(corner & 1 ? 1.0f : -1.0f, corner & 2 ? 1.0f : -1.0f, 1.0f, 1.0f);
+		glm::vec3 ray = glm::vec3(farCorner) / farCorner.w;
+		rays[corner] = ray / ray.z;
+	}
+
+	glm::vec3 towardsLight = glm::normalize(lightDirection);
+	glm::vec3 up = std::abs(towardsLight.z) > 0.99f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(0.0f, 0.0f, 1.0f);
+	glm::mat4x4 lightRotation = glm::lookAt(glm::vec3(0.0f), -towardsLight, up);
+	glm::mat4x4 inverseLightRotation = glm::inverse(lightRotation);
+
+	for (uint32_t cascade = 0; cascade < CASCADE_COUNT; ++cascade) {
+		// Bounding sphere of the slice, so the size doesn't change when the camera turns
+		std::array<glm::vec3, 8> corners;
+		glm::vec3 center = {0.0f, 0.0f, 0.0f};
+		for (uint32_t corner = 0; corner < 4; ++corner) {
+			corners[corner] = glm::vec3(inverseView * glm::vec4(rays[corner] * splits[cascade], 1.0f));
+			corners[corner + 4] = glm::vec3(inverseView * glm::vec4(rays[corner] * splits[cascade + 1], 1.0f));
+			center += corners[corner] + corners[corner + 4];
+		}
+		center /= 8.0f;
+		float radius = 0.0f;
+		for (const glm::vec3& corner : corners) {
+			radius = std::max(radius, glm::distance(center, corner));
+		}
+		radius = std::ceil(radius * 16.0f) / 16.0f; // Keeps float noise from changing the projection
+
+		// Move in whole texels (near cascades) or in coarse steps padded into the bounds (cached cascades), so the map doesn't shimmer
+		// and cached cascades keep the same matrix until the camera has moved a fair bit
+		float texelSize = 2.0f * radius / MAP_SIZE;
+		bool cached = cascade >= FIRST_CACHED_CASCADE;
+		float step = cached ? std::max(1.0f, std::round(radius * CACHE_SNAP / texelSize)) * texelSize : texelSize;
+		float extent = cached ? radius + step : radius;
+		texelSize = 2.0f * extent / MAP_SIZE;
+		glm::vec3 lightSpaceCenter = glm::floor(glm::vec3(lightRotation * glm::vec4(center, 1.0f)) / step) * step;
+		center = glm::vec3(inverseLightRotation * glm::vec4(lightSpaceCenter, 1.0f));
+
+		float depthRange = extent + CASTER_DISTANCE;
+		glm::mat4x4 lightView = glm::lookAt(center + towardsLight * depthRange, center, up);
+		glm::mat4x4 lightProjection = glm::ortho(-extent, extent, -extent, extent, 0.0f, depthRange + extent);
+		m_uniforms.viewProjections[cascade] = lightProjection * lightView;
+		m_uniforms.texelSizes[cascade] = texelSize;
+		m_casterViewProjections[cascade] = m_uniforms.viewProjections[cascade] * modelMatrix;
+	}
+
+	wgpuQueueWriteBuffer(m_queue, m_uniformBuffer, 0, &m_uniforms, sizeof(ShadowUniforms));
+	for (uint32_t cascade = 0; cascade < CASCADE_COUNT; ++cascade) {
+		wgpuQueueWriteBuffer(m_queue, m_cascadeUniformBuffer, cascade * CASCADE_UNIFORM_STRIDE, &m_casterViewProjections[cascade], sizeof(glm::mat4x4));
+	}
+	Stats::Add(Stats::Counter::BytesUploaded, sizeof(ShadowUniforms) + CASCADE_COUNT * sizeof(glm::mat4x4));
+}
+
+WGPURenderPassEncoder CascadedShadows::beginPass(WGPUCommandEncoder encoder, WGPUTextureView view, bool clear,
+	const WGPURenderPassTimestampWrites* timestampWrites)
+{
+	WGPURenderPassDepthStencilAttachment depthStencilAtt = {};
+	depthStencilAtt.view = view;
+	depthStencilAtt.depthLoadOp = clear ? WGPULoadOp_Clear : WGPULoadOp_Load;
+	depthStencilAtt.depthStoreOp = WGPUStoreOp_Store;
+	depthStencilAtt.depthClearValue = 1.0f;
+	depthStencilAtt.depthReadOnly = false;
+	depthStencilAtt.stencilLoadOp = WGPULoadOp_Undefined;
+	depthStencilAtt.stencilStoreOp = WGPUStoreOp_Undefined;
+	depthStencilAtt.stencilClearValue = 0;
+	depthStencilAtt.stencilReadOnly = true;
+
+	WGPURenderPassDescriptor renderPassDesc = {};
+	renderPassDesc.nextInChain = nullptr;
+	renderPassDesc.label = "Shadow pass";
+	renderPassDesc.colorAttachmentCount = 0;
+	renderPassDesc.colorAttachments = nullptr;
+	renderPassDesc.depthStencilAttachment = &depthStencilAtt;
+	renderPassDesc.occlusionQuerySet = nullptr;
+	renderPassDesc.timestampWrites = timestampWrites;
+	WGPURenderPassEncoder pass = wgpuCommandEncoderBeginRenderPass(encoder, &renderPassDesc);
+	wgpuRenderPassEncoderSetPipeline(pass, m_pipeline);
+	return pass;
+}
+
+void CascadedShadows::Render(WGPUCommandEncoder encoder, GpuProfiler& profiler, const DrawCasters& drawCasters)
+{
+	TRACE_ZONE("CascadedShadows::Render");
+	if (!m_enabled || !m_bindGroup) {
+		return;
+	}
+
+	static const char* cascadeNames[CASCADE_COUNT] = {"Shadow cascade 0", "Shadow cascade 1", "Shadow cascade 2", "Shadow cascade 3"};
+	static const char* cacheNames[CACHED_CASCADE_COUNT] = {"Shadow cache 2", "Shadow cache 3"};
+	for (uint32_t cascade = 0; cascade < CASCADE_COUNT; ++cascade) {
+		uint32_t dynamicOffset = static_cast<uint32_t>(cascade * CASCADE_UNIFORM_STRIDE);
+		bool cached = cascade >= FIRST_CACHED_CASCADE;
+
+		if (cached) {
+			// Redraw the static casters only when the cascade moved (or the light, or the static set changed)
+			uint32_t layer = cascade - FIRST_CACHED_CASCADE;
+			if (m_cachedViewProjections[layer] != m_casterViewProjections[cascade]) {
+				WGPURenderPassEncoder pass = beginPass(encoder, m_staticCacheViews[layer], true, profiler.BeginRenderPass(cacheNames[layer]));
+				wgpuRenderPassEncoderSetBindGroup(pass, 0, m_bindGroup, 1, &dynamicOffset);
+				drawCasters(pass, true);
+				wgpuRenderPassEncoderEnd(pass);
+				wgpuRenderPassEncoderRelease(pass);
+				m_cachedViewProjections[layer] = m_casterViewProjections[cascade];
+				++m_cacheRenders;
+			}
+
+			WGPUImageCopyTexture source = {};
+			source.texture = m_staticCache;
+			source.mipLevel = 0;
+			source.origin = {0, 0, layer};
+			source.aspect = WGPUTextureAspect_All;
+			WGPUImageCopyTexture destination = source;
+			destination.texture = m_shadowMap;
+			destination.origin = {0, 0, cascade};
+			WGPUExtent3D copySize = {MAP_SIZE, MAP_SIZE, 1};
+			wgpuCommandEncoderCopyTextureToTexture(encoder, &source, &destination, &copySize);
+		}
+
+		// Near cascades get everything every frame, cached ones only the dynamic casters on top of the copy
+		WGPURenderPassEncoder pass = beginPass(encoder, m_cascadeViews[cascade], !cached, profiler.BeginRenderPass(cascadeNames[cascade]));
+		wgpuRenderPassEncoderSetBindGroup(pass, 0, m_bindGroup, 1, &dynamicOffset);
+		if (!cached) {
+			drawCasters(pass, true);
+		}
+		drawCasters(pass, false);
+		wgpuRenderPassEncoderEnd(pass);
+		wgpuRenderPassEncoderRelease(pass);
+	}
+}
+
+bool CascadedShadows::DrawImGui()
+{
+	bool changed = false;
+	ImGui::Begin("Shadows");
+	changed = ImGui::Checkbox("Enabled", &m_enabled) || changed;
+	changed = ImGui::SliderFloat("Distance", &m_maxDistance, 1.0f, 100.0f) || changed;
+	ImGui::Text("Splits: %.2f %.2f %.2f %.2f", m_uniforms.splits[0], m_uniforms.splits[1], m_uniforms.splits[2], m_uniforms.splits[3]);
+	ImGui::Text("Static cache redraws: %u", m_cacheRenders);
+	ImGui::End();
+	return changed;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+#include <functional>
+
+#include <webgpu/webgpu.h>
+#include <glm/glm.hpp>
+
+#include "GpuProfiler.hpp"
+
+// Read by fs_main
+struct ShadowUniforms
+{
+	std::array<glm::mat4x4, 4> viewProjections; // Render space to the light's clip space, per cascade
+	glm::vec4 splits; // Far view depth of each cascade
+	glm::vec4 texelSizes; // World size of a shadow map texel per cascade (normal offset)
+};
+static_assert(sizeof(ShadowUniforms) % 16 == 0);
+
+// Cascaded shadow maps for the primary directional light. The cascades are fitted to slices of the camera frustum every frame.
+// Static casters of the far cascades are rendered into a cache that is only redrawn when the cascade's matrix or the static set changes,
+// then copied in before the dynamic casters are drawn on top
+class CascadedShadows
+{
+public:
+	// Must match res/shader.wgsl
+	static constexpr uint32_t CASCADE_COUNT = 4;
+	static constexpr uint32_t MAP_SIZE = 2048;
+	static constexpr uint32_t FIRST_CACHED_CASCADE = 2;
+	static constexpr uint32_t CACHED_CASCADE_COUNT = CASCADE_COUNT - FIRST_CACHED_CASCADE;
+	static constexpr WGPUTextureFormat DEPTH_FORMAT = WGPUTextureFormat_Depth32Float;
+
+	// Draws the static or the dynamic shadow casters into a pass (pipeline and group 0 are already set)
+	using DrawCasters = std::function<void(WGPURenderPassEncoder pass, bool staticCasters)>;
+
+	bool Init(WGPUDevice device, WGPUQueue queue, uint64_t vertexStride);
+	void Terminate();
+	// The object transforms, again whenever the buffer gets replaced
+	void SetObjectBuffer(WGPUBuffer buffer, uint64_t size);
+	void InvalidateStaticCache() { m_cachedViewProjections = {}; }
+
+	bool IsEnabled() const { return m_enabled; }
+	void SetEnabled(bool enabled) { m_enabled = enabled; }
+	// Every frame, before Render. lightDirection points towards the light
+	void Update(const glm::mat4x4& viewMatrix, const glm::mat4x4& projectionMatrix, const glm::mat4x4& modelMatrix, glm::vec3 lightDirection, float zNear);
+	void Render(WGPUCommandEncoder encoder, GpuProfiler& profiler, const DrawCasters& drawCasters);
+
+	// Bound by the main render pipeline
+	WGPUTextureView GetShadowMapView() const { return m_shadowMapView; }
+	WGPUSampler GetSampler() const { return m_sampler; }
+	WGPUBuffer GetUniformBuffer() const { return m_uniformBuffer; }
+
+	// Returns true when something changed
+	bool DrawImGui();
+private:
+	static constexpr uint64_t CASCADE_UNIFORM_STRIDE = 256; // Dynamic offsets, the largest minUniformBufferOffsetAlignment
+	static constexpr float SPLIT_LAMBDA = 0.75f; // 0 is uniform splits, 1 is logarithmic
+	static constexpr float CASTER_DISTANCE = 20.0f; // How far towards the light casters are picked up, past the cascade's bounds
+	static constexpr float CACHE_SNAP = 0.125f; // Cached cascades move in steps of this fraction of their radius (and are padded by it)
+
+	WGPUDevice m_device = nullptr;
+	WGPUQueue m_queue = nullptr;
+	WGPUTexture m_shadowMap = nullptr;
+	WGPUTextureView m_shadowMapView = nullptr; // All cascades, for sampling
+	std::array<WGPUTextureView, CASCADE_COUNT> m_cascadeViews = {}; // One layer each, for rendering
+	WGPUTexture m_staticCache = nullptr;
+	std::array<WGPUTextureView, CACHED_CASCADE_COUNT> m_staticCacheViews = {};
+	WGPUSampler m_sampler = nullptr; // Comparison, linear for 2x2 PCF per tap
+	WGPUBuffer m_uniformBuffer = nullptr;
+	WGPUBuffer m_cascadeUniformBuffer = nullptr; // Caster matrices, CASCADE_UNIFORM_STRIDE apart
+	WGPUBindGroupLayout m_bindGroupLayout = nullptr;
+	WGPUBindGroup m_bindGroup = nullptr;
+	WGPUPipelineLayout m_pipelineLayout = nullptr;
+	WGPURenderPipeline m_pipeline = nullptr;
+
+	ShadowUniforms m_uniforms = {};
+	std::array<glm::mat4x4, CASCADE_COUNT> m_casterViewProjections = {}; // Also applies the global model matrix
+	std::array<glm::mat4x4, CACHED_CASCADE_COUNT> m_cachedViewProjections = {}; // What the static cache was rendered with
+	bool m_enabled = true;
+	float m_maxDistance = 10.0f; // View depth covered by the last cascade
+	uint32_t m_cacheRenders = 0; // Total, shown in Dear ImGui
+
+	WGPURenderPassEncoder beginPass(WGPUCommandEncoder encoder, WGPUTextureView view, bool clear, const WGPURenderPassTimestampWrites* timestampWrites);
+};
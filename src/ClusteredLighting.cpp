@@ -0,0 +1,285 @@
+#include <random>
+#include <algorithm>
+
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#define GLM_FORCE_LEFT_HANDED
+#include <glm/ext.hpp>
+
+#include <spdlog/spdlog.h>
+#include <imgui/imgui.h>
+
+#include "ClusteredLighting.hpp"
+#include "ResourceManager.hpp"
+#include "Stats.hpp"
+
+WGPUBindGroupLayoutEntry bufferLayoutEntry(uint32_t binding, WGPUBufferBindingType type, uint64_t minBindingSize)
+{
+	// Zero is "undefined" for the sampler/texture/storage texture parts
+	WGPUBindGroupLayoutEntry entry = {};
+	entry.nextInChain = nullptr;
+	entry.binding = binding;
+	entry.visibility = WGPUShaderStage_Compute;
+	entry.buffer.nextInChain = nullptr;
+	entry.buffer.type = type;
+	entry.buffer.hasDynamicOffset = false;
+	entry.buffer.minBindingSize = minBindingSize;
+	return entry;
+}
+
+bool ClusteredLighting::Init(WGPUDevice device, WGPUQueue queue)
+{
+	m_device = device;
+	m_queue = queue;
+
+	WGPUBufferDescriptor bufferDesc = {};
+	bufferDesc.nextInChain = nullptr;
+	bufferDesc.mappedAtCreation = false;
+
+	bufferDesc.label = "Light buffer";
+	bufferDesc.usage = WGPUBufferUsage_CopyDst | WGPUBufferUsage_Storage;
+	bufferDesc.size = GetLightBufferSize();
+	m_lightBuffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers, bufferDesc.size);
+
+	// Written by the compute pass, read by fs_main
+	bufferDesc.label = "Cluster light list buffer";
+	bufferDesc.usage = WGPUBufferUsage_Storage;
+	bufferDesc.size = GetClusterBufferSize();
+	m_clusterBuffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers, bufferDesc.size);
+
+	bufferDesc.label = "Cluster overflow buffer";
+	bufferDesc.usage = WGPUBufferUsage_Storage | WGPUBufferUsage_CopyDst | WGPUBufferUsage_CopySrc;
+	bufferDesc.size = sizeof(uint32_t);
+	m_overflowBuffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+	bufferDesc.label = "Cluster overflow readback buffer";
+	bufferDesc.usage = WGPUBufferUsage_MapRead | WGPUBufferUsage_CopyDst;
+	m_overflowReadbackBuffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers, 2 * sizeof(uint32_t));
+
+	bufferDesc.label = "Cluster uniform buffer";
+	bufferDesc.usage = WGPUBufferUsage_CopyDst | WGPUBufferUsage_Uniform;
+	bufferDesc.size = sizeof(ClusterUniforms);
+	m_uniformBuffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::UniformBuffers, bufferDesc.size);
+
+	// Compute bind group
+	std::array<WGPUBindGroupLayoutEntry, 4> layoutEntries = {
+		bufferLayoutEntry(0, WGPUBufferBindingType_Uniform, sizeof(ClusterUniforms)),
+		bufferLayoutEntry(1, WGPUBufferBindingType_ReadOnlyStorage, sizeof(PointLight)),
+		bufferLayoutEntry(2, WGPUBufferBindingType_Storage, (MAX_LIGHTS_PER_CLUSTER + 1) * sizeof(uint32_t)),
+		bufferLayoutEntry(3, WGPUBufferBindingType_Storage, sizeof(uint32_t))
+	};
+	WGPUBindGroupLayoutDescriptor bindGroupLayoutDesc = {};
+	bindGroupLayoutDesc.nextInChain = nullptr;
+	bindGroupLayoutDesc.label = "Light culling binding group layout";
+	bindGroupLayoutDesc.entryCount = static_cast<uint32_t>(layoutEntries.size());
+	bindGroupLayoutDesc.entries = layoutEntries.data();
+	m_bindGroupLayout = wgpuDeviceCreateBindGroupLayout(device, &bindGroupLayoutDesc);
+
+	std::array<WGPUBindGroupEntry, 4> bindings = {};
+	bindings[0].nextInChain = nullptr;
+	bindings[0].binding = 0;
+	bindings[0].buffer = m_uniformBuffer;
+	bindings[0].offset = 0;
+	bindings[0].size = sizeof(ClusterUniforms);
+	bindings[1].nextInChain = nullptr;
+	bindings[1].binding = 1;
+	bindings[1].buffer = m_lightBuffer;
+	bindings[1].offset = 0;
+	bindings[1].size = GetLightBufferSize();
+	bindings[2].nextInChain = nullptr;
+	bindings[2].binding = 2;
+	bindings[2].buffer = m_clusterBuffer;
+	bindings[2].offset = 0;
+	bindings[2].size = GetClusterBufferSize();
+	bindings[3].nextInChain = nullptr;
+	bindings[3].binding = 3;
+	bindings[3].buffer = m_overflowBuffer;
+	bindings[3].offset = 0;
+	bindings[3].size = sizeof(uint32_t);
+
+	WGPUBindGroupDescriptor bindGroupDesc = {};
+	bindGroupDesc.nextInChain = nullptr;
+	bindGroupDesc.label = "Light culling bind group";
+	bindGroupDesc.layout = m_bindGroupLayout;
+	bindGroupDesc.entryCount = static_cast<uint32_t>(bindings.size());
+	bindGroupDesc.entries = bindings.data();
+	m_bindGroup = wgpuDeviceCreateBindGroup(device, &bindGroupDesc);
+
+	// Compute pipeline
+	WGPUShaderModule shaderModule = ResourceManager::LoadShaderModule(RESOURCE_DIR "cluster.wgsl", device);
+	if (!shaderModule) {
+		SPDLOG_ERROR("Failed to create the light culling shader module!");
+		return false;
+	}
+
+	WGPUPipelineLayoutDescriptor layoutDesc = {};
+	layoutDesc.nextInChain = nullptr;
+	layoutDesc.label = "Light culling pipeline layout";
+	layoutDesc.bindGroupLayoutCount = 1;
+	layoutDesc.bindGroupLayouts = &m_bindGroupLayout;
+	m_pipelineLayout = wgpuDeviceCreatePipelineLayout(device, &layoutDesc);
+
+	WGPUComputePipelineDescriptor pipelineDesc = {};
+	pipelineDesc.nextInChain = nullptr;
+	pipelineDesc.label = "Light culling pipeline";
+	pipelineDesc.layout = m_pipelineLayout;
+	pipelineDesc.compute.nextInChain = nullptr;
+	pipelineDesc.compute.module = shaderModule;
+	pipelineDesc.compute.entryPoint = "cs_main";
+	pipelineDesc.compute.constantCount = 0;
+	pipelineDesc.compute.constants = nullptr;
+	m_pipeline = wgpuDeviceCreateComputePipeline(device, &pipelineDesc);
+	wgpuShaderModuleRelease(shaderModule);
+
+	SetLights(MakeRandomLights(m_requestedLightCount));
+
+	return m_bindGroup != nullptr && m_pipeline != nullptr;
+}
+
+void ClusteredLighting::Terminate()
+{
+	if (m_pipeline) {
+		wgpuComputePipelineRelease(m_pipeline);
+		wgpuPipelineLayoutRelease(m_pipelineLayout);
+		m_pipeline = nullptr;
+	}
+	if (m_bindGroup) {
+		wgpuBindGroupRelease(m_bindGroup);
+		wgpuBindGroupLayoutRelease(m_bindGroupLayout);
+		m_bindGroup = nullptr;
+	}
+	for (WGPUBuffer* buffer : {&m_lightBuffer, &m_clusterBuffer, &m_uniformBuffer, &m_overflowBuffer, &m_overflowReadbackBuffer}) {
+		if (*buffer) {
+			wgpuBufferDestroy(*buffer);
+			wgpuBufferRelease(*buffer);
+			*buffer = nullptr;
+		}
+	}
+}
+
+void ClusteredLighting::SetLights(const std::vector<PointLight>& lights)
+{
+	m_lights.assign(lights.begin(), lights.begin() + std::min<size_t>(lights.size(), MAX_LIGHTS));
+	if (lights.size() > MAX_LIGHTS) {
+		SPDLOG_WARN("Only the first {} of {} lights are used.", MAX_LIGHTS, lights.size());
+	}
+	m_uniforms.lightCount = static_cast<uint32_t>(m_lights.size());
+	m_requestedLightCount = static_cast<int>(m_lights.size());
+	if (!m_lights.empty()) {
+		wgpuQueueWriteBuffer(m_queue, m_lightBuffer, 0, m_lights.data(), m_lights.size() * sizeof(PointLight));
+		Stats::Add(Stats::Counter::BytesUploaded, m_lights.size() * sizeof(PointLight));
+	}
+}
+
+void ClusteredLighting::Update(const glm::mat4x4& viewMatrix, const glm::mat4x4& projectionMatrix, glm::vec2 screenSize, float zNear, float zFar)
+{
+	m_uniforms.inverseProjection = glm::inverse(projectionMatrix);
+	m_uniforms.viewMatrix = viewMatrix;
+	m_uniforms.screenSize = screenSize;
+	m_uniforms.zNear = zNear;
+	m_uniforms.zFar = zFar;
+	wgpuQueueWriteBuffer(m_queue, m_uniformBuffer, 0, &m_uniforms, sizeof(ClusterUniforms));
+	Stats::Add(Stats::Counter::BytesUploaded, sizeof(ClusterUniforms));
+}
+
+void ClusteredLighting::Dispatch(WGPUCommandEncoder encoder, GpuProfiler& profiler)
+{
+	wgpuCommandEncoderClearBuffer(encoder, m_overflowBuffer, 0, sizeof(uint32_t));
+
+	WGPUComputePassDescriptor passDesc = {};
+	passDesc.nextInChain = nullptr;
+	passDesc.label = "Light culling pass";
+	passDesc.timestampWrites = profiler.BeginComputePass("Light culling");
+	WGPUComputePassEncoder passEncoder = wgpuCommandEncoderBeginComputePass(encoder, &passDesc);
+	wgpuComputePassEncoderSetPipeline(passEncoder, m_pipeline);
+	wgpuComputePassEncoderSetBindGroup(passEncoder, 0, m_bindGroup, 0, nullptr);
+	// One invocation per cluster
+	wgpuComputePassEncoderDispatchWorkgroups(passEncoder, (CLUSTER_COUNT + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1, 1);
+	wgpuComputePassEncoderEnd(passEncoder);
+	wgpuComputePassEncoderRelease(passEncoder);
+}
+
+uint32_t ClusteredLighting::ReadOverflowCount(WGPUInstance instance)
+{
+	// Queued after the last dispatch, so the copy sees its count
+	WGPUCommandEncoderDescriptor encoderDesc = {};
+	encoderDesc.nextInChain = nullptr;
+	encoderDesc.label = "Cluster overflow readback encoder";
+	WGPUCommandEncoder encoder = wgpuDeviceCreateCommandEncoder(m_device, &encoderDesc);
+	wgpuCommandEncoderCopyBufferToBuffer(encoder, m_overflowBuffer, 0, m_overflowReadbackBuffer, 0, sizeof(uint32_t));
+	WGPUCommandBufferDescriptor commandBufferDesc = {};
+	commandBufferDesc.nextInChain = nullptr;
+	commandBufferDesc.label = "Cluster overflow readback";
+	WGPUCommandBuffer commandBuffer = wgpuCommandEncoderFinish(encoder, &commandBufferDesc);
+	wgpuCommandEncoderRelease(encoder);
+	wgpuQueueSubmit(m_queue, 1, &commandBuffer);
+	wgpuCommandBufferRelease(commandBuffer);
+
+	struct MapState
+	{
+		bool done = false;
+		bool success = false;
+	};
+	MapState mapState;
+	auto onMapped = [](WGPUBufferMapAsyncStatus status, void* pUserData)
+	{
+		MapState& mapState = *reinterpret_cast<MapState*>(pUserData);
+		mapState.success = status == WGPUBufferMapAsyncStatus_Success;
+		mapState.done = true;
+	};
+	wgpuBufferMapAsync(m_overflowReadbackBuffer, WGPUMapMode_Read, 0, sizeof(uint32_t), onMapped, (void*)&mapState);
+	while (!mapState.done) {
+		wgpuInstanceProcessEvents(instance);
+		wgpuDeviceTick(m_device);
+	}
+	uint32_t count = 0;
+	if (mapState.success) {
+		count = *reinterpret_cast<const uint32_t*>(wgpuBufferGetConstMappedRange(m_overflowReadbackBuffer, 0, sizeof(uint32_t)));
+		wgpuBufferUnmap(m_overflowReadbackBuffer);
+	}
+	return count;
+}
+
+bool ClusteredLighting::DrawImGui()
+{
+	bool changed = false;
+	ImGui::Begin("Point lights");
+	ImGui::SliderInt("Count", &m_requestedLightCount, 0, MAX_LIGHTS);
+	if (ImGui::IsItemDeactivatedAfterEdit()) {
+		SetLights(MakeRandomLights(static_cast<uint32_t>(m_requestedLightCount)));
+		changed = true;
+	}
+	bool bruteForce = IsBruteForce();
+	if (ImGui::Checkbox("Brute force (reference)", &bruteForce)) {
+		SetBruteForce(bruteForce);
+		changed = true;
+	}
+	ImGui::Text("%u clusters (%ux%ux%u)", CLUSTER_COUNT, CLUSTER_X, CLUSTER_Y, CLUSTER_Z);
+	ImGui::End();
+	return changed;
+}
+
+std::vector<PointLight> ClusteredLighting::MakeRandomLights(uint32_t count, uint32_t seed)
+{
+	std::mt19937 random(seed);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	std::vector<PointLight> lights(count);
+	for (uint32_t i = 0; i < count; ++i) {
+		PointLight& light = lights[i];
+		// Z-up, over and around the boat
+		glm::vec3 position = {unit(random) * 4.0f - 2.0f, unit(random) * 4.0f - 2.0f, unit(random) * 1.0f};
+		float range = 0.2f + unit(random) * 0.4f;
+		light.positionRange = {position, range};
+		light.colorIntensity = {glm::vec3(unit(random), unit(random), unit(random)), 0.5f + unit(random)};
+		// Every fourth light is a spot pointing down-ish
+		if (i % 4 == 0) {
+			glm::vec3 direction = glm::normalize(glm::vec3(unit(random) - 0.5f, unit(random) - 0.5f, -1.0f));
+			light.directionCone = {direction, std::cos(glm::radians(20.0f + unit(random) * 25.0f))};
+		} else {
+			light.directionCone = {0.0f, 0.0f, -1.0f, -2.0f};
+		}
+	}
+	return lights;
+}
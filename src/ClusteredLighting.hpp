@@ -0,0 +1,92 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include <webgpu/webgpu.h>
+#include <glm/glm.hpp>
+
+#include "GpuProfiler.hpp"
+
+// Point and spot lights, in render space
+struct PointLight
+{
+	glm::vec4 positionRange; // xyz position, w range (the light has no effect past it)
+	glm::vec4 colorIntensity; // rgb color, w intensity
+	glm::vec4 directionCone; // xyz spot direction, w cosine of the outer cone angle (-2 for point lights)
+};
+static_assert(sizeof(PointLight) % 16 == 0);
+
+struct ClusterUniforms
+{
+	glm::mat4x4 inverseProjection;
+	glm::mat4x4 viewMatrix;
+	glm::vec2 screenSize;
+	float zNear;
+	float zFar;
+	uint32_t lightCount;
+	uint32_t _pad[3];
+};
+static_assert(sizeof(ClusterUniforms) % 16 == 0);
+
+// Clustered forward lighting: a compute pass bins the lights into a froxel grid (screen tiles x exponential depth slices)
+// every frame, and fs_main only loops over the lights of the fragment's cluster
+class ClusteredLighting
+{
+public:
+	// Must match res/cluster.wgsl and res/shader.wgsl
+	static constexpr uint32_t CLUSTER_X = 16;
+	static constexpr uint32_t CLUSTER_Y = 9;
+	static constexpr uint32_t CLUSTER_Z = 24;
+	static constexpr uint32_t CLUSTER_COUNT = CLUSTER_X * CLUSTER_Y * CLUSTER_Z;
+	static constexpr uint32_t MAX_LIGHTS_PER_CLUSTER = 127; // Plus the count, so a cluster is 128 u32s
+	static constexpr uint32_t MAX_LIGHTS = 4096;
+	static constexpr uint32_t WORKGROUP_SIZE = 64;
+
+	bool Init(WGPUDevice device, WGPUQueue queue);
+	void Terminate();
+
+	void SetLights(const std::vector<PointLight>& lights);
+	const std::vector<PointLight>& GetLights() const { return m_lights; }
+	// Shade with every light instead of the cluster's list (reference for validation). Selects a shader variant, see PipelineKey
+	void SetBruteForce(bool bruteForce) { m_bruteForce = bruteForce; }
+	bool IsBruteForce() const { return m_bruteForce; }
+
+	// Every frame, before Dispatch
+	void Update(const glm::mat4x4& viewMatrix, const glm::mat4x4& projectionMatrix, glm::vec2 screenSize, float zNear, float zFar);
+	// Records the binning compute pass
+	void Dispatch(WGPUCommandEncoder encoder, GpuProfiler& profiler);
+	// Clusters of the last dispatch that had more than MAX_LIGHTS_PER_CLUSTER lights and dropped the rest. Blocks until the GPU
+	// got there, benchmarks only
+	uint32_t ReadOverflowCount(WGPUInstance instance);
+
+	// Bound by the main render pipeline
+	WGPUBuffer GetLightBuffer() const { return m_lightBuffer; }
+	WGPUBuffer GetClusterBuffer() const { return m_clusterBuffer; }
+	WGPUBuffer GetUniformBuffer() const { return m_uniformBuffer; }
+	uint64_t GetLightBufferSize() const { return MAX_LIGHTS * sizeof(PointLight); }
+	uint64_t GetClusterBufferSize() const { return CLUSTER_COUNT * (MAX_LIGHTS_PER_CLUSTER + 1) * sizeof(uint32_t); }
+
+	// Returns true when the lights changed
+	bool DrawImGui();
+
+	// Lights scattered around the boat
+	static std::vector<PointLight> MakeRandomLights(uint32_t count, uint32_t seed = 1);
+private:
+	WGPUDevice m_device = nullptr;
+	WGPUQueue m_queue = nullptr;
+	WGPUBuffer m_lightBuffer = nullptr;
+	WGPUBuffer m_clusterBuffer = nullptr;
+	WGPUBuffer m_uniformBuffer = nullptr;
+	WGPUBuffer m_overflowBuffer = nullptr;
+	WGPUBuffer m_overflowReadbackBuffer = nullptr;
+	WGPUBindGroupLayout m_bindGroupLayout = nullptr;
+	WGPUBindGroup m_bindGroup = nullptr;
+	WGPUPipelineLayout m_pipelineLayout = nullptr;
+	WGPUComputePipeline m_pipeline = nullptr;
+
+	std::vector<PointLight> m_lights;
+	ClusterUniforms m_uniforms = {};
+	bool m_bruteForce = false;
+	int m_requestedLightCount = 256; // Dear ImGui slider
+};
@@ -0,0 +1,252 @@
+#include <cmath>
+#include <array>
+#include <algorithm>
+
+#include <spdlog/spdlog.h>
+#include <imgui/imgui.h>
+
+#include "DynamicResolution.hpp"
+#include "ResourceManager.hpp"
+#include "Stats.hpp"
+
+bool DynamicResolution::Init(WGPUDevice device, WGPUQueue queue, WGPUTextureFormat colorFormat)
+{
+	m_device = device;
+	m_queue = queue;
+
+	WGPUBufferDescriptor bufferDesc = {};
+	bufferDesc.nextInChain = nullptr;
+	bufferDesc.label = "Upscale uniform buffer";
+	bufferDesc.usage = WGPUBufferUsage_CopyDst | WGPUBufferUsage_Uniform;
+	bufferDesc.size = sizeof(UpscaleUniforms);
+	bufferDesc.mappedAtCreation = false;
+	m_uniformBuffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::UniformBuffers, bufferDesc.size);
+
+	WGPUSamplerDescriptor samplerDesc = {};
+	samplerDesc.nextInChain = nullptr;
+	samplerDesc.label = "Upscale sampler";
+	samplerDesc.addressModeU = WGPUAddressMode_ClampToEdge;
+	samplerDesc.addressModeV = WGPUAddressMode_ClampToEdge;
+	samplerDesc.addressModeW = WGPUAddressMode_ClampToEdge;
+	samplerDesc.magFilter = WGPUFilterMode_Linear;
+	samplerDesc.minFilter = WGPUFilterMode_Linear;
+	samplerDesc.mipmapFilter = WGPUMipmapFilterMode_Nearest;
+	samplerDesc.lodMinClamp = 0.0f;
+	samplerDesc.lodMaxClamp = 1.0f;
+	samplerDesc.compare = WGPUCompareFunction_Undefined;
+	samplerDesc.maxAnisotropy = 1;
+	m_sampler = wgpuDeviceCreateSampler(device, &samplerDesc);
+
+	std::array<WGPUBindGroupLayoutEntry, 3> layoutEntries = {};
+	layoutEntries[0].nextInChain = nullptr;
+	layoutEntries[0].binding = 0;
+	layoutEntries[0].visibility = WGPUShaderStage_Fragment;
+	layoutEntries[0].texture.nextInChain = nullptr;
+	layoutEntries[0].texture.sampleType = WGPUTextureSampleType_Float;
+	layoutEntries[0].texture.viewDimension = WGPUTextureViewDimension_2D;
+	layoutEntries[0].texture.multisampled = false;
+	layoutEntries[1].nextInChain = nullptr;
+	layoutEntries[1].binding = 1;
+	layoutEntries[1].visibility = WGPUShaderStage_Fragment;
+	layoutEntries[1].sampler.nextInChain = nullptr;
+	layoutEntries[1].sampler.type = WGPUSamplerBindingType_Filtering;
+	layoutEntries[2].nextInChain = nullptr;
+	layoutEntries[2].binding = 2;
+	layoutEntries[2].visibility = WGPUShaderStage_Vertex | WGPUShaderStage_Fragment;
+	layoutEntries[2].buffer.nextInChain = nullptr;
+	layoutEntries[2].buffer.type = WGPUBufferBindingType_Uniform;
+	layoutEntries[2].buffer.hasDynamicOffset = false;
+	layoutEntries[2].buffer.minBindingSize = sizeof(UpscaleUniforms);
+	WGPUBindGroupLayoutDescriptor bindGroupLayoutDesc = {};
+	bindGroupLayoutDesc.nextInChain = nullptr;
+	bindGroupLayoutDesc.label = "Upscale binding group layout";
+	bindGroupLayoutDesc.entryCount = static_cast<uint32_t>(layoutEntries.size());
+	bindGroupLayoutDesc.entries = layoutEntries.data();
+	m_bindGroupLayout = wgpuDeviceCreateBindGroupLayout(device, &bindGroupLayoutDesc);
+
+	WGPUShaderModule shaderModule = ResourceManager::LoadShaderModule(RESOURCE_DIR "upscale.wgsl", device);
+	if (!shaderModule) {
+		SPDLOG_ERROR("Failed to create the upscale shader module!");
+		return false;
+	}
+
+	WGPUPipelineLayoutDescriptor layoutDesc = {};
+	layoutDesc.nextInChain = nullptr;
+	layoutDesc.label = "Upscale pipeline layout";
+	layoutDesc.bindGroupLayoutCount = 1;
+	layoutDesc.bindGroupLayouts = &m_bindGroupLayout;
+	m_pipelineLayout = wgpuDeviceCreatePipelineLayout(device, &layoutDesc);
+
+	WGPUColorTargetState colorTarget = {};
+	colorTarget.nextInChain = nullptr;
+	colorTarget.format = colorFormat;
+	colorTarget.blend = nullptr; // Overwrites every pixel
+	colorTarget.writeMask = WGPUColorWriteMask_All;
+
+	WGPUFragmentState fragState = {};
+	fragState.nextInChain = nullptr;
+	fragState.module = shaderModule;
+	fragState.entryPoint = "fs_main";
+	fragState.constantCount = 0;
+	fragState.constants = nullptr;
+	fragState.targetCount = 1;
+	fragState.targets = &colorTarget;
+
+	WGPURenderPipelineDescriptor pipelineDesc = {};
+	pipelineDesc.nextInChain = nullptr;
+	pipelineDesc.label = "Upscale pipeline";
+	pipelineDesc.layout = m_pipelineLayout;
+	pipelineDesc.vertex.nextInChain = nullptr;
+	pipelineDesc.vertex.module = shaderModule;
+	pipelineDesc.vertex.entryPoint = "vs_main";
+	pipelineDesc.vertex.constantCount = 0;
+	pipelineDesc.vertex.constants = nullptr;
+	pipelineDesc.vertex.bufferCount = 0; // Generated from the vertex index
+	pipelineDesc.vertex.buffers = nullptr;
+	pipelineDesc.primitive.nextInChain = nullptr;
+	pipelineDesc.primitive.topology = WGPUPrimitiveTopology_TriangleList;
+	pipelineDesc.primitive.stripIndexFormat = WGPUIndexFormat_Undefined;
+	pipelineDesc.primitive.frontFace = WGPUFrontFace_CCW;
+	pipelineDesc.primitive.cullMode = WGPUCullMode_None;
+	pipelineDesc.depthStencil = nullptr;
+	pipelineDesc.multisample.nextInChain = nullptr;
+	pipelineDesc.multisample.count = 1;
+	pipelineDesc.multisample.mask = ~0u;
+	pipelineDesc.multisample.alphaToCoverageEnabled = false;
+	pipelineDesc.fragment = &fragState;
+	m_pipeline = wgpuDeviceCreateRenderPipeline(device, &pipelineDesc);
+	wgpuShaderModuleRelease(shaderModule);
+
+	return m_pipeline != nullptr;
+}
+
+void DynamicResolution::Terminate()
+{
+	if (m_bindGroup) {
+		wgpuBindGroupRelease(m_bindGroup);
+		m_bindGroup = nullptr;
+	}
+	if (m_pipeline) {
+		wgpuRenderPipelineRelease(m_pipeline);
+		wgpuPipelineLayoutRelease(m_pipelineLayout);
+		m_pipeline = nullptr;
+	}
+	if (m_bindGroupLayout) {
+		wgpuBindGroupLayoutRelease(m_bindGroupLayout);
+		m_bindGroupLayout = nullptr;
+	}
+	if (m_sampler) {
+		wgpuSamplerRelease(m_sampler);
+		m_sampler = nullptr;
+	}
+	if (m_uniformBuffer) {
+		wgpuBufferDestroy(m_uniformBuffer);
+		wgpuBufferRelease(m_uniformBuffer);
+		m_uniformBuffer = nullptr;
+	}
+}
+
+void DynamicResolution::Update(float gpuMs)
+{
+	m_lastGpuMs = gpuMs;
+	if (!m_enabled || gpuMs <= 0.0f || ++m_framesSinceAdjust < ADJUST_INTERVAL) {
+		return; // No timestamp queries means nothing to go by
+	}
+	m_framesSinceAdjust = 0;
+	if (std::abs(gpuMs - m_budgetMs) < DEAD_ZONE * m_budgetMs) {
+		return;
+	}
+
+	// Shading cost goes with the pixel count, so with the square of the scale
+	float target = m_scale * std::sqrt(m_budgetMs / gpuMs);
+	m_scale = std::clamp(std::clamp(target, m_scale - MAX_STEP, m_scale + MAX_STEP), MIN_SCALE, MAX_SCALE);
+}
+
+glm::uvec2 DynamicResolution::GetRenderSize(glm::uvec2 framebufferSize)
+{
+	glm::vec2 size = glm::round(glm::vec2(framebufferSize) * GetScale());
+	m_lastRenderSize = glm::max(glm::uvec2(size), glm::uvec2(1));
+	return m_lastRenderSize;
+}
+
+WGPUBindGroup DynamicResolution::getBindGroup(const RenderTargetPool::Target& source)
+{
+	if (m_bindGroup && m_bindGroupTargetId == source.id) {
+		return m_bindGroup;
+	}
+	if (m_bindGroup) {
+		wgpuBindGroupRelease(m_bindGroup);
+	}
+
+	std::array<WGPUBindGroupEntry, 3> bindings = {};
+	bindings[0].nextInChain = nullptr;
+	bindings[0].binding = 0;
+	bindings[0].textureView = source.view;
+	bindings[1].nextInChain = nullptr;
+	bindings[1].binding = 1;
+	bindings[1].sampler = m_sampler;
+	bindings[2].nextInChain = nullptr;
+	bindings[2].binding = 2;
+	bindings[2].buffer = m_uniformBuffer;
+	bindings[2].offset = 0;
+	bindings[2].size = sizeof(UpscaleUniforms);
+
+	WGPUBindGroupDescriptor bindGroupDesc = {};
+	bindGroupDesc.nextInChain = nullptr;
+	bindGroupDesc.label = "Upscale bind group";
+	bindGroupDesc.layout = m_bindGroupLayout;
+	bindGroupDesc.entryCount = static_cast<uint32_t>(bindings.size());
+	bindGroupDesc.entries = bindings.data();
+	m_bindGroup = wgpuDeviceCreateBindGroup(m_device, &bindGroupDesc);
+	m_bindGroupTargetId = source.id;
+	return m_bindGroup;
+}
+
+void DynamicResolution::Upscale(WGPUCommandEncoder encoder, GpuProfiler& profiler, const RenderTargetPool::Target& source, glm::uvec2 renderSize,
+	WGPUTextureView targetView)
+{
+	glm::vec2 sourceSize = glm::vec2(source.width, source.height);
+	UpscaleUniforms uniforms = {};
+	uniforms.uvScale = glm::vec2(renderSize) / sourceSize;
+	uniforms.uvMax = (glm::vec2(renderSize) - 0.5f) / sourceSize;
+	wgpuQueueWriteBuffer(m_queue, m_uniformBuffer, 0, &uniforms, sizeof(UpscaleUniforms));
+	Stats::Add(Stats::Counter::BytesUploaded, sizeof(UpscaleUniforms));
+
+	WGPURenderPassColorAttachment colorAtt = {};
+	colorAtt.nextInChain = nullptr;
+	colorAtt.view = targetView;
+	colorAtt.depthSlice = WGPU_DEPTH_SLICE_UNDEFINED;
+	colorAtt.resolveTarget = nullptr;
+	colorAtt.loadOp = WGPULoadOp_Clear; // Cheaper than Load on tilers, and every pixel gets written anyway
+	colorAtt.storeOp = WGPUStoreOp_Store;
+	colorAtt.clearValue = WGPUColor{0.0, 0.0, 0.0, 1.0};
+
+	WGPURenderPassDescriptor renderPassDesc = {};
+	renderPassDesc.nextInChain = nullptr;
+	renderPassDesc.label = "Upscale pass";
+	renderPassDesc.colorAttachmentCount = 1;
+	renderPassDesc.colorAttachments = &colorAtt;
+	renderPassDesc.depthStencilAttachment = nullptr;
+	renderPassDesc.occlusionQuerySet = nullptr;
+	renderPassDesc.timestampWrites = profiler.BeginRenderPass("Upscale");
+	WGPURenderPassEncoder pass = wgpuCommandEncoderBeginRenderPass(encoder, &renderPassDesc);
+	wgpuRenderPassEncoderSetPipeline(pass, m_pipeline);
+	wgpuRenderPassEncoderSetBindGroup(pass, 0, getBindGroup(source), 0, nullptr);
+	wgpuRenderPassEncoderDraw(pass, 3, 1, 0, 0);
+	Stats::Add(Stats::Counter::DrawCalls, 1);
+	wgpuRenderPassEncoderEnd(pass);
+	wgpuRenderPassEncoderRelease(pass);
+}
+
+bool DynamicResolution::DrawImGui()
+{
+	bool changed = false;
+	ImGui::Begin("Dynamic resolution");
+	changed = ImGui::Checkbox("Enabled", &m_enabled) || changed;
+	changed = ImGui::SliderFloat("Budget (ms)", &m_budgetMs, 4.0f, 33.0f) || changed;
+	changed = ImGui::SliderFloat("Scale", &m_scale, MIN_SCALE, MAX_SCALE) || changed; // The controller takes over again on the next adjustment
+	ImGui::Text("Render size: %ux%u | GPU %.2f ms", m_lastRenderSize.x, m_lastRenderSize.y, m_lastGpuMs);
+	ImGui::End();
+	return changed;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <webgpu/webgpu.h>
+#include <glm/glm.hpp>
+
+#include "GpuProfiler.hpp"
+#include "RenderTargetPool.hpp"
+
+// Read by res/upscale.wgsl
+struct UpscaleUniforms
+{
+	glm::vec2 uvScale;
+	glm::vec2 uvMax;
+};
+static_assert(sizeof(UpscaleUniforms) % 16 == 0);
+
+// Renders the scene at a fraction of the framebuffer resolution, picked every frame from the measured GPU time so it stays
+// within a frame budget, then upscales it into the swap chain (the UI is drawn afterwards, at native resolution)
+class DynamicResolution
+{
+public:
+	static constexpr float MIN_SCALE = 0.5f; // Per axis
+	static constexpr float MAX_SCALE = 1.0f;
+
+	bool Init(WGPUDevice device, WGPUQueue queue, WGPUTextureFormat colorFormat);
+	void Terminate();
+
+	bool IsEnabled() const { return m_enabled; }
+	void SetEnabled(bool enabled) { m_enabled = enabled; }
+	void SetBudget(float budgetMs) { m_budgetMs = budgetMs; }
+	float GetScale() const { return m_enabled ? m_scale : MAX_SCALE; }
+	// Every frame, with the latest GPU frame time (timestamp queries, so a few frames old)
+	void Update(float gpuMs);
+	glm::uvec2 GetRenderSize(glm::uvec2 framebufferSize);
+
+	// The scene was rendered at renderSize into the top-left corner of source, targetView is the full framebuffer
+	void Upscale(WGPUCommandEncoder encoder, GpuProfiler& profiler, const RenderTargetPool::Target& source, glm::uvec2 renderSize, WGPUTextureView targetView);
+
+	bool DrawImGui();
+private:
+	static constexpr float DEAD_ZONE = 0.05f; // No change while the GPU time is within this fraction of the budget
+	static constexpr float MAX_STEP = 0.05f; // Largest scale change per adjustment
+	static constexpr uint32_t ADJUST_INTERVAL = 4; // Frames, the timings lag behind by about this much
+
+	WGPUDevice m_device = nullptr;
+	WGPUQueue m_queue = nullptr;
+	WGPUBuffer m_uniformBuffer = nullptr;
+	WGPUSampler m_sampler = nullptr;
+	WGPUBindGroupLayout m_bindGroupLayout = nullptr;
+	WGPUPipelineLayout m_pipelineLayout = nullptr;
+	WGPURenderPipeline m_pipeline = nullptr;
+	WGPUBindGroup m_bindGroup = nullptr; // For the last source, which the pool keeps handing out
+	uint64_t m_bindGroupTargetId = 0;
+
+	bool m_enabled = true;
+	float m_budgetMs = 16.0f;
+	float m_scale = MAX_SCALE;
+	float m_lastGpuMs = 0.0f;
+	uint32_t m_framesSinceAdjust = 0;
+	glm::uvec2 m_lastRenderSize = {0, 0}; // Shown in Dear ImGui
+
+	WGPUBindGroup getBindGroup(const RenderTargetPool::Target& source);
+};
@@ -0,0 +1,191 @@
+#include <cassert>
+#include <algorithm>
+
+#include "EntityStore.hpp"
+
+std::vector<EntityStore::ComponentType>& EntityStore::componentTypes()
+{
+	static std::vector<ComponentType> types;
+	return types;
+}
+
+uint32_t EntityStore::registerComponentType(uint32_t size, uint32_t alignment)
+{
+	std::vector<ComponentType>& types = componentTypes();
+	assert(types.size() < MAX_COMPONENT_TYPES);
+	types.push_back({size, alignment});
+	return static_cast<uint32_t>(types.size() - 1);
+}
+
+void EntityStore::Destroy(Entity entity)
+{
+	if (!IsAlive(entity)) {
+		return;
+	}
+	removeRow(m_locations[entity.index]);
+	Location& location = m_locations[entity.index];
+	location.archetype = UINT32_MAX;
+	++location.generation;
+	m_freeIndices.push_back(entity.index);
+	--m_entityCount;
+}
+
+void EntityStore::Clear()
+{
+	// Archetypes stay, they will most likely be needed again
+	for (Archetype& archetype : m_archetypes) {
+		archetype.chunks.clear();
+	}
+	for (uint32_t index = 0; index < m_locations.size(); ++index) {
+		Location& location = m_locations[index];
+		if (location.archetype != UINT32_MAX) {
+			location.archetype = UINT32_MAX;
+			++location.generation;
+			m_freeIndices.push_back(index);
+		}
+	}
+	m_entityCount = 0;
+}
+
+bool EntityStore::IsAlive(Entity entity) const
+{
+	return entity.index < m_locations.size() && m_locations[entity.index].archetype != UINT32_MAX && m_locations[entity.index].generation == entity.generation;
+}
+
+uint32_t EntityStore::GetChunkCount() const
+{
+	uint32_t count = 0;
+	for (const Archetype& archetype : m_archetypes) {
+		count += static_cast<uint32_t>(archetype.chunks.size());
+	}
+	return count;
+}
+
+uint32_t EntityStore::findArchetype(Mask mask)
+{
+	auto it = m_archetypeIndices.find(mask);
+	if (it != m_archetypeIndices.end()) {
+		return it->second;
+	}
+
+	Archetype archetype;
+	archetype.mask = mask;
+	uint32_t rowBytes = sizeof(Entity);
+	uint32_t paddingBytes = 0;
+	const std::vector<ComponentType>& types = componentTypes();
+	for (uint32_t id = 0; id < types.size(); ++id) {
+		if (mask & (Mask(1) << id)) {
+			archetype.types.push_back(id);
+			rowBytes += types[id].size;
+			paddingBytes += types[id].alignment;
+		}
+	}
+
+	// Entity handles first, then one array per component
+	archetype.capacity = std::max((CHUNK_BYTES - paddingBytes) / rowBytes, 1u);
+	uint32_t offset = archetype.capacity * sizeof(Entity);
+	for (uint32_t id : archetype.types) {
+		offset = (offset + types[id].alignment - 1) / types[id].alignment * types[id].alignment;
+		archetype.offsets.push_back(offset);
+		offset += archetype.capacity * types[id].size;
+	}
+	assert(offset <= CHUNK_BYTES || archetype.capacity == 1);
+
+	m_archetypes.push_back(std::move(archetype));
+	uint32_t index = static_cast<uint32_t>(m_archetypes.size() - 1);
+	m_archetypeIndices[mask] = index;
+	return index;
+}
+
+EntityStore::Entity EntityStore::allocateEntity()
+{
+	Entity entity;
+	if (!m_freeIndices.empty()) {
+		entity.index = m_freeIndices.back();
+		m_freeIndices.pop_back();
+	} else {
+		entity.index = static_cast<uint32_t>(m_locations.size());
+		m_locations.push_back({});
+	}
+	entity.generation = m_locations[entity.index].generation;
+	++m_entityCount;
+	return entity;
+}
+
+void EntityStore::appendRow(uint32_t archetypeIndex, Entity entity)
+{
+	Archetype& archetype = m_archetypes[archetypeIndex];
+	if (archetype.chunks.empty() || archetype.chunks.back().count == archetype.capacity) {
+		// Big enough for the single entity of an oversized archetype too
+		size_t bytes = archetype.capacity * sizeof(Entity);
+		if (!archetype.types.empty()) {
+			bytes = archetype.offsets.back() + archetype.capacity * componentTypes()[archetype.types.back()].size;
+		}
+		bytes = std::max<size_t>(bytes, CHUNK_BYTES);
+		Chunk chunk;
+		chunk.memory = std::make_unique<std::max_align_t[]>((bytes + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t));
+		archetype.chunks.push_back(std::move(chunk));
+	}
+	Chunk& chunk = archetype.chunks.back();
+	uint32_t row = chunk.count++;
+	reinterpret_cast<Entity*>(chunk.GetData())[row] = entity;
+
+	Location& location = m_locations[entity.index];
+	location.archetype = archetypeIndex;
+	location.chunk = static_cast<uint32_t>(archetype.chunks.size() - 1);
+	location.row = row;
+}
+
+void EntityStore::removeRow(const Location& location)
+{
+	Archetype& archetype = m_archetypes[location.archetype];
+	Chunk& chunk = archetype.chunks[location.chunk];
+	Chunk& lastChunk = archetype.chunks.back();
+	uint32_t lastRow = lastChunk.count - 1;
+
+	if (&chunk != &lastChunk || location.row != lastRow) {
+		Entity moved = reinterpret_cast<Entity*>(lastChunk.GetData())[lastRow];
+		reinterpret_cast<Entity*>(chunk.GetData())[location.row] = moved;
+		const std::vector<ComponentType>& types = componentTypes();
+		for (size_t i = 0; i < archetype.types.size(); ++i) {
+			uint32_t size = types[archetype.types[i]].size;
+			std::memcpy(chunk.GetData() + archetype.offsets[i] + location.row * size, lastChunk.GetData() + archetype.offsets[i] + lastRow * size, size);
+		}
+		m_locations[moved.index].chunk = location.chunk;
+		m_locations[moved.index].row = location.row;
+	}
+
+	if (--lastChunk.count == 0) {
+		archetype.chunks.pop_back();
+	}
+}
+
+void EntityStore::moveToArchetype(Entity entity, uint32_t archetypeIndex)
+{
+	Location from = m_locations[entity.index];
+	appendRow(archetypeIndex, entity);
+	const Location& to = m_locations[entity.index];
+
+	// Components both archetypes have, the new ones are left for the caller
+	const std::vector<ComponentType>& types = componentTypes();
+	Mask shared = m_archetypes[from.archetype].mask & m_archetypes[archetypeIndex].mask;
+	for (uint32_t id : m_archetypes[archetypeIndex].types) {
+		if (shared & (Mask(1) << id)) {
+			std::memcpy(getComponent(to, id), getComponent(from, id), types[id].size);
+		}
+	}
+
+	// Another entity of the old archetype takes the row, ours is not touched
+	removeRow(from);
+}
+
+std::byte* EntityStore::getComponent(const Location& location, uint32_t typeId)
+{
+	Archetype& archetype = m_archetypes[location.archetype];
+	for (size_t i = 0; i < archetype.types.size(); ++i) {
+		if (archetype.types[i] == typeId) {
+			return archetype.chunks[location.chunk].GetData() + archetype.offsets[i] + location.row * componentTypes()[typeId].size;
+		}
+	}
+	return nullptr;
+}
@@ -0,0 +1,223 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <tuple>
+#include <vector>
+#include <unordered_map>
+#include <type_traits>
+
+#include "JobSystem.hpp"
+
+// Archetype-based entity storage: entities with the same set of components live together in fixed-size chunks that hold one
+// array per component, so a query is a linear sweep over the chunks of every matching archetype.
+// Components must be trivially copyable (entities change archetype with a memcpy). No structural changes (Create, Destroy,
+// Add, Remove, Clear) while iterating
+class EntityStore
+{
+public:
+	static constexpr uint32_t MAX_COMPONENT_TYPES = 64;
+	static constexpr uint32_t CHUNK_BYTES = 16 * 1024;
+
+	struct Entity
+	{
+		uint32_t index = UINT32_MAX;
+		uint32_t generation = 0; // Bumped when the index is reused, so stale handles are not alive
+		bool operator==(const Entity& other) const = default;
+	};
+	static const Entity INVALID_ENTITY;
+
+	template<typename... Components>
+	Entity Create(const Components&... components);
+	void Destroy(Entity entity);
+	void Clear();
+	bool IsAlive(Entity entity) const;
+
+	// Adding or removing a component moves the entity to another archetype
+	template<typename T>
+	void Add(Entity entity, const T& component);
+	template<typename T>
+	void Remove(Entity entity);
+	template<typename T>
+	T* Get(Entity entity); // nullptr if the entity does not have one
+
+	// function(Entity, Components&...) for every entity with (at least) these components, in storage order
+	template<typename... Components, typename Function>
+	void Each(Function&& function);
+	// Same, with the chunks spread over the job system. The function may only write to the entity it is given
+	template<typename... Components, typename Function>
+	void ParallelEach(Function&& function);
+
+	uint32_t GetEntityCount() const { return m_entityCount; }
+	uint32_t GetArchetypeCount() const { return static_cast<uint32_t>(m_archetypes.size()); }
+	uint32_t GetChunkCount() const;
+private:
+	using Mask = uint64_t;
+
+	struct Chunk
+	{
+		std::unique_ptr<std::max_align_t[]> memory;
+		uint32_t count = 0;
+
+		std::byte* GetData() { return reinterpret_cast<std::byte*>(memory.get()); }
+	};
+
+	struct Archetype
+	{
+		Mask mask = 0;
+		std::vector<uint32_t> types; // Component type ids, ascending
+		std::vector<uint32_t> offsets; // Start of each type's array inside a chunk (the entity array is at 0)
+		uint32_t capacity = 0; // Entities per chunk
+		std::vector<Chunk> chunks; // Dense: only the last one may be partly filled
+	};
+
+	struct Location
+	{
+		uint32_t archetype = UINT32_MAX;
+		uint32_t chunk = 0;
+		uint32_t row = 0;
+		uint32_t generation = 0;
+	};
+
+	struct ComponentType
+	{
+		uint32_t size;
+		uint32_t alignment;
+	};
+
+	std::vector<Archetype> m_archetypes;
+	std::unordered_map<Mask, uint32_t> m_archetypeIndices;
+	std::vector<Location> m_locations; // By entity index
+	std::vector<uint32_t> m_freeIndices;
+	uint32_t m_entityCount = 0;
+
+	static std::vector<ComponentType>& componentTypes();
+	static uint32_t registerComponentType(uint32_t size, uint32_t alignment);
+	template<typename T>
+	static uint32_t typeId();
+	template<typename... Components>
+	static Mask maskOf() { return ((Mask(1) << typeId<Components>()) | ... | 0); }
+
+	uint32_t findArchetype(Mask mask);
+	Entity allocateEntity();
+	// Appends a row to the archetype's last chunk and points the entity's location at it
+	void appendRow(uint32_t archetypeIndex, Entity entity);
+	// Fills the hole with the archetype's last entity
+	void removeRow(const Location& location);
+	void moveToArchetype(Entity entity, uint32_t archetypeIndex);
+	std::byte* getComponent(const Location& location, uint32_t typeId);
+
+	template<typename T>
+	T* column(Archetype& archetype, Chunk& chunk);
+	template<typename... Components, typename Function>
+	void eachInChunk(Archetype& archetype, Chunk& chunk, Function& function);
+};
+
+inline constexpr EntityStore::Entity EntityStore::INVALID_ENTITY = {};
+
+template<typename T>
+uint32_t EntityStore::typeId()
+{
+	static_assert(std::is_trivially_copyable_v<T>, "Components are moved with memcpy");
+	static const uint32_t id = registerComponentType(sizeof(T), alignof(T));
+	return id;
+}
+
+template<typename... Components>
+EntityStore::Entity EntityStore::Create(const Components&... components)
+{
+	Entity entity = allocateEntity();
+	appendRow(findArchetype(maskOf<Components...>()), entity);
+	const Location& location = m_locations[entity.index];
+	(std::memcpy(getComponent(location, typeId<Components>()), &components, sizeof(Components)), ...);
+	return entity;
+}
+
+template<typename T>
+void EntityStore::Add(Entity entity, const T& component)
+{
+	Mask mask = m_archetypes[m_locations[entity.index].archetype].mask;
+	Mask bit = Mask(1) << typeId<T>();
+	if (!(mask & bit)) {
+		moveToArchetype(entity, findArchetype(mask | bit));
+	}
+	std::memcpy(getComponent(m_locations[entity.index], typeId<T>()), &component, sizeof(T));
+}
+
+template<typename T>
+void EntityStore::Remove(Entity entity)
+{
+	Mask mask = m_archetypes[m_locations[entity.index].archetype].mask;
+	Mask bit = Mask(1) << typeId<T>();
+	if (mask & bit) {
+		moveToArchetype(entity, findArchetype(mask & ~bit));
+	}
+}
+
+template<typename T>
+T* EntityStore::Get(Entity entity)
+{
+	if (!IsAlive(entity)) {
+		return nullptr;
+	}
+	return reinterpret_cast<T*>(getComponent(m_locations[entity.index], typeId<T>()));
+}
+
+template<typename T>
+T* EntityStore::column(Archetype& archetype, Chunk& chunk)
+{
+	uint32_t id = typeId<T>();
+	for (size_t i = 0; i < archetype.types.size(); ++i) {
+		if (archetype.types[i] == id) {
+			return reinterpret_cast<T*>(chunk.GetData() + archetype.offsets[i]);
+		}
+	}
+	return nullptr;
+}
+
+template<typename... Components, typename Function>
+void EntityStore::eachInChunk(Archetype& archetype, Chunk& chunk, Function& function)
+{
+	Entity* entities = reinterpret_cast<Entity*>(chunk.GetData());
+	std::tuple<Components*...> columns = {column<Components>(archetype, chunk)...};
+	for (uint32_t row = 0; row < chunk.count; ++row) {
+		function(entities[row], std::get<Components*>(columns)[row]...);
+	}
+}
+
+template<typename... Components, typename Function>
+void EntityStore::Each(Function&& function)
+{
+	Mask query = maskOf<Components...>();
+	for (Archetype& archetype : m_archetypes) {
+		if ((archetype.mask & query) != query) {
+			continue;
+		}
+		for (Chunk& chunk : archetype.chunks) {
+			eachInChunk<Components...>(archetype, chunk, function);
+		}
+	}
+}
+
+template<typename... Components, typename Function>
+void EntityStore::ParallelEach(Function&& function)
+{
+	// One job per chunk, chunks are big enough to be worth it and never share a cache line
+	Mask query = maskOf<Components...>();
+	std::vector<std::pair<Archetype*, Chunk*>> chunks;
+	for (Archetype& archetype : m_archetypes) {
+		if ((archetype.mask & query) == query) {
+			for (Chunk& chunk : archetype.chunks) {
+				chunks.push_back({&archetype, &chunk});
+			}
+		}
+	}
+	JobSystem::ParallelFor(static_cast<uint32_t>(chunks.size()), 1, [this, &chunks, &function](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; ++i) {
+			eachInChunk<Components...>(*chunks[i].first, *chunks[i].second, function);
+		}
+	});
+}
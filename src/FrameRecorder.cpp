@@ -0,0 +1,352 @@
+#include <vector>
+#include <chrono>
+#include <cstring>
+
+#include <spdlog/spdlog.h>
+#include <imgui/imgui.h>
+
+#include "FrameRecorder.hpp"
+#include "ResourceManager.hpp"
+#include "Trace.hpp"
+#include "Stats.hpp"
+
+bool FrameRecorder::Init(WGPUInstance instance, WGPUDevice device)
+{
+	m_instance = instance;
+	m_device = device;
+	for (Readback& readback : m_readbacks) {
+		readback.recorder = this;
+	}
+	m_stopWorker = false;
+	m_worker = std::thread(&FrameRecorder::workerMain, this);
+	return true;
+}
+
+void FrameRecorder::Terminate()
+{
+	if (!m_device) {
+		return;
+	}
+	Stop();
+	m_capturePath.clear();
+	Flush();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopWorker = true;
+	}
+	m_condition.notify_all();
+	m_worker.join();
+
+	for (Readback& readback : m_readbacks) {
+		if (readback.buffer) {
+			wgpuBufferDestroy(readback.buffer);
+			wgpuBufferRelease(readback.buffer);
+			Stats::TrackGpuMemory(Stats::MemoryCategory::Readbacks, -static_cast<int64_t>(readback.capacity));
+			readback.buffer = nullptr;
+			readback.capacity = 0;
+		}
+	}
+	m_device = nullptr;
+}
+
+bool FrameRecorder::Start(const std::filesystem::path& directory, Format format)
+{
+	Stop();
+	std::error_code error;
+	std::filesystem::create_directories(directory, error);
+	if (error) {
+		SPDLOG_ERROR("Could not create \"{}\": {}", directory.string(), error.message());
+		return false;
+	}
+	if (format == Format::RawVideo) {
+		m_video = std::make_shared<std::ofstream>(directory / "recording.rgba", std::ios::binary);
+		if (!*m_video) {
+			SPDLOG_ERROR("Could not open \"{}\"", (directory / "recording.rgba").string());
+			m_video.reset();
+			return false;
+		}
+	}
+	m_directory = directory;
+	m_format = format;
+	m_videoSize = {0, 0};
+	m_frameIndex = 0;
+	m_recording = true;
+	SPDLOG_INFO("Recording to \"{}\" ({})", directory.string(), format == Format::RawVideo ? "raw video" : "PNG sequence");
+	return true;
+}
+
+void FrameRecorder::Stop()
+{
+	if (!m_recording) {
+		return;
+	}
+	m_recording = false;
+	if (m_video) {
+		// The frames still in flight hold on to the file, it's closed after the last one
+		m_video.reset();
+		SPDLOG_INFO("Recorded {} frames of {}x{}, encode with: ffmpeg -f rawvideo -pixel_format rgba -video_size {}x{} -framerate 60 -i \"{}\" recording.mp4",
+			m_frameIndex, m_videoSize.x, m_videoSize.y, m_videoSize.x, m_videoSize.y, (m_directory / "recording.rgba").string());
+	} else {
+		SPDLOG_INFO("Recorded {} frames to \"{}\"", m_frameIndex, m_directory.string());
+	}
+}
+
+bool FrameRecorder::reserve(Readback& readback, uint64_t size)
+{
+	if (readback.capacity >= size) {
+		return true;
+	}
+	if (readback.buffer) {
+		wgpuBufferDestroy(readback.buffer);
+		wgpuBufferRelease(readback.buffer);
+		Stats::TrackGpuMemory(Stats::MemoryCategory::Readbacks, -static_cast<int64_t>(readback.capacity));
+	}
+	WGPUBufferDescriptor bufferDesc = {};
+	bufferDesc.label = "Frame recorder readback buffer";
+	bufferDesc.usage = WGPUBufferUsage_CopyDst | WGPUBufferUsage_MapRead;
+	bufferDesc.size = size;
+	bufferDesc.mappedAtCreation = false;
+	readback.buffer = wgpuDeviceCreateBuffer(m_device, &bufferDesc);
+	readback.capacity = readback.buffer ? size : 0;
+	Stats::TrackGpuMemory(Stats::MemoryCategory::Readbacks, readback.capacity);
+	return readback.buffer != nullptr;
+}
+
+void FrameRecorder::RecordFrame(WGPUCommandEncoder encoder, WGPUTexture texture, WGPUTextureFormat format, glm::uvec2 size)
+{
+	if (!IsActive() || !m_device || size.x == 0 || size.y == 0) {
+		return;
+	}
+	TRACE_ZONE("FrameRecorder::RecordFrame");
+	if (format != WGPUTextureFormat_BGRA8Unorm && format != WGPUTextureFormat_RGBA8Unorm) {
+		SPDLOG_WARN("Can't record frames of texture format {}", static_cast<uint32_t>(format));
+		Stop();
+		m_capturePath.clear();
+		return;
+	}
+	// A raw video has one frame size, frames after a resize are skipped
+	bool recordFrame = m_recording;
+	if (recordFrame && m_video) {
+		if (m_videoSize == glm::uvec2(0, 0)) {
+			m_videoSize = size;
+		}
+		recordFrame = m_videoSize == size;
+	}
+	if (!recordFrame && m_capturePath.empty()) {
+		++m_droppedFrameCount;
+		return;
+	}
+
+	// The oldest readback should be free by now. If the GPU or the worker is behind, drop the frame instead of waiting for it
+	Readback& readback = m_readbacks[m_readbackIndex];
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (readback.state != ReadbackState::Free) {
+			++m_droppedFrameCount;
+			return;
+		}
+	}
+	uint32_t bytesPerRow = (4 * size.x + 255) & ~255u;
+	if (!reserve(readback, static_cast<uint64_t>(bytesPerRow) * size.y)) {
+		++m_droppedFrameCount;
+		return;
+	}
+
+	WGPUImageCopyTexture source = {};
+	source.texture = texture;
+	source.mipLevel = 0;
+	source.origin = {0, 0, 0};
+	source.aspect = WGPUTextureAspect_All;
+	WGPUImageCopyBuffer destination = {};
+	destination.buffer = readback.buffer;
+	destination.layout.offset = 0;
+	destination.layout.bytesPerRow = bytesPerRow;
+	destination.layout.rowsPerImage = size.y;
+	WGPUExtent3D copySize = {size.x, size.y, 1};
+	wgpuCommandEncoderCopyTextureToBuffer(encoder, &source, &destination, &copySize);
+
+	readback.state = ReadbackState::Recording;
+	readback.size = size;
+	readback.bytesPerRow = bytesPerRow;
+	readback.bgra = format == WGPUTextureFormat_BGRA8Unorm;
+	readback.video = recordFrame ? m_video : nullptr;
+	readback.pngPath.clear();
+	if (recordFrame && !m_video) {
+		char name[32];
+		snprintf(name, sizeof(name), "frame_%06llu.png", (unsigned long long)m_frameIndex);
+		readback.pngPath = m_directory / name;
+	}
+	readback.capturePath = std::move(m_capturePath);
+	m_capturePath.clear();
+	if (recordFrame) {
+		++m_frameIndex;
+	}
+	m_currentReadback = &readback;
+	m_readbackIndex = (m_readbackIndex + 1) % READBACK_COUNT;
+}
+
+void FrameRecorder::EndFrame()
+{
+	// Unmap what the worker is done with
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (Readback& readback : m_readbacks) {
+			if (readback.state == ReadbackState::Done) {
+				wgpuBufferUnmap(readback.buffer);
+				readback.mapped = nullptr;
+				readback.video.reset();
+				readback.state = ReadbackState::Free;
+			}
+		}
+	}
+
+	if (!m_currentReadback) {
+		return;
+	}
+	Readback& readback = *m_currentReadback;
+	m_currentReadback = nullptr;
+
+	// Resolves once the GPU is done with the frame (callback fires from wgpuInstanceProcessEvents/wgpuDeviceTick)
+	auto onMapped = [](WGPUBufferMapAsyncStatus status, void* pUserData)
+	{
+		Readback& readback = *reinterpret_cast<Readback*>(pUserData);
+		FrameRecorder& recorder = *readback.recorder;
+		std::lock_guard<std::mutex> lock(recorder.m_mutex);
+		if (status != WGPUBufferMapAsyncStatus_Success) {
+			SPDLOG_WARN("Could not map a frame readback buffer ({})", static_cast<uint32_t>(status));
+			readback.video.reset();
+			readback.state = ReadbackState::Free;
+			++recorder.m_droppedFrameCount;
+			return;
+		}
+		readback.mapped = reinterpret_cast<const uint8_t*>(wgpuBufferGetConstMappedRange(readback.buffer, 0, static_cast<size_t>(readback.bytesPerRow) * readback.size.y));
+		readback.state = ReadbackState::Writing;
+		recorder.m_queue.push_back(&readback);
+		recorder.m_condition.notify_one();
+	};
+	readback.state = ReadbackState::Mapping;
+	size_t size = static_cast<size_t>(readback.bytesPerRow) * readback.size.y;
+	wgpuBufferMapAsync(readback.buffer, WGPUMapMode_Read, 0, size, onMapped, (void*)&readback);
+}
+
+void FrameRecorder::Flush()
+{
+	TRACE_ZONE("FrameRecorder::Flush");
+	for (;;) {
+		EndFrame();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			bool busy = false;
+			for (const Readback& readback : m_readbacks) {
+				busy |= readback.state != ReadbackState::Free;
+			}
+			if (!busy) {
+				return;
+			}
+		}
+		wgpuInstanceProcessEvents(m_instance);
+		wgpuDeviceTick(m_device);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+void FrameRecorder::workerMain()
+{
+	Trace::SetThreadName("Frame recorder");
+	std::vector<uint8_t> pixels;
+	for (;;) {
+		Readback* readback = nullptr;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_condition.wait(lock, [this]() { return m_stopWorker || !m_queue.empty(); });
+			if (m_queue.empty()) {
+				return; // Stopping, Terminate flushed everything before
+			}
+			readback = m_queue.front();
+			m_queue.pop_front();
+		}
+		TRACE_ZONE("FrameRecorder::writeFrame");
+		uint64_t startNs = Trace::NowNs();
+
+		// Take the rows out of the mapped buffer first, so it goes back to the ring before the (slow) file writes
+		glm::uvec2 size = readback->size;
+		size_t rowBytes = 4ull * size.x;
+		pixels.resize(rowBytes * size.y);
+		for (uint32_t y = 0; y < size.y; ++y) {
+			const uint8_t* src = readback->mapped + static_cast<size_t>(y) * readback->bytesPerRow;
+			uint8_t* dst = pixels.data() + y * rowBytes;
+			if (readback->bgra) {
+				for (uint32_t x = 0; x < size.x; ++x) {
+					dst[4 * x + 0] = src[4 * x + 2];
+					dst[4 * x + 1] = src[4 * x + 1];
+					dst[4 * x + 2] = src[4 * x + 0];
+					dst[4 * x + 3] = src[4 * x + 3];
+				}
+			} else {
+				memcpy(dst, src, rowBytes);
+			}
+		}
+		std::shared_ptr<std::ofstream> video;
+		std::filesystem::path pngPath, capturePath;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			video = readback->video;
+			pngPath = std::move(readback->pngPath);
+			capturePath = std::move(readback->capturePath);
+			readback->state = ReadbackState::Done;
+		}
+
+		uint64_t bytes = 0;
+		if (video) {
+			video->write(reinterpret_cast<const char*>(pixels.data()), pixels.size());
+			bytes += pixels.size();
+		}
+		if (!pngPath.empty() && ResourceManager::SavePng(pngPath, pixels.data(), size.x, size.y)) {
+			bytes += std::filesystem::file_size(pngPath);
+		}
+		if (!capturePath.empty() && ResourceManager::SavePng(capturePath, pixels.data(), size.x, size.y)) {
+			SPDLOG_INFO("Saved frame capture \"{}\"", capturePath.string());
+		}
+		if (video || !pngPath.empty()) {
+			++m_writtenFrameCount;
+			m_writtenBytes += bytes;
+		}
+		m_lastWriteMs = (Trace::NowNs() - startNs) * 1e-6f;
+	}
+}
+
+void FrameRecorder::DrawImGui()
+{
+	ImGui::Begin("Recording");
+	uint32_t busyCount = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (const Readback& readback : m_readbacks) {
+			busyCount += readback.state != ReadbackState::Free;
+		}
+	}
+	ImGui::Text("Readbacks in flight: %u / %u", busyCount, READBACK_COUNT);
+	ImGui::Text("Frames written: %llu (%.1f MB), dropped: %llu", (unsigned long long)GetWrittenFrameCount(), GetWrittenBytes() / (1024.0 * 1024.0),
+		(unsigned long long)m_droppedFrameCount);
+	ImGui::Text("Last write: %.2f ms (worker thread)", m_lastWriteMs.load());
+	if (ImGui::Button("Capture frame")) {
+		char name[32];
+		snprintf(name, sizeof(name), "capture_%03llu.png", (unsigned long long)m_captureCount++);
+		CaptureNextFrame(name);
+	}
+	if (m_recording) {
+		ImGui::Text("Recording frame %llu to \"%s\"", (unsigned long long)m_frameIndex, m_directory.string().c_str());
+		if (ImGui::Button("Stop")) {
+			Stop();
+		}
+	} else {
+		if (ImGui::Button("Record PNG sequence")) {
+			Start("recording", Format::PngSequence);
+		}
+		ImGui::SameLine();
+		if (ImGui::Button("Record raw video")) {
+			Start("recording", Format::RawVideo);
+		}
+	}
+	ImGui::End();
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <array>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <fstream>
+#include <filesystem>
+#include <condition_variable>
+
+#include <webgpu/webgpu.h>
+#include <glm/glm.hpp>
+
+// Frame captures and session recordings without stalling the renderer. A recorded frame is copied into one of a ring of
+// MapRead buffers, which is only mapped once the GPU got through the frame. A worker thread takes the mapped rows out and
+// writes them as PNG files or appends them to a raw RGBA8 video file. When every buffer is still busy the frame is dropped
+class FrameRecorder
+{
+public:
+	static constexpr uint32_t READBACK_COUNT = 6; // More than the frames in flight, the rest gives the worker some slack
+
+	enum class Format
+	{
+		PngSequence, // directory/frame_000000.png, ...
+		RawVideo // directory/recording.rgba, the size and the ffmpeg command line are logged
+	};
+
+	bool Init(WGPUInstance instance, WGPUDevice device);
+	// Writes out the frames still on their way first
+	void Terminate();
+
+	bool Start(const std::filesystem::path& directory, Format format);
+	void Stop();
+	bool IsRecording() const { return m_recording; }
+	// The next recorded frame also goes to this PNG (recording or not)
+	void CaptureNextFrame(const std::filesystem::path& path) { m_capturePath = path; }
+	bool IsActive() const { return m_recording || !m_capturePath.empty(); }
+
+	// Copies the finished frame (BGRA8 or RGBA8) into a free readback buffer. Call before finishing the frame's command encoder
+	void RecordFrame(WGPUCommandEncoder encoder, WGPUTexture texture, WGPUTextureFormat format, glm::uvec2 size);
+	// Call after the frame got submitted: maps what RecordFrame copied and recycles the buffers the worker is done with
+	void EndFrame();
+	// Blocks until every frame recorded so far is written
+	void Flush();
+
+	uint64_t GetWrittenFrameCount() const { return m_writtenFrameCount; }
+	uint64_t GetDroppedFrameCount() const { return m_droppedFrameCount; }
+	uint64_t GetWrittenBytes() const { return m_writtenBytes; }
+
+	void DrawImGui();
+private:
+	enum class ReadbackState
+	{
+		Free,
+		Recording, // Copied into by the frame being encoded
+		Mapping, // Waiting on MapAsync
+		Writing, // Mapped, the worker is copying the rows out
+		Done // Ready to unmap
+	};
+
+	struct Readback
+	{
+		FrameRecorder* recorder = nullptr;
+		WGPUBuffer buffer = nullptr;
+		uint64_t capacity = 0;
+		ReadbackState state = ReadbackState::Free; // Writing -> Done is done by the worker, under m_mutex
+		const uint8_t* mapped = nullptr;
+		glm::uvec2 size = {0, 0};
+		uint32_t bytesPerRow = 0; // 256 byte aligned
+		bool bgra = false;
+		// Where the frame goes
+		std::shared_ptr<std::ofstream> video; // Closed once the last frame of the recording is written
+		std::filesystem::path pngPath;
+		std::filesystem::path capturePath;
+	};
+
+	WGPUInstance m_instance = nullptr;
+	WGPUDevice m_device = nullptr;
+	std::array<Readback, READBACK_COUNT> m_readbacks;
+	uint32_t m_readbackIndex = 0;
+	Readback* m_currentReadback = nullptr;
+
+	// Current recording
+	bool m_recording = false;
+	Format m_format = Format::PngSequence;
+	std::filesystem::path m_directory;
+	std::shared_ptr<std::ofstream> m_video;
+	glm::uvec2 m_videoSize = {0, 0}; // Frames of another size are dropped
+	uint64_t m_frameIndex = 0;
+	std::filesystem::path m_capturePath;
+
+	// Worker thread
+	std::thread m_worker;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::deque<Readback*> m_queue; // Mapped, in frame order
+	bool m_stopWorker = false;
+
+	// Stats
+	std::atomic<uint64_t> m_writtenFrameCount = 0;
+	std::atomic<uint64_t> m_writtenBytes = 0;
+	std::atomic<float> m_lastWriteMs = 0.0f;
+	uint64_t m_droppedFrameCount = 0;
+	uint64_t m_captureCount = 0; // For the names of the captures taken from the UI
+
+	bool reserve(Readback& readback, uint64_t size);
+	void workerMain();
+};
@@ -0,0 +1,335 @@
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GEOMETRY_CODEC_SSE2
+#endif
+
+#include "GeometryCodec.hpp"
+#include "Trace.hpp"
+
+namespace GeometryCodec
+{
+namespace
+{
+// Header value of a group: how many bits each of its 16 deltas takes
+constexpr uint32_t GROUP_BITS[4] = {0, 2, 4, 8};
+
+uint8_t zigzag8(uint8_t delta)
+{
+	return static_cast<uint8_t>((delta << 1) ^ static_cast<uint8_t>(static_cast<int8_t>(delta) >> 7));
+}
+
+#ifndef GEOMETRY_CODEC_SSE2 // The SSE2 decoder does it 16 lanes at a time
+uint8_t unzigzag8(uint8_t value)
+{
+	return static_cast<uint8_t>((value >> 1) ^ -(value & 1));
+}
+#endif
+
+uint32_t zigzag32(uint32_t delta)
+{
+	return (delta << 1) ^ static_cast<uint32_t>(static_cast<int32_t>(delta) >> 31);
+}
+
+uint32_t unzigzag32(uint32_t value)
+{
+	return (value >> 1) ^ (0u - (value & 1));
+}
+
+uint32_t hashVertex(const uint8_t* vertex, size_t stride)
+{
+	// FNV-1a, vertices are short
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < stride; ++i) {
+		hash = (hash ^ vertex[i]) * 16777619u;
+	}
+	return hash;
+}
+}
+
+void IndexVertices(const void* vertices, size_t count, size_t stride, std::vector<uint8_t>& uniqueVertices, std::vector<uint32_t>& indices)
+{
+	TRACE_ZONE("GeometryCodec::IndexVertices");
+	const uint8_t* source = static_cast<const uint8_t*>(vertices);
+	uniqueVertices.clear();
+	indices.resize(count);
+
+	// Open addressing, at most half full. Slots hold unique vertex + 1
+	size_t tableSize = 16;
+	while (tableSize < count * 2) {
+		tableSize *= 2;
+	}
+	std::vector<uint32_t> table(tableSize, 0);
+	uint32_t uniqueCount = 0;
+	for (size_t i = 0; i < count; ++i) {
+		const uint8_t* vertex = source + i * stride;
+		size_t slot = hashVertex(vertex, stride) & (tableSize - 1);
+		while (table[slot] != 0 && std::memcmp(uniqueVertices.data() + (table[slot] - 1) * stride, vertex, stride) != 0) {
+			slot = (slot + 1) & (tableSize - 1);
+		}
+		if (table[slot] == 0) {
+			uniqueVertices.insert(uniqueVertices.end(), vertex, vertex + stride);
+			table[slot] = ++uniqueCount;
+		}
+		indices[i] = table[slot] - 1;
+	}
+}
+
+std::vector<uint8_t> EncodeVertices(const void* vertices, size_t count, size_t stride)
+{
+	TRACE_ZONE("GeometryCodec::EncodeVertices");
+	const uint8_t* source = static_cast<const uint8_t*>(vertices);
+	std::vector<uint8_t> encoded;
+	encoded.reserve(count * stride / 2);
+	uint8_t previous[MAX_STRIDE] = {};
+	uint8_t deltas[VERTEX_BLOCK];
+	for (size_t blockStart = 0; blockStart < count; blockStart += VERTEX_BLOCK) {
+		uint32_t blockCount = static_cast<uint32_t>(std::min<size_t>(VERTEX_BLOCK, count - blockStart));
+		uint32_t groupCount = (blockCount + GROUP_SIZE - 1) / GROUP_SIZE;
+		for (size_t k = 0; k < stride; ++k) {
+			// Byte plane k of the block as zig-zagged deltas, padded with zeros to whole groups
+			uint8_t last = previous[k];
+			for (uint32_t i = 0; i < blockCount; ++i) {
+				uint8_t value = source[(blockStart + i) * stride + k];
+				deltas[i] = zigzag8(static_cast<uint8_t>(value - last));
+				last = value;
+			}
+			previous[k] = last;
+			std::fill(deltas + blockCount, deltas + groupCount * GROUP_SIZE, uint8_t(0));
+
+			size_t header = encoded.size();
+			encoded.resize(header + (groupCount + 3) / 4, 0);
+			for (uint32_t group = 0; group < groupCount; ++group) {
+				const uint8_t* values = deltas + group * GROUP_SIZE;
+				uint8_t largest = *std::max_element(values, values + GROUP_SIZE);
+				uint32_t mode = largest == 0 ? 0 : largest < 4 ? 1 : largest < 16 ? 2 : 3;
+				encoded[header + group / 4] |= static_cast<uint8_t>(mode << ((group % 4) * 2));
+				uint32_t bits = GROUP_BITS[mode];
+				for (uint32_t i = 0; bits > 0 && i < GROUP_SIZE; i += 8 / bits) {
+					uint8_t packed = 0;
+					for (uint32_t j = 0; j < 8 / bits; ++j) {
+						packed |= static_cast<uint8_t>(values[i + j] << (j * bits));
+					}
+					encoded.push_back(packed);
+				}
+			}
+		}
+	}
+	return encoded;
+}
+
+namespace
+{
+#ifdef GEOMETRY_CODEC_SSE2
+__m128i unpackGroup(uint32_t mode, const uint8_t* data)
+{
+	switch (mode) {
+	case 0:
+		return _mm_setzero_si128();
+	case 1: {
+		uint32_t word;
+		std::memcpy(&word, data, 4);
+		__m128i packed = _mm_cvtsi32_si128(static_cast<int>(word));
+		__m128i mask = _mm_set1_epi8(3);
+		__m128i v0 = _mm_and_si128(packed, mask);
+		__m128i v1 = _mm_and_si128(_mm_srli_epi16(packed, 2), mask);
+		__m128i v2 = _mm_and_si128(_mm_srli_epi16(packed, 4), mask);
+		__m128i v3 = _mm_and_si128(_mm_srli_epi16(packed, 6), mask);
+		return _mm_unpacklo_epi16(_mm_unpacklo_epi8(v0, v1), _mm_unpacklo_epi8(v2, v3));
+	}
+	case 2: {
+		__m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(data));
+		__m128i mask = _mm_set1_epi8(15);
+		return _mm_unpacklo_epi8(_mm_and_si128(packed, mask), _mm_and_si128(_mm_srli_epi16(packed, 4), mask));
+	}
+	default:
+		return _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+	}
+}
+#endif
+
+// Decodes one byte plane of a block (whole groups, the padding repeats the last value). last is the plane's value in the
+// previous vertex on the way in and in the block's last vertex on the way out
+bool decodePlane(const uint8_t*& data, const uint8_t* end, uint32_t blockCount, uint8_t* plane, uint8_t& last)
+{
+	uint32_t groupCount = (blockCount + GROUP_SIZE - 1) / GROUP_SIZE;
+	const uint8_t* header = data;
+	data += (groupCount + 3) / 4;
+	if (data > end) {
+		return false;
+	}
+#ifdef GEOMETRY_CODEC_SSE2
+	__m128i one = _mm_set1_epi8(1);
+	__m128i low7 = _mm_set1_epi8(0x7f);
+	__m128i carry = _mm_set1_epi8(static_cast<char>(last));
+#endif
+	for (uint32_t group = 0; group < groupCount; ++group) {
+		uint8_t* values = plane + group * GROUP_SIZE;
+		uint32_t mode = (header[group / 4] >> ((group % 4) * 2)) & 3;
+		uint32_t bytes = GROUP_BITS[mode] * GROUP_SIZE / 8;
+		if (end - data < static_cast<ptrdiff_t>(bytes)) {
+			return false;
+		}
+#ifdef GEOMETRY_CODEC_SSE2
+		__m128i value = unpackGroup(mode, data);
+		value = _mm_xor_si128(_mm_and_si128(_mm_srli_epi16(value, 1), low7), _mm_sub_epi8(_mm_setzero_si128(), _mm_and_si128(value, one)));
+		// Prefix sum across the 16 lanes
+		value = _mm_add_epi8(value, _mm_slli_si128(value, 1));
+		value = _mm_add_epi8(value, _mm_slli_si128(value, 2));
+		value = _mm_add_epi8(value, _mm_slli_si128(value, 4));
+		value = _mm_add_epi8(value, _mm_slli_si128(value, 8));
+		value = _mm_add_epi8(value, carry);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(values), value);
+		// Broadcast lane 15 without going through memory (store forwarding would stall)
+		carry = _mm_unpackhi_epi8(value, value);
+		carry = _mm_shuffle_epi32(_mm_unpackhi_epi16(carry, carry), 0xff);
+#else
+		for (uint32_t i = 0; i < GROUP_SIZE; ++i) {
+			uint8_t delta;
+			switch (mode) {
+			case 0:
+				delta = 0;
+				break;
+			case 1:
+				delta = (data[i / 4] >> ((i % 4) * 2)) & 3;
+				break;
+			case 2:
+				delta = (data[i / 2] >> ((i % 2) * 4)) & 15;
+				break;
+			default:
+				delta = data[i];
+				break;
+			}
+			last = static_cast<uint8_t>(last + unzigzag8(delta));
+			values[i] = last;
+		}
+#endif
+		data += bytes;
+	}
+#ifdef GEOMETRY_CODEC_SSE2
+	last = plane[groupCount * GROUP_SIZE - 1];
+#endif
+	return true;
+}
+
+// planes[k * VERTEX_BLOCK + i] is byte k of vertex i
+void interleavePlanes(const uint8_t* planes, uint32_t blockCount, size_t stride, uint8_t* vertices)
+{
+#ifdef GEOMETRY_CODEC_SSE2
+	// 16x16 byte transposes. The last column of tiles is moved back to end at the stride, rewriting a few bytes rather than
+	// falling back to the scalar loop
+	uint32_t i = 0;
+	for (; stride >= 16 && i + 16 <= blockCount; i += 16) {
+		for (size_t tile = 0; tile < stride; tile += 16) {
+			size_t column = std::min(tile, stride - 16);
+			__m128i rows[16];
+			for (int r = 0; r < 16; ++r) {
+				rows[r] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(planes + (column + r) * VERTEX_BLOCK + i));
+			}
+			__m128i temp[16];
+			for (int r = 0; r < 8; ++r) {
+				temp[r] = _mm_unpacklo_epi8(rows[2 * r], rows[2 * r + 1]);
+				temp[r + 8] = _mm_unpackhi_epi8(rows[2 * r], rows[2 * r + 1]);
+			}
+			for (int h = 0; h < 2; ++h) {
+				for (int r = 0; r < 4; ++r) {
+					rows[h * 8 + r] = _mm_unpacklo_epi16(temp[h * 8 + 2 * r], temp[h * 8 + 2 * r + 1]);
+					rows[h * 8 + r + 4] = _mm_unpackhi_epi16(temp[h * 8 + 2 * r], temp[h * 8 + 2 * r + 1]);
+				}
+			}
+			for (int q = 0; q < 4; ++q) {
+				for (int r = 0; r < 2; ++r) {
+					temp[q * 4 + r] = _mm_unpacklo_epi32(rows[q * 4 + 2 * r], rows[q * 4 + 2 * r + 1]);
+					temp[q * 4 + r + 2] = _mm_unpackhi_epi32(rows[q * 4 + 2 * r], rows[q * 4 + 2 * r + 1]);
+				}
+			}
+			for (int e = 0; e < 8; ++e) {
+				rows[2 * e] = _mm_unpacklo_epi64(temp[2 * e], temp[2 * e + 1]);
+				rows[2 * e + 1] = _mm_unpackhi_epi64(temp[2 * e], temp[2 * e + 1]);
+			}
+			for (int v = 0; v < 16; ++v) {
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(vertices + (i + v) * stride + column), rows[v]);
+			}
+		}
+	}
+	// Leftover vertices of a short block
+	for (; i < blockCount; ++i) {
+		for (size_t k = 0; k < stride; ++k) {
+			vertices[i * stride + k] = planes[k * VERTEX_BLOCK + i];
+		}
+	}
+#else
+	for (size_t k = 0; k < stride; ++k) {
+		for (uint32_t i = 0; i < blockCount; ++i) {
+			vertices[i * stride + k] = planes[k * VERTEX_BLOCK + i];
+		}
+	}
+#endif
+}
+}
+
+bool DecodeVertices(const uint8_t* data, size_t size, void* vertices, size_t count, size_t stride)
+{
+	TRACE_ZONE("GeometryCodec::DecodeVertices");
+	if (stride == 0 || stride > MAX_STRIDE) {
+		return false;
+	}
+	uint8_t* destination = static_cast<uint8_t*>(vertices);
+	const uint8_t* end = data + size;
+	uint8_t previous[MAX_STRIDE] = {};
+	std::vector<uint8_t> planes(stride * VERTEX_BLOCK);
+	for (size_t blockStart = 0; blockStart < count; blockStart += VERTEX_BLOCK) {
+		uint32_t blockCount = static_cast<uint32_t>(std::min<size_t>(VERTEX_BLOCK, count - blockStart));
+		for (size_t k = 0; k < stride; ++k) {
+			if (!decodePlane(data, end, blockCount, planes.data() + k * VERTEX_BLOCK, previous[k])) {
+				return false;
+			}
+		}
+		interleavePlanes(planes.data(), blockCount, stride, destination + blockStart * stride); // The block stays in L1
+	}
+	return data == end;
+}
+
+std::vector<uint8_t> EncodeIndices(const uint32_t* indices, size_t count)
+{
+	TRACE_ZONE("GeometryCodec::EncodeIndices");
+	std::vector<uint8_t> encoded;
+	encoded.reserve(count);
+	uint32_t previous = 0;
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t value = zigzag32(indices[i] - previous);
+		previous = indices[i];
+		while (value >= 0x80) {
+			encoded.push_back(static_cast<uint8_t>(value | 0x80));
+			value >>= 7;
+		}
+		encoded.push_back(static_cast<uint8_t>(value));
+	}
+	return encoded;
+}
+
+bool DecodeIndices(const uint8_t* data, size_t size, uint32_t* indices, size_t count)
+{
+	TRACE_ZONE("GeometryCodec::DecodeIndices");
+	const uint8_t* end = data + size;
+	uint32_t previous = 0;
+	for (size_t i = 0; i < count; ++i) {
+		uint32_t value = 0;
+		for (uint32_t shift = 0;; shift += 7) {
+			if (data == end || shift > 28) {
+				return false;
+			}
+			uint8_t byte = *data++;
+			value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+			if (byte < 0x80) {
+				break;
+			}
+		}
+		previous += unzigzag32(value);
+		indices[i] = previous;
+	}
+	return data == end;
+}
+}
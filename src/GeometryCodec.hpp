@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Lossless compression for mesh data, meant to be decoded at load time faster than the bytes it saves can be read.
+// Vertices: each byte of a vertex is delta coded against the same byte of the previous vertex, and the deltas (zig-zagged,
+// one byte plane per block of VERTEX_BLOCK vertices) are bit packed in groups of 16 at 0, 2, 4 or 8 bits each.
+// Indices: delta against the previous index, zig-zag, then LEB128 varints.
+// The decoders return false on truncated or corrupt data instead of reading past it
+namespace GeometryCodec
+{
+	constexpr uint32_t VERTEX_BLOCK = 256;
+	constexpr uint32_t GROUP_SIZE = 16;
+	constexpr size_t MAX_STRIDE = 256;
+
+	// Merges identical vertices (bitwise). uniqueVertices gets them in order of first use, so neighbours stay close
+	void IndexVertices(const void* vertices, size_t count, size_t stride, std::vector<uint8_t>& uniqueVertices, std::vector<uint32_t>& indices);
+
+	std::vector<uint8_t> EncodeVertices(const void* vertices, size_t count, size_t stride);
+	bool DecodeVertices(const uint8_t* data, size_t size, void* vertices, size_t count, size_t stride);
+
+	std::vector<uint8_t> EncodeIndices(const uint32_t* indices, size_t count);
+	bool DecodeIndices(const uint8_t* data, size_t size, uint32_t* indices, size_t count);
+
+	// The most size encoded bytes can decode to, for checking counts read from a file before allocating for them. Every 4 groups
+	// of a byte plane take at least their header byte, every index at least one varint byte
+	constexpr size_t MaxVertexCount(size_t size, size_t stride) { return stride == 0 ? 0 : size / stride * (4 * GROUP_SIZE); }
+	constexpr size_t MaxIndexCount(size_t size) { return size; }
+}
@@ -0,0 +1,262 @@
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
+#include <spdlog/spdlog.h>
+#include <imgui/imgui.h>
+
+#include "GpuProfiler.hpp"
+#include "Trace.hpp"
+#include "Stats.hpp"
+
+bool GpuProfiler::Init(WGPUDevice device, bool timestampsSupported)
+{
+	if (!timestampsSupported) {
+		SPDLOG_WARN("Adapter does not support timestamp queries, GPU profiling disabled.");
+		return true; // Not fatal, everything just returns nullptr
+	}
+
+	// Two timestamps (beginning and end) per pass
+	WGPUQuerySetDescriptor querySetDesc = {};
+	querySetDesc.nextInChain = nullptr;
+	querySetDesc.label = "GPU profiler query set";
+	querySetDesc.type = WGPUQueryType_Timestamp;
+	querySetDesc.count = 2 * MAX_PASSES;
+	m_querySet = wgpuDeviceCreateQuerySet(device, &querySetDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::Queries, querySetDesc.count * sizeof(uint64_t));
+
+	WGPUBufferDescriptor bufferDesc = {};
+	bufferDesc.nextInChain = nullptr;
+	bufferDesc.label = "GPU profiler resolve buffer";
+	bufferDesc.usage = WGPUBufferUsage_QueryResolve | WGPUBufferUsage_CopySrc;
+	bufferDesc.size = 2 * MAX_PASSES * sizeof(uint64_t);
+	bufferDesc.mappedAtCreation = false;
+	m_resolveBuffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::Queries, (1 + READBACK_COUNT) * bufferDesc.size);
+
+	// Resolving straight into a MapRead buffer is not allowed, so each frame copies into one of these
+	bufferDesc.label = "GPU profiler readback buffer";
+	bufferDesc.usage = WGPUBufferUsage_MapRead | WGPUBufferUsage_CopyDst;
+	for (Readback& readback : m_readbacks) {
+		readback.profiler = this;
+		readback.buffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+		readback.passNames.reserve(MAX_PASSES);
+	}
+
+	return m_querySet != nullptr && m_resolveBuffer != nullptr;
+}
+
+void GpuProfiler::Terminate()
+{
+	for (Readback& readback : m_readbacks) {
+		if (readback.buffer) {
+			wgpuBufferDestroy(readback.buffer);
+			wgpuBufferRelease(readback.buffer);
+			readback.buffer = nullptr;
+		}
+	}
+	if (m_resolveBuffer) {
+		wgpuBufferDestroy(m_resolveBuffer);
+		wgpuBufferRelease(m_resolveBuffer);
+		m_resolveBuffer = nullptr;
+	}
+	if (m_querySet) {
+		wgpuQuerySetDestroy(m_querySet);
+		wgpuQuerySetRelease(m_querySet);
+		m_querySet = nullptr;
+	}
+}
+
+void GpuProfiler::BeginFrame()
+{
+	m_currentReadback = nullptr;
+	if (!IsEnabled()) {
+		return;
+	}
+
+	// If the oldest readback is still mapping, skip profiling this frame instead of waiting for it
+	Readback& readback = m_readbacks[m_readbackIndex];
+	if (readback.state != ReadbackState::Free) {
+		return;
+	}
+	readback.state = ReadbackState::Recording;
+	readback.passNames.clear();
+	m_currentReadback = &readback;
+	m_readbackIndex = (m_readbackIndex + 1) % READBACK_COUNT;
+}
+
+uint32_t GpuProfiler::beginPass(const char* name)
+{
+	if (!m_currentReadback || m_currentReadback->passNames.size() >= MAX_PASSES) {
+		return MAX_PASSES;
+	}
+	m_currentReadback->passNames.push_back(name);
+	return static_cast<uint32_t>(m_currentReadback->passNames.size() - 1);
+}
+
+const WGPURenderPassTimestampWrites* GpuProfiler::BeginRenderPass(const char* name)
+{
+	uint32_t pass = beginPass(name);
+	if (pass == MAX_PASSES) {
+		return nullptr;
+	}
+	WGPURenderPassTimestampWrites& writes = m_renderPassWrites[pass];
+	writes.querySet = m_querySet;
+	writes.beginningOfPassWriteIndex = 2 * pass;
+	writes.endOfPassWriteIndex = 2 * pass + 1;
+	return &writes;
+}
+
+const WGPUComputePassTimestampWrites* GpuProfiler::BeginComputePass(const char* name)
+{
+	uint32_t pass = beginPass(name);
+	if (pass == MAX_PASSES) {
+		return nullptr;
+	}
+	WGPUComputePassTimestampWrites& writes = m_computePassWrites[pass];
+	writes.querySet = m_querySet;
+	writes.beginningOfPassWriteIndex = 2 * pass;
+	writes.endOfPassWriteIndex = 2 * pass + 1;
+	return &writes;
+}
+
+void GpuProfiler::ResolveFrame(WGPUCommandEncoder encoder)
+{
+	if (!m_currentReadback || m_currentReadback->passNames.empty()) {
+		return;
+	}
+	uint32_t queryCount = 2 * static_cast<uint32_t>(m_currentReadback->passNames.size());
+	wgpuCommandEncoderResolveQuerySet(encoder, m_querySet, 0, queryCount, m_resolveBuffer, 0);
+	wgpuCommandEncoderCopyBufferToBuffer(encoder, m_resolveBuffer, 0, m_currentReadback->buffer, 0, queryCount * sizeof(uint64_t));
+}
+
+void GpuProfiler::EndFrame()
+{
+	if (!m_currentReadback) {
+		return;
+	}
+	Readback& readback = *m_currentReadback;
+	m_currentReadback = nullptr;
+	if (readback.passNames.empty()) {
+		readback.state = ReadbackState::Free;
+		return;
+	}
+
+	// Resolves once the GPU is done with the frame (callback fires from wgpuInstanceProcessEvents/wgpuDeviceTick)
+	auto onMapped = [](WGPUBufferMapAsyncStatus status, void* pUserData)
+	{
+		Readback& readback = *reinterpret_cast<Readback*>(pUserData);
+		if (status == WGPUBufferMapAsyncStatus_Success) {
+			readback.profiler->onReadbackMapped(readback);
+			wgpuBufferUnmap(readback.buffer);
+		}
+		readback.state = ReadbackState::Free;
+	};
+	readback.state = ReadbackState::Mapping;
+	readback.submitNs = Trace::NowNs();
+	size_t size = 2 * readback.passNames.size() * sizeof(uint64_t);
+	wgpuBufferMapAsync(readback.buffer, WGPUMapMode_Read, 0, size, onMapped, (void*)&readback);
+}
+
+GpuProfiler::PassTiming& GpuProfiler::getPassTiming(const char* name)
+{
+	for (PassTiming& timing : m_passTimings) {
+		if (timing.name == name) {
+			return timing;
+		}
+	}
+	PassTiming& timing = m_passTimings.emplace_back();
+	timing.name = name;
+	return timing;
+}
+
+void GpuProfiler::onReadbackMapped(Readback& readback)
+{
+	size_t size = 2 * readback.passNames.size() * sizeof(uint64_t);
+	const uint64_t* timestamps = reinterpret_cast<const uint64_t*>(wgpuBufferGetConstMappedRange(readback.buffer, 0, size));
+	if (!timestamps) {
+		return;
+	}
+
+	// GPU timestamps use their own clock, so anchor the first pass at the CPU submit time
+	uint64_t gpuBase = timestamps[0];
+	for (size_t pass = 0; pass < readback.passNames.size(); ++pass) {
+		uint64_t begin = timestamps[2 * pass];
+		uint64_t end = timestamps[2 * pass + 1];
+		if (begin >= gpuBase && end >= begin) {
+			Trace::AddGpuEvent(readback.passNames[pass], readback.submitNs + (begin - gpuBase), readback.submitNs + (end - gpuBase));
+		}
+		// Timestamps are in nanoseconds, but some backends occasionally go backwards
+		float ms = end > begin ? static_cast<float>((end - begin) * 1e-6) : 0.0f;
+
+		PassTiming& timing = getPassTiming(readback.passNames[pass]);
+		timing.lastMs = ms;
+		timing.history[timing.historyIndex] = ms;
+		timing.historyIndex = (timing.historyIndex + 1) % HISTORY_SIZE;
+		timing.sampleCount = std::min(timing.sampleCount + 1, HISTORY_SIZE);
+
+		float sum = 0.0f, maxMs = 0.0f;
+		for (uint32_t i = 0; i < timing.sampleCount; ++i) {
+			sum += timing.history[i];
+			maxMs = std::max(maxMs, timing.history[i]);
+		}
+		timing.averageMs = sum / timing.sampleCount;
+		timing.maxMs = maxMs;
+	}
+}
+
+float GpuProfiler::GetTotalMs() const
+{
+	float totalMs = 0.0f;
+	for (const PassTiming& timing : m_passTimings) {
+		totalMs += timing.lastMs;
+	}
+	return totalMs;
+}
+
+void GpuProfiler::DrawImGui()
+{
+	ImGui::Begin("GPU Profiler");
+	if (!IsEnabled()) {
+		ImGui::Text("Timestamp queries are not supported by this adapter.");
+		ImGui::End();
+		return;
+	}
+
+	float totalMs = 0.0f;
+	for (const PassTiming& timing : m_passTimings) {
+		totalMs += timing.averageMs;
+		ImGui::Text("%-12s %6.3f ms (avg %6.3f, max %6.3f)", timing.name.c_str(), timing.lastMs, timing.averageMs, timing.maxMs);
+		// The history is a ring, so offset the plot to start at the oldest sample
+		ImGui::PlotLines(("##" + timing.name).c_str(), timing.history.data(), HISTORY_SIZE, timing.historyIndex, nullptr, 0.0f, timing.maxMs * 1.2f, ImVec2(0, 40));
+	}
+	ImGui::Separator();
+	ImGui::Text("Total (avg): %.3f ms", totalMs);
+	if (ImGui::Button("Export to gpu_timings.csv")) {
+		ExportCsv("gpu_timings.csv");
+	}
+	ImGui::End();
+}
+
+bool GpuProfiler::ExportCsv(const std::filesystem::path& path) const
+{
+	std::ofstream file(path);
+	if (!file.is_open()) {
+		SPDLOG_ERROR("Could not write GPU timings to \"{}\"", path.string());
+		return false;
+	}
+
+	// One row per pass, oldest sample first
+	file << "pass,last_ms,average_ms,max_ms,history_ms...\n";
+	for (const PassTiming& timing : m_passTimings) {
+		file << timing.name << "," << timing.lastMs << "," << timing.averageMs << "," << timing.maxMs;
+		uint32_t start = timing.sampleCount < HISTORY_SIZE ? 0 : timing.historyIndex;
+		for (uint32_t i = 0; i < timing.sampleCount; ++i) {
+			file << "," << timing.history[(start + i) % HISTORY_SIZE];
+		}
+		file << "\n";
+	}
+
+	SPDLOG_INFO("GPU timings written to \"{}\"", path.string());
+	return true;
+}
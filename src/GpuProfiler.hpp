@@ -0,0 +1,78 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+#include <filesystem>
+
+#include <webgpu/webgpu.h>
+
+// Times passes with timestamp queries. Results are read back with MapAsync a few frames later, so nothing ever stalls
+class GpuProfiler
+{
+public:
+	static constexpr uint32_t MAX_PASSES = 16; // Per frame
+	static constexpr uint32_t READBACK_COUNT = 4; // More than the frames in flight, so a free readback buffer is (almost) always around
+	static constexpr uint32_t HISTORY_SIZE = 120;
+
+	struct PassTiming
+	{
+		std::string name;
+		float lastMs = 0.0f;
+		float averageMs = 0.0f; // Over the history
+		float maxMs = 0.0f; // Over the history
+		std::array<float, HISTORY_SIZE> history = {};
+		uint32_t historyIndex = 0;
+		uint32_t sampleCount = 0;
+	};
+
+	bool Init(WGPUDevice device, bool timestampsSupported);
+	void Terminate();
+	bool IsEnabled() const { return m_querySet != nullptr; }
+
+	void BeginFrame();
+	// Plug the result into the pass descriptor's timestampWrites (nullptr when disabled/out of queries/readbacks)
+	const WGPURenderPassTimestampWrites* BeginRenderPass(const char* name);
+	const WGPUComputePassTimestampWrites* BeginComputePass(const char* name);
+	// Call right before finishing the frame's command encoder
+	void ResolveFrame(WGPUCommandEncoder encoder);
+	// Call after the frame got submitted
+	void EndFrame();
+
+	const std::vector<PassTiming>& GetPassTimings() const { return m_passTimings; }
+	// Sum of the latest time of every pass
+	float GetTotalMs() const;
+	void DrawImGui();
+	bool ExportCsv(const std::filesystem::path& path) const;
+private:
+	enum class ReadbackState
+	{
+		Free,
+		Recording, // Used by the frame being encoded
+		Mapping // Waiting on MapAsync
+	};
+
+	struct Readback
+	{
+		GpuProfiler* profiler = nullptr;
+		WGPUBuffer buffer = nullptr;
+		ReadbackState state = ReadbackState::Free;
+		std::vector<const char*> passNames;
+		uint64_t submitNs = 0; // CPU time of the submit, used to line GPU passes up with the CPU trace
+	};
+
+	WGPUQuerySet m_querySet = nullptr;
+	WGPUBuffer m_resolveBuffer = nullptr;
+	std::array<Readback, READBACK_COUNT> m_readbacks;
+	uint32_t m_readbackIndex = 0;
+	Readback* m_currentReadback = nullptr; // nullptr when this frame is not profiled
+
+	std::array<WGPURenderPassTimestampWrites, MAX_PASSES> m_renderPassWrites = {};
+	std::array<WGPUComputePassTimestampWrites, MAX_PASSES> m_computePassWrites = {};
+
+	std::vector<PassTiming> m_passTimings;
+
+	uint32_t beginPass(const char* name);
+	void onReadbackMapped(Readback& readback);
+	PassTiming& getPassTiming(const char* name);
+};
@@ -0,0 +1,130 @@
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <string>
+
+#include <spdlog/spdlog.h>
+
+#include "JobSystem.hpp"
+#include "Trace.hpp"
+
+namespace JobSystem
+{
+std::vector<std::thread> g_workers;
+std::deque<std::function<void()>> g_queue;
+std::mutex g_queueMutex;
+std::condition_variable g_queueCondition;
+bool g_running = false;
+
+// Pops and runs a single job, returns false if the queue was empty
+bool tryRunOne()
+{
+	std::function<void()> job;
+	{
+		std::lock_guard<std::mutex> lock(g_queueMutex);
+		if (g_queue.empty()) {
+			return false;
+		}
+		job = std::move(g_queue.front());
+		g_queue.pop_front();
+	}
+	job();
+	return true;
+}
+
+void workerMain(uint32_t workerIndex)
+{
+	std::string threadName = "Worker " + std::to_string(workerIndex);
+	Trace::SetThreadName(threadName.c_str());
+
+	while (true) {
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(g_queueMutex);
+			g_queueCondition.wait(lock, [] { return !g_running || !g_queue.empty(); });
+			if (!g_running && g_queue.empty()) {
+				return;
+			}
+			job = std::move(g_queue.front());
+			g_queue.pop_front();
+		}
+		job();
+	}
+}
+
+bool Init(uint32_t workerCount)
+{
+	if (workerCount == 0) {
+		uint32_t hardwareThreads = std::thread::hardware_concurrency();
+		workerCount = hardwareThreads > 1 ? hardwareThreads - 1 : 1;
+	}
+
+	g_running = true;
+	g_workers.reserve(workerCount);
+	for (uint32_t i = 0; i < workerCount; ++i) {
+		g_workers.emplace_back(workerMain, i);
+	}
+
+	SPDLOG_INFO("Job system started with {} workers.", workerCount);
+	return true;
+}
+
+void ParallelFor(uint32_t count, uint32_t batchSize, const std::function<void(uint32_t begin, uint32_t end)>& job)
+{
+	if (count == 0) {
+		return;
+	}
+	batchSize = std::max(batchSize, 1u);
+
+	// Not worth waking anybody up
+	if (g_workers.empty() || count <= batchSize) {
+		job(0, count);
+		return;
+	}
+
+	uint32_t batchCount = (count + batchSize - 1) / batchSize;
+	std::atomic<uint32_t> pending = batchCount;
+	{
+		std::lock_guard<std::mutex> lock(g_queueMutex);
+		for (uint32_t begin = 0; begin < count; begin += batchSize) {
+			uint32_t end = std::min(begin + batchSize, count);
+			g_queue.emplace_back([&job, &pending, begin, end]
+			{
+				TRACE_ZONE("Job");
+				job(begin, end);
+				pending.fetch_sub(1, std::memory_order_release);
+			});
+		}
+	}
+	g_queueCondition.notify_all();
+
+	// Help instead of blocking (also keeps nested ParallelFor calls from deadlocking)
+	while (pending.load(std::memory_order_acquire) > 0) {
+		if (!tryRunOne()) {
+			std::this_thread::yield();
+		}
+	}
+}
+
+uint32_t GetWorkerCount()
+{
+	return static_cast<uint32_t>(g_workers.size());
+}
+
+void Terminate()
+{
+	{
+		std::lock_guard<std::mutex> lock(g_queueMutex);
+		g_running = false;
+	}
+	g_queueCondition.notify_all();
+	for (std::thread& worker : g_workers) {
+		worker.join();
+	}
+	g_workers.clear();
+}
+}
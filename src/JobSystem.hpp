@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+namespace JobSystem
+{
+	bool Init(uint32_t workerCount = 0); // 0 = one worker per hardware thread (minus the main thread)
+	// Splits [0, count) into ranges of at most batchSize and runs them on the workers. The calling thread helps out and returns once every range is done
+	void ParallelFor(uint32_t count, uint32_t batchSize, const std::function<void(uint32_t begin, uint32_t end)>& job);
+	uint32_t GetWorkerCount();
+	void Terminate();
+};
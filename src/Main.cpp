@@ -5,6 +5,14 @@
 #include <fstream>
 #include <array>
 #include <thread>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cstring>
 
 // GLM
 // Z is (0, 1) and not OpenGL's (-1, 1)
@@ -31,12 +39,25 @@
 
 #include "Main.hpp"
 #include "ResourceManager.hpp"
+#include "JobSystem.hpp"
+#include "Trace.hpp"
+#include "Stats.hpp"
 
 #ifndef RESOURCE_DIR
 #error "A RESOURCE_DIR must be defined to compile the project!"
 #endif
 
 constexpr float PI = 3.14159265358979323846f;
+// Dear ImGui needs a few frames after an input to settle hover/active states
+constexpr uint32_t REDRAW_FRAMES = 3;
+// How long an idle on-demand loop sleeps before checking GPU callbacks again (seconds)
+constexpr double IDLE_WAIT_TIMEOUT = 0.25;
+// Projection planes (also used to normalize sort depths and to slice the light clusters)
+constexpr float NEAR_PLANE = 0.01f;
+constexpr float FAR_PLANE = 100.0f;
+// DepthPrepassMode::Auto turns the pre-pass on above, and off again below, this estimated depth complexity
+constexpr float PREPASS_ENABLE_COMPLEXITY = 2.5f;
+constexpr float PREPASS_DISABLE_COMPLEXITY = 1.5f;
 
 // Custom Dear ImGui stuff
 namespace ImGui
@@ -50,6 +71,49 @@ bool DragDirection(const char* label, glm::vec4& direction)
 }
 }
 
+// Records a MainLoop phase in both the trace and the performance HUD
+void endPhase(const char* name, Stats::Phase phase, uint64_t startTicks)
+{
+	uint64_t endTicks = Trace::Now();
+	Trace::Record(name, startTicks, endTicks);
+	Stats::RecordPhase(phase, (Trace::TicksToNs(endTicks) - Trace::TicksToNs(startTicks)) * 1e-6f);
+}
+
+// Render passes and render bundles record the same commands under different names
+void setPipeline(WGPURenderPassEncoder encoder, WGPURenderPipeline pipeline) { wgpuRenderPassEncoderSetPipeline(encoder, pipeline); }
+void setPipeline(WGPURenderBundleEncoder encoder, WGPURenderPipeline pipeline) { wgpuRenderBundleEncoderSetPipeline(encoder, pipeline); }
+void setVertexBuffer(WGPURenderPassEncoder encoder, WGPUBuffer buffer, uint64_t size) { wgpuRenderPassEncoderSetVertexBuffer(encoder, 0, buffer, 0, size); }
+void setVertexBuffer(WGPURenderBundleEncoder encoder, WGPUBuffer buffer, uint64_t size) { wgpuRenderBundleEncoderSetVertexBuffer(encoder, 0, buffer, 0, size); }
+void setBindGroup(WGPURenderPassEncoder encoder, uint32_t index, WGPUBindGroup group, uint32_t offsetCount, const uint32_t* offsets)
+{
+	wgpuRenderPassEncoderSetBindGroup(encoder, index, group, offsetCount, offsets);
+}
+void setBindGroup(WGPURenderBundleEncoder encoder, uint32_t index, WGPUBindGroup group, uint32_t offsetCount, const uint32_t* offsets)
+{
+	wgpuRenderBundleEncoderSetBindGroup(encoder, index, group, offsetCount, offsets);
+}
+void draw(WGPURenderPassEncoder encoder, uint32_t vertexCount, uint32_t firstVertex, uint32_t firstInstance, uint32_t instanceCount = 1)
+{
+	wgpuRenderPassEncoderDraw(encoder, vertexCount, instanceCount, firstVertex, firstInstance);
+}
+void draw(WGPURenderBundleEncoder encoder, uint32_t vertexCount, uint32_t firstVertex, uint32_t firstInstance, uint32_t instanceCount = 1)
+{
+	wgpuRenderBundleEncoderDraw(encoder, vertexCount, instanceCount, firstVertex, firstInstance);
+}
+
+// Bounding spheres grow with the largest axis
+float maxAxisScale(const glm::mat4x4& matrix)
+{
+	return std::max({glm::length(glm::vec3(matrix[0])), glm::length(glm::vec3(matrix[1])), glm::length(glm::vec3(matrix[2]))});
+}
+
+// PhysX is Y-up while rendering is Z-up (see onMouseButton)
+void applyBodyPose(TransformHierarchy& transforms, TransformHierarchy::NodeId node, const physx::PxTransform& pose)
+{
+	transforms.SetTranslation(node, glm::vec3(pose.p.x, -pose.p.z, pose.p.y));
+	transforms.SetRotation(node, glm::quat(pose.q.w, pose.q.x, -pose.q.z, pose.q.y));
+}
+
 // Takes value and rounds it up to the next multiple of step
 uint32_t Application::ceilToNextMultiple(uint32_t value, uint32_t step)
 {
@@ -137,8 +201,8 @@ WGPURequiredLimits Application::getRequiredLimits(WGPUAdapter adapter) const
 	requiredLimits.limits.maxVertexAttributes = 4;
 	// One vertex buffer
 	requiredLimits.limits.maxVertexBuffers = 1;
-	// In otherwords, how many individual attributes can be passed from the vertex to fragment shader (x, y, z), (nx, ny, nz),  and (u, v)
-	requiredLimits.limits.maxInterStageShaderComponents = 8;
+	// In otherwords, how many individual attributes can be passed from the vertex to fragment shader (r, g, b), (nx, ny, nz), (u, v), and the world position
+	requiredLimits.limits.maxInterStageShaderComponents = 11;
 	// Minimum required buffer size needed (10k vertices allowed for meshes)
 	requiredLimits.limits.maxBufferSize = 150000 * sizeof(VertexAttributes);
 	// Maximum stride between consecutive vertices in a vertex buffer
@@ -148,21 +212,27 @@ WGPURequiredLimits Application::getRequiredLimits(WGPUAdapter adapter) const
 
 	// For texture uniforms (Dear ImGui needs AT LEAST 2)
 	requiredLimits.limits.maxBindGroups = 2;
-	// Use at most 1 uniform buffer per stage
-	requiredLimits.limits.maxUniformBuffersPerShaderStage = 2;
-	// Uniform structs have a size of a maximum 16 floats (way more than needed)
-	requiredLimits.limits.maxUniformBufferBindingSize = 16 * 4 * sizeof(float);
+	// My uniforms, lighting, the material, the clusters and the shadow cascades
+	requiredLimits.limits.maxUniformBuffersPerShaderStage = 5;
+	// The biggest uniform struct is the shadow one (4 matrices and a bit)
+	requiredLimits.limits.maxUniformBufferBindingSize = sizeof(ShadowUniforms);
 	// Extra limit requirement
-	requiredLimits.limits.maxDynamicUniformBuffersPerPipelineLayout = 1;
+	requiredLimits.limits.maxDynamicUniformBuffersPerPipelineLayout = 1; // Frame slot, or the cascade in the shadow pipeline
+	// Per-object model matrices and draw instances (vertex), lights, cluster lists, virtual texture feedback, texture array
+	// materials and the fragment counter (fragment and light culling)
+	requiredLimits.limits.maxStorageBuffersPerShaderStage = 5;
+	requiredLimits.limits.maxStorageBufferBindingSize = supportedLimits.limits.maxStorageBufferBindingSize;
 
 	// Textures / Depth buffer
 
-	requiredLimits.limits.maxSamplersPerShaderStage = 1; // Allows for one sampler in the shader
-	requiredLimits.limits.maxSampledTexturesPerShaderStage = 1; // Allows a single texture to be sampled in a shader
-	// Upped both for higher-resolution textures
+	requiredLimits.limits.maxSamplersPerShaderStage = 2; // The texture sampler and the shadow comparison sampler
+	requiredLimits.limits.maxSampledTexturesPerShaderStage = 3; // The material's texture, its page table and the shadow map
+	// Upped both for higher-resolution textures. The virtual texture tile cache gets whatever the adapter supports, its budget
+	// decides how much of that it actually takes
 	requiredLimits.limits.maxTextureDimension1D = 2048;
-	requiredLimits.limits.maxTextureDimension2D = 2048;
-	requiredLimits.limits.maxTextureArrayLayers = 1;
+	requiredLimits.limits.maxTextureDimension2D = m_virtualTextureBudget > 0 ? supportedLimits.limits.maxTextureDimension2D
+		: std::min(4096u, supportedLimits.limits.maxTextureDimension2D);
+	requiredLimits.limits.maxTextureArrayLayers = std::max(CascadedShadows::CASCADE_COUNT, supportedLimits.limits.maxTextureArrayLayers); // And texture arrays
 
 	// IMPORTANT!!! MUST SET THESE TO AN INITIALIZED VALUE
 
@@ -373,39 +443,42 @@ std::pair<WGPUSurfaceTexture, WGPUTextureView> Application::getNextSurfaceViewDa
 
 void Application::onResize()
 {
-	// Get rid of depth buffer
-	wgpuTextureViewRelease(m_depthTextureView);
-	wgpuTextureDestroy(m_depthTexture);
-	wgpuTextureRelease(m_depthTexture);
-
 	// Get rid of swap chain
 	wgpuSwapChainRelease(m_swapChain);
 
-	// Recreate both (TODO: check if pipeline is okay)
+	// Recreate it (TODO: check if pipeline is okay), the scene targets follow the new size by themselves
 	initSwapChain();
-	initDepthBuffer();
+	m_renderTargetPool.ReleaseUnused(); // The old sizes won't come back
 
 	updateProjectionMatrix();
+	requestRedraw();
 }
 
 void Application::updateProjectionMatrix()
 {
 	int width, height;
 	glfwGetFramebufferSize(m_glfwWindow, &width, &height);
+	if (width == 0 || height == 0) {
+		return; // Minimized
+	}
 	float ratio = width / (float)height;
-	m_uniforms.projectionMatrix = glm::perspective(45 * PI / 180, ratio, 0.01f, 100.0f);
-	wgpuQueueWriteBuffer(m_queue, m_uniformBuffer, offsetof(MyUniforms, projectionMatrix), &m_uniforms.projectionMatrix, sizeof(MyUniforms::projectionMatrix));
+	m_uniforms.projectionMatrix = glm::perspective(45 * PI / 180, ratio, NEAR_PLANE, FAR_PLANE);
+	// Uploaded to the frame's uniform slice in MainLoop
 }
 
-void Application::updateViewMatrix()
+glm::vec3 Application::getCameraPosition() const
 {
 	float cx = std::cos(m_cameraState.angles.x);
 	float sx = std::sin(m_cameraState.angles.x);
 	float cy = std::cos(m_cameraState.angles.y);
 	float sy = std::sin(m_cameraState.angles.y);
-	glm::vec3 position = glm::vec3(cx * cy, sx * cy, sy) * std::exp(-m_cameraState.zoom);
-	m_uniforms.viewMatrix = glm::lookAt(position, glm::vec3(0.0f), glm::vec3(0, 0, 1));
-	wgpuQueueWriteBuffer(m_queue, m_uniformBuffer, offsetof(MyUniforms, viewMatrix), &m_uniforms.viewMatrix, sizeof(MyUniforms::viewMatrix));
+	return m_cameraState.target + glm::vec3(cx * cy, sx * cy, sy) * std::exp(-m_cameraState.zoom);
+}
+
+void Application::updateViewMatrix()
+{
+	m_uniforms.viewMatrix = glm::lookAt(getCameraPosition(), m_cameraState.target, glm::vec3(0, 0, 1));
+	// Uploaded to the frame's uniform slice in MainLoop
 }
 
 void Application::updateDragInertia()
@@ -425,6 +498,23 @@ void Application::updateDragInertia()
 		// Dampen the velocity to exponentially decrease and eventually stop
 		m_dragState.velocity *= m_dragState.inertia;
 		updateViewMatrix();
+		requestRedraw();
+	}
+}
+
+void Application::requestRedraw()
+{
+	m_redrawFrames = REDRAW_FRAMES;
+}
+
+void Application::updateIdleStats()
+{
+	double now = glfwGetTime();
+	double window = now - m_idleWindowStart;
+	if (window >= 1.0) {
+		m_idlePercent = static_cast<float>(100.0 * m_idleTime / window);
+		m_idleTime = 0.0;
+		m_idleWindowStart = now;
 	}
 }
 
@@ -437,6 +527,7 @@ void Application::onMouseMove(double xpos, double ypos)
 		// Clamp to prevent going too far up/down
 		m_cameraState.angles.y = glm::clamp(m_cameraState.angles.y, -PI / 2 + 1e-5f, PI / 2 - 1e-5f);
 		updateViewMatrix();
+		requestRedraw();
 
 		// Inertia
 		m_dragState.velocity = delta - m_dragState.previousDelta;
@@ -465,6 +556,38 @@ void Application::onMouseButton(int button, int action, int mods)
 			m_dragState.active = false;
 			break;
 		}
+	} else if (button == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS) {
+		double xpos, ypos;
+		glfwGetCursorPos(m_glfwWindow, &xpos, &ypos);
+		pickAtCursor(xpos, ypos);
+	}
+}
+
+void Application::pickAtCursor(double xpos, double ypos)
+{
+	// Cursor positions are in window coordinates (not framebuffer pixels)
+	int width, height;
+	glfwGetWindowSize(m_glfwWindow, &width, &height);
+	if (width == 0 || height == 0) {
+		return;
+	}
+
+	// Depth goes from 0 (near) to 1 (far) because of GLM_FORCE_DEPTH_ZERO_TO_ONE
+	glm::vec2 ndc = {2.0f * (float)xpos / width - 1.0f, 1.0f - 2.0f * (float)ypos / height};
+	glm::mat4x4 inverseViewProj = glm::inverse(m_uniforms.projectionMatrix * m_uniforms.viewMatrix);
+	glm::vec4 nearPoint = inverseViewProj * glm::vec4(ndc, 0.0f, 1.0f);
+	glm::vec4 farPoint = inverseViewProj * glm::vec4(ndc, 1.0f, 1.0f);
+	glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+	glm::vec3 direction = glm::normalize(glm::vec3(farPoint) / farPoint.w - origin);
+
+	// Rendering is Z-up while PhysX is Y-up (same swap as the OBJ loader, but inverted)
+	auto toPhysics = [](const glm::vec3& v) { return physx::PxVec3(v.x, v.z, -v.y); };
+
+	Physics::QueryHit hit;
+	if (Physics::Raycast(toPhysics(origin), toPhysics(direction), 1000.0f, hit)) {
+		SPDLOG_INFO("Picked actor {} at {{{}, {}, {}}} (distance {})", (void*)hit.actor, hit.position.x, hit.position.y, hit.position.z, hit.distance);
+	} else {
+		SPDLOG_INFO("Picked nothing.");
 	}
 }
 
@@ -473,6 +596,7 @@ void Application::onScroll(double xoffset, double yoffset)
 	m_cameraState.zoom += m_dragState.scrollSensitivity * static_cast<float>(yoffset);
 	m_cameraState.zoom = glm::clamp(m_cameraState.zoom, -2.0f, 2.0f);
 	updateViewMatrix();
+	requestRedraw();
 }
 
 bool Application::initWindowAndDevice()
@@ -555,6 +679,7 @@ bool Application::initWindowAndDevice()
 	adapterOpts.compatibleSurface = m_surface;
 	// adapterOpts.powerPreference = WGPUPowerPreference_HighPerformance;
 	adapterOpts.backendType = WGPUBackendType_Vulkan;
+	adapterOpts.forceFallbackAdapter = m_useFallbackAdapter; // SwiftShader
 	m_adapter = requestAdapterSync(m_instance, &adapterOpts);
 	SPDLOG_INFO("Created adapter.");
 	displayAdapterInfo(m_adapter);
@@ -563,11 +688,19 @@ bool Application::initWindowAndDevice()
 
 	WGPURequiredLimits requiredLimits = getRequiredLimits(m_adapter);
 
+	// Optional features
+	std::vector<WGPUFeatureName> requiredFeatures;
+	m_timestampsSupported = wgpuAdapterHasFeature(m_adapter, WGPUFeatureName_TimestampQuery);
+	if (m_timestampsSupported) {
+		requiredFeatures.push_back(WGPUFeatureName_TimestampQuery); // GPU profiler
+	}
+
 	SPDLOG_INFO("Requesting device...");
 	WGPUDeviceDescriptor deviceDesc = {};
 	deviceDesc.nextInChain = nullptr;
 	deviceDesc.label = "My Device";
-	deviceDesc.requiredFeatureCount = 0;
+	deviceDesc.requiredFeatureCount = requiredFeatures.size();
+	deviceDesc.requiredFeatures = requiredFeatures.data();
 	deviceDesc.requiredLimits = &requiredLimits;
 	deviceDesc.defaultQueue.nextInChain = nullptr;
 	deviceDesc.defaultQueue.label = "The Default Queue";
@@ -617,7 +750,7 @@ bool Application::initSwapChain()
 	WGPUSwapChainDescriptor swapChainDes = {};
 	swapChainDes.nextInChain = nullptr;
 	swapChainDes.label = "My main swap chain";
-	swapChainDes.usage = WGPUTextureUsage_RenderAttachment;
+	swapChainDes.usage = WGPUTextureUsage_RenderAttachment | WGPUTextureUsage_CopySrc; // CopySrc for FrameRecorder
 	swapChainDes.format = m_swapChainFormat;
 	swapChainDes.width = static_cast<uint32_t>(width);
 	swapChainDes.height = static_cast<uint32_t>(height);
@@ -627,44 +760,6 @@ bool Application::initSwapChain()
 	return m_swapChain != nullptr;
 }
 
-bool Application::initDepthBuffer()
-{
-	// Important to initialize!
-	m_depthTextureFormat = WGPUTextureFormat_Depth24Plus;
-	int width, height;
-	glfwGetFramebufferSize(m_glfwWindow, &width, &height);
-
-	// Depth texture
-	WGPUTextureDescriptor depthTextureDesc = {};
-	depthTextureDesc.nextInChain = nullptr;
-	depthTextureDesc.label = "My main depth texture";
-	depthTextureDesc.usage = WGPUTextureUsage_RenderAttachment;
-	depthTextureDesc.dimension = WGPUTextureDimension_2D;
-	depthTextureDesc.size = {static_cast<uint32_t>(width), static_cast<uint32_t>(height), 1};
-	depthTextureDesc.format = m_depthTextureFormat;
-	depthTextureDesc.mipLevelCount = 1;
-	depthTextureDesc.sampleCount = 1;
-	depthTextureDesc.viewFormatCount = 1;
-	depthTextureDesc.viewFormats = &m_depthTextureFormat;
-	m_depthTexture = wgpuDeviceCreateTexture(m_device, &depthTextureDesc);
-	// Log later!
-
-	WGPUTextureViewDescriptor depthTextureViewDesc = {};
-	depthTextureViewDesc.nextInChain = nullptr;
-	depthTextureViewDesc.label = "My main depth texture view";
-	depthTextureViewDesc.format = m_depthTextureFormat;
-	depthTextureViewDesc.dimension = WGPUTextureViewDimension_2D;
-	depthTextureViewDesc.baseMipLevel = 0;
-	depthTextureViewDesc.mipLevelCount = 1;
-	depthTextureViewDesc.baseArrayLayer = 0;
-	depthTextureViewDesc.arrayLayerCount = 1;
-	depthTextureViewDesc.aspect = WGPUTextureAspect_DepthOnly;
-	m_depthTextureView = wgpuTextureCreateView(m_depthTexture, &depthTextureViewDesc);
-	// Log later!
-
-	return m_depthTextureView != nullptr;
-}
-
 bool Application::initTexture()
 {
 	WGPUSamplerDescriptor samplerDesc = {};
@@ -682,20 +777,31 @@ bool Application::initTexture()
 	samplerDesc.maxAnisotropy = 1;
 	m_sampler = wgpuDeviceCreateSampler(m_device, &samplerDesc);
 
-	m_textureView = nullptr;
-	m_texture = ResourceManager::LoadTexture(RESOURCE_DIR "fourareen2K_albedo.jpg", m_device, &m_textureView);
-	if (!m_texture) {
+	m_assets.Init(m_device);
+	m_defaultTexture = m_assets.LoadTexture(RESOURCE_DIR "fourareen2K_albedo.jpg");
+	if (!m_defaultTexture) {
 		SPDLOG_ERROR("Could not load texture!");
 		exit(1);
 	}
 	// Log!
 
-	return m_textureView != nullptr;
+	return m_defaultTexture.GetTextureView() != nullptr;
 }
 
 bool Application::initGeometry()
 {
-	bool success = ResourceManager::LoadGeometryFromObj(RESOURCE_DIR "fourareen.obj", m_vertexData);
+	// The compressed copy in the cache directory is much smaller to read, it's rewritten whenever the .obj or its .mtl is newer
+	// (the .mtl of the same name, the usual export layout)
+	std::filesystem::path objPath = m_modelPath;
+	std::filesystem::path mtlPath = std::filesystem::path(m_modelPath).replace_extension(".mtl");
+	std::filesystem::path meshPath = ResourceManager::GetCachePath(objPath, ".mesh");
+	bool success = ResourceManager::IsCacheCurrent(meshPath, {objPath, mtlPath}) && ResourceManager::LoadCompressedGeometry(meshPath, m_vertexData, &m_subMeshes, &m_materials);
+	if (!success) {
+		success = ResourceManager::LoadGeometryFromObj(objPath, m_vertexData, &m_subMeshes, &m_materials);
+		if (success) {
+			ResourceManager::SaveCompressedGeometry(meshPath, m_vertexData, m_subMeshes, m_materials);
+		}
+	}
 	if (!success) {
 		SPDLOG_ERROR("Could not load geometry!");
 		exit(1);
@@ -709,10 +815,36 @@ bool Application::initGeometry()
 	bufferDesc.mappedAtCreation = false;
 	m_vertexBuffer = wgpuDeviceCreateBuffer(m_device, &bufferDesc);
 	wgpuQueueWriteBuffer(m_queue, m_vertexBuffer, 0, m_vertexData.data(), bufferDesc.size);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::VertexBuffers, bufferDesc.size);
+	Stats::Add(Stats::Counter::BytesUploaded, bufferDesc.size);
 
 	m_vertexCount = static_cast<uint32_t>(m_vertexData.size());
+
+	// Separate position stream for the depth-only passes (pre-pass and shadows), 12 bytes a vertex instead of 44
+	std::vector<glm::vec3> positions(m_vertexCount);
+	glm::vec3 boundsMin = glm::vec3(std::numeric_limits<float>::max());
+	glm::vec3 boundsMax = glm::vec3(std::numeric_limits<float>::lowest());
+	for (uint32_t i = 0; i < m_vertexCount; ++i) {
+		positions[i] = m_vertexData[i].position;
+		boundsMin = glm::min(boundsMin, positions[i]);
+		boundsMax = glm::max(boundsMax, positions[i]);
+	}
+	m_meshCenter = (boundsMin + boundsMax) * 0.5f;
+	m_meshRadius = 0.0f;
+	for (const glm::vec3& position : positions) {
+		m_meshRadius = std::max(m_meshRadius, glm::distance(position, m_meshCenter));
+	}
+	bufferDesc.label = "Position vertex buffer";
+	bufferDesc.size = positions.size() * sizeof(glm::vec3);
+	m_positionBuffer = wgpuDeviceCreateBuffer(m_device, &bufferDesc);
+	wgpuQueueWriteBuffer(m_queue, m_positionBuffer, 0, positions.data(), bufferDesc.size);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::VertexBuffers, bufferDesc.size);
+	Stats::Add(Stats::Counter::BytesUploaded, bufferDesc.size);
+
+	m_hasVertexColors = std::any_of(m_vertexData.begin(), m_vertexData.end(), [](const VertexAttributes& vertex) { return vertex.color != glm::vec3(1.0f); });
+	SPDLOG_INFO("Loaded {} vertices in {} sub-meshes with {} materials.", m_vertexCount, m_subMeshes.size(), m_materials.size());
 	
-	return m_vertexBuffer != nullptr;
+	return m_vertexBuffer != nullptr && m_positionBuffer != nullptr;
 }
 
 bool Application::initUniforms()
@@ -721,19 +853,23 @@ bool Application::initUniforms()
 	bufferDesc.nextInChain = nullptr;
 	bufferDesc.label = "My main uniform buffer";
 	bufferDesc.usage = WGPUBufferUsage_CopyDst | WGPUBufferUsage_Uniform;
-	bufferDesc.size = sizeof(MyUniforms); // IMPORTANT! MAKE SURE WE ARE USING MULTIPLES OF 16
+	// One slice per frame in flight and per turntable view, each aligned to minUniformBufferOffsetAlignment
+	bufferDesc.size = m_uniformStride * (MAX_FRAMES_IN_FLIGHT + MAX_BATCH_VIEWS);
 	bufferDesc.mappedAtCreation = false;
 	m_uniformBuffer = wgpuDeviceCreateBuffer(m_device, &bufferDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::UniformBuffers, bufferDesc.size);
 
 	m_uniforms.modelMatrix = glm::mat4x4(1.0);
 	m_uniforms.viewMatrix = glm::lookAt(glm::vec3(-2.0f, -3.0f, 2.0f), glm::vec3(0.0f), glm::vec3(0, 0, 1));
-	m_uniforms.projectionMatrix = glm::perspective(45 * PI / 180, 1920.0f / 1080.0f, 0.01f, 100.0f);
+	m_uniforms.projectionMatrix = glm::perspective(45 * PI / 180, 1920.0f / 1080.0f, NEAR_PLANE, FAR_PLANE);
 	m_uniforms.color = {0.0f, 1.0f, 0.4f, 1.0f};
 	m_uniforms.time = 1.0f;
 
 	updateViewMatrix(); // Optional?
 
-	wgpuQueueWriteBuffer(m_queue, m_uniformBuffer, 0, &m_uniforms, sizeof(MyUniforms));
+	for (uint32_t slot = 0; slot < MAX_FRAMES_IN_FLIGHT; ++slot) {
+		wgpuQueueWriteBuffer(m_queue, m_uniformBuffer, slot * m_uniformStride, &m_uniforms, sizeof(MyUniforms));
+	}
 
 	return m_uniformBuffer != nullptr;
 }
@@ -747,6 +883,7 @@ bool Application::initLightingUniforms()
 	bufferDesc.size = sizeof(LightingUniforms); // IMPORTANT! MAKE SURE WE ARE USING MULTIPLES OF 16
 	bufferDesc.mappedAtCreation = false;
 	m_lightingUniformBuffer = wgpuDeviceCreateBuffer(m_device, &bufferDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::UniformBuffers, bufferDesc.size);
 
 	m_lightingUniforms.directions[0] = {0.5f, -0.9f, 0.1f, 0.0f};
 	m_lightingUniforms.directions[1] = {0.2f, 0.4f, 0.3f, 0.0f};
@@ -758,9 +895,48 @@ bool Application::initLightingUniforms()
 	return m_lightingUniformBuffer != nullptr;
 }
 
+bool Application::initObjectBuffer(uint32_t capacity)
+{
+	WGPUBufferDescriptor bufferDesc = {};
+	bufferDesc.nextInChain = nullptr;
+	bufferDesc.label = "Object buffer";
+	bufferDesc.usage = WGPUBufferUsage_CopyDst | WGPUBufferUsage_Storage;
+	bufferDesc.size = capacity * sizeof(glm::mat4x4);
+	bufferDesc.mappedAtCreation = false;
+	m_objectBuffer = wgpuDeviceCreateBuffer(m_device, &bufferDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers, bufferDesc.size);
+	m_objectCapacity = capacity;
+	m_objectsChanged = true;
+
+	// The static bundle's records, then at most one per sub-mesh of every object (only written with texture arrays)
+	bufferDesc.label = "Draw instance buffer";
+	bufferDesc.size = 2 * capacity * std::max<size_t>(m_subMeshes.size(), 1) * sizeof(glm::uvec2);
+	m_drawInstanceBuffer = wgpuDeviceCreateBuffer(m_device, &bufferDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers, bufferDesc.size);
+
+	return m_objectBuffer != nullptr && m_drawInstanceBuffer != nullptr;
+}
+
+bool Application::initFragmentCounter()
+{
+	WGPUBufferDescriptor bufferDesc = {};
+	bufferDesc.nextInChain = nullptr;
+	bufferDesc.label = "Fragment count buffer";
+	bufferDesc.usage = WGPUBufferUsage_Storage | WGPUBufferUsage_CopyDst | WGPUBufferUsage_CopySrc;
+	bufferDesc.size = sizeof(uint32_t);
+	bufferDesc.mappedAtCreation = false;
+	m_fragmentCountBuffer = wgpuDeviceCreateBuffer(m_device, &bufferDesc);
+	bufferDesc.label = "Fragment count readback buffer";
+	bufferDesc.usage = WGPUBufferUsage_MapRead | WGPUBufferUsage_CopyDst;
+	m_fragmentCountReadbackBuffer = wgpuDeviceCreateBuffer(m_device, &bufferDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers, 2 * sizeof(uint32_t));
+
+	return m_fragmentCountBuffer != nullptr && m_fragmentCountReadbackBuffer != nullptr;
+}
+
 bool Application::initBindGroupLayout()
 {
-	std::vector<WGPUBindGroupLayoutEntry> bindingLayoutEntries(4);
+	std::vector<WGPUBindGroupLayoutEntry> bindingLayoutEntries(13);
 
 	// For the uniform buffer
 	WGPUBindGroupLayoutEntry& myUniformLayout = bindingLayoutEntries[0];
@@ -769,19 +945,11 @@ bool Application::initBindGroupLayout()
 	myUniformLayout.visibility = WGPUShaderStage_Vertex | WGPUShaderStage_Fragment;
 	myUniformLayout.buffer.nextInChain = nullptr;
 	myUniformLayout.buffer.type = WGPUBufferBindingType_Uniform;
-	myUniformLayout.buffer.hasDynamicOffset = false;
+	myUniformLayout.buffer.hasDynamicOffset = true; // Selects the frame slot's slice
 	myUniformLayout.buffer.minBindingSize = sizeof(MyUniforms); // Need multiple of 16 for uniform buffer
 
-	// For the texture
-	WGPUBindGroupLayoutEntry& textureLayout = bindingLayoutEntries[1];
-	setDefault(textureLayout);
-	textureLayout.binding = 1;
-	textureLayout.visibility = WGPUShaderStage_Fragment;
-	textureLayout.texture.sampleType = WGPUTextureSampleType_Float; // What variable type will be returned when sampling the texture
-	textureLayout.texture.viewDimension = WGPUTextureViewDimension_2D;
-
-	// For the sampler
-	WGPUBindGroupLayoutEntry& samplerLayout = bindingLayoutEntries[2];
+	// For the sampler (the texture is per material, see below)
+	WGPUBindGroupLayoutEntry& samplerLayout = bindingLayoutEntries[1];
 	setDefault(samplerLayout);
 	samplerLayout.binding = 2;
 	samplerLayout.visibility = WGPUShaderStage_Fragment;
@@ -789,7 +957,7 @@ bool Application::initBindGroupLayout()
 	samplerLayout.sampler.type = WGPUSamplerBindingType_Filtering;
 
 	// For the other uniform
-	WGPUBindGroupLayoutEntry& lightingUniformLayout = bindingLayoutEntries[3];
+	WGPUBindGroupLayoutEntry& lightingUniformLayout = bindingLayoutEntries[2];
 	setDefault(lightingUniformLayout);
 	lightingUniformLayout.binding = 3;
 	lightingUniformLayout.visibility = WGPUShaderStage_Fragment;
@@ -798,6 +966,98 @@ bool Application::initBindGroupLayout()
 	lightingUniformLayout.buffer.hasDynamicOffset = false;
 	lightingUniformLayout.buffer.minBindingSize = sizeof(LightingUniforms); // Need multiple of 16 for uniform buffer
 
+	// For the object transforms
+	WGPUBindGroupLayoutEntry& objectLayout = bindingLayoutEntries[3];
+	setDefault(objectLayout);
+	objectLayout.binding = 4;
+	objectLayout.visibility = WGPUShaderStage_Vertex;
+	objectLayout.buffer.nextInChain = nullptr;
+	objectLayout.buffer.type = WGPUBufferBindingType_ReadOnlyStorage;
+	objectLayout.buffer.hasDynamicOffset = false;
+	objectLayout.buffer.minBindingSize = sizeof(glm::mat4x4);
+
+	// For the point lights and the per-cluster light lists
+	WGPUBindGroupLayoutEntry& lightLayout = bindingLayoutEntries[4];
+	setDefault(lightLayout);
+	lightLayout.binding = 5;
+	lightLayout.visibility = WGPUShaderStage_Fragment;
+	lightLayout.buffer.nextInChain = nullptr;
+	lightLayout.buffer.type = WGPUBufferBindingType_ReadOnlyStorage;
+	lightLayout.buffer.hasDynamicOffset = false;
+	lightLayout.buffer.minBindingSize = sizeof(PointLight);
+
+	WGPUBindGroupLayoutEntry& clusterLayout = bindingLayoutEntries[5];
+	setDefault(clusterLayout);
+	clusterLayout.binding = 6;
+	clusterLayout.visibility = WGPUShaderStage_Fragment;
+	clusterLayout.buffer.nextInChain = nullptr;
+	clusterLayout.buffer.type = WGPUBufferBindingType_ReadOnlyStorage;
+	clusterLayout.buffer.hasDynamicOffset = false;
+	clusterLayout.buffer.minBindingSize = (ClusteredLighting::MAX_LIGHTS_PER_CLUSTER + 1) * sizeof(uint32_t);
+
+	WGPUBindGroupLayoutEntry& clusterUniformLayout = bindingLayoutEntries[6];
+	setDefault(clusterUniformLayout);
+	clusterUniformLayout.binding = 7;
+	clusterUniformLayout.visibility = WGPUShaderStage_Fragment;
+	clusterUniformLayout.buffer.nextInChain = nullptr;
+	clusterUniformLayout.buffer.type = WGPUBufferBindingType_Uniform;
+	clusterUniformLayout.buffer.hasDynamicOffset = false;
+	clusterUniformLayout.buffer.minBindingSize = sizeof(ClusterUniforms);
+
+	// For the cascaded shadow maps
+	WGPUBindGroupLayoutEntry& shadowMapLayout = bindingLayoutEntries[7];
+	setDefault(shadowMapLayout);
+	shadowMapLayout.binding = 8;
+	shadowMapLayout.visibility = WGPUShaderStage_Fragment;
+	shadowMapLayout.texture.sampleType = WGPUTextureSampleType_Depth;
+	shadowMapLayout.texture.viewDimension = WGPUTextureViewDimension_2DArray;
+
+	WGPUBindGroupLayoutEntry& shadowSamplerLayout = bindingLayoutEntries[8];
+	setDefault(shadowSamplerLayout);
+	shadowSamplerLayout.binding = 9;
+	shadowSamplerLayout.visibility = WGPUShaderStage_Fragment;
+	shadowSamplerLayout.sampler.nextInChain = nullptr;
+	shadowSamplerLayout.sampler.type = WGPUSamplerBindingType_Comparison;
+
+	WGPUBindGroupLayoutEntry& shadowUniformLayout = bindingLayoutEntries[9];
+	setDefault(shadowUniformLayout);
+	shadowUniformLayout.binding = 10;
+	shadowUniformLayout.visibility = WGPUShaderStage_Fragment;
+	shadowUniformLayout.buffer.nextInChain = nullptr;
+	shadowUniformLayout.buffer.type = WGPUBufferBindingType_Uniform;
+	shadowUniformLayout.buffer.hasDynamicOffset = false;
+	shadowUniformLayout.buffer.minBindingSize = sizeof(ShadowUniforms);
+
+	// Virtual texture feedback, written by fs_main
+	WGPUBindGroupLayoutEntry& feedbackLayout = bindingLayoutEntries[10];
+	setDefault(feedbackLayout);
+	feedbackLayout.binding = 11;
+	feedbackLayout.visibility = WGPUShaderStage_Fragment;
+	feedbackLayout.buffer.nextInChain = nullptr;
+	feedbackLayout.buffer.type = WGPUBufferBindingType_Storage;
+	feedbackLayout.buffer.hasDynamicOffset = false;
+	feedbackLayout.buffer.minBindingSize = 0;
+
+	// Draw instances, with texture arrays
+	WGPUBindGroupLayoutEntry& drawInstanceLayout = bindingLayoutEntries[11];
+	setDefault(drawInstanceLayout);
+	drawInstanceLayout.binding = 12;
+	drawInstanceLayout.visibility = WGPUShaderStage_Vertex;
+	drawInstanceLayout.buffer.nextInChain = nullptr;
+	drawInstanceLayout.buffer.type = WGPUBufferBindingType_ReadOnlyStorage;
+	drawInstanceLayout.buffer.hasDynamicOffset = false;
+	drawInstanceLayout.buffer.minBindingSize = 0;
+
+	// Fragment counter
+	WGPUBindGroupLayoutEntry& fragmentCountLayout = bindingLayoutEntries[12];
+	setDefault(fragmentCountLayout);
+	fragmentCountLayout.binding = 13;
+	fragmentCountLayout.visibility = WGPUShaderStage_Fragment;
+	fragmentCountLayout.buffer.nextInChain = nullptr;
+	fragmentCountLayout.buffer.type = WGPUBufferBindingType_Storage;
+	fragmentCountLayout.buffer.hasDynamicOffset = false;
+	fragmentCountLayout.buffer.minBindingSize = sizeof(uint32_t);
+
 	// 2. Create bind group layout (blueprint)
 	WGPUBindGroupLayoutDescriptor bindGroupLayoutDesc = {};
 	bindGroupLayoutDesc.nextInChain = nullptr;
@@ -806,29 +1066,62 @@ bool Application::initBindGroupLayout()
 	bindGroupLayoutDesc.entries = bindingLayoutEntries.data();
 	m_bindGroupLayout = wgpuDeviceCreateBindGroupLayout(m_device, &bindGroupLayoutDesc);
 
-	return m_bindGroupLayout != nullptr;
-}
+	// Group 1: per material
+	std::vector<WGPUBindGroupLayoutEntry> materialLayoutEntries(3);
 
-bool Application::initRenderPipeline()
-{
-	// Create shader
-	WGPUShaderModule shaderModule = ResourceManager::LoadShaderModule(RESOURCE_DIR "shader.wgsl", m_device);
-	if (shaderModule == nullptr) {
-		SPDLOG_ERROR("Failed to create shader module!");
-		exit(1);
+	// For the base color texture
+	WGPUBindGroupLayoutEntry& textureLayout = materialLayoutEntries[0];
+	setDefault(textureLayout);
+	textureLayout.binding = 0;
+	textureLayout.visibility = WGPUShaderStage_Fragment;
+	textureLayout.texture.sampleType = WGPUTextureSampleType_Float; // What variable type will be returned when sampling the texture
+	textureLayout.texture.viewDimension = WGPUTextureViewDimension_2D;
+
+	// For the material uniform
+	WGPUBindGroupLayoutEntry& materialUniformLayout = materialLayoutEntries[1];
+	setDefault(materialUniformLayout);
+	materialUniformLayout.binding = 1;
+	materialUniformLayout.visibility = WGPUShaderStage_Fragment;
+	materialUniformLayout.buffer.nextInChain = nullptr;
+	materialUniformLayout.buffer.type = WGPUBufferBindingType_Uniform;
+	materialUniformLayout.buffer.hasDynamicOffset = false;
+	materialUniformLayout.buffer.minBindingSize = sizeof(MaterialUniforms);
+
+	// For the virtual texture page table (the white texture when the material isn't virtual)
+	WGPUBindGroupLayoutEntry& pageTableLayout = materialLayoutEntries[2];
+	setDefault(pageTableLayout);
+	pageTableLayout.binding = 2;
+	pageTableLayout.visibility = WGPUShaderStage_Fragment;
+	pageTableLayout.texture.sampleType = WGPUTextureSampleType_Float;
+	pageTableLayout.texture.viewDimension = WGPUTextureViewDimension_2D;
+
+	// Texture arrays: per array instead, with every material in a storage buffer (fs_main picks one per instance)
+	if (m_useTextureArrays) {
+		textureLayout.texture.viewDimension = WGPUTextureViewDimension_2DArray;
+		materialUniformLayout.buffer.type = WGPUBufferBindingType_ReadOnlyStorage;
+		materialUniformLayout.buffer.minBindingSize = sizeof(MaterialData);
+		materialLayoutEntries.pop_back();
 	}
-	SPDLOG_INFO("Shader module created.");
 
-	WGPURenderPipelineDescriptor pipelineDesc = {};
-	pipelineDesc.nextInChain = nullptr;
-	pipelineDesc.label = "Main pipeline";
+	WGPUBindGroupLayoutDescriptor materialLayoutDesc = {};
+	materialLayoutDesc.nextInChain = nullptr;
+	materialLayoutDesc.label = "Material binding group layout";
+	materialLayoutDesc.entryCount = static_cast<uint32_t>(materialLayoutEntries.size());
+	materialLayoutDesc.entries = materialLayoutEntries.data();
+	m_materialBindGroupLayout = wgpuDeviceCreateBindGroupLayout(m_device, &materialLayoutDesc);
+
+	return m_bindGroupLayout != nullptr && m_materialBindGroupLayout != nullptr;
+}
 
+bool Application::initRenderPipeline()
+{
 	// Layout (a bunch of the work done before)
 	WGPUPipelineLayoutDescriptor layoutDesc = {};
 	layoutDesc.nextInChain = nullptr;
 	layoutDesc.label = "Main pipeline layout";
-	layoutDesc.bindGroupLayoutCount = 1;
-	layoutDesc.bindGroupLayouts = &m_bindGroupLayout;
+	std::array<WGPUBindGroupLayout, 2> bindGroupLayouts = {m_bindGroupLayout, m_materialBindGroupLayout};
+	layoutDesc.bindGroupLayoutCount = static_cast<uint32_t>(bindGroupLayouts.size());
+	layoutDesc.bindGroupLayouts = bindGroupLayouts.data();
 
 	SPDLOG_INFO("Creating pipeline layout...");
 	m_layout = wgpuDeviceCreatePipelineLayout(m_device, &layoutDesc);
@@ -838,6 +1131,60 @@ bool Application::initRenderPipeline()
 	}
 	SPDLOG_INFO("Pipeline layout created");
 
+	// Pipelines are created per material on first use, build the common one now so shader errors show up at startup
+	PipelineKey key;
+	key.vertexColors = m_hasVertexColors;
+	key.textureArray = m_useTextureArrays;
+	return getPipelineId(key) != UINT32_MAX;
+}
+
+AssetCache::Handle Application::getShaderModule(const std::vector<std::string>& defines)
+{
+	AssetCache::Handle shaderModule = m_assets.LoadShaderModule(RESOURCE_DIR "shader.wgsl", defines);
+	if (!shaderModule) {
+		SPDLOG_ERROR("Failed to create shader module!");
+		exit(1);
+	}
+	return shaderModule;
+}
+
+WGPURenderPipeline Application::createRenderPipeline(const PipelineKey& key)
+{
+	// Interface changes need their own module, everything else is an override constant
+	std::vector<std::string> defines;
+	if (key.vertexColors) {
+		defines.push_back("VERTEX_COLOR");
+	}
+	if (key.virtualTexture) {
+		defines.push_back("VIRTUAL_TEXTURE");
+	}
+	if (key.textureArray) {
+		defines.push_back("TEXTURE_ARRAY");
+	}
+	AssetCache::Handle shaderModule = getShaderModule(defines);
+
+	auto constant = [](const char* name, double value)
+	{
+		WGPUConstantEntry entry = {};
+		entry.nextInChain = nullptr;
+		entry.key = name;
+		entry.value = value; // Bools are 0/1
+		return entry;
+	};
+	std::array<WGPUConstantEntry, 7> fragmentConstants = {
+		constant("DIRECTIONAL_LIGHT_COUNT", key.directionalLightCount),
+		constant("POINT_LIGHTS", key.pointLights),
+		constant("BRUTE_FORCE_LIGHTS", key.bruteForceLights),
+		constant("USE_TEXTURE", key.textured),
+		constant("ALPHA_TEST", key.alphaTest),
+		constant("SHADOWS", key.shadows),
+		constant("COUNT_FRAGMENTS", key.countFragments),
+	};
+
+	std::string label = "Main pipeline " + std::to_string(key.Pack());
+	WGPURenderPipelineDescriptor pipelineDesc = {};
+	pipelineDesc.nextInChain = nullptr;
+	pipelineDesc.label = label.c_str();
 	pipelineDesc.layout = m_layout;
 
 	// Vertex
@@ -859,6 +1206,9 @@ bool Application::initRenderPipeline()
 	vertexAttribs[3].format = WGPUVertexFormat_Float32x2;
 	vertexAttribs[3].offset = offsetof(VertexAttributes, uv);
 	vertexAttribs[3].shaderLocation = 3;
+	if (!key.vertexColors) {
+		vertexAttribs.erase(vertexAttribs.begin() + 2);
+	}
 
 	WGPUVertexBufferLayout vertexBufferLayout = {};
 	vertexBufferLayout.arrayStride = sizeof(VertexAttributes); // 11 attributes: (X, Y, Z), (NX, NY, NZ), (R, G, B), and (U, V)
@@ -867,7 +1217,7 @@ bool Application::initRenderPipeline()
 	vertexBufferLayout.attributes = vertexAttribs.data();
 
 	pipelineDesc.vertex.nextInChain = nullptr;
-	pipelineDesc.vertex.module = shaderModule;
+	pipelineDesc.vertex.module = shaderModule.GetShaderModule();
 	pipelineDesc.vertex.entryPoint = "vs_main";
 	pipelineDesc.vertex.constantCount = 0;
 	pipelineDesc.vertex.constants = nullptr;
@@ -888,8 +1238,10 @@ bool Application::initRenderPipeline()
 	setDefault(depthStencilState);
 	WGPUTextureFormat depthTextureFormat = WGPUTextureFormat_Depth24Plus;
 	depthStencilState.format = m_depthTextureFormat;
-	depthStencilState.depthWriteEnabled = true;
-	depthStencilState.depthCompare = WGPUCompareFunction_Less; // Blend if current depth value is less than the one stored in the Z-Buffer
+	// Transparent materials still test against depth but don't write it, pre-pass depth is final
+	depthStencilState.depthWriteEnabled = !key.transparent && !key.depthEqual;
+	// Blend if current depth value is less than the one stored in the Z-Buffer (or exactly the pre-pass depth)
+	depthStencilState.depthCompare = key.depthEqual ? WGPUCompareFunction_Equal : WGPUCompareFunction_Less;
 	depthStencilState.stencilReadMask = 0;
 	depthStencilState.stencilWriteMask = 0;
 
@@ -921,10 +1273,10 @@ bool Application::initRenderPipeline()
 
 	WGPUFragmentState fragState = {};
 	fragState.nextInChain = nullptr;
-	fragState.module = shaderModule;
+	fragState.module = shaderModule.GetShaderModule();
 	fragState.entryPoint = "fs_main";
-	fragState.constantCount = 0;
-	fragState.constants = nullptr;
+	fragState.constantCount = static_cast<uint32_t>(fragmentConstants.size());
+	fragState.constants = fragmentConstants.data();
 	fragState.targetCount = 1;
 	fragState.targets = &colorTarget;
 
@@ -935,45 +1287,292 @@ bool Application::initRenderPipeline()
 		fragState.entryPoint, (int)colorTarget.format);
 
 	// Create the pipeline
-	m_pipeline = wgpuDeviceCreateRenderPipeline(m_device, &pipelineDesc);
-
-	// Discard after binding to pipeline
-	wgpuShaderModuleRelease(shaderModule);
-
-	if (!m_pipeline) {
+	WGPURenderPipeline pipeline = wgpuDeviceCreateRenderPipeline(m_device, &pipelineDesc);
+	if (!pipeline) {
 		SPDLOG_ERROR("wgpuDeviceCreateRenderPipeline returned nullptr!");
 		exit(1);
 	} else {
 		SPDLOG_INFO("Render pipeline created.");
 	}
 
-	return m_pipeline != nullptr;
+	return pipeline;
+}
+
+bool Application::initDepthPrepassPipeline()
+{
+	// Only needs the view and the object transforms
+	WGPUPipelineLayoutDescriptor layoutDesc = {};
+	layoutDesc.nextInChain = nullptr;
+	layoutDesc.label = "Depth pre-pass pipeline layout";
+	layoutDesc.bindGroupLayoutCount = 1;
+	layoutDesc.bindGroupLayouts = &m_bindGroupLayout;
+	m_depthPrepassLayout = wgpuDeviceCreatePipelineLayout(m_device, &layoutDesc);
+
+	WGPUVertexAttribute positionAttrib = {};
+	positionAttrib.format = WGPUVertexFormat_Float32x3;
+	positionAttrib.offset = 0;
+	positionAttrib.shaderLocation = 0;
+	WGPUVertexBufferLayout vertexBufferLayout = {};
+	vertexBufferLayout.arrayStride = sizeof(glm::vec3); // m_positionBuffer
+	vertexBufferLayout.stepMode = WGPUVertexStepMode_Vertex;
+	vertexBufferLayout.attributeCount = 1;
+	vertexBufferLayout.attributes = &positionAttrib;
+
+	WGPURenderPipelineDescriptor pipelineDesc = {};
+	pipelineDesc.nextInChain = nullptr;
+	pipelineDesc.label = "Depth pre-pass pipeline";
+	pipelineDesc.layout = m_depthPrepassLayout;
+	pipelineDesc.vertex.nextInChain = nullptr;
+	AssetCache::Handle shaderModule = getShaderModule({});
+	pipelineDesc.vertex.module = shaderModule.GetShaderModule();
+	pipelineDesc.vertex.entryPoint = "vs_depth"; // Same (@invariant) position as vs_main, so the main pass can test for Equal
+	pipelineDesc.vertex.constantCount = 0;
+	pipelineDesc.vertex.constants = nullptr;
+	pipelineDesc.vertex.bufferCount = 1;
+	pipelineDesc.vertex.buffers = &vertexBufferLayout;
+	pipelineDesc.primitive.nextInChain = nullptr;
+	pipelineDesc.primitive.topology = WGPUPrimitiveTopology_TriangleList;
+	pipelineDesc.primitive.stripIndexFormat = WGPUIndexFormat_Undefined;
+	pipelineDesc.primitive.frontFace = WGPUFrontFace_CCW;
+	pipelineDesc.primitive.cullMode = WGPUCullMode_None; // Has to match the main pipelines
+
+	WGPUDepthStencilState depthStencilState = {};
+	setDefault(depthStencilState);
+	depthStencilState.format = m_depthTextureFormat;
+	depthStencilState.depthWriteEnabled = true;
+	depthStencilState.depthCompare = WGPUCompareFunction_Less;
+	depthStencilState.stencilReadMask = 0;
+	depthStencilState.stencilWriteMask = 0;
+	pipelineDesc.depthStencil = &depthStencilState;
+
+	pipelineDesc.multisample.nextInChain = nullptr;
+	pipelineDesc.multisample.count = 1;
+	pipelineDesc.multisample.mask = ~0u;
+	pipelineDesc.multisample.alphaToCoverageEnabled = false;
+	pipelineDesc.fragment = nullptr; // Depth only
+
+	m_depthPrepassPipeline = wgpuDeviceCreateRenderPipeline(m_device, &pipelineDesc);
+	if (!m_depthPrepassPipeline) {
+		SPDLOG_ERROR("Could not create the depth pre-pass pipeline!");
+		return false;
+	}
+	return true;
+}
+
+void Application::updateDepthPrepass()
+{
+	bool wasActive = m_depthPrepassActive;
+
+	// Rough depth complexity: screen coverage of every object's bounding sphere, summed up (NDC is 2x2)
+	m_depthComplexity = 0.0f;
+	glm::mat4x4 viewModel = m_uniforms.viewMatrix * m_uniforms.modelMatrix;
+	float modelScale = maxAxisScale(m_uniforms.modelMatrix);
+	m_entities.Each<Bounds>([&](EntityStore::Entity, const Bounds& bounds)
+	{
+		glm::vec3 center = glm::vec3(viewModel * glm::vec4(bounds.center, 1.0f));
+		float radius = bounds.radius * modelScale;
+		if (center.z < -radius) {
+			return; // Behind the camera
+		}
+		if (center.z <= radius) {
+			m_depthComplexity += 1.0f; // Camera inside the bounds, assume it covers the screen
+			return;
+		}
+		float radiusX = radius / center.z * m_uniforms.projectionMatrix[0][0];
+		float radiusY = radius / center.z * m_uniforms.projectionMatrix[1][1];
+		m_depthComplexity += std::min(glm::pi<float>() * radiusX * radiusY / 4.0f, 1.0f);
+	});
+
+	switch (m_depthPrepassMode) {
+	case DepthPrepassMode::Off:
+		m_depthPrepassActive = false;
+		break;
+	case DepthPrepassMode::On:
+		m_depthPrepassActive = true;
+		break;
+	case DepthPrepassMode::Auto:
+		// With some hysteresis so the variants don't flip back and forth while orbiting
+		if (m_depthComplexity > PREPASS_ENABLE_COMPLEXITY) {
+			m_depthPrepassActive = true;
+		} else if (m_depthComplexity < PREPASS_DISABLE_COMPLEXITY) {
+			m_depthPrepassActive = false;
+		}
+		break;
+	}
+	if (m_depthPrepassActive != wasActive) {
+		SPDLOG_INFO("Depth pre-pass {} (depth complexity {:.2f}).", m_depthPrepassActive ? "on" : "off", m_depthComplexity);
+	}
+}
+
+void Application::encodeDepthPrepass(WGPUCommandEncoder encoder, WGPUTextureView depthView, glm::uvec2 renderSize)
+{
+	WGPURenderPassDepthStencilAttachment depthStencilAtt = {};
+	depthStencilAtt.view = depthView;
+	depthStencilAtt.depthLoadOp = WGPULoadOp_Clear;
+	depthStencilAtt.depthStoreOp = WGPUStoreOp_Store;
+	depthStencilAtt.depthClearValue = 1.0f;
+	depthStencilAtt.depthReadOnly = false;
+	depthStencilAtt.stencilLoadOp = WGPULoadOp_Undefined;
+	depthStencilAtt.stencilStoreOp = WGPUStoreOp_Undefined;
+	depthStencilAtt.stencilClearValue = 0;
+	depthStencilAtt.stencilReadOnly = true;
+
+	WGPURenderPassDescriptor renderPassDesc = {};
+	renderPassDesc.nextInChain = nullptr;
+	renderPassDesc.label = "Depth pre-pass";
+	renderPassDesc.colorAttachmentCount = 0;
+	renderPassDesc.colorAttachments = nullptr;
+	renderPassDesc.depthStencilAttachment = &depthStencilAtt;
+	renderPassDesc.occlusionQuerySet = nullptr;
+	renderPassDesc.timestampWrites = m_gpuProfiler.BeginRenderPass("Depth pre-pass");
+	WGPURenderPassEncoder pass = wgpuCommandEncoderBeginRenderPass(encoder, &renderPassDesc);
+	setViewport(pass, renderSize);
+
+	wgpuRenderPassEncoderSetPipeline(pass, m_depthPrepassPipeline);
+	uint32_t dynamicOffset = m_frameSlot * m_uniformStride;
+	wgpuRenderPassEncoderSetBindGroup(pass, 0, m_bindGroup, 1, &dynamicOffset);
+
+	// No materials bound here, so without overrides neighbouring opaque sub-meshes merge into one draw for every object at once.
+	// Alpha tested sub-meshes are drawn with depth writes in the main pass, transparent ones without
+	drawPositions(pass, [](const MeshRenderer&) { return true; }, [](const Material& material) { return !material.transparent && !material.alphaTest; });
+
+	wgpuRenderPassEncoderEnd(pass);
+	wgpuRenderPassEncoderRelease(pass);
+}
+
+uint32_t Application::getPipelineId(const PipelineKey& key)
+{
+	auto it = m_pipelineIds.find(key.Pack());
+	if (it != m_pipelineIds.end()) {
+		return it->second;
+	}
+
+	TRACE_ZONE("CreateRenderPipeline");
+	WGPURenderPipeline pipeline = createRenderPipeline(key);
+	if (!pipeline) {
+		return UINT32_MAX;
+	}
+	uint32_t pipelineId = static_cast<uint32_t>(m_pipelines.size());
+	m_pipelines.push_back(pipeline);
+	m_pipelineIds[key.Pack()] = pipelineId;
+	return pipelineId;
+}
+
+PipelineKey Application::makePipelineKey(uint32_t materialId) const
+{
+	const Material& material = m_materials[materialId];
+	PipelineKey key;
+	key.directionalLightCount = m_directionalLightCount;
+	key.pointLights = m_pointLightsEnabled;
+	key.bruteForceLights = m_clusteredLighting.IsBruteForce();
+	key.shadows = m_cascadedShadows.IsEnabled();
+	key.vertexColors = m_hasVertexColors;
+	key.textured = m_materialResources[materialId].textureView != m_whiteTextureView; // Also true when it fell back to the default texture
+	key.virtualTexture = m_materialResources[materialId].virtualTexture != VirtualTextureCache::INVALID_TEXTURE;
+	key.textureArray = m_useTextureArrays;
+	key.alphaTest = material.alphaTest;
+	key.transparent = material.transparent;
+	key.depthEqual = m_depthPrepassActive && !material.transparent && !material.alphaTest; // The pre-pass skips those (no blending, no discard)
+	key.countFragments = m_countFragments;
+	return key;
+}
+
+void Application::updateMaterialPipelines()
+{
+	PipelineKey sceneKey;
+	sceneKey.directionalLightCount = m_directionalLightCount;
+	sceneKey.pointLights = m_pointLightsEnabled;
+	sceneKey.bruteForceLights = m_clusteredLighting.IsBruteForce();
+	sceneKey.shadows = m_cascadedShadows.IsEnabled();
+	sceneKey.depthEqual = m_depthPrepassActive;
+	sceneKey.vertexColors = m_hasVertexColors;
+	sceneKey.textureArray = m_useTextureArrays;
+	sceneKey.countFragments = m_countFragments;
+	sceneKey.textured = false;
+	if (sceneKey.Pack() == m_shaderFeatures && m_materialPipelineIds.size() == m_materials.size()) {
+		return;
+	}
+
+	m_shaderFeatures = sceneKey.Pack();
+	m_materialPipelineIds.resize(m_materials.size());
+	for (uint32_t materialId = 0; materialId < m_materials.size(); ++materialId) {
+		m_materialPipelineIds[materialId] = getPipelineId(makePipelineKey(materialId));
+	}
+	invalidateStaticBundles(); // Pipelines are baked into the bundles
 }
 
 bool Application::initBindGroup()
 {
 	// 1. Create bind group entry (actual resource data)
-	std::vector<WGPUBindGroupEntry> bindings(4);
+	std::vector<WGPUBindGroupEntry> bindings(13);
 	// Uniform buffer
 	bindings[0].nextInChain = nullptr;
 	bindings[0].binding = 0; // Index of binding
 	bindings[0].buffer = m_uniformBuffer;
 	bindings[0].offset = 0;
 	bindings[0].size = sizeof(MyUniforms);
-	// Texture
-	bindings[1].nextInChain = nullptr;
-	bindings[1].binding = 1;
-	bindings[1].textureView = m_textureView;
 	// Sampler
-	bindings[2].nextInChain = nullptr;
-	bindings[2].binding = 2;
-	bindings[2].sampler = m_sampler;
+	bindings[1].nextInChain = nullptr;
+	bindings[1].binding = 2;
+	bindings[1].sampler = m_sampler;
 	// Another uniform buffer
+	bindings[2].nextInChain = nullptr;
+	bindings[2].binding = 3; // Index of binding
+	bindings[2].buffer = m_lightingUniformBuffer;
+	bindings[2].offset = 0;
+	bindings[2].size = sizeof(LightingUniforms);
+	// Object transforms
 	bindings[3].nextInChain = nullptr;
-	bindings[3].binding = 3; // Index of binding
-	bindings[3].buffer = m_lightingUniformBuffer;
+	bindings[3].binding = 4;
+	bindings[3].buffer = m_objectBuffer;
 	bindings[3].offset = 0;
-	bindings[3].size = sizeof(LightingUniforms);
+	bindings[3].size = m_objectCapacity * sizeof(glm::mat4x4);
+	// Lights and clusters
+	bindings[4].nextInChain = nullptr;
+	bindings[4].binding = 5;
+	bindings[4].buffer = m_clusteredLighting.GetLightBuffer();
+	bindings[4].offset = 0;
+	bindings[4].size = m_clusteredLighting.GetLightBufferSize();
+	bindings[5].nextInChain = nullptr;
+	bindings[5].binding = 6;
+	bindings[5].buffer = m_clusteredLighting.GetClusterBuffer();
+	bindings[5].offset = 0;
+	bindings[5].size = m_clusteredLighting.GetClusterBufferSize();
+	bindings[6].nextInChain = nullptr;
+	bindings[6].binding = 7;
+	bindings[6].buffer = m_clusteredLighting.GetUniformBuffer();
+	bindings[6].offset = 0;
+	bindings[6].size = sizeof(ClusterUniforms);
+	// Shadows
+	bindings[7].nextInChain = nullptr;
+	bindings[7].binding = 8;
+	bindings[7].textureView = m_cascadedShadows.GetShadowMapView();
+	bindings[8].nextInChain = nullptr;
+	bindings[8].binding = 9;
+	bindings[8].sampler = m_cascadedShadows.GetSampler();
+	bindings[9].nextInChain = nullptr;
+	bindings[9].binding = 10;
+	bindings[9].buffer = m_cascadedShadows.GetUniformBuffer();
+	bindings[9].offset = 0;
+	bindings[9].size = sizeof(ShadowUniforms);
+	// Virtual texture feedback
+	bindings[10].nextInChain = nullptr;
+	bindings[10].binding = 11;
+	bindings[10].buffer = m_virtualTextures.GetFeedbackBuffer();
+	bindings[10].offset = 0;
+	bindings[10].size = m_virtualTextures.GetFeedbackBufferSize();
+	// Draw instances
+	bindings[11].nextInChain = nullptr;
+	bindings[11].binding = 12;
+	bindings[11].buffer = m_drawInstanceBuffer;
+	bindings[11].offset = 0;
+	bindings[11].size = 2 * m_objectCapacity * std::max<size_t>(m_subMeshes.size(), 1) * sizeof(glm::uvec2);
+	// Fragment counter
+	bindings[12].nextInChain = nullptr;
+	bindings[12].binding = 13;
+	bindings[12].buffer = m_fragmentCountBuffer;
+	bindings[12].offset = 0;
+	bindings[12].size = sizeof(uint32_t);
 
 	// 2. Create the actual bind group
 	WGPUBindGroupDescriptor bindGroupDesc = {};
@@ -983,10 +1582,204 @@ bool Application::initBindGroup()
 	bindGroupDesc.entryCount = static_cast<uint32_t>(bindings.size());
 	bindGroupDesc.entries = bindings.data();
 	m_bindGroup = wgpuDeviceCreateBindGroup(m_device, &bindGroupDesc);
+	// The shadow casters read the object transforms too
+	m_cascadedShadows.SetObjectBuffer(m_objectBuffer, m_objectCapacity * sizeof(glm::mat4x4));
 
 	return m_bindGroup != nullptr;
 }
 
+std::filesystem::path Application::getMaterialTexturePath(const Material& material) const
+{
+	if (material.baseColorTexture.empty() || std::filesystem::exists(material.baseColorTexture)) {
+		return material.baseColorTexture;
+	}
+	// The .mtl may name a texture we don't ship (e.g. fourareen4K_albedo.png), fall back to the default one
+	SPDLOG_WARN("Texture \"{}\" of material \"{}\" not found, using the default texture.", material.baseColorTexture.string(), material.name);
+	return RESOURCE_DIR "fourareen2K_albedo.jpg";
+}
+
+AssetCache::Handle Application::getMaterialTexture(const Material& material)
+{
+	if (material.baseColorTexture.empty()) {
+		return {};
+	}
+	// The default texture is the same asset as m_defaultTexture, materials sharing a file share the texture
+	return m_assets.LoadTexture(getMaterialTexturePath(material));
+}
+
+bool Application::initMaterials()
+{
+	// 1x1 white texture, so untextured materials go through the same shader
+	WGPUTextureDescriptor textureDesc = {};
+	textureDesc.nextInChain = nullptr;
+	textureDesc.label = "White texture";
+	textureDesc.usage = WGPUTextureUsage_TextureBinding | WGPUTextureUsage_CopyDst;
+	textureDesc.dimension = WGPUTextureDimension_2D;
+	textureDesc.size = {1, 1, 1};
+	textureDesc.format = WGPUTextureFormat_RGBA8Unorm;
+	textureDesc.mipLevelCount = 1;
+	textureDesc.sampleCount = 1;
+	textureDesc.viewFormatCount = 0;
+	textureDesc.viewFormats = nullptr;
+	m_whiteTexture = wgpuDeviceCreateTexture(m_device, &textureDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::Textures, 4);
+
+	WGPUImageCopyTexture destination = {};
+	destination.texture = m_whiteTexture;
+	destination.mipLevel = 0;
+	destination.origin = {0, 0, 0};
+	destination.aspect = WGPUTextureAspect_All;
+	WGPUTextureDataLayout source = {};
+	source.nextInChain = nullptr;
+	source.offset = 0;
+	source.bytesPerRow = 4;
+	source.rowsPerImage = 1;
+	const uint8_t white[4] = {255, 255, 255, 255};
+	wgpuQueueWriteTexture(m_queue, &destination, white, sizeof(white), &source, &textureDesc.size);
+
+	WGPUTextureViewDescriptor textureViewDesc = {};
+	textureViewDesc.nextInChain = nullptr;
+	textureViewDesc.label = "White texture view";
+	textureViewDesc.format = textureDesc.format;
+	textureViewDesc.dimension = WGPUTextureViewDimension_2D;
+	textureViewDesc.baseMipLevel = 0;
+	textureViewDesc.mipLevelCount = 1;
+	textureViewDesc.baseArrayLayer = 0;
+	textureViewDesc.arrayLayerCount = 1;
+	textureViewDesc.aspect = WGPUTextureAspect_All;
+	m_whiteTextureView = wgpuTextureCreateView(m_whiteTexture, &textureViewDesc);
+	if (m_useTextureArrays) {
+		return m_whiteTextureView != nullptr && initTextureArrayMaterials();
+	}
+
+	// One uniform buffer and bind group per material, never rebuilt while drawing
+	m_materialResources.resize(m_materials.size());
+	for (size_t i = 0; i < m_materials.size(); ++i) {
+		const Material& material = m_materials[i];
+		MaterialResources& resources = m_materialResources[i];
+		resources.bindGroupId = static_cast<uint32_t>(i);
+		if (m_virtualTextures.IsEnabled() && !material.baseColorTexture.empty()) {
+			resources.virtualTexture = m_virtualTextures.Register(getMaterialTexturePath(material));
+		}
+		bool isVirtual = resources.virtualTexture != VirtualTextureCache::INVALID_TEXTURE;
+		if (!isVirtual) {
+			resources.texture = getMaterialTexture(material);
+		}
+		resources.textureView = isVirtual ? m_virtualTextures.GetCacheView() : resources.texture ? resources.texture.GetTextureView() : m_whiteTextureView;
+
+		MaterialUniforms uniforms;
+		uniforms.baseColor = material.baseColor;
+		if (!material.baseColorTexture.empty()) {
+			uniforms.baseColor = {1.0f, 1.0f, 1.0f, material.baseColor.a};
+		}
+		if (isVirtual) {
+			uniforms.virtualTexture = m_virtualTextures.GetShaderParameters(resources.virtualTexture);
+		}
+
+		WGPUBufferDescriptor bufferDesc = {};
+		bufferDesc.nextInChain = nullptr;
+		bufferDesc.label = "Material uniform buffer";
+		bufferDesc.usage = WGPUBufferUsage_CopyDst | WGPUBufferUsage_Uniform;
+		bufferDesc.size = sizeof(MaterialUniforms);
+		bufferDesc.mappedAtCreation = false;
+		resources.uniformBuffer = wgpuDeviceCreateBuffer(m_device, &bufferDesc);
+		wgpuQueueWriteBuffer(m_queue, resources.uniformBuffer, 0, &uniforms, sizeof(MaterialUniforms));
+		Stats::TrackGpuMemory(Stats::MemoryCategory::UniformBuffers, bufferDesc.size);
+
+		std::array<WGPUBindGroupEntry, 3> bindings = {};
+		bindings[0].nextInChain = nullptr;
+		bindings[0].binding = 0;
+		bindings[0].textureView = resources.textureView;
+		bindings[1].nextInChain = nullptr;
+		bindings[1].binding = 1;
+		bindings[1].buffer = resources.uniformBuffer;
+		bindings[1].offset = 0;
+		bindings[1].size = sizeof(MaterialUniforms);
+		bindings[2].nextInChain = nullptr;
+		bindings[2].binding = 2;
+		bindings[2].textureView = isVirtual ? m_virtualTextures.GetPageTableView(resources.virtualTexture) : m_whiteTextureView;
+
+		WGPUBindGroupDescriptor bindGroupDesc = {};
+		bindGroupDesc.nextInChain = nullptr;
+		bindGroupDesc.label = "Material bind group";
+		bindGroupDesc.layout = m_materialBindGroupLayout;
+		bindGroupDesc.entryCount = static_cast<uint32_t>(bindings.size());
+		bindGroupDesc.entries = bindings.data();
+		resources.bindGroup = wgpuDeviceCreateBindGroup(m_device, &bindGroupDesc);
+		if (!resources.bindGroup) {
+			return false;
+		}
+	}
+
+	return m_whiteTextureView != nullptr;
+}
+
+bool Application::initTextureArrayMaterials()
+{
+	// The import step: untextured materials get a white texture too, so every material has a place in some array
+	std::vector<std::filesystem::path> texturePaths;
+	for (const Material& material : m_materials) {
+		texturePaths.push_back(getMaterialTexturePath(material));
+	}
+	std::vector<TextureArrays::Entry> entries = m_textureArrays.Build(m_device, m_queue, texturePaths);
+	if (entries.size() != m_materials.size()) {
+		return false;
+	}
+
+	std::vector<MaterialData> materialData(m_materials.size());
+	for (size_t i = 0; i < m_materials.size(); ++i) {
+		const Material& material = m_materials[i];
+		materialData[i].baseColor = material.baseColor;
+		if (!material.baseColorTexture.empty()) {
+			materialData[i].baseColor = {1.0f, 1.0f, 1.0f, material.baseColor.a};
+		}
+		materialData[i].uvTransform = entries[i].uvTransform;
+		materialData[i].layer = entries[i].layer;
+	}
+	WGPUBufferDescriptor bufferDesc = {};
+	bufferDesc.nextInChain = nullptr;
+	bufferDesc.label = "Material data buffer";
+	bufferDesc.usage = WGPUBufferUsage_CopyDst | WGPUBufferUsage_Storage;
+	bufferDesc.size = materialData.size() * sizeof(MaterialData);
+	bufferDesc.mappedAtCreation = false;
+	m_materialDataBuffer = wgpuDeviceCreateBuffer(m_device, &bufferDesc);
+	wgpuQueueWriteBuffer(m_queue, m_materialDataBuffer, 0, materialData.data(), bufferDesc.size);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers, bufferDesc.size);
+
+	// One bind group per array
+	for (uint32_t array = 0; array < m_textureArrays.GetArrayCount(); ++array) {
+		std::array<WGPUBindGroupEntry, 2> bindings = {};
+		bindings[0].nextInChain = nullptr;
+		bindings[0].binding = 0;
+		bindings[0].textureView = m_textureArrays.GetView(array);
+		bindings[1].nextInChain = nullptr;
+		bindings[1].binding = 1;
+		bindings[1].buffer = m_materialDataBuffer;
+		bindings[1].offset = 0;
+		bindings[1].size = bufferDesc.size;
+
+		WGPUBindGroupDescriptor bindGroupDesc = {};
+		bindGroupDesc.nextInChain = nullptr;
+		bindGroupDesc.label = "Texture array bind group";
+		bindGroupDesc.layout = m_materialBindGroupLayout;
+		bindGroupDesc.entryCount = static_cast<uint32_t>(bindings.size());
+		bindGroupDesc.entries = bindings.data();
+		m_textureArrayBindGroups.push_back(wgpuDeviceCreateBindGroup(m_device, &bindGroupDesc));
+		if (!m_textureArrayBindGroups.back()) {
+			return false;
+		}
+	}
+
+	m_materialResources.resize(m_materials.size());
+	for (size_t i = 0; i < m_materials.size(); ++i) {
+		MaterialResources& resources = m_materialResources[i];
+		resources.textureView = m_materials[i].baseColorTexture.empty() ? m_whiteTextureView : m_textureArrays.GetView(entries[i].array); // Picks the pipeline
+		resources.bindGroup = m_textureArrayBindGroups[entries[i].array];
+		resources.bindGroupId = entries[i].array;
+	}
+	return true;
+}
+
 bool Application::initDearImGui()
 {
 	IMGUI_CHECKVERSION();
@@ -997,9 +1790,9 @@ bool Application::initDearImGui()
 	ImGui_ImplGlfw_InitForOther(m_glfwWindow, true);
 	ImGui_ImplWGPU_InitInfo dearImGuiInfo = {};
 	dearImGuiInfo.Device = m_device;
-	dearImGuiInfo.NumFramesInFlight = 3;
+	dearImGuiInfo.NumFramesInFlight = MAX_FRAMES_IN_FLIGHT + 1; // Plus the frame being recorded
 	dearImGuiInfo.RenderTargetFormat = m_swapChainFormat;
-	dearImGuiInfo.DepthStencilFormat = m_depthTextureFormat;
+	dearImGuiInfo.DepthStencilFormat = WGPUTextureFormat_Undefined; // Drawn in its own pass without depth
 	// dearImGuiInfo.PipelineMultisampleState;
 	// ImGui_ImplWGPU_Init(m_device, 3, m_swapChainFormat, m_depthTextureFormat);
 	ImGui_ImplWGPU_Init(&dearImGuiInfo);
@@ -1008,6 +1801,7 @@ bool Application::initDearImGui()
 
 void Application::updateDearImGui(WGPURenderPassEncoder renderPassEncoder)
 {
+	TRACE_ZONE("ImGui");
 	ImGui_ImplWGPU_NewFrame();
 	ImGui_ImplGlfw_NewFrame();
 	ImGui::NewFrame();
@@ -1021,29 +1815,466 @@ void Application::updateDearImGui(WGPURenderPassEncoder renderPassEncoder)
 	lightingChanged = ImGui::DragDirection("Direction #1", m_lightingUniforms.directions[1]) || lightingChanged;
 	ImGui::End();
 	m_lightingUniformsChanged = lightingChanged;
-	
-	ImGui::EndFrame();
-	// Convert the UI defined above into low-level drawing commands
-	ImGui::Render();
-	// Low-level renderings on WebGPU's part
-	ImGui_ImplWGPU_RenderDrawData(ImGui::GetDrawData(), renderPassEncoder);
-}
 
-void Application::updateLightingUniforms()
-{
-	if (m_lightingUniformsChanged) {
-		wgpuQueueWriteBuffer(m_queue, m_lightingUniformBuffer, 0, &m_lightingUniforms, sizeof(LightingUniforms));
-		m_lightingUniformsChanged = false;
+	ImGui::Begin("Redraw");
+	bool onDemand = m_redrawMode == RedrawMode::OnDemand;
+	if (ImGui::Checkbox("On-demand redraw", &onDemand)) {
+		m_redrawMode = onDemand ? RedrawMode::OnDemand : RedrawMode::Continuous;
 	}
-}
+	ImGui::Text("Idle: %.1f%%", m_idlePercent);
+	ImGui::End();
+
+	ImGui::Begin("Scene");
+	ImGui::Text("Objects: %u (%u archetypes, %u chunks)", m_entities.GetEntityCount(), m_entities.GetArchetypeCount(), m_entities.GetChunkCount());
+	ImGui::Checkbox("Static render bundles", &m_useRenderBundles);
+	int prepassMode = static_cast<int>(m_depthPrepassMode);
+	if (ImGui::Combo("Depth pre-pass", &prepassMode, "Off\0On\0Auto\0")) {
+		m_depthPrepassMode = static_cast<DepthPrepassMode>(prepassMode);
+		requestRedraw();
+	}
+	ImGui::Text("Depth complexity: %.2f (pre-pass %s)", m_depthComplexity, m_depthPrepassActive ? "on" : "off");
+	ImGui::Text("Render targets: %u (%.1f MB, %u allocated so far)", m_renderTargetPool.GetTargetCount(), m_renderTargetPool.GetBytes() / (1024.0 * 1024.0),
+		m_renderTargetPool.GetAllocationCount());
+	ImGui::End();
+
+	// Changing these switches every material to another variant (see updateMaterialPipelines)
+	ImGui::Begin("Shader");
+	int directionalLightCount = static_cast<int>(m_directionalLightCount);
+	bool shaderChanged = ImGui::SliderInt("Directional lights", &directionalLightCount, 0, 2);
+	m_directionalLightCount = static_cast<uint32_t>(directionalLightCount);
+	shaderChanged = ImGui::Checkbox("Point lights", &m_pointLightsEnabled) || shaderChanged;
+	ImGui::Text("Variants compiled: %zu (%zu modules)", m_pipelines.size(), m_assets.GetResidentCount(AssetCache::AssetType::ShaderModule));
+	ImGui::End();
+
+	ImGui::Begin("Trace");
+	if (ImGui::Button("Write trace.json")) {
+		Trace::WriteChromeTrace("trace.json"); // Open in chrome://tracing or ui.perfetto.dev
+	}
+	ImGui::End();
+
+	bool pointLightsChanged = m_clusteredLighting.DrawImGui();
+	bool shadowsChanged = m_cascadedShadows.DrawImGui();
+	bool resolutionChanged = m_dynamicResolution.DrawImGui();
+	m_renderGraph.DrawImGui();
+	m_virtualTextures.DrawImGui();
+	m_textureArrays.DrawImGui();
+	m_assets.DrawImGui();
+	m_worldStreamer.DrawImGui();
+	m_recorder.DrawImGui();
+
+	m_gpuProfiler.DrawImGui();
+	Stats::DrawHud(m_gpuProfiler.GetTotalMs());
+
+	// Keep drawing while a widget is being dragged/typed into
+	ImGuiIO& io = ImGui::GetIO();
+	if (lightingChanged || pointLightsChanged || shadowsChanged || resolutionChanged || shaderChanged || ImGui::IsAnyItemActive() || io.WantTextInput) {
+		requestRedraw();
+	}
+	
+	ImGui::EndFrame();
+	// Convert the UI defined above into low-level drawing commands
+	ImGui::Render();
+	// Low-level renderings on WebGPU's part
+	ImDrawData* drawData = ImGui::GetDrawData();
+	ImGui_ImplWGPU_RenderDrawData(drawData, renderPassEncoder);
+	for (int i = 0; i < drawData->CmdListsCount; ++i) {
+		Stats::Add(Stats::Counter::DrawCalls, drawData->CmdLists[i]->CmdBuffer.Size);
+	}
+	Stats::Add(Stats::Counter::Triangles, drawData->TotalIdxCount / 3);
+	Stats::Add(Stats::Counter::BytesUploaded, drawData->TotalVtxCount * sizeof(ImDrawVert) + drawData->TotalIdxCount * sizeof(ImDrawIdx));
+}
+
+EntityStore::Entity Application::AddObject(const glm::mat4x4& modelMatrix, bool isStatic, EntityStore::Entity parent)
+{
+	const Transform* parentTransform = m_entities.Get<Transform>(parent);
+	TransformHierarchy::NodeId node = m_transforms.AddNode(parentTransform ? parentTransform->node : TransformHierarchy::INVALID_NODE);
+	m_transforms.SetLocal(node, modelMatrix);
+	MeshRenderer renderer;
+	renderer.isStatic = isStatic;
+	EntityStore::Entity object = m_entities.Create(Transform{node}, renderer, Bounds{});
+	m_objectsChanged = true;
+	if (isStatic) {
+		invalidateStaticBundles();
+		m_cascadedShadows.InvalidateStaticCache();
+	}
+	requestRedraw();
+	return object;
+}
+
+void Application::SetObjectTransform(EntityStore::Entity object, const glm::mat4x4& modelMatrix)
+{
+	// Bundles only reference the object buffer, so moving (even a static object) does not re-record them
+	// Uploaded (and the shadow cache invalidated if needed) once the hierarchy has been updated
+	if (const Transform* transform = m_entities.Get<Transform>(object)) {
+		m_transforms.SetLocal(transform->node, modelMatrix);
+		requestRedraw();
+	}
+}
+
+void Application::AttachRigidBody(EntityStore::Entity object, physx::PxRigidActor* actor)
+{
+	const Transform* transform = m_entities.Get<Transform>(object);
+	if (!transform) {
+		return;
+	}
+	applyBodyPose(m_transforms, transform->node, actor->getGlobalPose());
+	m_entities.Add(object, RigidBody{actor});
+	m_objectsChanged = true; // New archetype, so a new object buffer slot
+	requestRedraw();
+}
+
+void Application::SetObjectMaterial(EntityStore::Entity object, uint32_t material)
+{
+	MeshRenderer* renderer = m_entities.Get<MeshRenderer>(object);
+	if (!renderer || (material != UINT32_MAX && material >= m_materials.size()) || renderer->material == material) {
+		return;
+	}
+	renderer->material = material;
+	if (renderer->isStatic) {
+		invalidateStaticBundles();
+		m_cascadedShadows.InvalidateStaticCache();
+	}
+	requestRedraw();
+}
+
+void Application::syncRigidBodies()
+{
+	m_entities.Each<RigidBody, Transform>([this](EntityStore::Entity, const RigidBody& body, const Transform& transform)
+	{
+		const physx::PxRigidDynamic* dynamic = body.actor->is<physx::PxRigidDynamic>();
+		if (dynamic && !dynamic->isSleeping()) {
+			applyBodyPose(m_transforms, transform.node, body.actor->getGlobalPose());
+		}
+	});
+}
+
+void Application::RemoveObject(EntityStore::Entity object)
+{
+	const Transform* transform = m_entities.Get<Transform>(object);
+	const MeshRenderer* renderer = m_entities.Get<MeshRenderer>(object);
+	if (!transform || !renderer) {
+		return;
+	}
+	if (renderer->isStatic) {
+		invalidateStaticBundles();
+		m_cascadedShadows.InvalidateStaticCache();
+	}
+	m_transforms.ReleaseNode(transform->node);
+	m_entities.Destroy(object);
+	m_objectsChanged = true;
+	requestRedraw();
+}
+
+void Application::ClearObjects()
+{
+	m_worldStreamer.Close();
+	m_entities.Clear();
+	m_transforms.Clear();
+	m_objectsChanged = true;
+	invalidateStaticBundles();
+	m_cascadedShadows.InvalidateStaticCache();
+	requestRedraw();
+}
+
+bool Application::OpenWorld(const std::filesystem::path& path)
+{
+	WorldStreamer::SceneCallbacks callbacks;
+	callbacks.addObject = [this](const glm::mat4x4& modelMatrix) { return AddObject(modelMatrix, false); }; // Dynamic, so streaming doesn't keep rebuilding the static bundles and shadow cache
+	callbacks.removeObject = [this](EntityStore::Entity object) { RemoveObject(object); };
+	if (!m_worldStreamer.Open(path, callbacks)) {
+		return false;
+	}
+	requestRedraw();
+	return true;
+}
+
+void Application::invalidateStaticBundles()
+{
+	for (WGPURenderBundle& bundle : m_staticBundles) {
+		if (bundle) {
+			wgpuRenderBundleRelease(bundle);
+			bundle = nullptr;
+		}
+	}
+}
+
+WGPURenderBundle Application::recordStaticBundle(uint32_t slot)
+{
+	TRACE_ZONE("RecordStaticBundle");
+	// Must match the attachments of the main pass
+	WGPURenderBundleEncoderDescriptor bundleEncoderDesc = {};
+	bundleEncoderDesc.nextInChain = nullptr;
+	bundleEncoderDesc.label = "Static geometry bundle encoder";
+	bundleEncoderDesc.colorFormatCount = 1;
+	bundleEncoderDesc.colorFormats = &m_swapChainFormat;
+	bundleEncoderDesc.depthStencilFormat = m_depthTextureFormat;
+	bundleEncoderDesc.sampleCount = 1;
+	bundleEncoderDesc.depthReadOnly = false;
+	bundleEncoderDesc.stencilReadOnly = true;
+	WGPURenderBundleEncoder bundleEncoder = wgpuDeviceCreateRenderBundleEncoder(m_device, &bundleEncoderDesc);
+
+	// Static opaque draws, sorted without depth since the camera moves after recording
+	RenderQueue queue;
+	m_entities.Each<MeshRenderer>([&](EntityStore::Entity, const MeshRenderer& renderer)
+	{
+		if (!renderer.isStatic) {
+			return;
+		}
+		for (uint32_t subMeshIndex = 0; subMeshIndex < m_subMeshes.size(); ++subMeshIndex) {
+			uint32_t materialId = getMaterialId(renderer, subMeshIndex);
+			if (!m_materials[materialId].transparent) {
+				uint32_t pipelineId = m_materialPipelineIds[materialId];
+				uint32_t bindGroupId = m_materialResources[materialId].bindGroupId;
+				queue.Push(RenderQueue::MakeOpaqueKey(pipelineId, bindGroupId, subMeshIndex, 0.0f), {renderer.instance, subMeshIndex, pipelineId, materialId});
+			}
+		}
+	});
+	queue.Sort();
+	m_bundleStateChanges = {};
+	m_drawInstances.clear(); // The bundle's records go first, every slot's bundle writes the same ones
+	encodeRenderQueue(bundleEncoder, queue, slot, m_bundleStateChanges);
+	m_staticDrawInstanceCount = static_cast<uint32_t>(m_drawInstances.size());
+	uploadDrawInstances(0);
+
+	WGPURenderBundleDescriptor bundleDesc = {};
+	bundleDesc.nextInChain = nullptr;
+	bundleDesc.label = "Static geometry bundle";
+	WGPURenderBundle bundle = wgpuRenderBundleEncoderFinish(bundleEncoder, &bundleDesc);
+	wgpuRenderBundleEncoderRelease(bundleEncoder);
+	return bundle;
+}
+
+void Application::buildRenderQueue()
+{
+	TRACE_ZONE("BuildRenderQueue");
+	updateDepthPrepass();
+	updateMaterialPipelines();
+	m_renderQueue.Clear();
+	glm::vec3 cameraPosition = glm::vec3(glm::inverse(m_uniforms.viewMatrix)[3]);
+
+	m_entities.Each<Transform, MeshRenderer>([&](EntityStore::Entity, const Transform& transform, const MeshRenderer& renderer)
+	{
+		glm::mat4x4 modelMatrix = m_uniforms.modelMatrix * transform.world;
+		for (uint32_t subMeshIndex = 0; subMeshIndex < m_subMeshes.size(); ++subMeshIndex) {
+			const SubMesh& subMesh = m_subMeshes[subMeshIndex];
+			uint32_t materialId = getMaterialId(renderer, subMeshIndex);
+			bool transparent = m_materials[materialId].transparent;
+			// Static opaque draws are in the bundle already
+			if (!transparent && renderer.isStatic && m_useRenderBundles) {
+				continue;
+			}
+
+			float depth = glm::distance(cameraPosition, glm::vec3(modelMatrix * glm::vec4(subMesh.center, 1.0f))) / FAR_PLANE;
+			uint32_t pipelineId = m_materialPipelineIds[materialId];
+			uint32_t bindGroupId = m_materialResources[materialId].bindGroupId; // Materials of a texture array sort together
+			RenderQueue::DrawItem item = {renderer.instance, subMeshIndex, pipelineId, materialId};
+			if (transparent) {
+				m_renderQueue.Push(RenderQueue::MakeTransparentKey(pipelineId, bindGroupId, subMeshIndex, depth), item);
+			} else {
+				m_renderQueue.Push(RenderQueue::MakeOpaqueKey(pipelineId, bindGroupId, subMeshIndex, m_opaqueFrontToBack ? depth : 1.0f - depth), item);
+			}
+		}
+	});
+
+	// Opaque first (top bit clear), then transparent back to front
+	m_renderQueue.Sort();
+}
+
+uint32_t Application::getMaterialId(const MeshRenderer& renderer, uint32_t subMeshIndex) const
+{
+	return renderer.material != UINT32_MAX ? renderer.material : m_subMeshes[subMeshIndex].materialId;
+}
+
+template<typename ObjectFilter, typename MaterialFilter>
+void Application::drawPositions(WGPURenderPassEncoder pass, ObjectFilter includeObject, MaterialFilter includeMaterial)
+{
+	wgpuRenderPassEncoderSetVertexBuffer(pass, 0, m_positionBuffer, 0, m_vertexCount * sizeof(glm::vec3));
+	MeshRenderer run; // The override of the objects in [runStart, runEnd)
+	uint32_t runStart = 0, runEnd = 0;
+	auto flush = [&]()
+	{
+		if (runEnd == runStart) {
+			return;
+		}
+		uint32_t rangeStart = 0, rangeEnd = 0;
+		auto draw = [&]()
+		{
+			if (rangeEnd > rangeStart) {
+				wgpuRenderPassEncoderDraw(pass, rangeEnd - rangeStart, runEnd - runStart, rangeStart, runStart);
+				Stats::Add(Stats::Counter::DrawCalls, 1);
+			}
+		};
+		for (uint32_t subMeshIndex = 0; subMeshIndex < m_subMeshes.size(); ++subMeshIndex) {
+			const SubMesh& subMesh = m_subMeshes[subMeshIndex];
+			if (!includeMaterial(m_materials[getMaterialId(run, subMeshIndex)])) {
+				continue;
+			}
+			if (subMesh.firstVertex != rangeEnd) {
+				draw();
+				rangeStart = subMesh.firstVertex;
+			}
+			rangeEnd = subMesh.firstVertex + subMesh.vertexCount;
+		}
+		draw();
+	};
+	m_entities.Each<Transform, MeshRenderer>([&](EntityStore::Entity, const Transform&, const MeshRenderer& renderer)
+	{
+		if (!includeObject(renderer)) {
+			return;
+		}
+		if (renderer.instance != runEnd || renderer.material != run.material) {
+			flush();
+			runStart = renderer.instance;
+			run.material = renderer.material;
+		}
+		runEnd = renderer.instance + 1;
+	});
+	flush();
+}
+
+template<typename Encoder>
+void Application::encodeRenderQueue(Encoder encoder, const RenderQueue& queue, uint32_t slot, RenderQueue::StateChanges& stateChanges)
+{
+	if (queue.GetSize() == 0) {
+		return;
+	}
+
+	// Shared by every draw
+	setVertexBuffer(encoder, m_vertexBuffer, m_vertexData.size() * sizeof(VertexAttributes));
+	uint32_t dynamicOffset = slot * m_uniformStride;
+	setBindGroup(encoder, 0, m_bindGroup, 1, &dynamicOffset);
+
+	// Only switch state when the sorted neighbour differs
+	uint32_t pipelineId = UINT32_MAX;
+	WGPUBindGroup bindGroup = nullptr;
+	for (size_t i = 0; i < queue.GetSize();) {
+		const RenderQueue::DrawItem& item = queue[i];
+		if (item.pipelineId != pipelineId) {
+			pipelineId = item.pipelineId;
+			setPipeline(encoder, m_pipelines[pipelineId]);
+			++stateChanges.pipelines;
+		}
+		if (m_materialResources[item.materialId].bindGroup != bindGroup) {
+			bindGroup = m_materialResources[item.materialId].bindGroup;
+			setBindGroup(encoder, 1, bindGroup, 0, nullptr);
+			++stateChanges.bindGroups;
+		}
+		const SubMesh& subMesh = m_subMeshes[item.subMeshIndex];
+		++stateChanges.draws;
+		if (!m_useTextureArrays) {
+			draw(encoder, subMesh.vertexCount, subMesh.firstVertex, item.objectIndex); // First instance selects the object
+			++i;
+			continue;
+		}
+
+		// Texture arrays: neighbours that only differ by object and material become instances of one draw, each instance
+		// selects an (object, material) record
+		uint32_t firstInstance = static_cast<uint32_t>(m_drawInstances.size());
+		size_t end = i;
+		for (; end < queue.GetSize(); ++end) {
+			const RenderQueue::DrawItem& next = queue[end];
+			if (next.pipelineId != pipelineId || next.subMeshIndex != item.subMeshIndex || m_materialResources[next.materialId].bindGroup != bindGroup) {
+				break;
+			}
+			m_drawInstances.push_back({next.objectIndex, next.materialId});
+		}
+		draw(encoder, subMesh.vertexCount, subMesh.firstVertex, firstInstance, static_cast<uint32_t>(end - i));
+		i = end;
+	}
+}
+
+void Application::uploadDrawInstances(uint32_t first)
+{
+	if (m_drawInstances.size() > first) {
+		uint64_t size = (m_drawInstances.size() - first) * sizeof(glm::uvec2);
+		wgpuQueueWriteBuffer(m_queue, m_drawInstanceBuffer, first * sizeof(glm::uvec2), &m_drawInstances[first], size);
+		Stats::Add(Stats::Counter::BytesUploaded, size);
+	}
+}
+
+void Application::uploadObjects()
+{
+	// Moving an object moves everything attached to it, including static objects whose cached shadow depth is now wrong
+	if (m_transforms.Update() > 0) {
+		m_objectsChanged = true;
+		std::atomic<bool> staticMoved = false;
+		m_entities.ParallelEach<Transform, MeshRenderer, Bounds>([this, &staticMoved](EntityStore::Entity, Transform& transform, const MeshRenderer& renderer, Bounds& bounds)
+		{
+			if (!m_transforms.WasUpdated(transform.node)) {
+				return;
+			}
+			transform.world = m_transforms.GetWorldMatrix(transform.node);
+			bounds.center = glm::vec3(transform.world * glm::vec4(m_meshCenter, 1.0f));
+			bounds.radius = m_meshRadius * maxAxisScale(transform.world);
+			if (renderer.isStatic) {
+				staticMoved = true;
+			}
+		});
+		if (staticMoved) {
+			m_cascadedShadows.InvalidateStaticCache();
+		}
+	}
+	if (!m_objectsChanged) {
+		return;
+	}
+
+	// Object buffer slots follow storage order, so adding entities can shift them (and the bundles have them baked in)
+	std::vector<glm::mat4x4> matrices;
+	matrices.reserve(m_entities.GetEntityCount());
+	bool staticSlotsMoved = false;
+	m_entities.Each<Transform, MeshRenderer>([&](EntityStore::Entity, const Transform& transform, MeshRenderer& renderer)
+	{
+		uint32_t instance = static_cast<uint32_t>(matrices.size());
+		staticSlotsMoved |= renderer.isStatic && renderer.instance != instance;
+		renderer.instance = instance;
+		matrices.push_back(transform.world);
+	});
+	m_instanceCount = static_cast<uint32_t>(matrices.size());
+	if (staticSlotsMoved) {
+		invalidateStaticBundles();
+	}
+	if (matrices.empty()) {
+		m_objectsChanged = false;
+		return;
+	}
+
+	// Grow the buffer, which means a new bind group and therefore new bundles
+	if (m_instanceCount > m_objectCapacity) {
+		Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers, -static_cast<int64_t>(m_objectCapacity * sizeof(glm::mat4x4)));
+		wgpuBufferRelease(m_objectBuffer); // In-flight frames keep their reference
+		wgpuBufferRelease(m_drawInstanceBuffer);
+		Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers,
+			-static_cast<int64_t>(2 * m_objectCapacity * std::max<size_t>(m_subMeshes.size(), 1) * sizeof(glm::uvec2)));
+		initObjectBuffer(std::max(m_instanceCount, m_objectCapacity * 2));
+		wgpuBindGroupRelease(m_bindGroup);
+		initBindGroup();
+		invalidateStaticBundles();
+	}
+
+	wgpuQueueWriteBuffer(m_queue, m_objectBuffer, 0, matrices.data(), matrices.size() * sizeof(glm::mat4x4));
+	Stats::Add(Stats::Counter::BytesUploaded, matrices.size() * sizeof(glm::mat4x4));
+	m_objectsChanged = false;
+}
+
+void Application::updateLightingUniforms()
+{
+	if (m_lightingUniformsChanged) {
+		wgpuQueueWriteBuffer(m_queue, m_lightingUniformBuffer, 0, &m_lightingUniforms, sizeof(LightingUniforms));
+		Stats::Add(Stats::Counter::BytesUploaded, sizeof(LightingUniforms));
+		m_lightingUniformsChanged = false;
+	}
+}
 
 bool Application::Initialize()
 {
+	Trace::SetThreadName("Main");
 	if (!initWindowAndDevice())
 		return false;
 	if (!initSwapChain())
 		return false;
-	if (!initDepthBuffer())
+	m_renderTargetPool.Init(m_device);
+	m_renderGraph.Init(m_device, &m_renderTargetPool);
+	if (!m_dynamicResolution.Init(m_device, m_queue, m_swapChainFormat))
 		return false;
 	if (!initTexture())
 		return false;
@@ -1053,63 +2284,147 @@ bool Application::Initialize()
 		return false;
 	if (!initLightingUniforms())
 		return false;
+	if (!initObjectBuffer(1))
+		return false;
+	if (!initFragmentCounter())
+		return false;
+	if (!m_clusteredLighting.Init(m_device, m_queue))
+		return false;
+	if (!m_cascadedShadows.Init(m_device, m_queue, sizeof(glm::vec3))) // Reads m_positionBuffer
+		return false;
+	if (!m_virtualTextures.Init(m_device, m_queue, m_virtualTextureBudget))
+		return false;
+	if (m_useTextureArrays && m_virtualTextures.IsEnabled()) {
+		SPDLOG_WARN("Texture arrays and virtual textures don't mix, using virtual textures.");
+		m_useTextureArrays = false;
+	}
 	if (!initBindGroupLayout())
 		return false;
 	if (!initRenderPipeline()) // Important that this stays here!
 		return false;
+	if (!initDepthPrepassPipeline())
+		return false;
 	if (!initBindGroup())
 		return false;
+	if (!initMaterials())
+		return false;
 	if (!initDearImGui())
 		return false;
+	if (!m_gpuProfiler.Init(m_device, m_timestampsSupported))
+		return false;
+	if (!m_recorder.Init(m_instance, m_device))
+		return false;
+	if (!JobSystem::Init())
+		return false;
 	if (!Physics::Init())
 		return false;
+	addDefaultScene();
+	m_idleWindowStart = glfwGetTime();
+	requestRedraw();
 	return true;
 }
 
-void Application::MainLoop()
+void Application::addDefaultScene()
 {
-	glfwPollEvents();
-	wgpuInstanceProcessEvents(m_instance);
-	wgpuDeviceTick(m_device);
+	AddObject(glm::mat4x4(1.0f)); // The boat
+
+	// A smaller one rides the PhysX box, dropped beside the first and drawn in another opaque material
+	physx::PxRigidDynamic* box = Physics::GetWorld().GetBox();
+	box->setGlobalPose(physx::PxTransform(2.0f * m_meshRadius + 1.0f, 5.0f, 0.0f));
+	box->setLinearVelocity(physx::PxVec3(0.0f));
+	box->setAngularVelocity(physx::PxVec3(0.0f));
+	EntityStore::Entity physicsBoat = AddObject(glm::scale(glm::mat4x4(1.0f), glm::vec3(1.0f / std::max(m_meshRadius, 1e-3f))), false);
+	AttachRigidBody(physicsBoat, box);
+	for (uint32_t materialId = 0; materialId < m_materials.size(); ++materialId) {
+		if (materialId != m_subMeshes[0].materialId && !m_materials[materialId].transparent) {
+			SetObjectMaterial(physicsBoat, materialId);
+			break;
+		}
+	}
+}
 
-	// Physics
-	Physics::Step();
+void Application::waitForFrameSlot(uint32_t slot)
+{
+	// Only blocks when the CPU is more than MAX_FRAMES_IN_FLIGHT frames ahead of the GPU
+	uint64_t phaseStart = Trace::Now();
+	double start = glfwGetTime();
+	while (m_frameSlots[slot].inFlight) {
+		wgpuInstanceProcessEvents(m_instance);
+		wgpuDeviceTick(m_device);
+		if (m_frameSlots[slot].inFlight) {
+			std::this_thread::yield();
+		}
+	}
+	m_frameTimings.cpuWaitMs = static_cast<float>((glfwGetTime() - start) * 1000.0);
+	endPhase("WaitForFrameSlot", Stats::Phase::WaitForFrameSlot, phaseStart);
+}
 
-	// Updates!
-	updateDragInertia();
-	updateLightingUniforms();
+void Application::updateViewUniforms(glm::uvec2 renderSize)
+{
+	m_clusteredLighting.Update(m_uniforms.viewMatrix, m_uniforms.projectionMatrix, glm::vec2(renderSize), NEAR_PLANE, FAR_PLANE);
+	m_cascadedShadows.Update(m_uniforms.viewMatrix, m_uniforms.projectionMatrix, m_uniforms.modelMatrix, glm::vec3(m_lightingUniforms.directions[0]), NEAR_PLANE);
+}
 
-	// 0. Update buffers (only upload time to MyUniforms, which is the first 4 bytes)
-	// TODO: Optimize
-	// float t = static_cast<float>(glfwGetTime());
-	// glm::mat4x4 S = glm::scale(glm::mat4x4(1.0), glm::vec3(0.3f));
-	// glm::mat4x4 T1 = glm::translate(glm::mat4x4(1.0), glm::vec3(0.5, 0.0, 0.0));
-	// glm::mat4x4 R1 = glm::rotate(glm::mat4x4(1.0), t, glm::vec3(0.0, 0.0, 1.0));
-	// m_uniforms.modelMatrix = R1 * T1 * S;
-	// m_uniforms.time = t;
-	// wgpuQueueWriteBuffer(m_queue, m_uniformBuffer, 0 * m_uniformStride + offsetof(MyUniforms, modelMatrix), &m_uniforms.modelMatrix, sizeof(MyUniforms::modelMatrix));
-	// wgpuQueueWriteBuffer(m_queue, m_uniformBuffer, 1 * m_uniformStride + offsetof(MyUniforms, time), &t, sizeof(float));
-	
+void Application::drawShadowCasters(WGPURenderPassEncoder pass, bool staticCasters)
+{
+	// Transparent sub-meshes don't cast shadows, the rest casts solid (no alpha test in the depth-only pipeline)
+	drawPositions(pass, [staticCasters](const MeshRenderer& renderer) { return renderer.isStatic == staticCasters; },
+		[](const Material& material) { return !material.transparent; });
+}
 
-	// float viewZ = glm::mix(0.0f, 0.25f, cos(2 * PI * glfwGetTime() / 4) * 0.5 + 0.5);
-	// m_uniforms.viewMatrix = glm::lookAt(glm::vec3(-0.5f, -1.5f, viewZ + 0.25f), glm::vec3(0.0f), glm::vec3(0, 0, 1));
-	// wgpuQueueWriteBuffer(m_queue, m_uniformBuffer, offsetof(MyUniforms, viewMatrix), &m_uniforms.viewMatrix, sizeof(MyUniforms::viewMatrix));
+void Application::setViewport(WGPURenderPassEncoder pass, glm::uvec2 renderSize)
+{
+	// Pooled targets can be larger than what gets rendered
+	wgpuRenderPassEncoderSetViewport(pass, 0.0f, 0.0f, static_cast<float>(renderSize.x), static_cast<float>(renderSize.y), 0.0f, 1.0f);
+	wgpuRenderPassEncoderSetScissorRect(pass, 0, 0, renderSize.x, renderSize.y);
+}
 
-	// 1. Get textures from our surface
-	// auto [surfaceTexture, targetView] = getNextSurfaceViewData();
-	// if (!targetView) return;
+void Application::addScenePasses(RenderGraph::Handle colorTarget, glm::uvec2 renderSize, bool exactSize)
+{
+	RenderGraph& graph = m_renderGraph;
+	RenderGraph::Handle clusterLights = graph.ImportBuffer("Cluster lights", m_clusteredLighting.GetClusterBuffer());
+	RenderGraph::Handle shadowMap = graph.ImportTexture("Shadow map", m_cascadedShadows.GetShadowMapView());
+	RenderGraph::TextureDesc depthDesc;
+	depthDesc.width = renderSize.x;
+	depthDesc.height = renderSize.y;
+	depthDesc.format = m_depthTextureFormat;
+	depthDesc.usage = WGPUTextureUsage_RenderAttachment;
+	depthDesc.exactSize = exactSize;
+	RenderGraph::Handle depth = graph.CreateTexture("Scene depth", depthDesc);
+
+	// Bin the lights and render the shadow maps first, the main pass reads both (unless the shader variant doesn't, then they get culled)
+	graph.AddPass("Light culling", [this](WGPUCommandEncoder encoder) { m_clusteredLighting.Dispatch(encoder, m_gpuProfiler); })
+		.Write(clusterLights);
+	graph.AddPass("Shadows", [this](WGPUCommandEncoder encoder)
+	{
+		m_cascadedShadows.Render(encoder, m_gpuProfiler, [this](WGPURenderPassEncoder pass, bool staticCasters) { drawShadowCasters(pass, staticCasters); });
+	}).Write(shadowMap);
+	if (m_depthPrepassActive) {
+		graph.AddPass("Depth pre-pass", [this, depth, renderSize](WGPUCommandEncoder encoder) { encodeDepthPrepass(encoder, m_renderGraph.GetView(depth), renderSize); })
+			.Write(depth);
+	}
 
-	// 1. Get next available texture from swap chain
-	WGPUTextureView nextTexture = wgpuSwapChainGetCurrentTextureView(m_swapChain);
-	if (!nextTexture) {
-		SPDLOG_ERROR("Cannot acquire next swap chain texture.");
-		return;
+	RenderGraph::PassBuilder mainPass = graph.AddPass("Main", [this, colorTarget, depth, renderSize](WGPUCommandEncoder encoder)
+	{
+		encodeMainPass(encoder, m_renderGraph.GetView(colorTarget), m_renderGraph.GetView(depth), renderSize);
+	});
+	mainPass.Write(colorTarget).Write(depth);
+	if (m_depthPrepassActive) {
+		mainPass.Read(depth);
+	}
+	if (m_pointLightsEnabled && !m_clusteredLighting.IsBruteForce()) {
+		mainPass.Read(clusterLights);
 	}
+	if (m_cascadedShadows.IsEnabled()) {
+		mainPass.Read(shadowMap);
+	}
+}
 
-	// 2. Establish render pass & attachments
+void Application::encodeMainPass(WGPUCommandEncoder encoder, WGPUTextureView colorView, WGPUTextureView depthView, glm::uvec2 renderSize)
+{
 	WGPURenderPassColorAttachment colorAtt = {};
 	colorAtt.nextInChain = nullptr;
-	colorAtt.view = nextTexture;
+	colorAtt.view = colorView;
 	colorAtt.depthSlice = WGPU_DEPTH_SLICE_UNDEFINED;
 	colorAtt.resolveTarget = nullptr;
 	colorAtt.loadOp = WGPULoadOp_Clear;
@@ -1117,8 +2432,8 @@ void Application::MainLoop()
 	colorAtt.clearValue = WGPUColor{0.5, 0.5, 0.5, 1.0};
 
 	WGPURenderPassDepthStencilAttachment depthStencilAtt = {};
-	depthStencilAtt.view = m_depthTextureView;
-	depthStencilAtt.depthLoadOp = WGPULoadOp_Clear;
+	depthStencilAtt.view = depthView;
+	depthStencilAtt.depthLoadOp = m_depthPrepassActive ? WGPULoadOp_Load : WGPULoadOp_Clear;
 	depthStencilAtt.depthStoreOp = WGPUStoreOp_Store;
 	depthStencilAtt.depthClearValue = 1.0f; // The back plane of the Z-Buffer
 	depthStencilAtt.depthReadOnly = false;
@@ -1135,68 +2450,1126 @@ void Application::MainLoop()
 	renderPassDesc.colorAttachments = &colorAtt;
 	renderPassDesc.depthStencilAttachment = &depthStencilAtt;
 	renderPassDesc.occlusionQuerySet = nullptr;
-	renderPassDesc.timestampWrites = nullptr;
-	
-	// 3. Command encoder & render pass
+	renderPassDesc.timestampWrites = m_gpuProfiler.BeginRenderPass("Main");
+	if (m_countFragments) {
+		wgpuCommandEncoderClearBuffer(encoder, m_fragmentCountBuffer, 0, sizeof(uint32_t));
+	}
+	WGPURenderPassEncoder renderPassEncoder = wgpuCommandEncoderBeginRenderPass(encoder, &renderPassDesc);
+	setViewport(renderPassEncoder, renderSize); // Render bundles inherit it
+
+	// Static objects are replayed from this slot's bundle (recorded on first use after an invalidation)
+	if (m_useRenderBundles) {
+		WGPURenderBundle& bundle = m_staticBundles[m_frameSlot];
+		if (!bundle) {
+			bundle = recordStaticBundle(m_frameSlot);
+		}
+		wgpuRenderPassEncoderExecuteBundles(renderPassEncoder, 1, &bundle);
+	}
+
+	// Issue the per-frame draw calls (ExecuteBundles resets the pass state, so this comes after)
+	RenderQueue::StateChanges stateChanges = m_useRenderBundles ? m_bundleStateChanges : RenderQueue::StateChanges{};
+	m_drawInstances.resize(m_staticDrawInstanceCount); // This frame's records after the bundle's (written before the submit, like the objects)
+	encodeRenderQueue(renderPassEncoder, m_renderQueue, m_frameSlot, stateChanges);
+	uploadDrawInstances(m_staticDrawInstanceCount);
+	m_mainPassStateChanges = stateChanges;
+	Stats::Add(Stats::Counter::DrawCalls, stateChanges.draws);
+	Stats::Add(Stats::Counter::Instances, m_instanceCount);
+	Stats::Add(Stats::Counter::Triangles, m_instanceCount * (m_vertexCount / 3));
+	Stats::Add(Stats::Counter::PipelineChanges, stateChanges.pipelines);
+	Stats::Add(Stats::Counter::BindGroupChanges, stateChanges.bindGroups);
+
+	wgpuRenderPassEncoderEnd(renderPassEncoder);
+	wgpuRenderPassEncoderRelease(renderPassEncoder);
+	if (m_countFragments) {
+		wgpuCommandEncoderCopyBufferToBuffer(encoder, m_fragmentCountBuffer, 0, m_fragmentCountReadbackBuffer, 0, sizeof(uint32_t));
+	}
+}
+
+void Application::encodeDearImGuiPass(WGPUCommandEncoder encoder, WGPUTextureView colorView)
+{
+	WGPURenderPassColorAttachment uiColorAtt = {};
+	uiColorAtt.nextInChain = nullptr;
+	uiColorAtt.view = colorView;
+	uiColorAtt.depthSlice = WGPU_DEPTH_SLICE_UNDEFINED;
+	uiColorAtt.resolveTarget = nullptr;
+	uiColorAtt.loadOp = WGPULoadOp_Load;
+	uiColorAtt.storeOp = WGPUStoreOp_Store;
+	uiColorAtt.clearValue = WGPUColor{0.0, 0.0, 0.0, 1.0};
+
+	WGPURenderPassDescriptor uiPassDesc = {};
+	uiPassDesc.nextInChain = nullptr;
+	uiPassDesc.label = "Dear ImGui render pass";
+	uiPassDesc.colorAttachmentCount = 1;
+	uiPassDesc.colorAttachments = &uiColorAtt;
+	uiPassDesc.depthStencilAttachment = nullptr;
+	uiPassDesc.occlusionQuerySet = nullptr;
+	uiPassDesc.timestampWrites = m_gpuProfiler.BeginRenderPass("ImGui");
+	WGPURenderPassEncoder uiPassEncoder = wgpuCommandEncoderBeginRenderPass(encoder, &uiPassDesc);
+	updateDearImGui(uiPassEncoder);
+	wgpuRenderPassEncoderEnd(uiPassEncoder);
+	wgpuRenderPassEncoderRelease(uiPassEncoder);
+}
+
+bool Application::captureScene(std::vector<uint8_t>& pixels, uint32_t& width, uint32_t& height)
+{
+	TRACE_ZONE("CaptureScene");
+	int framebufferWidth, framebufferHeight;
+	glfwGetFramebufferSize(m_glfwWindow, &framebufferWidth, &framebufferHeight);
+	width = static_cast<uint32_t>(framebufferWidth);
+	height = static_cast<uint32_t>(framebufferHeight);
+	if (width == 0 || height == 0) {
+		return false;
+	}
+	buildRenderQueue(); // Picks up shader feature changes since the last frame
+	updateViewUniforms({width, height}); // Always native resolution
+
+	// Same format as the swap chain so the pipelines and bundles can draw into it
+	WGPUTextureDescriptor textureDesc = {};
+	textureDesc.nextInChain = nullptr;
+	textureDesc.label = "Capture target";
+	textureDesc.usage = WGPUTextureUsage_RenderAttachment | WGPUTextureUsage_CopySrc;
+	textureDesc.dimension = WGPUTextureDimension_2D;
+	textureDesc.size = {width, height, 1};
+	textureDesc.format = m_swapChainFormat;
+	textureDesc.mipLevelCount = 1;
+	textureDesc.sampleCount = 1;
+	textureDesc.viewFormatCount = 0;
+	textureDesc.viewFormats = nullptr;
+	WGPUTexture texture = wgpuDeviceCreateTexture(m_device, &textureDesc);
+	WGPUTextureView textureView = wgpuTextureCreateView(texture, nullptr);
+
+	// Rows of a texture copy have to be 256 byte aligned
+	uint32_t bytesPerRow = ceilToNextMultiple(4 * width, 256);
+	WGPUBufferDescriptor bufferDesc = {};
+	bufferDesc.nextInChain = nullptr;
+	bufferDesc.label = "Capture readback buffer";
+	bufferDesc.usage = WGPUBufferUsage_CopyDst | WGPUBufferUsage_MapRead;
+	bufferDesc.size = static_cast<uint64_t>(bytesPerRow) * height;
+	bufferDesc.mappedAtCreation = false;
+	WGPUBuffer readbackBuffer = wgpuDeviceCreateBuffer(m_device, &bufferDesc);
+
 	WGPUCommandEncoderDescriptor cmdEncoderDesc = {};
 	cmdEncoderDesc.nextInChain = nullptr;
-	cmdEncoderDesc.label = "Main command encoder";
+	cmdEncoderDesc.label = "Capture command encoder";
 	WGPUCommandEncoder cmdEncoder = wgpuDeviceCreateCommandEncoder(m_device, &cmdEncoderDesc);
-	WGPURenderPassEncoder renderPassEncoder = wgpuCommandEncoderBeginRenderPass(cmdEncoder, &renderPassDesc);
+	m_renderGraph.Reset();
+	RenderGraph::Handle captureTarget = m_renderGraph.ImportTexture("Capture target", textureView);
+	m_renderGraph.MarkOutput(captureTarget);
+	addScenePasses(captureTarget, {width, height}, true);
+	m_renderGraph.Compile();
+	m_renderGraph.Execute(cmdEncoder);
+
+	WGPUImageCopyTexture source = {};
+	source.nextInChain = nullptr;
+	source.texture = texture;
+	source.mipLevel = 0;
+	source.origin = {0, 0, 0};
+	source.aspect = WGPUTextureAspect_All;
+	WGPUImageCopyBuffer destination = {};
+	destination.nextInChain = nullptr;
+	destination.buffer = readbackBuffer;
+	destination.layout.nextInChain = nullptr;
+	destination.layout.offset = 0;
+	destination.layout.bytesPerRow = bytesPerRow;
+	destination.layout.rowsPerImage = height;
+	wgpuCommandEncoderCopyTextureToBuffer(cmdEncoder, &source, &destination, &textureDesc.size);
 
-	// Issue draw calls starting here
-	wgpuRenderPassEncoderSetPipeline(renderPassEncoder, m_pipeline);
+	WGPUCommandBufferDescriptor cmdBuffDesc = {};
+	cmdBuffDesc.nextInChain = nullptr;
+	cmdBuffDesc.label = "Capture command buffer";
+	WGPUCommandBuffer cmdBuff = wgpuCommandEncoderFinish(cmdEncoder, &cmdBuffDesc);
+	wgpuCommandEncoderRelease(cmdEncoder);
+	wgpuQueueSubmit(m_queue, 1, &cmdBuff);
+	wgpuCommandBufferRelease(cmdBuff);
 
-	// Set vertex buffer while encoding the render pass
-	wgpuRenderPassEncoderSetVertexBuffer(renderPassEncoder, 0, m_vertexBuffer, 0, m_vertexData.size() * sizeof(VertexAttributes));
-	// wgpuRenderPassEncoderSetIndexBuffer(renderPassEncoder, m_indexBuffer, WGPUIndexFormat_Uint16, 0, wgpuBufferGetSize(m_indexBuffer));
+	// Block until mapped
+	struct MapState
+	{
+		bool done = false;
+		bool success = false;
+	};
+	MapState mapState;
+	auto onMapped = [](WGPUBufferMapAsyncStatus status, void* pUserData)
+	{
+		MapState& mapState = *reinterpret_cast<MapState*>(pUserData);
+		mapState.success = status == WGPUBufferMapAsyncStatus_Success;
+		mapState.done = true;
+	};
+	wgpuBufferMapAsync(readbackBuffer, WGPUMapMode_Read, 0, bufferDesc.size, onMapped, (void*)&mapState);
+	while (!mapState.done) {
+		wgpuInstanceProcessEvents(m_instance);
+		wgpuDeviceTick(m_device);
+	}
 
-	// Set binding group here!
-	uint32_t dynamicOffset = 0 * m_uniformStride;
-	wgpuRenderPassEncoderSetBindGroup(renderPassEncoder, 0, m_bindGroup, 0, &dynamicOffset); // TODO: Change the dynamics later
-	// wgpuRenderPassEncoderDrawIndexed(renderPassEncoder, m_indexCount, 1, 0, 0, 0);
-	wgpuRenderPassEncoderDraw(renderPassEncoder, m_vertexCount, 1, 0, 0);
+	if (mapState.success) {
+		const uint8_t* mapped = reinterpret_cast<const uint8_t*>(wgpuBufferGetConstMappedRange(readbackBuffer, 0, bufferDesc.size));
+		pixels.resize(4ull * width * height);
+		for (uint32_t y = 0; y < height; ++y) {
+			std::copy(mapped + y * bytesPerRow, mapped + y * bytesPerRow + 4 * width, pixels.data() + 4ull * y * width);
+		}
+		wgpuBufferUnmap(readbackBuffer);
+	} else {
+		SPDLOG_ERROR("Could not map the capture readback buffer.");
+	}
 
-	// For Dear ImGui
-	updateDearImGui(renderPassEncoder);
-	
-	// Leave out for now
-	// dynamicOffset = 1 * m_uniformStride;
-	// wgpuRenderPassEncoderSetBindGroup(renderPassEncoder, 0, m_bindGroup, 1, &dynamicOffset);
-	// wgpuRenderPassEncoderDrawIndexed(renderPassEncoder, m_indexCount, 1, 0, 0, 0);
+	wgpuBufferDestroy(readbackBuffer);
+	wgpuBufferRelease(readbackBuffer);
+	wgpuTextureViewRelease(textureView);
+	wgpuTextureDestroy(texture);
+	wgpuTextureRelease(texture);
+	return mapState.success;
+}
+
+void Application::encodeViewPass(WGPUCommandEncoder encoder, WGPUTextureView colorView, WGPUTextureView depthView, glm::uvec2 size, uint32_t slot)
+{
+	WGPURenderPassColorAttachment colorAtt = {};
+	colorAtt.nextInChain = nullptr;
+	colorAtt.view = colorView;
+	colorAtt.depthSlice = WGPU_DEPTH_SLICE_UNDEFINED;
+	colorAtt.resolveTarget = nullptr;
+	colorAtt.loadOp = WGPULoadOp_Clear;
+	colorAtt.storeOp = WGPUStoreOp_Store;
+	colorAtt.clearValue = WGPUColor{0.5, 0.5, 0.5, 1.0};
+
+	WGPURenderPassDepthStencilAttachment depthStencilAtt = {};
+	depthStencilAtt.view = depthView;
+	depthStencilAtt.depthLoadOp = WGPULoadOp_Clear;
+	depthStencilAtt.depthStoreOp = WGPUStoreOp_Discard; // Only the color gets read back
+	depthStencilAtt.depthClearValue = 1.0f;
+	depthStencilAtt.depthReadOnly = false;
+	depthStencilAtt.stencilLoadOp = WGPULoadOp_Undefined;
+	depthStencilAtt.stencilStoreOp = WGPUStoreOp_Undefined;
+	depthStencilAtt.stencilClearValue = 0;
+	depthStencilAtt.stencilReadOnly = true;
+
+	WGPURenderPassDescriptor renderPassDesc = {};
+	renderPassDesc.nextInChain = nullptr;
+	renderPassDesc.label = "Turntable view pass";
+	renderPassDesc.colorAttachmentCount = 1;
+	renderPassDesc.colorAttachments = &colorAtt;
+	renderPassDesc.depthStencilAttachment = &depthStencilAtt;
+	renderPassDesc.occlusionQuerySet = nullptr;
+	renderPassDesc.timestampWrites = nullptr;
+	WGPURenderPassEncoder renderPassEncoder = wgpuCommandEncoderBeginRenderPass(encoder, &renderPassDesc);
+	setViewport(renderPassEncoder, size);
+
+	// Every view draws the same queue, so they write (and share) the same draw instance records
+	RenderQueue::StateChanges stateChanges;
+	m_drawInstances.clear();
+	encodeRenderQueue(renderPassEncoder, m_renderQueue, slot, stateChanges);
+	Stats::Add(Stats::Counter::DrawCalls, stateChanges.draws);
+	Stats::Add(Stats::Counter::PipelineChanges, stateChanges.pipelines);
+	Stats::Add(Stats::Counter::BindGroupChanges, stateChanges.bindGroups);
 
 	wgpuRenderPassEncoderEnd(renderPassEncoder);
 	wgpuRenderPassEncoderRelease(renderPassEncoder);
+}
+
+float Application::RenderTurntable(const std::filesystem::path& directory, uint32_t viewCount, uint32_t size, uint32_t batchSize)
+{
+	TRACE_ZONE("RenderTurntable");
+	constexpr uint32_t BATCH_BUFFERING = 2; // The next batch renders while the last one is read back and written out
+	constexpr float FOV = 45 * PI / 180;
+	constexpr float ELEVATION = 25 * PI / 180;
+	if (viewCount == 0 || size == 0) {
+		return 0.0f;
+	}
+	batchSize = std::clamp(batchSize, 1u, std::min(viewCount, MAX_BATCH_VIEWS));
+	std::error_code error;
+	if (!directory.empty() && !std::filesystem::create_directories(directory, error) && error) {
+		SPDLOG_ERROR("Could not create \"{}\": {}", directory.string(), error.message());
+		return 0.0f;
+	}
+
+	// The views of a submission share the light and shadow buffers, so only lighting that doesn't follow the camera is left:
+	// no shadow cascades and every point light for every fragment
+	bool previousShadows = m_cascadedShadows.IsEnabled();
+	bool previousBruteForce = m_clusteredLighting.IsBruteForce();
+	bool previousBundles = m_useRenderBundles;
+	DepthPrepassMode previousPrepassMode = m_depthPrepassMode;
+	MyUniforms previousUniforms = m_uniforms;
+	m_cascadedShadows.SetEnabled(false);
+	m_clusteredLighting.SetBruteForce(true);
+	m_useRenderBundles = false; // The bundles have the frame slots baked in
+	m_depthPrepassMode = DepthPrepassMode::Off;
+
+	// An orbit that keeps the whole model in view
+	glm::vec3 center = glm::vec3(m_uniforms.modelMatrix * glm::vec4(m_meshCenter, 1.0f));
+	float radius = m_meshRadius * maxAxisScale(m_uniforms.modelMatrix);
+	float distance = 1.05f * radius / std::sin(0.5f * FOV);
+	m_uniforms.projectionMatrix = glm::perspective(FOV, 1.0f, 0.01f * distance, distance + 2.0f * radius);
+	auto getViewMatrix = [&](uint32_t view)
+	{
+		float azimuth = 2 * PI * view / viewCount;
+		glm::vec3 direction = {std::cos(ELEVATION) * std::cos(azimuth), std::cos(ELEVATION) * std::sin(azimuth), std::sin(ELEVATION)};
+		return glm::lookAt(center + distance * direction, center, glm::vec3(0, 0, 1));
+	};
+	m_uniforms.viewMatrix = getViewMatrix(0);
+	uploadObjects();
+	buildRenderQueue(); // Drawn from every angle, only the order of transparent draws is for the first view
+
+	// The views of a batch go to the layers of one texture array, read back with a single copy
+	WGPUTextureDescriptor textureDesc = {};
+	textureDesc.nextInChain = nullptr;
+	textureDesc.label = "Turntable views";
+	textureDesc.usage = WGPUTextureUsage_RenderAttachment | WGPUTextureUsage_CopySrc;
+	textureDesc.dimension = WGPUTextureDimension_2D;
+	textureDesc.size = {size, size, batchSize};
+	textureDesc.format = m_swapChainFormat; // What the pipelines draw into
+	textureDesc.mipLevelCount = 1;
+	textureDesc.sampleCount = 1;
+	textureDesc.viewFormatCount = 0;
+	textureDesc.viewFormats = nullptr;
+	// Every view gets its own depth buffer in the render graph, their lifetimes don't overlap so they all end up in one texture
+	RenderGraph::TextureDesc depthDesc;
+	depthDesc.width = size;
+	depthDesc.height = size;
+	depthDesc.format = m_depthTextureFormat;
+	depthDesc.usage = WGPUTextureUsage_RenderAttachment;
+	depthDesc.exactSize = true;
+	uint32_t bytesPerRow = ceilToNextMultiple(4 * size, 256);
+	uint64_t layerBytes = static_cast<uint64_t>(bytesPerRow) * size;
+	uint64_t targetBytes = 4ull * size * size * batchSize * BATCH_BUFFERING;
+	Stats::TrackGpuMemory(Stats::MemoryCategory::RenderTargets, targetBytes);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::Readbacks, layerBytes * batchSize * BATCH_BUFFERING);
+
+	struct Batch
+	{
+		WGPUTexture texture = nullptr;
+		std::vector<WGPUTextureView> layerViews;
+		WGPUBuffer readbackBuffer = nullptr;
+		uint32_t firstView = 0;
+		uint32_t viewCount = 0; // 0 when nothing is in flight
+		bool mapped = false;
+		bool success = false;
+	};
+	std::array<Batch, BATCH_BUFFERING> batches;
+	for (Batch& batch : batches) {
+		batch.texture = wgpuDeviceCreateTexture(m_device, &textureDesc);
+		for (uint32_t layer = 0; layer < batchSize; ++layer) {
+			WGPUTextureViewDescriptor viewDesc = {};
+			viewDesc.nextInChain = nullptr;
+			viewDesc.label = "Turntable view";
+			viewDesc.format = textureDesc.format;
+			viewDesc.dimension = WGPUTextureViewDimension_2D;
+			viewDesc.baseMipLevel = 0;
+			viewDesc.mipLevelCount = 1;
+			viewDesc.baseArrayLayer = layer;
+			viewDesc.arrayLayerCount = 1;
+			viewDesc.aspect = WGPUTextureAspect_All;
+			batch.layerViews.push_back(wgpuTextureCreateView(batch.texture, &viewDesc));
+		}
+		WGPUBufferDescriptor bufferDesc = {};
+		bufferDesc.nextInChain = nullptr;
+		bufferDesc.label = "Turntable readback buffer";
+		bufferDesc.usage = WGPUBufferUsage_CopyDst | WGPUBufferUsage_MapRead;
+		bufferDesc.size = layerBytes * batchSize;
+		bufferDesc.mappedAtCreation = false;
+		batch.readbackBuffer = wgpuDeviceCreateBuffer(m_device, &bufferDesc);
+	}
 
+	// Waits for a batch's readback, then converts and writes its views on the job system
+	bool bgra = m_swapChainFormat == WGPUTextureFormat_BGRA8Unorm;
+	auto finishBatch = [&](Batch& batch)
+	{
+		TRACE_ZONE("RenderTurntable::finishBatch");
+		while (!batch.mapped) {
+			wgpuInstanceProcessEvents(m_instance);
+			wgpuDeviceTick(m_device);
+		}
+		if (!batch.success) {
+			SPDLOG_ERROR("Could not map the turntable readback buffer.");
+		} else {
+			const uint8_t* mapped = reinterpret_cast<const uint8_t*>(wgpuBufferGetConstMappedRange(batch.readbackBuffer, 0, layerBytes * batch.viewCount));
+			if (!directory.empty()) {
+				JobSystem::ParallelFor(batch.viewCount, 1, [&](uint32_t begin, uint32_t end)
+				{
+					std::vector<uint8_t> pixels(4ull * size * size);
+					for (uint32_t layer = begin; layer < end; ++layer) {
+						for (uint32_t y = 0; y < size; ++y) {
+							const uint8_t* src = mapped + layer * layerBytes + static_cast<uint64_t>(y) * bytesPerRow;
+							uint8_t* dst = pixels.data() + 4ull * y * size;
+							for (uint32_t x = 0; x < size; ++x) {
+								dst[4 * x + 0] = src[4 * x + (bgra ? 2 : 0)];
+								dst[4 * x + 1] = src[4 * x + 1];
+								dst[4 * x + 2] = src[4 * x + (bgra ? 0 : 2)];
+								dst[4 * x + 3] = src[4 * x + 3];
+							}
+						}
+						char name[32];
+						snprintf(name, sizeof(name), "view_%03u.png", batch.firstView + layer);
+						ResourceManager::SavePng(directory / name, pixels.data(), size, size);
+					}
+				});
+			}
+			wgpuBufferUnmap(batch.readbackBuffer);
+		}
+		batch.viewCount = 0;
+	};
+
+	double start = glfwGetTime();
+	uint32_t submissionCount = 0;
+	for (uint32_t firstView = 0; firstView < viewCount; firstView += batchSize) {
+		Batch& batch = batches[submissionCount % BATCH_BUFFERING];
+		if (batch.viewCount > 0) {
+			finishBatch(batch); // Submitted BATCH_BUFFERING batches ago, most likely done by now
+		}
+		batch.firstView = firstView;
+		batch.viewCount = std::min(batchSize, viewCount - firstView);
+
+		// Each view has its own uniform slot. The writes land between the previous submission and this one
+		for (uint32_t i = 0; i < batch.viewCount; ++i) {
+			m_uniforms.viewMatrix = getViewMatrix(firstView + i);
+			wgpuQueueWriteBuffer(m_queue, m_uniformBuffer, (MAX_FRAMES_IN_FLIGHT + i) * m_uniformStride, &m_uniforms, sizeof(MyUniforms));
+		}
+		Stats::Add(Stats::Counter::BytesUploaded, batch.viewCount * sizeof(MyUniforms));
+
+		WGPUCommandEncoderDescriptor cmdEncoderDesc = {};
+		cmdEncoderDesc.nextInChain = nullptr;
+		cmdEncoderDesc.label = "Turntable command encoder";
+		WGPUCommandEncoder cmdEncoder = wgpuDeviceCreateCommandEncoder(m_device, &cmdEncoderDesc);
+		m_renderGraph.Reset();
+		for (uint32_t i = 0; i < batch.viewCount; ++i) {
+			RenderGraph::Handle color = m_renderGraph.ImportTexture("Turntable view", batch.layerViews[i]);
+			RenderGraph::Handle depth = m_renderGraph.CreateTexture("Turntable depth", depthDesc);
+			m_renderGraph.MarkOutput(color);
+			m_renderGraph.AddPass("Turntable view", [this, color, depth, size, i](WGPUCommandEncoder encoder)
+			{
+				encodeViewPass(encoder, m_renderGraph.GetView(color), m_renderGraph.GetView(depth), {size, size}, MAX_FRAMES_IN_FLIGHT + i);
+			}).Write(color).Write(depth);
+		}
+		m_renderGraph.Compile();
+		m_renderGraph.Execute(cmdEncoder);
+		uploadDrawInstances(0);
+
+		WGPUImageCopyTexture source = {};
+		source.nextInChain = nullptr;
+		source.texture = batch.texture;
+		source.mipLevel = 0;
+		source.origin = {0, 0, 0};
+		source.aspect = WGPUTextureAspect_All;
+		WGPUImageCopyBuffer destination = {};
+		destination.nextInChain = nullptr;
+		destination.buffer = batch.readbackBuffer;
+		destination.layout.nextInChain = nullptr;
+		destination.layout.offset = 0;
+		destination.layout.bytesPerRow = bytesPerRow;
+		destination.layout.rowsPerImage = size;
+		WGPUExtent3D copySize = {size, size, batch.viewCount};
+		wgpuCommandEncoderCopyTextureToBuffer(cmdEncoder, &source, &destination, &copySize);
+
+		WGPUCommandBufferDescriptor cmdBuffDesc = {};
+		cmdBuffDesc.nextInChain = nullptr;
+		cmdBuffDesc.label = "Turntable command buffer";
+		WGPUCommandBuffer cmdBuff = wgpuCommandEncoderFinish(cmdEncoder, &cmdBuffDesc);
+		wgpuCommandEncoderRelease(cmdEncoder);
+		wgpuQueueSubmit(m_queue, 1, &cmdBuff);
+		wgpuCommandBufferRelease(cmdBuff);
+		++submissionCount;
+
+		auto onMapped = [](WGPUBufferMapAsyncStatus status, void* pUserData)
+		{
+			Batch& batch = *reinterpret_cast<Batch*>(pUserData);
+			batch.success = status == WGPUBufferMapAsyncStatus_Success;
+			batch.mapped = true;
+		};
+		batch.mapped = false;
+		wgpuBufferMapAsync(batch.readbackBuffer, WGPUMapMode_Read, 0, layerBytes * batch.viewCount, onMapped, (void*)&batch);
+	}
+	// The rest, oldest first
+	for (uint32_t i = 0; i < BATCH_BUFFERING; ++i) {
+		Batch& batch = batches[(submissionCount + i) % BATCH_BUFFERING];
+		if (batch.viewCount > 0) {
+			finishBatch(batch);
+		}
+	}
+	float seconds = static_cast<float>(glfwGetTime() - start);
+	float viewsPerSecond = viewCount / std::max(seconds, 1e-6f);
+	SPDLOG_INFO("Rendered {} views of {}x{} in {} submissions ({} views each): {:.1f} views/s", viewCount, size, size, submissionCount, batchSize, viewsPerSecond);
+
+	for (Batch& batch : batches) {
+		for (WGPUTextureView view : batch.layerViews) {
+			wgpuTextureViewRelease(view);
+		}
+		wgpuTextureDestroy(batch.texture);
+		wgpuTextureRelease(batch.texture);
+		wgpuBufferDestroy(batch.readbackBuffer);
+		wgpuBufferRelease(batch.readbackBuffer);
+	}
+	Stats::TrackGpuMemory(Stats::MemoryCategory::RenderTargets, -static_cast<int64_t>(targetBytes));
+	Stats::TrackGpuMemory(Stats::MemoryCategory::Readbacks, -static_cast<int64_t>(layerBytes * batchSize * BATCH_BUFFERING));
+
+	// Back to the interactive settings (the draw instance records of the bundles got overwritten)
+	m_uniforms = previousUniforms;
+	m_cascadedShadows.SetEnabled(previousShadows);
+	m_clusteredLighting.SetBruteForce(previousBruteForce);
+	m_useRenderBundles = previousBundles;
+	m_depthPrepassMode = previousPrepassMode;
+	invalidateStaticBundles();
+	return viewsPerSecond;
+}
+
+void Application::RunTurntableBenchmark()
+{
+	constexpr uint32_t VIEW_COUNT = 64;
+	constexpr uint32_t SIZE = 256;
+	RenderTurntable({}, VIEW_COUNT, SIZE, 1); // Warm-up, compiles the pipeline variant
+
+	// Without writing files, so it's rendering and readback only
+	float oneByOne = 0.0f;
+	for (uint32_t batchSize : {1u, 4u, 16u, 64u}) {
+		float viewsPerSecond = RenderTurntable({}, VIEW_COUNT, SIZE, batchSize);
+		if (batchSize == 1) {
+			oneByOne = viewsPerSecond;
+		}
+		SPDLOG_INFO("Turntable batch of {}: {:.1f} views/s, {:.2f}x one view per submission", batchSize, viewsPerSecond, viewsPerSecond / std::max(oneByOne, 1e-6f));
+
+		// The graph of the last batch: one depth buffer per view, aliased into one texture
+		const RenderGraph::FrameReport& report = m_renderGraph.GetReport();
+		SPDLOG_INFO("  {} transient depth buffers in {} textures, {:.2f} MB instead of {:.2f} MB", report.transientCount, report.physicalCount,
+			report.peakBytes / (1024.0 * 1024.0), report.unaliasedBytes / (1024.0 * 1024.0));
+		if (batchSize > 1 && report.peakBytes >= report.unaliasedBytes) {
+			SPDLOG_ERROR("Render graph aliasing didn't reduce the transient memory of the turntable batch.");
+		}
+	}
+}
+
+uint32_t Application::countMainPassFragments()
+{
+	// The capture picks the counting pipelines up (and blocks until the GPU is done, so the copied count is ready as well)
+	std::vector<uint8_t> pixels;
+	uint32_t width = 0, height = 0;
+	m_countFragments = true;
+	bool captured = captureScene(pixels, width, height);
+	m_countFragments = false;
+	if (!captured) {
+		return 0;
+	}
+
+	struct MapState
+	{
+		bool done = false;
+		bool success = false;
+	};
+	MapState mapState;
+	auto onMapped = [](WGPUBufferMapAsyncStatus status, void* pUserData)
+	{
+		MapState& mapState = *reinterpret_cast<MapState*>(pUserData);
+		mapState.success = status == WGPUBufferMapAsyncStatus_Success;
+		mapState.done = true;
+	};
+	wgpuBufferMapAsync(m_fragmentCountReadbackBuffer, WGPUMapMode_Read, 0, sizeof(uint32_t), onMapped, (void*)&mapState);
+	while (!mapState.done) {
+		wgpuInstanceProcessEvents(m_instance);
+		wgpuDeviceTick(m_device);
+	}
+	uint32_t count = 0;
+	if (mapState.success) {
+		count = *reinterpret_cast<const uint32_t*>(wgpuBufferGetConstMappedRange(m_fragmentCountReadbackBuffer, 0, sizeof(uint32_t)));
+		wgpuBufferUnmap(m_fragmentCountReadbackBuffer);
+	}
+	return count;
+}
+
+void Application::MainLoop()
+{
+	TRACE_ZONE("MainLoop");
+
+	uint64_t phaseStart = Trace::Now();
+	if (m_redrawMode == RedrawMode::OnDemand && m_redrawFrames == 0) {
+		// Nothing is dirty, so sleep until an input event (or the timeout) wakes us up
+		double waitStart = glfwGetTime();
+		glfwWaitEventsTimeout(IDLE_WAIT_TIMEOUT);
+		double waited = glfwGetTime() - waitStart;
+		m_idleTime += waited;
+		m_frameFollowsIdle = true;
+		if (waited < IDLE_WAIT_TIMEOUT) {
+			requestRedraw(); // Woken up by an event (keys and hovering only go through Dear ImGui)
+		}
+	} else {
+		glfwPollEvents();
+	}
+	wgpuInstanceProcessEvents(m_instance);
+	wgpuDeviceTick(m_device);
+	updateIdleStats();
+	endPhase("Events", Stats::Phase::Events, phaseStart);
+
+	// Physics (a sleeping scene would not move anyway)
+	if (!Physics::GetWorld().IsAtRest()) {
+		phaseStart = Trace::Now();
+		Physics::Step();
+		syncRigidBodies();
+		endPhase("Physics", Stats::Phase::Physics, phaseStart);
+		requestRedraw();
+	}
+
+	// Streams in the tiles the last frames asked for (before the on-demand check, feedback arrives after the frame)
+	if (m_virtualTextures.Update()) {
+		requestRedraw();
+	}
+
+	// Cells around the camera, as much as fits in the streaming budget
+	if (m_worldStreamer.IsOpen()) {
+		phaseStart = Trace::Now();
+		if (m_worldStreamer.Update(getCameraPosition())) {
+			requestRedraw();
+		}
+		endPhase("Streaming", Stats::Phase::Streaming, phaseStart);
+	}
+
+	if (m_redrawMode == RedrawMode::OnDemand) {
+		if (m_redrawFrames == 0) {
+			return;
+		}
+		--m_redrawFrames;
+	}
+
+	m_frameSlot = static_cast<uint32_t>(m_frameNumber % MAX_FRAMES_IN_FLIGHT);
+	waitForFrameSlot(m_frameSlot);
+
+	// Updates!
+	phaseStart = Trace::Now();
+	updateDragInertia();
+	updateLightingUniforms();
+	uploadObjects();
+	buildRenderQueue();
+	// Scene resolution for this frame, from the latest GPU timings
+	int framebufferWidth, framebufferHeight;
+	glfwGetFramebufferSize(m_glfwWindow, &framebufferWidth, &framebufferHeight);
+	glm::uvec2 framebufferSize = {static_cast<uint32_t>(framebufferWidth), static_cast<uint32_t>(framebufferHeight)};
+	m_dynamicResolution.Update(m_gpuProfiler.GetTotalMs());
+	glm::uvec2 renderSize = m_dynamicResolution.GetRenderSize(framebufferSize);
+	bool upscale = renderSize != framebufferSize;
+	updateViewUniforms(renderSize);
+
+	// The slot is no longer read by the GPU, so it can be overwritten
+	m_uniforms.frame = static_cast<uint32_t>(m_frameNumber);
+	wgpuQueueWriteBuffer(m_queue, m_uniformBuffer, m_frameSlot * m_uniformStride, &m_uniforms, sizeof(MyUniforms));
+	Stats::Add(Stats::Counter::BytesUploaded, sizeof(MyUniforms));
+	endPhase("Update", Stats::Phase::Update, phaseStart);
+
+	// 0. Update buffers (only upload time to MyUniforms, which is the first 4 bytes)
+	// TODO: Optimize
+	// float t = static_cast<float>(glfwGetTime());
+	// glm::mat4x4 S = glm::scale(glm::mat4x4(1.0), glm::vec3(0.3f));
+	// glm::mat4x4 T1 = glm::translate(glm::mat4x4(1.0), glm::vec3(0.5, 0.0, 0.0));
+	// glm::mat4x4 R1 = glm::rotate(glm::mat4x4(1.0), t, glm::vec3(0.0, 0.0, 1.0));
+	// m_uniforms.modelMatrix = R1 * T1 * S;
+	// m_uniforms.time = t;
+	// wgpuQueueWriteBuffer(m_queue, m_uniformBuffer, 0 * m_uniformStride + offsetof(MyUniforms, modelMatrix), &m_uniforms.modelMatrix, sizeof(MyUniforms::modelMatrix));
+	// wgpuQueueWriteBuffer(m_queue, m_uniformBuffer, 1 * m_uniformStride + offsetof(MyUniforms, time), &t, sizeof(float));
+	
+
+	// float viewZ = glm::mix(0.0f, 0.25f, cos(2 * PI * glfwGetTime() / 4) * 0.5 + 0.5);
+	// m_uniforms.viewMatrix = glm::lookAt(glm::vec3(-0.5f, -1.5f, viewZ + 0.25f), glm::vec3(0.0f), glm::vec3(0, 0, 1));
+	// wgpuQueueWriteBuffer(m_queue, m_uniformBuffer, offsetof(MyUniforms, viewMatrix), &m_uniforms.viewMatrix, sizeof(MyUniforms::viewMatrix));
+
+	// 1. Get textures from our surface
+	// auto [surfaceTexture, targetView] = getNextSurfaceViewData();
+	// if (!targetView) return;
+
+	// 1. Get next available texture from swap chain
+	phaseStart = Trace::Now();
+	WGPUTextureView nextTexture = wgpuSwapChainGetCurrentTextureView(m_swapChain);
+	endPhase("AcquireSurface", Stats::Phase::AcquireSurface, phaseStart);
+	if (!nextTexture) {
+		SPDLOG_ERROR("Cannot acquire next swap chain texture.");
+		return;
+	}
+
+	phaseStart = Trace::Now();
+
+	// 2. Command encoder
+	WGPUCommandEncoderDescriptor cmdEncoderDesc = {};
+	cmdEncoderDesc.nextInChain = nullptr;
+	cmdEncoderDesc.label = "Main command encoder";
+	WGPUCommandEncoder cmdEncoder = wgpuDeviceCreateCommandEncoder(m_device, &cmdEncoderDesc);
+	m_gpuProfiler.BeginFrame();
+
+	// 3. The frame graph: light culling, shadows & the main render pass (straight into the swap chain at native resolution), upscale, UI
+	m_renderGraph.Reset();
+	RenderGraph::Handle backbuffer = m_renderGraph.ImportTexture("Swap chain", nextTexture);
+	m_renderGraph.MarkOutput(backbuffer);
+	RenderGraph::Handle sceneColor = backbuffer;
+	if (upscale) {
+		RenderGraph::TextureDesc colorDesc;
+		colorDesc.width = renderSize.x;
+		colorDesc.height = renderSize.y;
+		colorDesc.format = m_swapChainFormat;
+		colorDesc.usage = WGPUTextureUsage_RenderAttachment | WGPUTextureUsage_TextureBinding;
+		sceneColor = m_renderGraph.CreateTexture("Scene color", colorDesc);
+	}
+	addScenePasses(sceneColor, renderSize, !upscale);
+	if (upscale) {
+		m_renderGraph.AddPass("Upscale", [this, sceneColor, backbuffer, renderSize](WGPUCommandEncoder encoder)
+		{
+			m_dynamicResolution.Upscale(encoder, m_gpuProfiler, *m_renderGraph.GetTarget(sceneColor), renderSize, m_renderGraph.GetView(backbuffer));
+		}).Read(sceneColor).Write(backbuffer);
+	}
+	// Dear ImGui gets its own pass (on top of the scene, no depth) so it can be timed separately
+	m_renderGraph.AddPass("ImGui", [this, backbuffer](WGPUCommandEncoder encoder) { encodeDearImGuiPass(encoder, m_renderGraph.GetView(backbuffer)); })
+		.Read(backbuffer)
+		.Write(backbuffer);
+	m_renderGraph.Compile();
+	m_renderGraph.Execute(cmdEncoder);
+
+	// Recording copies the final image (UI included) out of the swap chain, it's read back a few frames later
+	if (m_recorder.IsActive()) {
+		WGPUTexture surfaceTexture = wgpuSwapChainGetCurrentTexture(m_swapChain);
+		glm::uvec2 surfaceSize = {wgpuTextureGetWidth(surfaceTexture), wgpuTextureGetHeight(surfaceTexture)};
+		m_recorder.RecordFrame(cmdEncoder, surfaceTexture, m_swapChainFormat, surfaceSize);
+		wgpuTextureRelease(surfaceTexture);
+	}
 	wgpuTextureViewRelease(nextTexture);
 
+	m_gpuProfiler.ResolveFrame(cmdEncoder);
+	m_virtualTextures.ResolveFeedback(cmdEncoder);
+
 	WGPUCommandBufferDescriptor cmdBuffDesc = {};
 	cmdBuffDesc.nextInChain = nullptr;
 	cmdBuffDesc.label = "Main command buffer";
 	WGPUCommandBuffer cmdBuff = wgpuCommandEncoderFinish(cmdEncoder, &cmdBuffDesc);
 	wgpuCommandEncoderRelease(cmdEncoder);
+	endPhase("Encode", Stats::Phase::Encode, phaseStart);
 
-	// 4. Establish callback
-	auto onQueueWorkDone = [](WGPUQueueWorkDoneStatus status, void* pUserData1, void* /* pUserData2 */)
+	// 4. Establish callback (frees up the frame slot once the GPU is done with it)
+	auto onQueueWorkDone = [](WGPUQueueWorkDoneStatus status, void* pUserData1, void* pUserData2)
 	{
 		// std::cout << "Queued work finished with status: " << status << "\n";
-		bool& gpuIdle = *reinterpret_cast<bool*>(pUserData1);
-		gpuIdle = true;
+		Application& app = *reinterpret_cast<Application*>(pUserData1);
+		FrameSlot& slot = *reinterpret_cast<FrameSlot*>(pUserData2);
+		slot.inFlight = false;
+		app.m_frameTimings.gpuWaitMs = static_cast<float>((glfwGetTime() - slot.submitTime) * 1000.0);
 	};
+	FrameSlot& frameSlot = m_frameSlots[m_frameSlot];
 	WGPUQueueWorkDoneCallbackInfo2 queueCBInfo = {};
 	queueCBInfo.nextInChain = nullptr;
 	queueCBInfo.mode = WGPUCallbackMode_AllowProcessEvents;
 	queueCBInfo.callback = onQueueWorkDone;
-	queueCBInfo.userdata1 = (void*)&m_gpuIdle;
-	queueCBInfo.userdata2 = nullptr;
+	queueCBInfo.userdata1 = (void*)this;
+	queueCBInfo.userdata2 = (void*)&frameSlot;
 
-	// 5. Submit
-	wgpuQueueOnSubmittedWorkDone2(m_queue, queueCBInfo);
+	// 5. Submit (the callback has to be registered after the submit to track this frame's work)
+	phaseStart = Trace::Now();
+	frameSlot.inFlight = true;
+	frameSlot.submitTime = glfwGetTime();
 	wgpuQueueSubmit(m_queue, 1, &cmdBuff);
+	wgpuQueueOnSubmittedWorkDone2(m_queue, queueCBInfo);
 	wgpuCommandBufferRelease(cmdBuff);
+	m_gpuProfiler.EndFrame();
+	m_virtualTextures.EndFrame();
+	m_recorder.EndFrame();
+	endPhase("Submit", Stats::Phase::Submit, phaseStart);
 
 	// 6. Present rendered surface
+	phaseStart = Trace::Now();
 	wgpuSwapChainPresent(m_swapChain);
+	endPhase("Present", Stats::Phase::Present, phaseStart);
+	m_renderTargetPool.EndFrame();
+	++m_frameNumber;
+
+	// Frames that follow an idle wait would just measure the idle time
+	double frameEnd = glfwGetTime();
+	if (!m_frameFollowsIdle) {
+		Stats::EndFrame(static_cast<float>((frameEnd - m_lastFrameEnd) * 1000.0));
+	}
+	m_lastFrameEnd = frameEnd;
+	m_frameFollowsIdle = false;
+}
+
+void Application::RunBundleBenchmark()
+{
+	constexpr uint32_t WARMUP_FRAMES = 10; // Also covers recording the bundles
+	constexpr uint32_t MEASURED_FRAMES = 100;
+	RedrawMode previousMode = m_redrawMode;
+	m_redrawMode = RedrawMode::Continuous;
+
+	for (uint32_t objectCount : {1000u, 10000u}) {
+		// Grid of small static boats
+		ClearObjects();
+		uint32_t side = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<float>(objectCount))));
+		float spacing = 2.0f / side;
+		for (uint32_t i = 0; i < objectCount; ++i) {
+			glm::vec3 position = {((i % side) - side * 0.5f) * spacing, ((i / side) - side * 0.5f) * spacing, 0.0f};
+			AddObject(glm::translate(glm::mat4x4(1.0f), position) * glm::scale(glm::mat4x4(1.0f), glm::vec3(0.4f * spacing)));
+		}
+
+		// Encode phase of MainLoop (the Dear ImGui pass is in both numbers)
+		std::array<float, 2> encodeMs = {};
+		for (uint32_t useBundles = 0; useBundles < 2; ++useBundles) {
+			m_useRenderBundles = useBundles == 1;
+			for (uint32_t frame = 0; frame < WARMUP_FRAMES + MEASURED_FRAMES && IsRunning(); ++frame) {
+				MainLoop();
+				if (frame >= WARMUP_FRAMES) {
+					encodeMs[useBundles] += Stats::GetLastFramePhase(Stats::Phase::Encode) / MEASURED_FRAMES;
+				}
+			}
+		}
+		SPDLOG_INFO("{} static objects: encode {:.3f} ms without bundles, {:.3f} ms with bundles ({:.1f}x)", objectCount, encodeMs[0], encodeMs[1],
+			encodeMs[1] > 0.0f ? encodeMs[0] / encodeMs[1] : 0.0f);
+	}
+
+	// Back to the normal scene
+	ClearObjects();
+	addDefaultScene();
+	m_useRenderBundles = true;
+	m_redrawMode = previousMode;
+}
+
+void Application::RunMaterialBenchmark()
+{
+	constexpr uint32_t OBJECT_COUNT = 1000;
+	constexpr uint32_t WARMUP_FRAMES = 10;
+	constexpr uint32_t MEASURED_FRAMES = 100;
+	std::vector<uint32_t> opaqueMaterials;
+	for (uint32_t materialId = 0; materialId < m_materials.size(); ++materialId) {
+		if (!m_materials[materialId].transparent) {
+			opaqueMaterials.push_back(materialId);
+		}
+	}
+	if (opaqueMaterials.size() < 2) {
+		SPDLOG_WARN("The model has {} opaque materials, the material benchmark needs at least 2.", opaqueMaterials.size());
+		return;
+	}
+	if (!m_useTextureArrays) {
+		SPDLOG_INFO("Texture arrays are off (App --texture-arrays), so no draw can mix materials.");
+	}
+	RedrawMode previousMode = m_redrawMode;
+	m_redrawMode = RedrawMode::Continuous;
+	bool previousBundles = m_useRenderBundles;
+	m_useRenderBundles = false; // Every draw goes through the render queue
+
+	// Grid of small boats, the second time each one in the next opaque material (the same sub-mesh of neighbouring boats
+	// then has different materials)
+	ClearObjects();
+	uint32_t side = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<float>(OBJECT_COUNT))));
+	float spacing = 2.0f / side;
+	std::vector<EntityStore::Entity> objects;
+	for (uint32_t i = 0; i < OBJECT_COUNT; ++i) {
+		glm::vec3 position = {((i % side) - side * 0.5f) * spacing, ((i / side) - side * 0.5f) * spacing, 0.0f};
+		objects.push_back(AddObject(glm::translate(glm::mat4x4(1.0f), position) * glm::scale(glm::mat4x4(1.0f), glm::vec3(0.4f * spacing))));
+	}
+	for (uint32_t mixed = 0; mixed < 2; ++mixed) {
+		for (uint32_t i = 0; i < OBJECT_COUNT; ++i) {
+			SetObjectMaterial(objects[i], mixed ? opaqueMaterials[i % opaqueMaterials.size()] : UINT32_MAX);
+		}
+		float encodeMs = 0.0f;
+		for (uint32_t frame = 0; frame < WARMUP_FRAMES + MEASURED_FRAMES && IsRunning(); ++frame) {
+			MainLoop();
+			if (frame >= WARMUP_FRAMES) {
+				encodeMs += Stats::GetLastFramePhase(Stats::Phase::Encode) / MEASURED_FRAMES;
+			}
+		}
+		size_t itemCount = m_renderQueue.GetSize();
+		SPDLOG_INFO("{} boats in {}: {} draw items in {} draws, {} bind group changes, encode {:.3f} ms", OBJECT_COUNT,
+			mixed ? "alternating materials" : "their own materials", itemCount, m_mainPassStateChanges.draws, m_mainPassStateChanges.bindGroups, encodeMs);
+		if (mixed && m_useTextureArrays && m_mainPassStateChanges.draws >= itemCount) {
+			SPDLOG_WARN("No draw mixed materials, every material's textures ended up in a different array.");
+		}
+	}
+
+	// Back to the normal scene
+	ClearObjects();
+	addDefaultScene();
+	m_useRenderBundles = previousBundles;
+	m_redrawMode = previousMode;
+}
+
+void Application::RunLightBenchmark()
+{
+	constexpr uint32_t VALIDATION_LIGHTS = 1024;
+	constexpr uint32_t WARMUP_FRAMES = 10; // Also lets the GPU profiler readbacks catch up
+	constexpr uint32_t MEASURED_FRAMES = 60;
+	RedrawMode previousMode = m_redrawMode;
+	m_redrawMode = RedrawMode::Continuous;
+	bool previousDynamicResolution = m_dynamicResolution.IsEnabled();
+	m_dynamicResolution.SetEnabled(false); // Same pixel count for every configuration
+	std::vector<PointLight> previousLights = m_clusteredLighting.GetLights();
+
+	// Correctness: the falloff is exactly zero past a light's range, so culling should not change a single pixel
+	m_clusteredLighting.SetLights(ClusteredLighting::MakeRandomLights(VALIDATION_LIGHTS));
+	MainLoop();
+	std::vector<uint8_t> clustered, reference;
+	uint32_t width = 0, height = 0;
+	m_clusteredLighting.SetBruteForce(false);
+	bool captured = captureScene(clustered, width, height);
+	uint32_t overflowClusters = m_clusteredLighting.ReadOverflowCount(m_instance); // Those would shade with fewer lights
+	m_clusteredLighting.SetBruteForce(true);
+	captured = captureScene(reference, width, height) && captured;
+	if (captured && clustered.size() == reference.size()) {
+		int maxDifference = 0;
+		uint32_t differentPixels = 0;
+		for (size_t i = 0; i < clustered.size(); i += 4) {
+			int pixelDifference = 0;
+			for (size_t channel = 0; channel < 3; ++channel) {
+				pixelDifference = std::max(pixelDifference, std::abs(int(clustered[i + channel]) - int(reference[i + channel])));
+			}
+			maxDifference = std::max(maxDifference, pixelDifference);
+			differentPixels += pixelDifference > 1 ? 1 : 0;
+		}
+		bool passed = maxDifference <= 1 && overflowClusters == 0;
+		SPDLOG_INFO("Clustered vs brute force with {} lights ({}x{}): max difference {}, {} pixels differ by more than 1, {} clusters overflowed. {}",
+			VALIDATION_LIGHTS, width, height, maxDifference, differentPixels, overflowClusters, passed ? "PASS" : "FAIL");
+	} else {
+		SPDLOG_ERROR("Could not capture the scene for validation.");
+	}
+
+	// Scaling
+	auto passMs = [this](const char* name)
+	{
+		for (const GpuProfiler::PassTiming& timing : m_gpuProfiler.GetPassTimings()) {
+			if (timing.name == name) {
+				return timing.lastMs;
+			}
+		}
+		return 0.0f;
+	};
+	if (!m_gpuProfiler.IsEnabled()) {
+		SPDLOG_WARN("No timestamp queries on this adapter, only frame times are reported (capped by vsync).");
+	}
+	for (uint32_t lightCount : {64u, 256u, 1024u, 4096u}) {
+		m_clusteredLighting.SetLights(ClusteredLighting::MakeRandomLights(lightCount));
+		for (bool bruteForce : {false, true}) {
+			m_clusteredLighting.SetBruteForce(bruteForce);
+			float cullingMs = 0.0f, mainMs = 0.0f;
+			double measureStart = 0.0;
+			for (uint32_t frame = 0; frame < WARMUP_FRAMES + MEASURED_FRAMES && IsRunning(); ++frame) {
+				if (frame == WARMUP_FRAMES) {
+					measureStart = glfwGetTime();
+				}
+				MainLoop();
+				if (frame >= WARMUP_FRAMES) {
+					cullingMs += passMs("Light culling") / MEASURED_FRAMES;
+					mainMs += passMs("Main") / MEASURED_FRAMES;
+				}
+			}
+			double frameMs = (glfwGetTime() - measureStart) * 1000.0 / MEASURED_FRAMES;
+			SPDLOG_INFO("{:5} lights, {:11}: light culling {:.3f} ms, main pass {:.3f} ms, frame {:.2f} ms", lightCount, bruteForce ? "brute force" : "clustered",
+				cullingMs, mainMs, frameMs);
+			if (!bruteForce) {
+				// Full clusters drop lights and shade less than they should, which would flatter the clustered timings
+				uint32_t overflowClusters = m_clusteredLighting.ReadOverflowCount(m_instance);
+				if (overflowClusters > 0) {
+					SPDLOG_ERROR("{} clusters had more than {} lights, the clustered numbers for {} lights are invalid. FAIL", overflowClusters,
+						ClusteredLighting::MAX_LIGHTS_PER_CLUSTER, lightCount);
+				}
+			}
+		}
+	}
+
+	m_clusteredLighting.SetBruteForce(false);
+	m_clusteredLighting.SetLights(previousLights);
+	m_dynamicResolution.SetEnabled(previousDynamicResolution);
+	m_redrawMode = previousMode;
+}
+
+void Application::RunPrepassBenchmark()
+{
+	constexpr uint32_t BOAT_COUNT = 32;
+	constexpr uint32_t LIGHT_COUNT = 1024; // Makes fs_main expensive enough to matter
+	constexpr uint32_t WARMUP_FRAMES = 10;
+	constexpr uint32_t MEASURED_FRAMES = 60;
+	RedrawMode previousMode = m_redrawMode;
+	DepthPrepassMode previousPrepassMode = m_depthPrepassMode;
+	m_redrawMode = RedrawMode::Continuous;
+	bool previousDynamicResolution = m_dynamicResolution.IsEnabled();
+	m_dynamicResolution.SetEnabled(false);
+	std::vector<PointLight> previousLights = m_clusteredLighting.GetLights();
+	m_clusteredLighting.SetLights(ClusteredLighting::MakeRandomLights(LIGHT_COUNT));
+
+	// Boats lined up along the view direction and drawn far ones first (dynamic, so they all go through the render queue):
+	// every pixel gets shaded once per boat behind it
+	bool previousFrontToBack = m_opaqueFrontToBack;
+	m_opaqueFrontToBack = false;
+	glm::mat4x4 inverseView = glm::inverse(m_uniforms.viewMatrix * m_uniforms.modelMatrix);
+	glm::vec3 cameraPosition = glm::vec3(inverseView[3]);
+	glm::vec3 forward = glm::normalize(glm::vec3(inverseView[2])); // Left-handed, the camera looks down +Z
+	float viewDistance = glm::length(cameraPosition);
+	ClearObjects();
+	for (uint32_t i = 0; i < BOAT_COUNT; ++i) {
+		float t = static_cast<float>(BOAT_COUNT - i) / BOAT_COUNT;
+		glm::vec3 position = cameraPosition + forward * (viewDistance * (0.25f + 1.5f * t)) - m_meshCenter;
+		AddObject(glm::translate(glm::mat4x4(1.0f), position), false);
+	}
+
+	auto passMs = [this](const char* name)
+	{
+		for (const GpuProfiler::PassTiming& timing : m_gpuProfiler.GetPassTimings()) {
+			if (timing.name == name) {
+				return timing.lastMs;
+			}
+		}
+		return 0.0f;
+	};
+	if (!m_gpuProfiler.IsEnabled()) {
+		SPDLOG_WARN("No timestamp queries on this adapter, only the fragment counts are reported.");
+	}
+	uint32_t fragmentsWithout = 0;
+	for (DepthPrepassMode mode : {DepthPrepassMode::Off, DepthPrepassMode::On}) {
+		m_depthPrepassMode = mode;
+		float prepassMs = 0.0f, mainMs = 0.0f;
+		for (uint32_t frame = 0; frame < WARMUP_FRAMES + MEASURED_FRAMES && IsRunning(); ++frame) {
+			MainLoop();
+			if (frame >= WARMUP_FRAMES) {
+				prepassMs += passMs("Depth pre-pass") / MEASURED_FRAMES;
+				mainMs += passMs("Main") / MEASURED_FRAMES;
+			}
+		}
+		uint32_t fragments = countMainPassFragments();
+		SPDLOG_INFO("{} boats, pre-pass {:3}: {} fs_main invocations, pre-pass {:.3f} ms, main pass {:.3f} ms, total {:.3f} ms", BOAT_COUNT,
+			mode == DepthPrepassMode::On ? "on" : "off", fragments, prepassMs, mainMs, prepassMs + mainMs);
+		if (mode == DepthPrepassMode::Off) {
+			fragmentsWithout = fragments;
+		} else if (fragments >= fragmentsWithout) {
+			// A storage write can cost the early depth test on some GPUs, then every fragment runs either way
+			SPDLOG_WARN("The pre-pass didn't reduce the fs_main invocations ({} vs {}).", fragments, fragmentsWithout);
+		} else {
+			SPDLOG_INFO("The pre-pass shaded {:.2f}x fewer fragments.", static_cast<double>(fragmentsWithout) / std::max(fragments, 1u));
+		}
+	}
+	m_depthPrepassMode = DepthPrepassMode::Auto;
+	updateDepthPrepass();
+	SPDLOG_INFO("Estimated depth complexity {:.2f}, auto would turn the pre-pass {}.", m_depthComplexity, m_depthPrepassActive ? "on" : "off");
+
+	// Back to the normal scene
+	ClearObjects();
+	addDefaultScene();
+	m_clusteredLighting.SetLights(previousLights);
+	m_depthPrepassMode = previousPrepassMode;
+	m_opaqueFrontToBack = previousFrontToBack;
+	m_dynamicResolution.SetEnabled(previousDynamicResolution);
+	m_redrawMode = previousMode;
+}
+
+void Application::RunStreamingBenchmark()
+{
+	constexpr uint32_t CELLS_PER_SIDE = 32;
+	constexpr float CELL_SIZE = 8.0f;
+	constexpr uint32_t OBJECTS_PER_CELL = 64;
+	constexpr float SPEED = 30.0f; // Per second, at a fixed 60 frames per second so every run flies the same path
+	constexpr float FRAME_TIME = 1.0f / 60.0f;
+	constexpr uint32_t MAX_WARMUP_FRAMES = 600;
+	constexpr float HITCH_MS = 2.0f;
+	RedrawMode previousMode = m_redrawMode;
+	m_redrawMode = RedrawMode::Continuous;
+	CameraState previousCamera = m_cameraState;
+
+	std::filesystem::path worldPath = std::filesystem::temp_directory_path() / "bench-streaming.world";
+	if (!WorldStreamer::GenerateWorld(worldPath, CELLS_PER_SIDE, CELL_SIZE, OBJECTS_PER_CELL)) {
+		return;
+	}
+	// Diagonally across the world, staying a load radius away from its edges
+	float halfExtent = 0.5f * CELLS_PER_SIDE * CELL_SIZE - WorldStreamer::DEFAULT_LOAD_RADIUS;
+	glm::vec3 start = {-halfExtent, -0.5f * halfExtent, 0.0f};
+	glm::vec3 end = {halfExtent, 0.5f * halfExtent, 0.0f};
+	uint32_t frameCount = static_cast<uint32_t>(glm::distance(start, end) / (SPEED * FRAME_TIME));
+
+	for (float budgetMs : {WorldStreamer::DEFAULT_BUDGET_MS, 0.0f}) {
+		ClearObjects();
+		if (!OpenWorld(worldPath)) {
+			break;
+		}
+		m_worldStreamer.SetBudget(budgetMs);
+		m_cameraState.target = start;
+		updateViewMatrix();
+		for (uint32_t frame = 0; frame < MAX_WARMUP_FRAMES && !m_worldStreamer.IsSettled() && IsRunning(); ++frame) {
+			MainLoop();
+		}
+
+		// CPU time of the frame without the waits on the GPU and the surface
+		std::vector<float> frameMs, streamingMs;
+		for (uint32_t frame = 0; frame < frameCount && IsRunning(); ++frame) {
+			m_cameraState.target = glm::mix(start, end, static_cast<float>(frame) / frameCount);
+			updateViewMatrix();
+			MainLoop();
+			float cpuMs = 0.0f;
+			for (Stats::Phase phase : {Stats::Phase::Events, Stats::Phase::Physics, Stats::Phase::Streaming, Stats::Phase::Update, Stats::Phase::Encode,
+				Stats::Phase::Submit}) {
+				cpuMs += Stats::GetLastFramePhase(phase);
+			}
+			frameMs.push_back(cpuMs);
+			streamingMs.push_back(m_worldStreamer.GetLastUpdateMs());
+		}
+		if (frameMs.empty()) {
+			break;
+		}
+
+		// A hitch is a frame that took HITCH_MS longer than usual
+		std::vector<float> sorted = frameMs;
+		std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+		float medianMs = sorted[sorted.size() / 2];
+		size_t hitches = std::count_if(frameMs.begin(), frameMs.end(), [medianMs](float ms) { return ms > medianMs + HITCH_MS; });
+		size_t slowStreaming = std::count_if(streamingMs.begin(), streamingMs.end(), [](float ms) { return ms > HITCH_MS; });
+		SPDLOG_INFO("Streaming budget {:.1f} ms (0 is none): {} frames, median CPU {:.2f} ms, max {:.2f} ms, {} hitches over {} ms ({} from streaming alone, max {:.2f} ms)",
+			budgetMs, frameMs.size(), medianMs, *std::max_element(frameMs.begin(), frameMs.end()),
+			hitches, HITCH_MS, slowStreaming, *std::max_element(streamingMs.begin(), streamingMs.end()));
+	}
+
+	// Back to the normal scene
+	ClearObjects();
+	addDefaultScene();
+	std::filesystem::remove(worldPath);
+	m_cameraState = previousCamera;
+	updateViewMatrix();
+	m_redrawMode = previousMode;
+}
+
+void Application::RunRecordingBenchmark()
+{
+	constexpr uint32_t WARMUP_FRAMES = 10; // Also fills the readback ring
+	constexpr uint32_t MEASURED_FRAMES = 300;
+	RedrawMode previousMode = m_redrawMode;
+	m_redrawMode = RedrawMode::Continuous;
+	m_recorder.Stop();
+
+	struct Mode
+	{
+		const char* name;
+		bool record;
+		FrameRecorder::Format format;
+	};
+	const Mode modes[] = {{"off", false, FrameRecorder::Format::PngSequence}, {"raw video", true, FrameRecorder::Format::RawVideo},
+		{"PNG sequence", true, FrameRecorder::Format::PngSequence}};
+	std::filesystem::path directory = std::filesystem::temp_directory_path() / "bench-recording";
+	float offCpuMs = 0.0f;
+	for (const Mode& mode : modes) {
+		if (mode.record && !m_recorder.Start(directory, mode.format)) {
+			break;
+		}
+		for (uint32_t frame = 0; frame < WARMUP_FRAMES && IsRunning(); ++frame) {
+			MainLoop();
+		}
+		uint64_t writtenBefore = m_recorder.GetWrittenFrameCount();
+		uint64_t droppedBefore = m_recorder.GetDroppedFrameCount();
+
+		// CPU time of the frame without the waits on the GPU and the surface, the wall time includes them (and the vsync)
+		double cpuMs = 0.0;
+		double start = glfwGetTime();
+		uint32_t frameCount = 0;
+		for (; frameCount < MEASURED_FRAMES && IsRunning(); ++frameCount) {
+			MainLoop();
+			for (Stats::Phase phase : {Stats::Phase::Events, Stats::Phase::Physics, Stats::Phase::Streaming, Stats::Phase::Update, Stats::Phase::Encode,
+				Stats::Phase::Submit}) {
+				cpuMs += Stats::GetLastFramePhase(phase);
+			}
+		}
+		if (frameCount == 0) {
+			break;
+		}
+		double wallMs = (glfwGetTime() - start) * 1000.0 / frameCount;
+		cpuMs /= frameCount;
+		m_recorder.Stop();
+		m_recorder.Flush();
+		if (!mode.record) {
+			offCpuMs = static_cast<float>(cpuMs);
+		}
+		SPDLOG_INFO("Recording {}: {:.2f} ms per frame, CPU {:.3f} ms ({:+.3f} ms over off), {} frames written, {} dropped", mode.name, wallMs, cpuMs,
+			cpuMs - offCpuMs, m_recorder.GetWrittenFrameCount() - writtenBefore, m_recorder.GetDroppedFrameCount() - droppedBefore);
+	}
+
+	std::error_code error;
+	std::filesystem::remove_all(directory, error);
+	m_redrawMode = previousMode;
 }
 
 void Application::Terminate()
@@ -1206,30 +3579,71 @@ void Application::Terminate()
 
 	SPDLOG_INFO("GPU work completed, cleaning up resources...");
 
+	m_worldStreamer.Close(); // Releases its actors
 	Physics::Terminate();
+	JobSystem::Terminate();
 
 	// Dear ImGui
 	ImGui_ImplGlfw_Shutdown();
 	ImGui_ImplWGPU_Shutdown();
 
+	m_recorder.Terminate(); // Writes out the frames still in flight
+	m_gpuProfiler.Terminate();
+	m_clusteredLighting.Terminate();
+	m_cascadedShadows.Terminate();
+	m_virtualTextures.Terminate();
+
+	invalidateStaticBundles();
+	for (MaterialResources& resources : m_materialResources) {
+		if (resources.uniformBuffer) { // Texture array materials share m_textureArrayBindGroups
+			wgpuBindGroupRelease(resources.bindGroup);
+			wgpuBufferRelease(resources.uniformBuffer);
+		}
+	}
+	for (WGPUBindGroup bindGroup : m_textureArrayBindGroups) {
+		wgpuBindGroupRelease(bindGroup);
+	}
+	if (m_materialDataBuffer) {
+		wgpuBufferRelease(m_materialDataBuffer);
+		Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers, -static_cast<int64_t>(m_materials.size() * sizeof(MaterialData)));
+	}
+	m_textureArrays.Terminate();
+	m_materialResources.clear(); // Drops the texture handles
+	wgpuTextureViewRelease(m_whiteTextureView);
+	wgpuTextureDestroy(m_whiteTexture);
+	wgpuTextureRelease(m_whiteTexture);
+
 	wgpuBindGroupRelease(m_bindGroup); // Uses the pipeline/layout first, so we release first
-	wgpuRenderPipelineRelease(m_pipeline);
+	for (WGPURenderPipeline pipeline : m_pipelines) {
+		wgpuRenderPipelineRelease(pipeline);
+	}
+	wgpuRenderPipelineRelease(m_depthPrepassPipeline);
+	wgpuPipelineLayoutRelease(m_depthPrepassLayout);
 
 	wgpuBindGroupLayoutRelease(m_bindGroupLayout);
+	wgpuBindGroupLayoutRelease(m_materialBindGroupLayout);
 	wgpuPipelineLayoutRelease(m_layout);
 
 	wgpuBufferRelease(m_uniformBuffer);
+	wgpuBufferRelease(m_objectBuffer);
+	wgpuBufferRelease(m_drawInstanceBuffer);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers, -static_cast<int64_t>(m_objectCapacity * sizeof(glm::mat4x4)));
+	Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers,
+		-static_cast<int64_t>(2 * m_objectCapacity * std::max<size_t>(m_subMeshes.size(), 1) * sizeof(glm::uvec2)));
+	wgpuBufferRelease(m_fragmentCountBuffer);
+	wgpuBufferRelease(m_fragmentCountReadbackBuffer);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers, -static_cast<int64_t>(2 * sizeof(uint32_t)));
 	// wgpuBufferRelease(m_indexBuffer);
 	wgpuBufferRelease(m_vertexBuffer);
+	wgpuBufferRelease(m_positionBuffer);
 
 	// Check if we can release stuff here?
-	wgpuTextureViewRelease(m_textureView);
-	wgpuTextureDestroy(m_texture);
-	wgpuTextureRelease(m_texture);
+	m_defaultTexture.Reset();
+	m_assets.Terminate();
 
-	wgpuTextureViewRelease(m_depthTextureView);
-	wgpuTextureDestroy(m_depthTexture);
-	wgpuTextureRelease(m_depthTexture);
+	m_dynamicResolution.Terminate();
+	m_renderGraph.Terminate();
+	m_renderTargetPool.Terminate();
 
 	wgpuSurfaceUnconfigure(m_surface);
 	wgpuSurfaceRelease(m_surface);
@@ -1253,17 +3667,175 @@ bool Application::IsRunning()
 	return !glfwWindowShouldClose(m_glfwWindow);
 }
 
-int main()
+namespace
+{
+// A whole positive number, nothing else. value is left alone otherwise
+bool parseCount(const char* text, uint32_t& value)
+{
+	uint32_t parsed = 0;
+	const char* end = text + std::strlen(text);
+	auto [last, error] = std::from_chars(text, end, parsed);
+	if (error != std::errc() || last != end || parsed == 0) {
+		return false;
+	}
+	value = parsed;
+	return true;
+}
+}
+
+int main(int argc, char** argv)
 {
+	Trace::Init();
+
+	// Offline what-if runs (no window or GPU): App --physics-batch [worlds] [steps]
+	if (argc >= 2 && std::string(argv[1]) == "--physics-batch") {
+		uint32_t worldCount = 256;
+		uint32_t stepCount = 600;
+		if ((argc >= 3 && !parseCount(argv[2], worldCount)) || (argc >= 4 && !parseCount(argv[3], stepCount)) || argc > 4) {
+			std::cerr << "Usage: App --physics-batch [worlds] [steps] (positive whole numbers, default 256 and 600)" << std::endl;
+			return 1;
+		}
+		if (!JobSystem::Init() || !Physics::Init()) {
+			return 1;
+		}
+		Physics::RunBatch(worldCount, stepCount);
+		Physics::Terminate();
+		JobSystem::Terminate();
+		return 0;
+	}
+	// App --bench-transforms [nodes]
+	if (argc >= 2 && std::string(argv[1]) == "--bench-transforms") {
+		uint32_t nodeCount = argc >= 3 ? static_cast<uint32_t>(std::stoul(argv[2])) : 100000;
+		if (!JobSystem::Init()) {
+			return 1;
+		}
+		TransformHierarchy::RunBenchmark(nodeCount);
+		JobSystem::Terminate();
+		return 0;
+	}
+	// App --bench-obj [MB]
+	if (argc >= 2 && std::string(argv[1]) == "--bench-obj") {
+		uint32_t megabytes = argc >= 3 ? static_cast<uint32_t>(std::stoul(argv[2])) : 256;
+		if (!JobSystem::Init()) {
+			return 1;
+		}
+		ResourceManager::RunObjBenchmark(megabytes);
+		JobSystem::Terminate();
+		return 0;
+	}
+	// App --bench-codec [file.obj]
+	if (argc >= 2 && std::string(argv[1]) == "--bench-codec") {
+		if (!JobSystem::Init()) {
+			return 1;
+		}
+		ResourceManager::RunCodecBenchmark(argc >= 3 ? argv[2] : "");
+		JobSystem::Terminate();
+		return 0;
+	}
+
 	Application app;
 
+	// Software rendering (SwiftShader), e.g. for --bench-lights validation on machines without a GPU: App --swiftshader
+	// Stream material textures through a tile cache (budget in MB): App --virtual-textures <MB>
+	// Pack material textures into texture arrays and batch draws across materials: App --texture-arrays
+	// Another model instead of the boat: App --model <file.obj>
+	for (int i = 1; i < argc; ++i) {
+		if (std::string(argv[i]) == "--swiftshader") {
+			app.UseFallbackAdapter();
+		} else if (std::string(argv[i]) == "--virtual-textures" && i + 1 < argc) {
+			app.UseVirtualTextures(std::stoull(argv[++i]) << 20);
+		} else if (std::string(argv[i]) == "--texture-arrays") {
+			app.UseTextureArrays();
+		} else if (std::string(argv[i]) == "--model" && i + 1 < argc) {
+			app.UseModel(argv[++i]);
+		}
+	}
+
 	if (!app.Initialize()) {
 		return 1;
 	}
+	// Always-on displays: App --on-demand
+	// Depth pre-pass (default auto): App --depth-prepass off|on|auto
+	// Dynamic resolution GPU budget (default 16, 0 is always native): App --frame-budget <ms>
+	// Evict unused textures above this much GPU memory (default 0, never): App --gpu-memory-budget <MB>
+	// Stream a world file around the camera (generated first if it doesn't exist): App --world <file.world>
+	// Record every frame as PNGs or as one raw RGBA video file: App --record <dir>, App --record-raw <dir>
+	// Turntable thumbnails of the model (default 64 views of 512x512), exits when done: App --turntable <dir> [views] [size]
+	// Benchmarks (exit when done): App --bench-bundles, App --bench-materials, App --bench-lights, App --bench-prepass, App --bench-streaming, App --bench-recording,
+	// App --bench-turntable, App --bench-assets
+	for (int i = 1; i < argc; ++i) {
+		if (std::string(argv[i]) == "--depth-prepass" && i + 1 < argc) {
+			std::string mode = argv[++i];
+			if (mode != "on" && mode != "off" && mode != "auto") {
+				SPDLOG_ERROR("Unknown --depth-prepass mode \"{}\", expected off, on or auto.", mode);
+				app.Terminate();
+				return 1;
+			}
+			app.SetDepthPrepassMode(mode == "on" ? DepthPrepassMode::On : mode == "off" ? DepthPrepassMode::Off : DepthPrepassMode::Auto);
+		} else if (std::string(argv[i]) == "--frame-budget" && i + 1 < argc) {
+			app.SetFrameBudget(std::stof(argv[++i]));
+		} else if (std::string(argv[i]) == "--gpu-memory-budget" && i + 1 < argc) {
+			app.SetGpuMemoryBudget(std::stoull(argv[++i]) << 20);
+		} else if (std::string(argv[i]) == "--record" && i + 1 < argc) {
+			app.StartRecording(argv[++i], FrameRecorder::Format::PngSequence);
+		} else if (std::string(argv[i]) == "--record-raw" && i + 1 < argc) {
+			app.StartRecording(argv[++i], FrameRecorder::Format::RawVideo);
+		}
+	}
+	for (int i = 1; i < argc; ++i) {
+		if (std::string(argv[i]) == "--on-demand") {
+			app.SetRedrawMode(RedrawMode::OnDemand);
+		} else if (std::string(argv[i]) == "--world" && i + 1 < argc) {
+			std::filesystem::path worldPath = argv[++i];
+			if (!std::filesystem::exists(worldPath)) {
+				WorldStreamer::GenerateWorld(worldPath, 32, 8.0f, 64);
+			}
+			app.OpenWorld(worldPath);
+		} else if (std::string(argv[i]) == "--bench-streaming") {
+			app.RunStreamingBenchmark();
+			app.Terminate();
+			return 0;
+		} else if (std::string(argv[i]) == "--bench-recording") {
+			app.RunRecordingBenchmark();
+			app.Terminate();
+			return 0;
+		} else if (std::string(argv[i]) == "--turntable" && i + 1 < argc) {
+			std::filesystem::path directory = argv[++i];
+			uint32_t viewCount = i + 1 < argc && std::isdigit(argv[i + 1][0]) ? std::stoul(argv[++i]) : 64;
+			uint32_t size = i + 1 < argc && std::isdigit(argv[i + 1][0]) ? std::stoul(argv[++i]) : 512;
+			app.RenderTurntable(directory, viewCount, size);
+			app.Terminate();
+			return 0;
+		} else if (std::string(argv[i]) == "--bench-turntable") {
+			app.RunTurntableBenchmark();
+			app.Terminate();
+			return 0;
+		} else if (std::string(argv[i]) == "--bench-prepass") {
+			app.RunPrepassBenchmark();
+			app.Terminate();
+			return 0;
+		} else if (std::string(argv[i]) == "--bench-bundles") {
+			app.RunBundleBenchmark();
+			app.Terminate();
+			return 0;
+		} else if (std::string(argv[i]) == "--bench-materials") {
+			app.RunMaterialBenchmark();
+			app.Terminate();
+			return 0;
+		} else if (std::string(argv[i]) == "--bench-assets") {
+			app.RunAssetBenchmark();
+			app.Terminate();
+			return 0;
+		} else if (std::string(argv[i]) == "--bench-lights") {
+			app.RunLightBenchmark();
+			app.Terminate();
+			return 0;
+		}
+	}
 	while (app.IsRunning()) {
 		app.MainLoop(); 
 	}
 	app.Terminate();
 	
 	return 0;
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -1,8 +1,11 @@
 #pragma once
 
 #include <array>
+#include <string>
+#include <vector>
 #include <utility>
 #include <filesystem>
+#include <unordered_map>
 
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
@@ -10,6 +13,28 @@
 
 #include <glm/glm.hpp>
 
+#include "GpuProfiler.hpp"
+#include "RenderQueue.hpp"
+#include "ClusteredLighting.hpp"
+#include "CascadedShadows.hpp"
+#include "DynamicResolution.hpp"
+#include "RenderTargetPool.hpp"
+#include "RenderGraph.hpp"
+#include "TransformHierarchy.hpp"
+#include "EntityStore.hpp"
+#include "VirtualTexture.hpp"
+#include "TextureArrays.hpp"
+#include "AssetCache.hpp"
+#include "WorldStreamer.hpp"
+#include "FrameRecorder.hpp"
+
+namespace physx { class PxRigidActor; }
+
+// How many frames the CPU may record ahead of the GPU before it has to wait
+constexpr uint32_t MAX_FRAMES_IN_FLIGHT = 2;
+// Views RenderTurntable can draw in one submission, each gets a uniform buffer slot after the frame slots
+constexpr uint32_t MAX_BATCH_VIEWS = 64;
+
 struct MyUniforms // Total size of the struct has to be a multiple of the alignment size of its largest field
 {
 	glm::mat4x4 projectionMatrix;
@@ -17,7 +42,8 @@ struct MyUniforms // Total size of the struct has to be a multiple of the alignm
 	glm::mat4x4 modelMatrix;
 	glm::vec4 color;
 	float time;
-	float _pad[3];
+	uint32_t frame; // Rotates the fragments that write virtual texture feedback
+	float _pad[2];
 };
 static_assert(sizeof(MyUniforms) % 16 == 0);
 
@@ -36,12 +62,99 @@ struct VertexAttributes
 	glm::vec2 uv;
 };
 
+// From the .mtl file
+struct Material
+{
+	std::string name;
+	glm::vec4 baseColor = {1.0f, 1.0f, 1.0f, 1.0f}; // Kd and d (Kd only tints materials without a texture)
+	std::filesystem::path baseColorTexture; // map_Kd, empty when there is none
+	bool transparent = false; // d < 1, drawn back to front without depth writes
+	bool alphaTest = false; // Has a map_d, fragments below the cutoff are discarded
+};
+
+struct MaterialUniforms
+{
+	glm::vec4 baseColor;
+	glm::uvec4 virtualTexture = glm::uvec4(0); // VirtualTextureCache::GetShaderParameters
+};
+static_assert(sizeof(MaterialUniforms) % 16 == 0);
+
+// With texture arrays, all materials live in one storage buffer instead
+struct MaterialData
+{
+	glm::vec4 baseColor;
+	glm::vec4 uvTransform; // TextureArrays::Entry::uvTransform
+	uint32_t layer;
+	uint32_t _pad[3];
+};
+static_assert(sizeof(MaterialData) % 16 == 0);
+
+// Consecutive faces of the mesh that share a material
+struct SubMesh
+{
+	uint32_t firstVertex = 0;
+	uint32_t vertexCount = 0;
+	uint32_t materialId = 0;
+	glm::vec3 center = {0.0f, 0.0f, 0.0f}; // Model space, used for depth sorting
+};
+
+// Selects a variant of res/shader.wgsl. Scene-wide features come first, the rest depends on the material
+struct PipelineKey
+{
+	uint32_t directionalLightCount = 2; // 0 to 2
+	bool pointLights = true;
+	bool bruteForceLights = false;
+	bool shadows = true;
+	bool depthEqual = false; // Opaque draws after the depth pre-pass: Equal test, no depth writes
+	bool vertexColors = false; // #ifdef VERTEX_COLOR, also drops the color attribute from the vertex layout
+	bool textured = true;
+	bool alphaTest = false;
+	bool transparent = false; // Blended without depth writes
+	bool virtualTexture = false; // #ifdef VIRTUAL_TEXTURE, samples the tile cache through the material's page table
+	bool textureArray = false; // #ifdef TEXTURE_ARRAY, material and object come from a per-instance record (scene-wide)
+	bool countFragments = false; // fs_main counts its invocations (scene-wide, benchmark only)
+
+	uint32_t Pack() const
+	{
+		return directionalLightCount | pointLights << 2 | bruteForceLights << 3 | vertexColors << 4 | textured << 5 | alphaTest << 6 | transparent << 7 | shadows << 8 | depthEqual << 9
+			| virtualTexture << 10 | textureArray << 11 | countFragments << 12;
+	}
+};
+
+// Scene entity components (see EntityStore). Every scene object has a Transform, a MeshRenderer and Bounds
+struct Transform
+{
+	TransformHierarchy::NodeId node = TransformHierarchy::INVALID_NODE;
+	glm::mat4x4 world = glm::mat4x4(1.0f); // Copied from the hierarchy when it changes
+};
+
+struct MeshRenderer
+{
+	uint32_t mesh = 0; // Only the loaded OBJ (mesh 0) for now
+	uint32_t material = UINT32_MAX; // Replaces the sub-meshes' own materials, unless UINT32_MAX (see Application::getMaterialId)
+	uint32_t instance = 0; // Object buffer slot (instance_index), assigned by uploadObjects
+	bool isStatic = true; // Static objects are recorded once into render bundles, dynamic ones are encoded every frame
+};
+
+struct Bounds // World-space bounding sphere, without MyUniforms::modelMatrix
+{
+	glm::vec3 center = glm::vec3(0.0f);
+	float radius = 0.0f;
+};
+
+struct RigidBody // Drives the transform of a root entity
+{
+	physx::PxRigidActor* actor = nullptr;
+};
+
 struct CameraState
 {
 	// Rotation around the global vertical axis and local horizontal axis respectively (xmouse, ymouse)
 	glm::vec2 angles = {0.8f, 0.5f};
 	// Position of camera along its local forward axis (scroll wheel)
 	float zoom = -1.2f;
+	// Point the camera orbits around and looks at
+	glm::vec3 target = {0.0f, 0.0f, 0.0f};
 };
 
 struct DragState
@@ -58,6 +171,25 @@ struct DragState
 	float inertia = 0.9f;
 };
 
+enum class DepthPrepassMode
+{
+	Off,
+	On,
+	Auto // On while the estimated depth complexity is high
+};
+
+enum class RedrawMode
+{
+	Continuous, // Render every iteration
+	OnDemand // Only render when something changed, block in glfwWaitEventsTimeout otherwise
+};
+
+struct FrameTimings
+{
+	float cpuWaitMs = 0.0f; // Time the CPU was blocked waiting for a free frame slot this frame
+	float gpuWaitMs = 0.0f; // Submit to work-done time of the most recently completed frame
+};
+
 class Application
 {
 public:
@@ -65,36 +197,240 @@ public:
 	void Terminate();
 	void MainLoop();
 	bool IsRunning();
+	const FrameTimings& GetFrameTimings() const { return m_frameTimings; }
+	void SetRedrawMode(RedrawMode mode) { m_redrawMode = mode; requestRedraw(); }
+
+	// Scene objects (adding/removing changes the static set, moving does not). An object attached to a parent object follows it,
+	// its model matrix is then relative to the parent
+	EntityStore::Entity AddObject(const glm::mat4x4& modelMatrix, bool isStatic = true, EntityStore::Entity parent = EntityStore::INVALID_ENTITY);
+	void SetObjectTransform(EntityStore::Entity object, const glm::mat4x4& modelMatrix);
+	// The object follows the body from then on (its model matrix is replaced by the body pose)
+	void AttachRigidBody(EntityStore::Entity object, physx::PxRigidActor* actor);
+	// Draws every sub-mesh of the object with this material instead of their own (UINT32_MAX to go back)
+	void SetObjectMaterial(EntityStore::Entity object, uint32_t material);
+	// Root objects without children only (like the streamed ones)
+	void RemoveObject(EntityStore::Entity object);
+	// Also closes the streamed world
+	void ClearObjects();
+	// Streams the cells of a world file around the camera into the scene, see WorldStreamer
+	bool OpenWorld(const std::filesystem::path& path);
+	void CloseWorld() { m_worldStreamer.Close(); }
+	// Compares CPU encode time with and without render bundles (App --bench-bundles)
+	void RunBundleBenchmark();
+	// Draws and encode time of a grid of boats in their own materials, then with every boat in another material. With texture
+	// arrays the mixed draws still merge (App --texture-arrays --bench-materials)
+	void RunMaterialBenchmark();
+	// Checks clustered shading against brute force, then times both at increasing light counts (App --bench-lights)
+	void RunLightBenchmark();
+	// GPU time with and without the depth pre-pass on a high-overdraw scene (App --bench-prepass)
+	void RunPrepassBenchmark();
+	// Flies the camera across a generated world with and without the streaming budget, reports frames with hitches over 2 ms (App --bench-streaming)
+	void RunStreamingBenchmark();
+	// Frame time with recording off, to a raw video and to a PNG sequence (App --bench-recording)
+	void RunRecordingBenchmark();
+	// Renders the scene from viewCount angles around the model into size x size images, batchSize views (layers of a texture
+	// array) per submission, and writes them to directory/view_000.png, ... (nothing when empty). Returns views per second
+	float RenderTurntable(const std::filesystem::path& directory, uint32_t viewCount, uint32_t size, uint32_t batchSize = 16);
+	// Views per second of a 64 view turntable at increasing batch sizes (App --bench-turntable, with --swiftshader for the CPU backend),
+	// also checks that the render graph aliased the per-view depth buffers
+	void RunTurntableBenchmark();
+	void SetDepthPrepassMode(DepthPrepassMode mode) { m_depthPrepassMode = mode; }
+	// GPU time the dynamic resolution aims for, 0 always renders at native resolution
+	void SetFrameBudget(float budgetMs) { m_dynamicResolution.SetEnabled(budgetMs > 0.0f); m_dynamicResolution.SetBudget(budgetMs); }
+	// Use the fallback (software, SwiftShader on Dawn) adapter, call before Initialize
+	void UseFallbackAdapter() { m_useFallbackAdapter = true; }
+	// Stream material textures through a tile cache of this size instead of loading them whole, call before Initialize
+	void UseVirtualTextures(uint64_t budgetBytes) { m_virtualTextureBudget = budgetBytes; }
+	// Pack material textures into texture arrays, so objects with different materials can share a draw. Call before Initialize
+	void UseTextureArrays() { m_useTextureArrays = true; }
+	// Load this .obj instead of the boat, call before Initialize
+	void UseModel(const std::filesystem::path& objPath) { m_modelPath = objPath; }
+	// Unreferenced textures get evicted while the tracked GPU memory is over this, 0 keeps everything loaded
+	void SetGpuMemoryBudget(uint64_t budgetBytes) { m_assets.SetBudget(budgetBytes); }
+	// Evicts and reloads 16 generated 1024x1024 textures, see AssetCache::RunBenchmark (App --bench-assets)
+	void RunAssetBenchmark() { m_assets.RunBenchmark(16, 1024); }
+	// Every presented frame (UI included) goes to the directory until the app exits, see FrameRecorder
+	bool StartRecording(const std::filesystem::path& directory, FrameRecorder::Format format) { return m_recorder.Start(directory, format); }
 
 	void onResize();
 private:
 	GLFWwindow* m_glfwWindow = nullptr;
 	WGPUInstance m_instance = nullptr;
 	WGPUAdapter m_adapter = nullptr;
+	bool m_useFallbackAdapter = false;
 	WGPUDevice m_device = nullptr;
 	WGPUQueue m_queue = nullptr;
 	WGPUSurface m_surface = nullptr;
 	WGPUSwapChain m_swapChain = nullptr;
 	WGPUTextureFormat m_swapChainFormat = WGPUTextureFormat_Undefined;
-	WGPURenderPipeline m_pipeline = nullptr;
 	WGPUBuffer m_vertexBuffer = nullptr, m_indexBuffer = nullptr, m_uniformBuffer = nullptr, m_lightingUniformBuffer = nullptr;
 	WGPUPipelineLayout m_layout = nullptr;
 	WGPUBindGroup m_bindGroup = nullptr;
 	WGPUBindGroupLayout m_bindGroupLayout = nullptr;
-	WGPUTexture m_texture = nullptr, m_depthTexture = nullptr;
-	WGPUTextureView m_textureView = nullptr, m_depthTextureView = nullptr;
-	WGPUTextureFormat m_depthTextureFormat = WGPUTextureFormat_Undefined;
+	WGPUBindGroupLayout m_materialBindGroupLayout = nullptr;
+	// Textures and shader modules, shared by path. Handles have to be gone before its Terminate
+	AssetCache m_assets;
+	AssetCache::Handle m_defaultTexture;
+	WGPUTextureFormat m_depthTextureFormat = WGPUTextureFormat_Depth24Plus; // The depth buffers come from m_renderTargetPool
 	WGPUSampler m_sampler = nullptr;
+	bool m_timestampsSupported = false;
+	GpuProfiler m_gpuProfiler;
+	FrameRecorder m_recorder;
+	// Scene color/depth targets, sized by m_dynamicResolution every frame
+	RenderTargetPool m_renderTargetPool;
+	DynamicResolution m_dynamicResolution;
+	// Rebuilt every frame by MainLoop/captureScene, its transient textures come from m_renderTargetPool
+	RenderGraph m_renderGraph;
 
-	bool m_gpuIdle = false;
 	// uint32_t m_vertexCount = 0;
 	std::vector<VertexAttributes> m_vertexData;
 	uint32_t m_vertexCount = 0;
+	std::vector<SubMesh> m_subMeshes;
+	WGPUBuffer m_positionBuffer = nullptr; // Positions only, for the depth-only passes
+	glm::vec3 m_meshCenter = {0.0f, 0.0f, 0.0f}; // Bounding sphere in model space
+	float m_meshRadius = 0.0f;
 	MyUniforms m_uniforms;
 	LightingUniforms m_lightingUniforms;
 	bool m_lightingUniformsChanged = true;
 	uint32_t m_uniformStride = 0;
 
+	// Point and spot lights, binned into clusters every frame
+	ClusteredLighting m_clusteredLighting;
+	// Shadows of directional light #0
+	CascadedShadows m_cascadedShadows;
+	void drawShadowCasters(WGPURenderPassEncoder pass, bool staticCasters);
+	// The clusters and the shadow cascades follow the camera
+	void updateViewUniforms(glm::uvec2 renderSize);
+
+	// Adds light culling, shadows, the depth pre-pass and the main pass, which renders into the top-left renderSize pixels of colorTarget (m_swapChainFormat)
+	void addScenePasses(RenderGraph::Handle colorTarget, glm::uvec2 renderSize, bool exactSize);
+	void encodeMainPass(WGPUCommandEncoder encoder, WGPUTextureView colorView, WGPUTextureView depthView, glm::uvec2 renderSize);
+	void encodeDearImGuiPass(WGPUCommandEncoder encoder, WGPUTextureView colorView);
+	void setViewport(WGPURenderPassEncoder pass, glm::uvec2 renderSize);
+	// Renders the scene offscreen and reads it back (tightly packed BGRA8), blocks until the GPU is done
+	bool captureScene(std::vector<uint8_t>& pixels, uint32_t& width, uint32_t& height);
+	// One turntable view: clears colorView and depthView and draws m_renderQueue with the uniforms of slot
+	void encodeViewPass(WGPUCommandEncoder encoder, WGPUTextureView colorView, WGPUTextureView depthView, glm::uvec2 size, uint32_t slot);
+
+	// Materials (bind group 1), created once and indexed by material ID
+	struct MaterialResources
+	{
+		AssetCache::Handle texture; // Empty for untextured, virtual and texture array materials
+		WGPUTextureView textureView = nullptr; // Of texture (or the white texture, or m_virtualTextures' cache)
+		uint32_t virtualTexture = VirtualTextureCache::INVALID_TEXTURE;
+		WGPUBuffer uniformBuffer = nullptr; // nullptr with texture arrays
+		WGPUBindGroup bindGroup = nullptr; // Shared by the materials of a texture array (owned by m_textureArrayBindGroups then)
+		uint32_t bindGroupId = 0; // Material field of the sort key, the same for materials that share the bind group
+	};
+	std::vector<Material> m_materials;
+	std::vector<MaterialResources> m_materialResources;
+	WGPUTexture m_whiteTexture = nullptr; // For materials without a texture
+	WGPUTextureView m_whiteTextureView = nullptr;
+	// Material textures streamed by tiles, off unless UseVirtualTextures was called
+	VirtualTextureCache m_virtualTextures;
+	uint64_t m_virtualTextureBudget = 0;
+	// Alternative to the above: material textures packed into arrays, one bind group per array and the materials in a storage buffer
+	bool m_useTextureArrays = false;
+	TextureArrays m_textureArrays;
+	std::vector<WGPUBindGroup> m_textureArrayBindGroups;
+	WGPUBuffer m_materialDataBuffer = nullptr;
+	bool initTextureArrayMaterials();
+	std::filesystem::path getMaterialTexturePath(const Material& material) const; // With the default texture in place of a missing one
+
+	// Shader permutations, compiled on first use. The pipeline ID doubles as the sort key's pipeline field
+	std::vector<WGPURenderPipeline> m_pipelines;
+	std::unordered_map<uint32_t, uint32_t> m_pipelineIds; // By PipelineKey::Pack
+	std::vector<uint32_t> m_materialPipelineIds; // Per material, for the current scene-wide features
+	uint32_t m_shaderFeatures = UINT32_MAX; // Packed scene-wide part of the key m_materialPipelineIds were picked with
+	uint32_t m_directionalLightCount = 2;
+	bool m_pointLightsEnabled = true;
+	bool m_hasVertexColors = false; // Any vertex that isn't white
+	PipelineKey makePipelineKey(uint32_t materialId) const;
+	uint32_t getPipelineId(const PipelineKey& key);
+	WGPURenderPipeline createRenderPipeline(const PipelineKey& key);
+	void updateMaterialPipelines(); // Cheap when nothing changed
+	AssetCache::Handle getShaderModule(const std::vector<std::string>& defines); // Only held while creating pipelines
+
+	// Depth pre-pass: lays down the opaque depth with a position-only pipeline, so fs_main runs once per visible pixel
+	DepthPrepassMode m_depthPrepassMode = DepthPrepassMode::Auto;
+	bool m_depthPrepassActive = false; // Decided every frame
+	float m_depthComplexity = 0.0f; // Estimate used by DepthPrepassMode::Auto
+	WGPUPipelineLayout m_depthPrepassLayout = nullptr;
+	WGPURenderPipeline m_depthPrepassPipeline = nullptr;
+	bool initDepthPrepassPipeline();
+	void updateDepthPrepass();
+	void encodeDepthPrepass(WGPUCommandEncoder encoder, WGPUTextureView depthView, glm::uvec2 renderSize);
+
+	// Fragment counter: with PipelineKey::countFragments every fs_main invocation of the main pass adds one to the buffer.
+	// Always bound, the other permutations just don't touch it
+	WGPUBuffer m_fragmentCountBuffer = nullptr;
+	WGPUBuffer m_fragmentCountReadbackBuffer = nullptr;
+	bool m_countFragments = false;
+	bool initFragmentCounter();
+	uint32_t countMainPassFragments(); // Renders offscreen with the counting pipelines and blocks
+	bool m_opaqueFrontToBack = true; // Off, opaque draws go back to front instead (to measure overdraw)
+
+	// Draws that are encoded every frame (dynamic, transparent, or everything when bundles are off)
+	RenderQueue m_renderQueue;
+	RenderQueue::StateChanges m_bundleStateChanges; // Replayed with the bundle every frame
+	RenderQueue::StateChanges m_mainPassStateChanges; // Last frame's, bundle included
+	void buildRenderQueue();
+	// What a sub-mesh of the object is drawn with, its own material unless the MeshRenderer replaces it
+	uint32_t getMaterialId(const MeshRenderer& renderer, uint32_t subMeshIndex) const;
+	// Position-only draws for the depth pre-pass and the shadows: the sub-meshes of the objects passing includeObject whose
+	// material passes includeMaterial. Neighbouring sub-meshes merge into one draw, objects in neighbouring slots with the
+	// same override into one instanced draw
+	template<typename ObjectFilter, typename MaterialFilter>
+	void drawPositions(WGPURenderPassEncoder pass, ObjectFilter includeObject, MaterialFilter includeMaterial);
+	template<typename Encoder>
+	void encodeRenderQueue(Encoder encoder, const RenderQueue& queue, uint32_t slot, RenderQueue::StateChanges& stateChanges);
+
+	// Scene objects
+	EntityStore m_entities;
+	TransformHierarchy m_transforms;
+	uint32_t m_instanceCount = 0; // Objects in the object buffer
+	WGPUBuffer m_objectBuffer = nullptr;
+	uint32_t m_objectCapacity = 0; // In objects
+	// Texture arrays: (object, material) per instance, the static bundle's records first, then this frame's
+	WGPUBuffer m_drawInstanceBuffer = nullptr; // Room for every sub-mesh of m_objectCapacity objects
+	std::vector<glm::uvec2> m_drawInstances;
+	uint32_t m_staticDrawInstanceCount = 0;
+	void uploadDrawInstances(uint32_t first);
+	bool m_objectsChanged = true; // Transforms need uploading
+
+	// Static draws recorded once per frame slot (the uniform dynamic offset is baked into the bundle)
+	std::array<WGPURenderBundle, MAX_FRAMES_IN_FLIGHT> m_staticBundles = {};
+	bool m_useRenderBundles = true;
+	void invalidateStaticBundles(); // Call when the static set, pipeline or bind group changes
+	WGPURenderBundle recordStaticBundle(uint32_t slot);
+	void syncRigidBodies();
+	void uploadObjects();
+	// The boat, and a smaller one riding the PhysX box (dropped again from its starting pose). Benchmarks come back to it
+	void addDefaultScene();
+
+	// Frames in flight (per-frame resources are indexed by m_frameSlot)
+	struct FrameSlot
+	{
+		bool inFlight = false; // Cleared by the queue work-done callback
+		double submitTime = 0.0;
+	};
+	std::array<FrameSlot, MAX_FRAMES_IN_FLIGHT> m_frameSlots;
+	uint64_t m_frameNumber = 0;
+	uint32_t m_frameSlot = 0;
+	FrameTimings m_frameTimings;
+	void waitForFrameSlot(uint32_t slot);
+
+	// On-demand redraw
+	RedrawMode m_redrawMode = RedrawMode::Continuous;
+	uint32_t m_redrawFrames = 0; // Frames left to render before going idle again
+	double m_idleTime = 0.0; // Time spent blocked in the current stats window
+	double m_idleWindowStart = 0.0;
+	float m_idlePercent = 0.0f;
+	double m_lastFrameEnd = 0.0;
+	bool m_frameFollowsIdle = false;
+	void requestRedraw();
+	void updateIdleStats();
+
 	uint32_t ceilToNextMultiple(uint32_t value, uint32_t step);
 	std::pair<WGPUSurfaceTexture, WGPUTextureView> getNextSurfaceViewData();
 	WGPUAdapter requestAdapterSync(WGPUInstance instance, const WGPURequestAdapterOptions* options);
@@ -110,14 +446,17 @@ private:
 	// For the initialization of the class
 	bool initWindowAndDevice();
 	bool initSwapChain();
-	bool initDepthBuffer();
 	bool initTexture();
+	std::filesystem::path m_modelPath = RESOURCE_DIR "fourareen.obj";
 	bool initGeometry();
 	bool initUniforms();
 	bool initLightingUniforms();
+	bool initObjectBuffer(uint32_t capacity);
 	bool initBindGroupLayout();
 	bool initRenderPipeline();
 	bool initBindGroup();
+	bool initMaterials();
+	AssetCache::Handle getMaterialTexture(const Material& material); // Empty without a texture
 
 	void updateProjectionMatrix();
 	void updateViewMatrix();
@@ -125,11 +464,15 @@ private:
 
 	// Input
 	CameraState m_cameraState;
+	glm::vec3 getCameraPosition() const;
+	WorldStreamer m_worldStreamer;
 	DragState m_dragState;
 	void updateDragInertia();
 	void onMouseMove(double xpos, double ypos);
 	void onMouseButton(int button, int action, int mods);
 	void onScroll(double xoffset, double yoffset);
+	// Unprojects the cursor through the camera and raycasts into the physics scene
+	void pickAtCursor(double xpos, double ypos);
 
 	// Dear ImGui
 	bool initDearImGui();
@@ -0,0 +1,93 @@
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <spdlog/spdlog.h>
+
+#include "MappedFile.hpp"
+
+bool MappedFile::Open(const std::filesystem::path& path)
+{
+	Close();
+#ifdef _WIN32
+	HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		SPDLOG_ERROR("Could not open \"{}\"!", path.string());
+		return false;
+	}
+	m_file = file;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		Close();
+		return false;
+	}
+	m_size = static_cast<size_t>(size.QuadPart);
+	if (m_size == 0) {
+		return true; // Can't map an empty file, but there's nothing to read either
+	}
+	m_mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (m_mapping) {
+		m_data = static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+	}
+#else
+	m_file = open(path.c_str(), O_RDONLY);
+	if (m_file < 0) {
+		SPDLOG_ERROR("Could not open \"{}\"!", path.string());
+		return false;
+	}
+	struct stat status;
+	if (fstat(m_file, &status) != 0) {
+		Close();
+		return false;
+	}
+	m_size = static_cast<size_t>(status.st_size);
+	if (m_size == 0) {
+		return true;
+	}
+	void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_file, 0);
+	if (data != MAP_FAILED) {
+		madvise(data, m_size, MADV_SEQUENTIAL); // Read-ahead
+		m_data = static_cast<const char*>(data);
+	}
+#endif
+	if (!m_data) {
+		SPDLOG_ERROR("Could not map \"{}\"!", path.string());
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::Close()
+{
+#ifdef _WIN32
+	if (m_data) {
+		UnmapViewOfFile(m_data);
+	}
+	if (m_mapping) {
+		CloseHandle(m_mapping);
+	}
+	if (m_file) {
+		CloseHandle(m_file);
+	}
+	m_mapping = nullptr;
+	m_file = nullptr;
+#else
+	if (m_data) {
+		munmap(const_cast<char*>(m_data), m_size);
+	}
+	if (m_file >= 0) {
+		close(m_file);
+	}
+	m_file = -1;
+#endif
+	m_data = nullptr;
+	m_size = 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <filesystem>
+
+// Read-only memory mapping of a whole file. Pages are read in by the OS on first touch, so nothing is copied and files
+// larger than RAM work too (64-bit builds)
+class MappedFile
+{
+public:
+	MappedFile() = default;
+	~MappedFile() { Close(); }
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool Open(const std::filesystem::path& path);
+	void Close();
+
+	const char* GetData() const { return m_data; }
+	size_t GetSize() const { return m_size; }
+	std::string_view GetText() const { return {m_data, m_size}; }
+private:
+	const char* m_data = nullptr;
+	size_t m_size = 0;
+#ifdef _WIN32
+	void* m_file = nullptr;
+	void* m_mapping = nullptr;
+#else
+	int m_file = -1;
+#endif
+};
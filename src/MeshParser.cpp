@@ -0,0 +1,393 @@
+#include <charconv>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+
+#include "MeshParser.hpp"
+#include "MappedFile.hpp"
+#include "JobSystem.hpp"
+#include "Trace.hpp"
+
+namespace MeshParser
+{
+namespace
+{
+// Faces before a chunk's first usemtl keep whatever material the previous chunks left active
+constexpr uint32_t INHERITED_MATERIAL = UINT32_MAX - 1;
+
+struct TextRange
+{
+	size_t begin;
+	size_t end;
+};
+
+// What one job found in its part of an OBJ. Indices are absolute, except the relative (negative) ones listed, which count
+// from the chunk's first vertex until the merge knows where that is
+struct ObjChunk
+{
+	std::vector<float> positions;
+	std::vector<float> colors;
+	std::vector<float> normals;
+	std::vector<float> texcoords;
+	std::vector<ObjIndex> indices;
+	std::vector<uint32_t> faceMaterials; // Into materialNames, or INHERITED_MATERIAL
+	std::vector<std::string> materialNames;
+	std::vector<std::string> materialLibraries;
+	std::vector<std::pair<size_t, uint32_t>> relativeIndices; // Position in indices, component (0 position, 1 texcoord, 2 normal)
+	uint32_t currentMaterial = INHERITED_MATERIAL;
+	bool hasColors = false;
+};
+
+// A piece of a [points] or [indices] section
+struct GeometryChunk
+{
+	bool points = false;
+	TextRange range;
+	std::vector<float> pointData;
+	std::vector<uint32_t> indexData;
+};
+
+bool isSpace(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+const char* skipSpaces(const char* p, const char* end)
+{
+	while (p < end && isSpace(*p)) {
+		++p;
+	}
+	return p;
+}
+
+template<typename T>
+bool parseNumber(const char*& p, const char* end, T& value)
+{
+	p = skipSpaces(p, end);
+	if (p < end && *p == '+') {
+		++p; // from_chars only takes a minus
+	}
+	auto [next, error] = std::from_chars(p, end, value);
+	if (error != std::errc()) {
+		return false;
+	}
+	p = next;
+	return true;
+}
+
+// Chunks of about CHUNK_BYTES, each ending right after a line break (or at the end of the text)
+std::vector<TextRange> splitLines(std::string_view text, size_t offset, size_t size)
+{
+	std::vector<TextRange> ranges;
+	size_t begin = offset;
+	size_t end = offset + size;
+	while (begin < end) {
+		size_t chunkEnd = std::min(begin + CHUNK_BYTES, end);
+		if (chunkEnd < end) {
+			size_t newline = text.find('\n', chunkEnd - 1);
+			chunkEnd = newline == std::string_view::npos ? end : std::min(newline + 1, end);
+		}
+		ranges.push_back({begin, chunkEnd});
+		begin = chunkEnd;
+	}
+	return ranges;
+}
+
+// One "v", "v/t", "v//n" or "v/t/n" face corner, 0 for the parts that are missing. False at the end of the line
+bool parseCorner(const char*& p, const char* end, int64_t (&values)[3])
+{
+	p = skipSpaces(p, end);
+	values[0] = values[1] = values[2] = 0;
+	for (int component = 0; component < 3 && p < end; ++component) {
+		if (*p != '/') {
+			auto [next, error] = std::from_chars(p, end, values[component]);
+			if (error != std::errc()) {
+				break;
+			}
+			p = next;
+		}
+		if (p >= end || *p != '/') {
+			break;
+		}
+		++p;
+	}
+	while (p < end && !isSpace(*p)) {
+		++p; // Whatever we didn't understand
+	}
+	return values[0] != 0;
+}
+
+void pushCorner(ObjChunk& chunk, const int64_t (&values)[3])
+{
+	ObjIndex index;
+	uint32_t* components[3] = {&index.position, &index.texcoord, &index.normal};
+	int64_t counts[3] = {int64_t(chunk.positions.size() / 3), int64_t(chunk.texcoords.size() / 2), int64_t(chunk.normals.size() / 3)};
+	for (uint32_t component = 0; component < 3; ++component) {
+		if (values[component] > 0) {
+			*components[component] = static_cast<uint32_t>(values[component] - 1);
+		} else if (values[component] < 0) {
+			// May point into an earlier chunk (wraps around until the chunk's base is added)
+			*components[component] = static_cast<uint32_t>(counts[component] + values[component]);
+			chunk.relativeIndices.push_back({chunk.indices.size(), component});
+		}
+	}
+	chunk.indices.push_back(index);
+}
+
+bool startsWithKeyword(std::string_view line, std::string_view keyword)
+{
+	return line.size() > keyword.size() && line.starts_with(keyword) && isSpace(line[keyword.size()]);
+}
+
+void parseObjLine(const char* p, const char* end, ObjChunk& chunk)
+{
+	p = skipSpaces(p, end);
+	while (end > p && (end[-1] == '\r' || isSpace(end[-1]))) {
+		--end;
+	}
+	std::string_view line(p, end - p);
+
+	if (startsWithKeyword(line, "v")) {
+		float values[6];
+		int count = 0;
+		p += 1;
+		while (count < 6 && parseNumber(p, end, values[count])) {
+			++count;
+		}
+		if (count < 3) {
+			return;
+		}
+		chunk.positions.insert(chunk.positions.end(), values, values + 3);
+		if (count == 6) {
+			chunk.colors.insert(chunk.colors.end(), values + 3, values + 6);
+			chunk.hasColors = true;
+		} else {
+			chunk.colors.insert(chunk.colors.end(), {1.0f, 1.0f, 1.0f});
+		}
+	} else if (startsWithKeyword(line, "vn")) {
+		float normal[3] = {0.0f, 0.0f, 0.0f};
+		p += 2;
+		for (int i = 0; i < 3 && parseNumber(p, end, normal[i]); ++i) {}
+		chunk.normals.insert(chunk.normals.end(), normal, normal + 3);
+	} else if (startsWithKeyword(line, "vt")) {
+		float uv[2] = {0.0f, 0.0f};
+		p += 2;
+		for (int i = 0; i < 2 && parseNumber(p, end, uv[i]); ++i) {}
+		chunk.texcoords.insert(chunk.texcoords.end(), uv, uv + 2);
+	} else if (startsWithKeyword(line, "f")) {
+		int64_t first[3], previous[3], current[3];
+		p += 1;
+		if (!parseCorner(p, end, first) || !parseCorner(p, end, previous)) {
+			return;
+		}
+		while (parseCorner(p, end, current)) {
+			pushCorner(chunk, first);
+			pushCorner(chunk, previous);
+			pushCorner(chunk, current);
+			chunk.faceMaterials.push_back(chunk.currentMaterial);
+			std::copy(current, current + 3, previous);
+		}
+	} else if (startsWithKeyword(line, "usemtl")) {
+		std::string_view name(skipSpaces(p + 6, end), end - skipSpaces(p + 6, end));
+		auto it = std::find(chunk.materialNames.begin(), chunk.materialNames.end(), name);
+		chunk.currentMaterial = static_cast<uint32_t>(it - chunk.materialNames.begin());
+		if (it == chunk.materialNames.end()) {
+			chunk.materialNames.emplace_back(name);
+		}
+	} else if (startsWithKeyword(line, "mtllib")) {
+		chunk.materialLibraries.emplace_back(skipSpaces(p + 6, end), end);
+	}
+	// Groups, objects, smoothing groups, lines and points don't matter for rendering
+}
+
+void parseObjChunk(const char* p, const char* end, ObjChunk& chunk)
+{
+	while (p < end) {
+		const char* lineEnd = static_cast<const char*>(std::memchr(p, '\n', end - p));
+		lineEnd = lineEnd ? lineEnd : end;
+		parseObjLine(p, lineEnd, chunk);
+		p = lineEnd + 1;
+	}
+}
+}
+
+bool ParseObj(const std::filesystem::path& path, ObjMesh& mesh)
+{
+	MappedFile file;
+	if (!file.Open(path)) {
+		return false;
+	}
+	ParseObjText(file.GetText(), mesh);
+	return true;
+}
+
+void ParseObjText(std::string_view text, ObjMesh& mesh)
+{
+	TRACE_ZONE("MeshParser::ParseObj");
+	std::vector<TextRange> ranges = splitLines(text, 0, text.size());
+	std::vector<ObjChunk> chunks(ranges.size());
+	JobSystem::ParallelFor(static_cast<uint32_t>(ranges.size()), 1, [&text, &ranges, &chunks](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; ++i) {
+			parseObjChunk(text.data() + ranges[i].begin, text.data() + ranges[i].end, chunks[i]);
+		}
+	});
+
+	// Where every chunk goes in the merged arrays, and what its materials are called there
+	struct ChunkBase
+	{
+		size_t positions = 0;
+		size_t normals = 0;
+		size_t texcoords = 0;
+		size_t indices = 0;
+		uint32_t inheritedMaterial = NO_INDEX;
+		std::vector<uint32_t> materials;
+	};
+	std::vector<ChunkBase> bases(chunks.size());
+	ChunkBase total;
+	bool hasColors = false;
+	std::unordered_map<std::string, uint32_t> materialIds;
+	mesh = {};
+	for (size_t i = 0; i < chunks.size(); ++i) {
+		const ObjChunk& chunk = chunks[i];
+		ChunkBase& base = bases[i];
+		base.positions = total.positions;
+		base.normals = total.normals;
+		base.texcoords = total.texcoords;
+		base.indices = total.indices;
+		base.inheritedMaterial = total.inheritedMaterial;
+		for (const std::string& name : chunk.materialNames) {
+			auto [it, inserted] = materialIds.try_emplace(name, static_cast<uint32_t>(mesh.materialNames.size()));
+			if (inserted) {
+				mesh.materialNames.push_back(name);
+			}
+			base.materials.push_back(it->second);
+		}
+		if (chunk.currentMaterial != INHERITED_MATERIAL) {
+			total.inheritedMaterial = base.materials[chunk.currentMaterial];
+		}
+		total.positions += chunk.positions.size() / 3;
+		total.normals += chunk.normals.size() / 3;
+		total.texcoords += chunk.texcoords.size() / 2;
+		total.indices += chunk.indices.size();
+		hasColors = hasColors || chunk.hasColors;
+		mesh.materialLibraries.insert(mesh.materialLibraries.end(), chunk.materialLibraries.begin(), chunk.materialLibraries.end());
+	}
+
+	mesh.positions.resize(total.positions * 3);
+	mesh.colors.resize(hasColors ? total.positions * 3 : 0);
+	mesh.normals.resize(total.normals * 3);
+	mesh.texcoords.resize(total.texcoords * 2);
+	mesh.indices.resize(total.indices);
+	mesh.faceMaterials.resize(total.indices / 3);
+	JobSystem::ParallelFor(static_cast<uint32_t>(chunks.size()), 1, [&mesh, &chunks, &bases](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; ++i) {
+			ObjChunk& chunk = chunks[i];
+			const ChunkBase& base = bases[i];
+			std::copy(chunk.positions.begin(), chunk.positions.end(), mesh.positions.begin() + base.positions * 3);
+			if (!mesh.colors.empty()) {
+				std::copy(chunk.colors.begin(), chunk.colors.end(), mesh.colors.begin() + base.positions * 3);
+			}
+			std::copy(chunk.normals.begin(), chunk.normals.end(), mesh.normals.begin() + base.normals * 3);
+			std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), mesh.texcoords.begin() + base.texcoords * 2);
+
+			ObjIndex* indices = mesh.indices.data() + base.indices;
+			std::copy(chunk.indices.begin(), chunk.indices.end(), indices);
+			uint32_t componentBases[3] = {static_cast<uint32_t>(base.positions), static_cast<uint32_t>(base.texcoords), static_cast<uint32_t>(base.normals)};
+			for (const auto& [position, component] : chunk.relativeIndices) {
+				uint32_t* components[3] = {&indices[position].position, &indices[position].texcoord, &indices[position].normal};
+				*components[component] += componentBases[component];
+			}
+
+			uint32_t* faceMaterials = mesh.faceMaterials.data() + base.indices / 3;
+			for (size_t face = 0; face < chunk.faceMaterials.size(); ++face) {
+				uint32_t material = chunk.faceMaterials[face];
+				faceMaterials[face] = material == INHERITED_MATERIAL ? base.inheritedMaterial : base.materials[material];
+			}
+			chunk = {}; // Keeps the peak memory down on big files
+		}
+	});
+}
+
+bool ParseGeometry(const std::filesystem::path& path, std::vector<float>& pointData, std::vector<uint32_t>& indexData, int dimensions)
+{
+	MappedFile file;
+	if (!file.Open(path)) {
+		return false;
+	}
+	ParseGeometryText(file.GetText(), pointData, indexData, dimensions);
+	return true;
+}
+
+void ParseGeometryText(std::string_view text, std::vector<float>& pointData, std::vector<uint32_t>& indexData, int dimensions)
+{
+	TRACE_ZONE("MeshParser::ParseGeometry");
+	// Section headers are rare, so find them first and then cut the sections into chunks
+	std::vector<GeometryChunk> chunks;
+	auto addSection = [&](int section, size_t begin, size_t end)
+	{
+		if (section != 0 && end > begin) {
+			for (const TextRange& range : splitLines(text, begin, end - begin)) {
+				GeometryChunk& chunk = chunks.emplace_back();
+				chunk.points = section == 1;
+				chunk.range = range;
+			}
+		}
+	};
+	int section = 0; // 0 none, 1 points, 2 indices
+	size_t sectionBegin = 0;
+	size_t position = 0;
+	while ((position = text.find('[', position)) != std::string_view::npos) {
+		bool lineStart = position == 0 || text[position - 1] == '\n';
+		int header = !lineStart ? 0 : text.substr(position).starts_with("[points]") ? 1 : text.substr(position).starts_with("[indices]") ? 2 : 0;
+		if (header == 0) {
+			++position;
+			continue;
+		}
+		addSection(section, sectionBegin, position);
+		section = header;
+		size_t newline = text.find('\n', position);
+		sectionBegin = position = newline == std::string_view::npos ? text.size() : newline + 1;
+	}
+	addSection(section, sectionBegin, text.size());
+
+	// Get x, y, (z), r, g, b per point and corners 0, 1, 2 per triangle
+	JobSystem::ParallelFor(static_cast<uint32_t>(chunks.size()), 1, [&text, &chunks, dimensions](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; ++i) {
+			GeometryChunk& chunk = chunks[i];
+			const char* p = text.data() + chunk.range.begin;
+			const char* chunkEnd = text.data() + chunk.range.end;
+			while (p < chunkEnd) {
+				const char* lineEnd = static_cast<const char*>(std::memchr(p, '\n', chunkEnd - p));
+				lineEnd = lineEnd ? lineEnd : chunkEnd;
+				const char* lineStart = skipSpaces(p, lineEnd);
+				if (lineStart < lineEnd && *lineStart != '#' && *lineStart != '\r') {
+					if (chunk.points) {
+						for (int value = 0; value < dimensions + 3; ++value) {
+							float number = 0.0f;
+							parseNumber(lineStart, lineEnd, number);
+							chunk.pointData.push_back(number);
+						}
+					} else {
+						for (int corner = 0; corner < 3; ++corner) {
+							uint32_t index = 0;
+							parseNumber(lineStart, lineEnd, index);
+							chunk.indexData.push_back(index);
+						}
+					}
+				}
+				p = lineEnd + 1;
+			}
+		}
+	});
+
+	pointData.clear();
+	indexData.clear();
+	for (const GeometryChunk& chunk : chunks) {
+		pointData.insert(pointData.end(), chunk.pointData.begin(), chunk.pointData.end());
+		indexData.insert(indexData.end(), chunk.indexData.begin(), chunk.indexData.end());
+	}
+}
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <filesystem>
+
+// Text geometry parsers that work straight on a memory-mapped file: the text is cut into line-aligned chunks, the chunks
+// are parsed with std::from_chars on the job system and the results are stitched together in file order
+namespace MeshParser
+{
+	constexpr size_t CHUNK_BYTES = 4 << 20; // Per job, extended to the next line break
+	constexpr uint32_t NO_INDEX = UINT32_MAX;
+
+	struct ObjIndex // 0-based, NO_INDEX when the face doesn't have it
+	{
+		uint32_t position = NO_INDEX;
+		uint32_t texcoord = NO_INDEX;
+		uint32_t normal = NO_INDEX;
+	};
+
+	struct ObjMesh
+	{
+		std::vector<float> positions; // xyz
+		std::vector<float> colors; // rgb per position, empty if no "v" line had a color
+		std::vector<float> normals; // xyz
+		std::vector<float> texcoords; // uv
+		std::vector<ObjIndex> indices; // Triangles (polygons are fanned)
+		std::vector<uint32_t> faceMaterials; // Per triangle, into materialNames (NO_INDEX before the first usemtl)
+		std::vector<std::string> materialNames; // usemtl names, in order of first use
+		std::vector<std::string> materialLibraries; // mtllib
+	};
+
+	bool ParseObj(const std::filesystem::path& path, ObjMesh& mesh);
+	void ParseObjText(std::string_view text, ObjMesh& mesh);
+	// The [points]/[indices] format: dimensions + 3 (rgb) floats per point, 3 indices per triangle
+	bool ParseGeometry(const std::filesystem::path& path, std::vector<float>& pointData, std::vector<uint32_t>& indexData, int dimensions);
+	void ParseGeometryText(std::string_view text, std::vector<float>& pointData, std::vector<uint32_t>& indexData, int dimensions);
+}
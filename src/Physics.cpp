@@ -1,7 +1,13 @@
+#include <algorithm>
+#include <chrono>
+
 #include <PxPhysicsAPI.h>
+#include <extensions/PxBatchQueryExt.h>
 #include <spdlog/spdlog.h>
 
 #include "Physics.hpp"
+#include "JobSystem.hpp"
+#include "Trace.hpp"
 
 class UserErrorCallback : public physx::PxErrorCallback
 {
@@ -18,17 +24,198 @@ physx::PxFoundation* g_foundation = nullptr;
 physx::PxPhysics* g_physics = nullptr;
 physx::PxDefaultAllocator g_allocator;
 physx::PxDefaultCpuDispatcher* g_cpuDispatcher = nullptr;
-physx::PxScene* g_scene = nullptr;
+// No worker threads, so the simulation runs on whichever thread calls simulate() (used by the batch worlds, which are already spread over the job system)
+physx::PxDefaultCpuDispatcher* g_inlineDispatcher = nullptr;
 
-// Ground
+// Shared by every world (one copy in memory no matter how many worlds exist)
 physx::PxMaterial* g_material = nullptr;
-physx::PxRigidStatic* g_ground = nullptr;
+physx::PxShape* g_groundShape = nullptr;
+physx::PxShape* g_boxShape = nullptr;
 
 // Box
-physx::PxTransform g_boxTransform = physx::PxTransform(0, 5, 0);
+const physx::PxTransform g_boxStartTransform = physx::PxTransform(0, 5, 0);
+physx::PxTransform g_boxTransform = g_boxStartTransform;
 physx::PxBoxGeometry g_boxGeometry = physx::PxVec3(1, 1, 1);
-physx::PxRigidDynamic* g_box = nullptr;
 
+// The world that gets rendered
+PhysicsWorld g_world;
+
+// Scene queries
+constexpr uint32_t QUERIES_PER_JOB = 256;
+
+void fillHit(const physx::PxLocationHit& block, QueryHit& hit)
+{
+	hit.hit = true;
+	hit.actor = block.actor;
+	hit.position = block.position;
+	hit.normal = block.normal;
+	hit.distance = block.distance;
+}
+
+void QueryBatch::Clear()
+{
+	raycasts.clear();
+	sweeps.clear();
+	overlaps.clear();
+	raycastHits.clear();
+	sweepHits.clear();
+	overlapHits.clear();
+}
+}
+
+bool PhysicsWorld::Init(physx::PxCpuDispatcher* cpuDispatcher)
+{
+	physx::PxSceneDesc sceneDesc(Physics::g_physics->getTolerancesScale());
+	sceneDesc.gravity = physx::PxVec3(0.0f, -9.81f, 0.0f); // Earth's gravity
+	sceneDesc.cpuDispatcher = cpuDispatcher;
+	sceneDesc.filterShader = physx::PxDefaultSimulationFilterShader; // TODO: Change later?
+
+	m_scene = Physics::g_physics->createScene(sceneDesc);
+	if (!m_scene) {
+		SPDLOG_ERROR("NVIDIA PhysX - createScene error!");
+		return false;
+	}
+
+	// Static ground plane
+	m_ground = Physics::g_physics->createRigidStatic(physx::PxTransformFromPlaneEquation(physx::PxPlane(0, 1, 0, 0)));
+	m_ground->attachShape(*Physics::g_groundShape);
+	m_scene->addActor(*m_ground);
+
+	// Dynamic box
+	m_box = Physics::g_physics->createRigidDynamic(Physics::g_boxStartTransform);
+	m_box->attachShape(*Physics::g_boxShape);
+	physx::PxRigidBodyExt::updateMassAndInertia(*m_box, 1.0f);
+	m_scene->addActor(*m_box);
+
+	return true;
+}
+
+void PhysicsWorld::Step(float timeStep)
+{
+	m_scene->simulate(timeStep);
+	m_scene->fetchResults(true);
+}
+
+bool PhysicsWorld::IsAtRest() const
+{
+	constexpr uint32_t ACTORS_PER_FETCH = 64;
+	physx::PxActor* actors[ACTORS_PER_FETCH];
+	uint32_t actorCount = m_scene->getNbActors(physx::PxActorTypeFlag::eRIGID_DYNAMIC);
+	for (uint32_t start = 0; start < actorCount; start += ACTORS_PER_FETCH) {
+		uint32_t fetched = m_scene->getActors(physx::PxActorTypeFlag::eRIGID_DYNAMIC, actors, ACTORS_PER_FETCH, start);
+		for (uint32_t i = 0; i < fetched; ++i) {
+			if (!static_cast<physx::PxRigidDynamic*>(actors[i])->isSleeping()) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void PhysicsWorld::Terminate()
+{
+	m_box->release();
+	m_ground->release();
+	m_scene->release();
+	m_box = nullptr;
+	m_ground = nullptr;
+	m_scene = nullptr;
+}
+
+bool PhysicsWorld::Raycast(const physx::PxVec3& origin, const physx::PxVec3& direction, float distance, Physics::QueryHit& hit) const
+{
+	hit = Physics::QueryHit();
+	physx::PxRaycastBuffer buffer;
+	if (!m_scene->raycast(origin, direction, distance, buffer) || !buffer.hasBlock) {
+		return false;
+	}
+	Physics::fillHit(buffer.block, hit);
+	return true;
+}
+
+void PhysicsWorld::ExecuteQueries(Physics::QueryBatch& batch) const
+{
+	TRACE_ZONE("Physics::ExecuteQueries");
+	batch.raycastHits.resize(batch.raycasts.size());
+	batch.sweepHits.resize(batch.sweeps.size());
+	batch.overlapHits.resize(batch.overlaps.size());
+
+	// Scene reads are safe from several threads as long as nobody is simulating
+	uint32_t queryCount = static_cast<uint32_t>(batch.raycasts.size() + batch.sweeps.size() + batch.overlaps.size());
+	JobSystem::ParallelFor(queryCount, Physics::QUERIES_PER_JOB, [this, &batch](uint32_t begin, uint32_t end)
+	{
+		executeQueryRange(batch, begin, end);
+	});
+}
+
+// Runs the queries [begin, end) of the batch (indices span raycasts, then sweeps, then overlaps)
+void PhysicsWorld::executeQueryRange(Physics::QueryBatch& batch, uint32_t begin, uint32_t end) const
+{
+	const uint32_t raycastCount = static_cast<uint32_t>(batch.raycasts.size());
+	const uint32_t sweepCount = static_cast<uint32_t>(batch.sweeps.size());
+
+	// Figure out how much of each query type lands in this range
+	uint32_t raycastBegin = std::min(begin, raycastCount), raycastEnd = std::min(end, raycastCount);
+	uint32_t sweepBegin = std::clamp(begin, raycastCount, raycastCount + sweepCount) - raycastCount;
+	uint32_t sweepEnd = std::clamp(end, raycastCount, raycastCount + sweepCount) - raycastCount;
+	uint32_t overlapBegin = std::max(begin, raycastCount + sweepCount) - raycastCount - sweepCount;
+	uint32_t overlapEnd = std::max(end, raycastCount + sweepCount) - raycastCount - sweepCount;
+
+	// Only blocking hits are needed, so no touch buffers
+	physx::PxBatchQueryExt* batchQuery = physx::PxCreateBatchQueryExt(*m_scene, nullptr,
+		raycastEnd - raycastBegin, 0, sweepEnd - sweepBegin, 0, overlapEnd - overlapBegin, 0);
+
+	std::vector<physx::PxRaycastBuffer*> raycastBuffers;
+	std::vector<physx::PxSweepBuffer*> sweepBuffers;
+	std::vector<physx::PxOverlapBuffer*> overlapBuffers;
+	raycastBuffers.reserve(raycastEnd - raycastBegin);
+	sweepBuffers.reserve(sweepEnd - sweepBegin);
+	overlapBuffers.reserve(overlapEnd - overlapBegin);
+
+	for (uint32_t i = raycastBegin; i < raycastEnd; ++i) {
+		const Physics::RaycastQuery& query = batch.raycasts[i];
+		raycastBuffers.push_back(batchQuery->raycast(query.origin, query.direction, query.distance));
+	}
+	for (uint32_t i = sweepBegin; i < sweepEnd; ++i) {
+		const Physics::SweepQuery& query = batch.sweeps[i];
+		sweepBuffers.push_back(batchQuery->sweep(query.geometry.any(), query.pose, query.direction, query.distance));
+	}
+	physx::PxQueryFilterData overlapFilter(physx::PxQueryFlag::eSTATIC | physx::PxQueryFlag::eDYNAMIC | physx::PxQueryFlag::eANY_HIT);
+	for (uint32_t i = overlapBegin; i < overlapEnd; ++i) {
+		const Physics::OverlapQuery& query = batch.overlaps[i];
+		overlapBuffers.push_back(batchQuery->overlap(query.geometry.any(), query.pose, 0, overlapFilter));
+	}
+
+	batchQuery->execute();
+
+	for (uint32_t i = 0; i < raycastBuffers.size(); ++i) {
+		Physics::QueryHit& hit = batch.raycastHits[raycastBegin + i];
+		hit = Physics::QueryHit();
+		if (raycastBuffers[i] && raycastBuffers[i]->hasBlock) {
+			Physics::fillHit(raycastBuffers[i]->block, hit);
+		}
+	}
+	for (uint32_t i = 0; i < sweepBuffers.size(); ++i) {
+		Physics::QueryHit& hit = batch.sweepHits[sweepBegin + i];
+		hit = Physics::QueryHit();
+		if (sweepBuffers[i] && sweepBuffers[i]->hasBlock) {
+			Physics::fillHit(sweepBuffers[i]->block, hit);
+		}
+	}
+	for (uint32_t i = 0; i < overlapBuffers.size(); ++i) {
+		Physics::QueryHit& hit = batch.overlapHits[overlapBegin + i];
+		hit = Physics::QueryHit();
+		if (overlapBuffers[i] && overlapBuffers[i]->hasBlock) {
+			hit.hit = true;
+			hit.actor = overlapBuffers[i]->block.actor;
+		}
+	}
+
+	batchQuery->release();
+}
+
+namespace Physics
+{
 bool Init()
 {
 	g_foundation = PxCreateFoundation(PX_PHYSICS_VERSION, g_allocator, g_physxErrorCallback);
@@ -45,49 +232,89 @@ bool Init()
 		return false;
 	}
 
-	physx::PxSceneDesc sceneDesc(g_physics->getTolerancesScale());
-	sceneDesc.gravity = physx::PxVec3(0.0f, -9.81f, 0.0f); // Earth's gravity
-
 	g_cpuDispatcher = physx::PxDefaultCpuDispatcherCreate(2);
-	sceneDesc.cpuDispatcher = g_cpuDispatcher;
-	sceneDesc.filterShader = physx::PxDefaultSimulationFilterShader; // TODO: Change later?
-
-	g_scene = g_physics->createScene(sceneDesc);
-	if (!g_scene) {
-		SPDLOG_ERROR("NVIDIA PhysX - createScene error!");
-		return false;
-	}
+	g_inlineDispatcher = physx::PxDefaultCpuDispatcherCreate(0);
 
-	// Static ground plane
+	// Non-exclusive shapes can be attached to actors in any number of scenes
 	g_material = g_physics->createMaterial(0.5f, 0.5f, 0.6f);
-	g_ground = physx::PxCreatePlane(*g_physics, physx::PxPlane(0, 1, 0, 0), *g_material);
-	g_scene->addActor(*g_ground);
+	g_groundShape = g_physics->createShape(physx::PxPlaneGeometry(), *g_material, false);
+	g_boxShape = g_physics->createShape(g_boxGeometry, *g_material, false);
 
-	// Dynamic box
-	g_box = physx::PxCreateDynamic(*g_physics, g_boxTransform, g_boxGeometry, *g_material, 1.0f);
-	g_scene->addActor(*g_box);
-
-	return true;
+	return g_world.Init(g_cpuDispatcher);
 }
 void Step()
 {
-	// Run at 75 FPS
-	g_scene->simulate(1.0f / 75.0f);
-	g_scene->fetchResults(true);
+	TRACE_ZONE("Physics::Step");
+	g_world.Step(TIME_STEP);
 
-	physx::PxTransform updatedBoxPos = g_box->getGlobalPose();
+	physx::PxTransform updatedBoxPos = g_world.GetBox()->getGlobalPose();
 	if (updatedBoxPos != g_boxTransform) {
 		SPDLOG_INFO("Box = {{{}, {}, {}}}", updatedBoxPos.p.x, updatedBoxPos.p.y, updatedBoxPos.p.z);
 		g_boxTransform = updatedBoxPos;
 	}
 }
+PhysicsWorld& GetWorld()
+{
+	return g_world;
+}
+bool Raycast(const physx::PxVec3& origin, const physx::PxVec3& direction, float distance, QueryHit& hit)
+{
+	return g_world.Raycast(origin, direction, distance, hit);
+}
+void ExecuteQueries(QueryBatch& batch)
+{
+	g_world.ExecuteQueries(batch);
+}
+physx::PxRigidStatic* CreateStaticBox(const physx::PxTransform& pose, const physx::PxVec3& halfExtents)
+{
+	physx::PxRigidStatic* actor = g_physics->createRigidStatic(pose);
+	physx::PxRigidActorExt::createExclusiveShape(*actor, physx::PxBoxGeometry(halfExtents), *g_material);
+	return actor;
+}
+double RunBatch(uint32_t worldCount, uint32_t stepCount)
+{
+	TRACE_ZONE("Physics::RunBatch");
+	// Scene creation goes through PxPhysics, so keep it on this thread
+	std::vector<PhysicsWorld> worlds(worldCount);
+	for (uint32_t i = 0; i < worldCount; ++i) {
+		if (!worlds[i].Init(g_inlineDispatcher)) {
+			SPDLOG_ERROR("Could not create batch world {} of {}!", i + 1, worldCount);
+			for (uint32_t j = 0; j < i; ++j) {
+				worlds[j].Terminate();
+			}
+			return 0.0;
+		}
+	}
+
+	// Each job owns whole worlds, so no two threads ever touch the same scene
+	auto start = std::chrono::steady_clock::now();
+	JobSystem::ParallelFor(worldCount, 1, [&worlds, stepCount](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; ++i) {
+			for (uint32_t step = 0; step < stepCount; ++step) {
+				worlds[i].Step(TIME_STEP);
+			}
+		}
+	});
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	for (PhysicsWorld& world : worlds) {
+		world.Terminate();
+	}
+
+	double stepsPerSecond = seconds > 0.0 ? (double)worldCount * stepCount / seconds : 0.0;
+	SPDLOG_INFO("Physics batch: {} worlds x {} steps in {:.3f} s ({:.0f} steps/s on {} workers)", worldCount, stepCount, seconds, stepsPerSecond, JobSystem::GetWorkerCount());
+	return stepsPerSecond;
+}
 void Terminate()
 {
-	g_box->release();
-	g_ground->release();
-	g_scene->release();
+	g_world.Terminate();
+	g_boxShape->release();
+	g_groundShape->release();
+	g_material->release();
+	g_inlineDispatcher->release();
 	g_cpuDispatcher->release();
 	g_physics->release();
 	g_foundation->release();
 }
-}
\ No newline at end of file
+}
@@ -1,8 +1,96 @@
 #pragma once
 
+#include <vector>
+
+#include <PxPhysicsAPI.h>
+
+namespace Physics
+{
+	struct RaycastQuery
+	{
+		physx::PxVec3 origin;
+		physx::PxVec3 direction; // Must be normalized
+		float distance = PX_MAX_F32;
+	};
+
+	struct SweepQuery
+	{
+		physx::PxGeometryHolder geometry;
+		physx::PxTransform pose;
+		physx::PxVec3 direction; // Must be normalized
+		float distance = PX_MAX_F32;
+	};
+
+	struct OverlapQuery
+	{
+		physx::PxGeometryHolder geometry;
+		physx::PxTransform pose;
+	};
+
+	struct QueryHit
+	{
+		bool hit = false;
+		physx::PxRigidActor* actor = nullptr;
+		// Overlaps only fill in the actor
+		physx::PxVec3 position = physx::PxVec3(0.0f);
+		physx::PxVec3 normal = physx::PxVec3(0.0f);
+		float distance = 0.0f;
+	};
+
+	// Gameplay/sensor code fills this in every tick and runs it in one go with ExecuteQueries
+	struct QueryBatch
+	{
+		std::vector<RaycastQuery> raycasts;
+		std::vector<SweepQuery> sweeps;
+		std::vector<OverlapQuery> overlaps;
+
+		// Same order as the queries above (closest blocking hit only)
+		std::vector<QueryHit> raycastHits;
+		std::vector<QueryHit> sweepHits;
+		std::vector<QueryHit> overlapHits;
+
+		void Clear();
+	};
+};
+
+// One independent copy of the simulated world (scene + actors). Materials and shapes are shared between all worlds
+class PhysicsWorld
+{
+public:
+	bool Init(physx::PxCpuDispatcher* cpuDispatcher);
+	void Step(float timeStep);
+	void Terminate();
+	// True when every dynamic actor is asleep (stepping would not move anything)
+	bool IsAtRest() const;
+
+	bool Raycast(const physx::PxVec3& origin, const physx::PxVec3& direction, float distance, Physics::QueryHit& hit) const;
+	// Must not be called while the scene is simulating
+	void ExecuteQueries(Physics::QueryBatch& batch) const;
+
+	physx::PxScene* GetScene() const { return m_scene; }
+	physx::PxRigidDynamic* GetBox() const { return m_box; }
+private:
+	physx::PxScene* m_scene = nullptr;
+	physx::PxRigidStatic* m_ground = nullptr;
+	physx::PxRigidDynamic* m_box = nullptr;
+
+	void executeQueryRange(Physics::QueryBatch& batch, uint32_t begin, uint32_t end) const;
+};
+
 namespace Physics
 {
+	constexpr float TIME_STEP = 1.0f / 75.0f; // Run at 75 FPS
+
 	bool Init();
+	// Steps the main (rendered) world
 	void Step();
+	PhysicsWorld& GetWorld();
+	// Closest hit along a single ray in the main world (use for picking, not for thousands of rays)
+	bool Raycast(const physx::PxVec3& origin, const physx::PxVec3& direction, float distance, QueryHit& hit);
+	void ExecuteQueries(QueryBatch& batch);
+	// Not added to any scene yet
+	physx::PxRigidStatic* CreateStaticBox(const physx::PxTransform& pose, const physx::PxVec3& halfExtents);
+	// Offline what-if runs: steps worldCount independent worlds stepCount times in parallel, returns the aggregate steps/second
+	double RunBatch(uint32_t worldCount, uint32_t stepCount);
 	void Terminate();
-};
\ No newline at end of file
+};
@@ -0,0 +1,369 @@
+#include <bit>
+#include <queue>
+#include <algorithm>
+
+#include <spdlog/spdlog.h>
+#include <imgui/imgui.h>
+
+#include "RenderGraph.hpp"
+#include "Stats.hpp"
+#include "Trace.hpp"
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::Read(Handle resource)
+{
+	m_graph.m_passes[m_pass].reads.push_back(resource);
+	m_graph.m_resources[resource].readers.push_back(m_pass);
+	return *this;
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::Write(Handle resource)
+{
+	m_graph.m_passes[m_pass].writes.push_back(resource);
+	m_graph.m_resources[resource].writers.push_back(m_pass);
+	return *this;
+}
+
+RenderGraph::PassBuilder& RenderGraph::PassBuilder::SideEffect()
+{
+	m_graph.m_passes[m_pass].sideEffect = true;
+	return *this;
+}
+
+void RenderGraph::Terminate()
+{
+	for (PhysicalBuffer& physical : m_physicalBuffers) {
+		Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers, -(int64_t)physical.size);
+		wgpuBufferDestroy(physical.buffer);
+		wgpuBufferRelease(physical.buffer);
+	}
+	m_physicalBuffers.clear();
+}
+
+void RenderGraph::Reset()
+{
+	m_resources.clear();
+	m_passes.clear();
+	m_order.clear();
+	m_physicalTextures.clear();
+	++m_frame;
+
+	// Buffers that no frame asked for in a while
+	std::erase_if(m_physicalBuffers, [this](PhysicalBuffer& physical)
+	{
+		if (m_frame - physical.lastUsedFrame < BUFFER_UNUSED_FRAMES) {
+			return false;
+		}
+		Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers, -(int64_t)physical.size);
+		wgpuBufferDestroy(physical.buffer);
+		wgpuBufferRelease(physical.buffer);
+		return true;
+	});
+}
+
+RenderGraph::Handle RenderGraph::addResource(Resource&& resource)
+{
+	m_resources.push_back(std::move(resource));
+	return static_cast<Handle>(m_resources.size() - 1);
+}
+
+RenderGraph::Handle RenderGraph::CreateTexture(const char* name, const TextureDesc& desc)
+{
+	Resource resource;
+	resource.name = name;
+	resource.type = ResourceType::Texture;
+	resource.textureDesc = desc;
+	uint32_t width = desc.exactSize ? desc.width : RenderTargetPool::RoundToBucket(desc.width);
+	uint32_t height = desc.exactSize ? desc.height : RenderTargetPool::RoundToBucket(desc.height);
+	resource.bytes = uint64_t(width) * height * RenderTargetPool::BytesPerTexel(desc.format);
+	return addResource(std::move(resource));
+}
+
+RenderGraph::Handle RenderGraph::CreateBuffer(const char* name, uint64_t size, WGPUBufferUsageFlags usage)
+{
+	Resource resource;
+	resource.name = name;
+	resource.type = ResourceType::Buffer;
+	resource.bufferSize = size;
+	resource.bufferUsage = usage;
+	resource.bytes = std::bit_ceil(size); // Pooled in powers of two
+	return addResource(std::move(resource));
+}
+
+RenderGraph::Handle RenderGraph::ImportTexture(const char* name, WGPUTextureView view)
+{
+	Resource resource;
+	resource.name = name;
+	resource.type = ResourceType::Texture;
+	resource.imported = true;
+	resource.view = view;
+	return addResource(std::move(resource));
+}
+
+RenderGraph::Handle RenderGraph::ImportBuffer(const char* name, WGPUBuffer buffer)
+{
+	Resource resource;
+	resource.name = name;
+	resource.type = ResourceType::Buffer;
+	resource.imported = true;
+	resource.buffer = buffer;
+	return addResource(std::move(resource));
+}
+
+void RenderGraph::MarkOutput(Handle resource)
+{
+	m_resources[resource].output = true;
+}
+
+RenderGraph::PassBuilder RenderGraph::AddPass(const char* name, ExecuteFunction execute)
+{
+	Pass pass;
+	pass.name = name;
+	pass.execute = std::move(execute);
+	m_passes.push_back(std::move(pass));
+	return PassBuilder(*this, static_cast<uint32_t>(m_passes.size() - 1));
+}
+
+void RenderGraph::Compile()
+{
+	TRACE_ZONE("RenderGraph::Compile");
+	cull();
+	sortPasses();
+	assignMemory();
+}
+
+void RenderGraph::cull()
+{
+	// Walk back from the outputs: a pass survives if it writes an output or something a surviving pass reads
+	std::vector<uint32_t> worklist;
+	for (uint32_t i = 0; i < m_passes.size(); ++i) {
+		Pass& pass = m_passes[i];
+		pass.culled = !pass.sideEffect && std::none_of(pass.writes.begin(), pass.writes.end(), [this](Handle resource) { return m_resources[resource].output; });
+		if (!pass.culled) {
+			worklist.push_back(i);
+		}
+	}
+	while (!worklist.empty()) {
+		uint32_t passIndex = worklist.back();
+		worklist.pop_back();
+		for (Handle resource : m_passes[passIndex].reads) {
+			for (uint32_t writer : m_resources[resource].writers) {
+				if (m_passes[writer].culled) {
+					m_passes[writer].culled = false;
+					worklist.push_back(writer);
+				}
+			}
+		}
+	}
+}
+
+void RenderGraph::sortPasses()
+{
+	// Accesses to the same resource keep their declaration order when one of them writes (reads of a resource declared
+	// before any of its writers wait for all of them). Ties go to declaration order, so a well-ordered frame stays as it is
+	std::vector<std::vector<uint32_t>> dependents(m_passes.size());
+	std::vector<uint32_t> dependencyCount(m_passes.size(), 0);
+	auto addEdge = [&](uint32_t from, uint32_t to)
+	{
+		if (from != to && !m_passes[from].culled && !m_passes[to].culled) {
+			dependents[from].push_back(to);
+			++dependencyCount[to];
+		}
+	};
+	for (const Resource& resource : m_resources) {
+		for (uint32_t writer : resource.writers) {
+			for (uint32_t other : resource.writers) {
+				if (other < writer) {
+					addEdge(other, writer);
+				}
+			}
+			for (uint32_t reader : resource.readers) {
+				bool earlierWriter = std::any_of(resource.writers.begin(), resource.writers.end(), [reader](uint32_t w) { return w < reader; });
+				if (writer < reader || !earlierWriter) {
+					addEdge(writer, reader);
+				} else if (reader < writer) {
+					addEdge(reader, writer); // Write after read
+				}
+			}
+		}
+	}
+
+	std::priority_queue<uint32_t, std::vector<uint32_t>, std::greater<uint32_t>> ready;
+	uint32_t survivingCount = 0;
+	for (uint32_t i = 0; i < m_passes.size(); ++i) {
+		if (!m_passes[i].culled) {
+			++survivingCount;
+			if (dependencyCount[i] == 0) {
+				ready.push(i);
+			}
+		}
+	}
+	while (!ready.empty()) {
+		uint32_t passIndex = ready.top();
+		ready.pop();
+		m_order.push_back(passIndex);
+		for (uint32_t dependent : dependents[passIndex]) {
+			if (--dependencyCount[dependent] == 0) {
+				ready.push(dependent);
+			}
+		}
+	}
+
+	if (m_order.size() != survivingCount) {
+		SPDLOG_ERROR("Render graph has a cycle, falling back to declaration order.");
+		m_order.clear();
+		for (uint32_t i = 0; i < m_passes.size(); ++i) {
+			if (!m_passes[i].culled) {
+				m_order.push_back(i);
+			}
+		}
+	}
+}
+
+void RenderGraph::assignMemory()
+{
+	// Lifetimes, as positions in the execution order
+	for (uint32_t position = 0; position < m_order.size(); ++position) {
+		const Pass& pass = m_passes[m_order[position]];
+		for (const std::vector<Handle>* accesses : {&pass.reads, &pass.writes}) {
+			for (Handle handle : *accesses) {
+				Resource& resource = m_resources[handle];
+				resource.firstUse = std::min(resource.firstUse, position);
+				resource.lastUse = std::max(resource.lastUse, position);
+			}
+		}
+	}
+
+	// Greedy: a resource takes over the first compatible texture/buffer whose previous resource is done with it
+	m_report = {};
+	m_report.passCount = static_cast<uint32_t>(m_passes.size());
+	m_report.culledPassCount = m_report.passCount - static_cast<uint32_t>(m_order.size());
+	for (uint32_t position = 0; position < m_order.size(); ++position) {
+		for (Resource& resource : m_resources) {
+			if (resource.imported || resource.firstUse != position) {
+				continue;
+			}
+			++m_report.transientCount;
+			m_report.unaliasedBytes += resource.bytes;
+			if (resource.type == ResourceType::Texture) {
+				resource.physical = acquirePhysicalTexture(resource);
+				resource.view = m_physicalTextures[resource.physical].target->view;
+			} else {
+				resource.physical = acquirePhysicalBuffer(resource);
+				resource.buffer = m_physicalBuffers[resource.physical].buffer;
+			}
+		}
+	}
+	for (const PhysicalTexture& physical : m_physicalTextures) {
+		m_report.peakBytes += physical.target->bytes;
+		++m_report.physicalCount;
+	}
+	for (const PhysicalBuffer& physical : m_physicalBuffers) {
+		if (physical.inUse) {
+			m_report.peakBytes += physical.size;
+			++m_report.physicalCount;
+		}
+	}
+}
+
+uint32_t RenderGraph::acquirePhysicalTexture(const Resource& resource)
+{
+	const TextureDesc& desc = resource.textureDesc;
+	uint32_t width = desc.exactSize ? desc.width : RenderTargetPool::RoundToBucket(desc.width);
+	uint32_t height = desc.exactSize ? desc.height : RenderTargetPool::RoundToBucket(desc.height);
+	for (uint32_t i = 0; i < m_physicalTextures.size(); ++i) {
+		PhysicalTexture& physical = m_physicalTextures[i];
+		const RenderTargetPool::Target& target = *physical.target;
+		if (physical.freeAfter < resource.firstUse && target.width == width && target.height == height && target.format == desc.format && target.usage == desc.usage) {
+			physical.freeAfter = resource.lastUse;
+			return i;
+		}
+	}
+
+	PhysicalTexture physical;
+	physical.target = m_texturePool->Acquire(desc.width, desc.height, desc.format, desc.usage, resource.name, desc.exactSize);
+	physical.freeAfter = resource.lastUse;
+	m_physicalTextures.push_back(physical);
+	return static_cast<uint32_t>(m_physicalTextures.size() - 1);
+}
+
+uint32_t RenderGraph::acquirePhysicalBuffer(const Resource& resource)
+{
+	for (uint32_t i = 0; i < m_physicalBuffers.size(); ++i) {
+		PhysicalBuffer& physical = m_physicalBuffers[i];
+		if ((!physical.inUse || physical.freeAfter < resource.firstUse) && physical.size == resource.bytes && physical.usage == resource.bufferUsage) {
+			physical.inUse = true;
+			physical.freeAfter = resource.lastUse;
+			physical.lastUsedFrame = m_frame;
+			return i;
+		}
+	}
+
+	WGPUBufferDescriptor bufferDesc = {};
+	bufferDesc.nextInChain = nullptr;
+	bufferDesc.label = resource.name;
+	bufferDesc.usage = resource.bufferUsage;
+	bufferDesc.size = resource.bytes;
+	bufferDesc.mappedAtCreation = false;
+	PhysicalBuffer physical;
+	physical.buffer = wgpuDeviceCreateBuffer(m_device, &bufferDesc);
+	physical.size = resource.bytes;
+	physical.usage = resource.bufferUsage;
+	physical.inUse = true;
+	physical.freeAfter = resource.lastUse;
+	physical.lastUsedFrame = m_frame;
+	Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers, physical.size);
+	m_physicalBuffers.push_back(physical);
+	return static_cast<uint32_t>(m_physicalBuffers.size() - 1);
+}
+
+void RenderGraph::Execute(WGPUCommandEncoder encoder)
+{
+	TRACE_ZONE("RenderGraph::Execute");
+	for (uint32_t passIndex : m_order) {
+		m_passes[passIndex].execute(encoder);
+	}
+
+	// The commands hold on to what they use, so everything can go back right away
+	for (PhysicalTexture& physical : m_physicalTextures) {
+		m_texturePool->Release(physical.target);
+	}
+	m_physicalTextures.clear();
+	for (PhysicalBuffer& physical : m_physicalBuffers) {
+		physical.inUse = false;
+	}
+}
+
+WGPUTextureView RenderGraph::GetView(Handle texture) const
+{
+	return m_resources[texture].view;
+}
+
+const RenderTargetPool::Target* RenderGraph::GetTarget(Handle texture) const
+{
+	const Resource& resource = m_resources[texture];
+	return resource.imported || resource.physical == UINT32_MAX ? nullptr : m_physicalTextures[resource.physical].target;
+}
+
+WGPUBuffer RenderGraph::GetBuffer(Handle buffer) const
+{
+	return m_resources[buffer].buffer;
+}
+
+void RenderGraph::DrawImGui()
+{
+	ImGui::Begin("Render graph");
+	ImGui::Text("Passes: %u (%u culled)", m_report.passCount, m_report.culledPassCount);
+	ImGui::Text("Transient resources: %u in %u allocations", m_report.transientCount, m_report.physicalCount);
+	ImGui::Text("Peak transient memory: %.2f MB (%.2f MB without aliasing)", m_report.peakBytes / (1024.0 * 1024.0), m_report.unaliasedBytes / (1024.0 * 1024.0));
+	if (ImGui::CollapsingHeader("Passes")) {
+		for (uint32_t passIndex : m_order) {
+			ImGui::Text("%s", m_passes[passIndex].name);
+		}
+		for (const Pass& pass : m_passes) {
+			if (pass.culled) {
+				ImGui::TextDisabled("%s (culled)", pass.name);
+			}
+		}
+	}
+	ImGui::End();
+}
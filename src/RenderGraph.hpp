@@ -0,0 +1,148 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+
+#include <webgpu/webgpu.h>
+
+#include "RenderTargetPool.hpp"
+
+// Frame graph, rebuilt every frame: passes declare what they read and write, Compile culls the passes nothing depends on,
+// orders the rest and assigns memory to the transient resources. Resources whose lifetimes don't overlap share a texture/buffer
+// (WebGPU has no placed resources, so this is aliasing at the object level), the textures themselves come from a RenderTargetPool
+class RenderGraph
+{
+public:
+	using Handle = uint32_t;
+	static constexpr Handle INVALID_HANDLE = UINT32_MAX;
+	static constexpr uint32_t BUFFER_UNUSED_FRAMES = 120; // Pooled transient buffers are destroyed after this many frames
+
+	struct TextureDesc
+	{
+		uint32_t width = 0;
+		uint32_t height = 0;
+		WGPUTextureFormat format = WGPUTextureFormat_Undefined;
+		WGPUTextureUsageFlags usage = WGPUTextureUsage_RenderAttachment;
+		bool exactSize = false; // See RenderTargetPool::Acquire
+	};
+
+	// Filled by Compile, shown in Dear ImGui
+	struct FrameReport
+	{
+		uint32_t passCount = 0;
+		uint32_t culledPassCount = 0;
+		uint32_t transientCount = 0; // Transient resources that are actually used
+		uint32_t physicalCount = 0; // Textures and buffers backing them
+		uint64_t peakBytes = 0; // Transient memory the frame needs (after aliasing)
+		uint64_t unaliasedBytes = 0; // What it would need without aliasing
+	};
+
+	using ExecuteFunction = std::function<void(WGPUCommandEncoder encoder)>;
+
+	class PassBuilder
+	{
+	public:
+		PassBuilder& Read(Handle resource);
+		PassBuilder& Write(Handle resource);
+		PassBuilder& SideEffect(); // Never culled (writes something the graph doesn't track)
+	private:
+		friend class RenderGraph;
+		PassBuilder(RenderGraph& graph, uint32_t pass) : m_graph(graph), m_pass(pass) {}
+		RenderGraph& m_graph;
+		uint32_t m_pass;
+	};
+
+	void Init(WGPUDevice device, RenderTargetPool* texturePool) { m_device = device; m_texturePool = texturePool; }
+	void Terminate();
+
+	// Starts a new frame (the previous one must have been executed)
+	void Reset();
+	Handle CreateTexture(const char* name, const TextureDesc& desc);
+	Handle CreateBuffer(const char* name, uint64_t size, WGPUBufferUsageFlags usage);
+	Handle ImportTexture(const char* name, WGPUTextureView view);
+	Handle ImportBuffer(const char* name, WGPUBuffer buffer);
+	// Passes writing outputs (and whatever they read) survive culling
+	void MarkOutput(Handle resource);
+	// The function runs during Execute, when GetView/GetBuffer are valid
+	PassBuilder AddPass(const char* name, ExecuteFunction execute);
+
+	void Compile();
+	// Records the surviving passes, then hands the transient textures back to the pool
+	void Execute(WGPUCommandEncoder encoder);
+
+	WGPUTextureView GetView(Handle texture) const;
+	const RenderTargetPool::Target* GetTarget(Handle texture) const; // nullptr for imported textures
+	WGPUBuffer GetBuffer(Handle buffer) const;
+	const FrameReport& GetReport() const { return m_report; }
+	void DrawImGui();
+private:
+	enum class ResourceType
+	{
+		Texture,
+		Buffer
+	};
+
+	struct Resource
+	{
+		const char* name = "";
+		ResourceType type = ResourceType::Texture;
+		bool imported = false;
+		bool output = false;
+		TextureDesc textureDesc;
+		uint64_t bufferSize = 0;
+		WGPUBufferUsageFlags bufferUsage = WGPUBufferUsage_None;
+		uint64_t bytes = 0;
+		std::vector<uint32_t> writers; // Passes, in declaration order
+		std::vector<uint32_t> readers;
+		// Compile
+		uint32_t firstUse = UINT32_MAX; // Position in m_order
+		uint32_t lastUse = 0;
+		uint32_t physical = UINT32_MAX; // Index into m_physicalTextures/m_physicalBuffers
+		WGPUTextureView view = nullptr;
+		WGPUBuffer buffer = nullptr;
+	};
+
+	struct Pass
+	{
+		const char* name = "";
+		ExecuteFunction execute;
+		std::vector<Handle> reads;
+		std::vector<Handle> writes;
+		bool sideEffect = false;
+		bool culled = false;
+	};
+
+	// A texture or buffer shared by resources that are never alive at the same time
+	struct PhysicalTexture
+	{
+		RenderTargetPool::Target* target = nullptr;
+		uint32_t freeAfter = 0; // Last use of the latest resource placed in it
+	};
+
+	struct PhysicalBuffer
+	{
+		WGPUBuffer buffer = nullptr;
+		uint64_t size = 0;
+		WGPUBufferUsageFlags usage = WGPUBufferUsage_None;
+		bool inUse = false; // This frame
+		uint32_t freeAfter = 0;
+		uint64_t lastUsedFrame = 0;
+	};
+
+	WGPUDevice m_device = nullptr;
+	RenderTargetPool* m_texturePool = nullptr;
+	std::vector<Resource> m_resources;
+	std::vector<Pass> m_passes;
+	std::vector<uint32_t> m_order; // Surviving passes, in execution order
+	std::vector<PhysicalTexture> m_physicalTextures; // This frame's
+	std::vector<PhysicalBuffer> m_physicalBuffers; // Kept across frames
+	uint64_t m_frame = 0;
+	FrameReport m_report;
+
+	Handle addResource(Resource&& resource);
+	void cull();
+	void sortPasses();
+	void assignMemory();
+	uint32_t acquirePhysicalTexture(const Resource& resource);
+	uint32_t acquirePhysicalBuffer(const Resource& resource);
+};
@@ -0,0 +1,70 @@
+#include <array>
+#include <algorithm>
+
+#include "RenderQueue.hpp"
+
+uint64_t quantizeDepth(float depth, uint32_t bits)
+{
+	uint64_t maxValue = (1ull << bits) - 1;
+	return static_cast<uint64_t>(std::clamp(depth, 0.0f, 1.0f) * maxValue);
+}
+
+uint64_t RenderQueue::MakeOpaqueKey(uint32_t pipelineId, uint32_t materialId, uint32_t meshId, float depth)
+{
+	return (uint64_t(pipelineId & 0xFF) << 55) | (uint64_t(materialId & 0xFFFF) << 39) | (uint64_t(meshId & 0xFFFF) << 23) | quantizeDepth(depth, 23);
+}
+
+uint64_t RenderQueue::MakeTransparentKey(uint32_t pipelineId, uint32_t materialId, uint32_t meshId, float depth)
+{
+	uint64_t backToFront = quantizeDepth(1.0f - depth, 24);
+	return (1ull << 63) | (backToFront << 39) | (uint64_t(pipelineId & 0xFF) << 31) | (uint64_t(materialId & 0xFFFF) << 15) | uint64_t(meshId & 0x7FFF);
+}
+
+void RenderQueue::Clear()
+{
+	m_items.clear();
+	m_entries.clear();
+}
+
+void RenderQueue::Push(uint64_t key, const DrawItem& item)
+{
+	m_entries.push_back({key, static_cast<uint32_t>(m_items.size())});
+	m_items.push_back(item);
+}
+
+void RenderQueue::Sort()
+{
+	size_t count = m_entries.size();
+	if (count < 2) {
+		return;
+	}
+	m_scratch.resize(count);
+	SortEntry* source = m_entries.data();
+	SortEntry* destination = m_scratch.data();
+
+	for (uint32_t shift = 0; shift < 64; shift += 8) {
+		std::array<uint32_t, 256> offsets = {};
+		for (size_t i = 0; i < count; ++i) {
+			++offsets[(source[i].key >> shift) & 0xFF];
+		}
+		// Usually true for most of the key (few pipelines and materials)
+		if (offsets[(source[0].key >> shift) & 0xFF] == count) {
+			continue;
+		}
+
+		uint32_t sum = 0;
+		for (uint32_t& offset : offsets) {
+			uint32_t digitCount = offset;
+			offset = sum;
+			sum += digitCount;
+		}
+		for (size_t i = 0; i < count; ++i) {
+			destination[offsets[(source[i].key >> shift) & 0xFF]++] = source[i];
+		}
+		std::swap(source, destination);
+	}
+
+	if (source != m_entries.data()) {
+		std::copy(source, source + count, m_entries.data());
+	}
+}
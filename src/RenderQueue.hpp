@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Draws sorted by a 64-bit key so that neighbouring draws share as much state as possible.
+// Opaque:      [63] 0 | pipeline (8) | material (16) | mesh (16) | depth, front to back (23)
+// Transparent: [63] 1 | depth, back to front (24) | pipeline (8) | material (16) | mesh (15)
+class RenderQueue
+{
+public:
+	struct DrawItem
+	{
+		uint32_t objectIndex;
+		uint32_t subMeshIndex;
+		uint32_t pipelineId;
+		uint32_t materialId;
+	};
+
+	// Counted while encoding a sorted queue
+	struct StateChanges
+	{
+		uint32_t pipelines = 0;
+		uint32_t bindGroups = 0;
+		uint32_t draws = 0;
+	};
+
+	// Depth is normalized to [0, 1] (distance to the camera over the far plane)
+	static uint64_t MakeOpaqueKey(uint32_t pipelineId, uint32_t materialId, uint32_t meshId, float depth);
+	static uint64_t MakeTransparentKey(uint32_t pipelineId, uint32_t materialId, uint32_t meshId, float depth);
+
+	void Clear();
+	void Push(uint64_t key, const DrawItem& item);
+	// LSD radix sort, 8 bits per pass. Passes where every key has the same byte are skipped
+	void Sort();
+
+	size_t GetSize() const { return m_entries.size(); }
+	const DrawItem& operator[](size_t index) const { return m_items[m_entries[index].itemIndex]; }
+private:
+	struct SortEntry
+	{
+		uint64_t key;
+		uint32_t itemIndex;
+	};
+
+	std::vector<DrawItem> m_items;
+	std::vector<SortEntry> m_entries;
+	std::vector<SortEntry> m_scratch;
+};
@@ -0,0 +1,121 @@
+#include <algorithm>
+
+#include <spdlog/spdlog.h>
+
+#include "RenderTargetPool.hpp"
+#include "Stats.hpp"
+
+uint32_t RenderTargetPool::BytesPerTexel(WGPUTextureFormat format)
+{
+	switch (format) {
+	case WGPUTextureFormat_RGBA16Float:
+	case WGPUTextureFormat_RG32Float:
+		return 8;
+	case WGPUTextureFormat_RGBA32Float:
+		return 16;
+	default:
+		return 4; // 8-bit RGBA/BGRA, Depth24Plus (at most), Depth32Float
+	}
+}
+
+void RenderTargetPool::Terminate()
+{
+	for (std::unique_ptr<Target>& target : m_targets) {
+		destroy(*target);
+	}
+	m_targets.clear();
+}
+
+RenderTargetPool::Target* RenderTargetPool::Acquire(uint32_t width, uint32_t height, WGPUTextureFormat format, WGPUTextureUsageFlags usage, const char* label,
+	bool exactSize)
+{
+	uint32_t bucketWidth = exactSize ? width : RoundToBucket(width);
+	uint32_t bucketHeight = exactSize ? height : RoundToBucket(height);
+	for (std::unique_ptr<Target>& target : m_targets) {
+		if (!target->inUse && target->width == bucketWidth && target->height == bucketHeight && target->format == format && target->usage == usage) {
+			target->inUse = true;
+			target->lastUsedFrame = m_frame;
+			return target.get();
+		}
+	}
+
+	WGPUTextureDescriptor textureDesc = {};
+	textureDesc.nextInChain = nullptr;
+	textureDesc.label = label;
+	textureDesc.usage = usage;
+	textureDesc.dimension = WGPUTextureDimension_2D;
+	textureDesc.size = {bucketWidth, bucketHeight, 1};
+	textureDesc.format = format;
+	textureDesc.mipLevelCount = 1;
+	textureDesc.sampleCount = 1;
+	textureDesc.viewFormatCount = 0;
+	textureDesc.viewFormats = nullptr;
+
+	auto target = std::make_unique<Target>();
+	target->id = m_nextId++;
+	target->texture = wgpuDeviceCreateTexture(m_device, &textureDesc);
+	target->view = wgpuTextureCreateView(target->texture, nullptr);
+	target->width = bucketWidth;
+	target->height = bucketHeight;
+	target->format = format;
+	target->usage = usage;
+	target->bytes = uint64_t(bucketWidth) * bucketHeight * BytesPerTexel(format);
+	target->inUse = true;
+	target->lastUsedFrame = m_frame;
+	Stats::TrackGpuMemory(Stats::MemoryCategory::RenderTargets, target->bytes);
+	++m_allocationCount;
+	SPDLOG_INFO("Render target pool: created {} {}x{}.", label, bucketWidth, bucketHeight);
+
+	m_targets.push_back(std::move(target));
+	return m_targets.back().get();
+}
+
+void RenderTargetPool::Release(Target* target)
+{
+	if (target) {
+		target->inUse = false;
+	}
+}
+
+void RenderTargetPool::EndFrame()
+{
+	++m_frame;
+	std::erase_if(m_targets, [this](std::unique_ptr<Target>& target)
+	{
+		if (target->inUse || m_frame - target->lastUsedFrame < UNUSED_FRAMES) {
+			return false;
+		}
+		destroy(*target);
+		return true;
+	});
+}
+
+void RenderTargetPool::ReleaseUnused()
+{
+	std::erase_if(m_targets, [this](std::unique_ptr<Target>& target)
+	{
+		if (target->inUse) {
+			return false;
+		}
+		destroy(*target);
+		return true;
+	});
+}
+
+uint64_t RenderTargetPool::GetBytes() const
+{
+	uint64_t bytes = 0;
+	for (const std::unique_ptr<Target>& target : m_targets) {
+		bytes += target->bytes;
+	}
+	return bytes;
+}
+
+void RenderTargetPool::destroy(Target& target)
+{
+	Stats::TrackGpuMemory(Stats::MemoryCategory::RenderTargets, -(int64_t)target.bytes);
+	wgpuTextureViewRelease(target.view);
+	wgpuTextureDestroy(target.texture);
+	wgpuTextureRelease(target.texture);
+	target = {};
+}
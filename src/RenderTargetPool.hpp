@@ -0,0 +1,57 @@
+#pragma once
+
+#include <memory>
+#include <algorithm>
+#include <vector>
+
+#include <webgpu/webgpu.h>
+
+// Recycles render targets between frames. Sizes are rounded up to buckets, so a target that only changes size a little
+// (dynamic resolution) keeps getting the same texture and renders into its top-left corner
+class RenderTargetPool
+{
+public:
+	static constexpr uint32_t BUCKET_SIZE = 128; // Pixels, per axis
+	static constexpr uint32_t UNUSED_FRAMES = 120; // Free targets are destroyed after this many frames
+
+	struct Target
+	{
+		uint64_t id = 0; // Unique per allocation, to key things created from the texture
+		WGPUTexture texture = nullptr;
+		WGPUTextureView view = nullptr;
+		uint32_t width = 0; // Allocated size (a multiple of BUCKET_SIZE unless exact), may be larger than requested
+		uint32_t height = 0;
+		WGPUTextureFormat format = WGPUTextureFormat_Undefined;
+		WGPUTextureUsageFlags usage = WGPUTextureUsage_None;
+		uint64_t bytes = 0;
+		bool inUse = false;
+		uint64_t lastUsedFrame = 0;
+	};
+
+	void Init(WGPUDevice device) { m_device = device; }
+	void Terminate();
+
+	// Valid until Release. Reusing a target across frames in flight is fine, the queue orders the passes.
+	// exactSize skips the bucketing, for targets that share a pass with a texture of the exact size (the swap chain)
+	Target* Acquire(uint32_t width, uint32_t height, WGPUTextureFormat format, WGPUTextureUsageFlags usage, const char* label, bool exactSize = false);
+	void Release(Target* target);
+	// Once per frame, destroys targets that were not used for a while
+	void EndFrame();
+	// Destroys every free target (e.g. after a resize, the old buckets won't come back)
+	void ReleaseUnused();
+
+	static uint32_t RoundToBucket(uint32_t size) { return std::max(1u, (size + BUCKET_SIZE - 1) / BUCKET_SIZE) * BUCKET_SIZE; }
+	static uint32_t BytesPerTexel(WGPUTextureFormat format);
+
+	uint32_t GetTargetCount() const { return static_cast<uint32_t>(m_targets.size()); }
+	uint32_t GetAllocationCount() const { return m_allocationCount; }
+	uint64_t GetBytes() const;
+private:
+	WGPUDevice m_device = nullptr;
+	std::vector<std::unique_ptr<Target>> m_targets; // Stable addresses for the callers
+	uint64_t m_frame = 0;
+	uint64_t m_nextId = 1;
+	uint32_t m_allocationCount = 0; // Total, shown in Dear ImGui
+
+	void destroy(Target& target);
+};
@@ -1,14 +1,77 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <unordered_set>
+#include <map>
+#include <atomic>
+#include <chrono>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <array>
+#include <algorithm>
+#include <type_traits>
 
 #include <stb/stb_image.h>
 #include <tinyobjloader/tiny_obj_loader.h>
 #include <spdlog/spdlog.h>
 #include "ResourceManager.hpp"
+#include "MeshParser.hpp"
+#include "MappedFile.hpp"
+#include "GeometryCodec.hpp"
+#include "JobSystem.hpp"
+#include "Trace.hpp"
+#include "Stats.hpp"
 
-bool ResourceManager::LoadGeometry(const std::filesystem::path& path, std::vector<float>& pointData, std::vector<uint16_t>& indexData, int dimensions)
+#ifndef CACHE_DIR
+#error "A CACHE_DIR must be defined to compile the project!"
+#endif
+
+std::filesystem::path ResourceManager::GetCachePath(const std::filesystem::path& sourcePath, const char* extension)
+{
+	// The hash of the full source path keeps sources of the same name in different directories apart
+	std::error_code error;
+	std::filesystem::path directory = CACHE_DIR;
+	if (!std::filesystem::create_directories(directory, error) && error) {
+		SPDLOG_WARN("Could not create the cache directory \"{}\": {}", directory.string(), error.message());
+	}
+	std::filesystem::path absolutePath = std::filesystem::absolute(sourcePath, error);
+	size_t hash = std::hash<std::string>()(absolutePath.generic_string());
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%016llx", static_cast<unsigned long long>(hash));
+	return directory / (sourcePath.stem().string() + suffix + extension);
+}
+
+bool ResourceManager::IsCacheCurrent(const std::filesystem::path& cachePath, const std::vector<std::filesystem::path>& sourcePaths)
+{
+	std::error_code error;
+	if (!std::filesystem::exists(cachePath, error)) {
+		return false;
+	}
+	std::filesystem::file_time_type cacheTime = std::filesystem::last_write_time(cachePath, error);
+	for (const std::filesystem::path& sourcePath : sourcePaths) {
+		if (std::filesystem::exists(sourcePath, error) && std::filesystem::last_write_time(sourcePath, error) > cacheTime) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool ResourceManager::LoadGeometry(const std::filesystem::path& path, std::vector<float>& pointData, std::vector<uint32_t>& indexData, int dimensions)
+{
+	TRACE_ZONE("ResourceManager::LoadGeometry");
+	if (!MeshParser::ParseGeometry(path, pointData, indexData, dimensions)) {
+		SPDLOG_ERROR("Could not load geometry!");
+		return false;
+	}
+	return true;
+}
+
+bool ResourceManager::LoadGeometryIostream(const std::filesystem::path& path, std::vector<float>& pointData, std::vector<uint32_t>& indexData, int dimensions)
 {
+	TRACE_ZONE("ResourceManager::LoadGeometryIostream");
 	std::ifstream file(path);
 	if (!file.is_open()) {
 		SPDLOG_ERROR("Could not load geometry!");
@@ -27,7 +90,7 @@ bool ResourceManager::LoadGeometry(const std::filesystem::path& path, std::vecto
 	Section currentSection = Section::None;
 
 	float value;
-	uint16_t index;
+	uint32_t index;
 	std::string line;
 	while (!file.eof()) {
 		std::getline(file, line);
@@ -41,7 +104,7 @@ bool ResourceManager::LoadGeometry(const std::filesystem::path& path, std::vecto
 			currentSection = Section::Points;
 		} else if (line == "[indices]") {
 			currentSection = Section::Indices;
-		} else if (line[0] == '#' || line.empty()) {
+		} else if (line.empty() || line[0] == '#') {
 			// Do nothing yet
 		} else if (currentSection == Section::Points) {
 			std::istringstream iss(line);
@@ -54,25 +117,172 @@ bool ResourceManager::LoadGeometry(const std::filesystem::path& path, std::vecto
 			std::istringstream iss(line);
 			// Get corners 0, 1, 2
 			for (int i = 0; i < 3; ++i) {
-				iss >> value;
-				indexData.push_back(value);
+				iss >> index;
+				indexData.push_back(index);
+			}
+		}
+	}
+
+	return true;
+}
+
+namespace
+{
+Material toMaterial(const tinyobj::material_t& objMaterial, const std::filesystem::path& baseDir)
+{
+	Material material;
+	material.name = objMaterial.name;
+	material.baseColor = {objMaterial.diffuse[0], objMaterial.diffuse[1], objMaterial.diffuse[2], objMaterial.dissolve};
+	if (!objMaterial.diffuse_texname.empty()) {
+		material.baseColorTexture = baseDir / objMaterial.diffuse_texname;
+	}
+	material.transparent = objMaterial.dissolve < 1.0f;
+	material.alphaTest = !objMaterial.alpha_texname.empty(); // Cutout, the shader reads it from the base color texture's alpha
+	return material;
+}
+
+void fillMaterials(const std::vector<tinyobj::material_t>& objMaterials, const std::filesystem::path& baseDir, bool usesDefaultMaterial, std::vector<Material>& materials)
+{
+	materials.clear();
+	for (const tinyobj::material_t& objMaterial : objMaterials) {
+		materials.push_back(toMaterial(objMaterial, baseDir));
+	}
+	if (usesDefaultMaterial || materials.empty()) {
+		Material material;
+		material.name = "Default";
+		materials.push_back(material);
+	}
+}
+
+void computeSubMeshCenters(const std::vector<VertexAttributes>& vertexData, std::vector<SubMesh>& subMeshes)
+{
+	for (SubMesh& subMesh : subMeshes) {
+		glm::vec3 sum = {0.0f, 0.0f, 0.0f};
+		for (uint32_t i = 0; i < subMesh.vertexCount; ++i) {
+			sum += vertexData[subMesh.firstVertex + i].position;
+		}
+		subMesh.center = subMesh.vertexCount > 0 ? sum / static_cast<float>(subMesh.vertexCount) : sum;
+	}
+}
+}
+
+bool ResourceManager::LoadGeometryFromObj(const std::filesystem::path& path, std::vector<VertexAttributes>& vertexData, std::vector<SubMesh>* subMeshes,
+	std::vector<Material>* materials)
+{
+	TRACE_ZONE("ResourceManager::LoadGeometryFromObj");
+	MeshParser::ObjMesh mesh;
+	if (!MeshParser::ParseObj(path, mesh)) {
+		return false;
+	}
+
+	// The .mtl (and its textures) sit next to the .obj. It's tiny, so tinyobj can keep reading it
+	std::filesystem::path baseDir = path.parent_path();
+	std::vector<tinyobj::material_t> objMaterials;
+	std::map<std::string, int> objMaterialIds;
+	for (const std::string& library : mesh.materialLibraries) {
+		std::ifstream file(baseDir / library);
+		if (!file.is_open()) {
+			SPDLOG_WARN("Material library \"{}\" not found", library);
+			continue;
+		}
+		std::string warn;
+		std::string err;
+		tinyobj::LoadMtl(&objMaterialIds, &objMaterials, &file, &warn, &err);
+		if (!warn.empty()) {
+			SPDLOG_WARN("{}", warn);
+		}
+		if (!err.empty()) {
+			SPDLOG_ERROR("{}", err);
+		}
+	}
+
+	// Faces without a (known) material get a default one at the end of the table
+	uint32_t defaultMaterialId = static_cast<uint32_t>(objMaterials.size());
+	std::vector<uint32_t> materialIds;
+	for (const std::string& name : mesh.materialNames) {
+		auto it = objMaterialIds.find(name);
+		materialIds.push_back(it != objMaterialIds.end() ? static_cast<uint32_t>(it->second) : defaultMaterialId);
+	}
+
+	// Filling in vertexData, one vertex per corner
+	vertexData.resize(mesh.indices.size());
+	size_t positionCount = mesh.positions.size() / 3;
+	size_t normalCount = mesh.normals.size() / 3;
+	size_t texcoordCount = mesh.texcoords.size() / 2;
+	std::atomic<bool> outOfBounds = false;
+	JobSystem::ParallelFor(static_cast<uint32_t>(mesh.indices.size()), 64 * 1024, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; ++i) {
+			const MeshParser::ObjIndex& idx = mesh.indices[i];
+			VertexAttributes& vertex = vertexData[i];
+			vertex = {};
+			if (idx.position >= positionCount) {
+				outOfBounds = true;
+				continue;
+			}
+
+			// Avoid mirroring by adding a minus
+			const float* position = &mesh.positions[3 * idx.position];
+			vertex.position = {position[0], -position[2], position[1]};
+			vertex.color = mesh.colors.empty() ? glm::vec3(1.0f) : glm::vec3(mesh.colors[3 * idx.position], mesh.colors[3 * idx.position + 1], mesh.colors[3 * idx.position + 2]);
+
+			// Also apply the transform to normals!!
+			if (idx.normal < normalCount) {
+				const float* normal = &mesh.normals[3 * idx.normal];
+				vertex.normal = {normal[0], -normal[2], normal[1]};
+			}
+
+			if (idx.texcoord < texcoordCount) {
+				const float* uv = &mesh.texcoords[2 * idx.texcoord];
+				vertex.uv = {uv[0], 1 - uv[1]}; // Invert V axis for modern graphics APIs (Vulkan, DX12, etc.)
 			}
 		}
+	});
+	if (outOfBounds) {
+		SPDLOG_WARN("Vertex indices out of bounds in \"{}\"", path.string());
+	}
+
+	// Runs of faces with the same material
+	bool usesDefaultMaterial = false;
+	if (subMeshes) {
+		subMeshes->clear();
+		for (size_t face = 0; face < mesh.faceMaterials.size(); ++face) {
+			uint32_t objMaterialId = mesh.faceMaterials[face];
+			uint32_t materialId = objMaterialId != MeshParser::NO_INDEX ? materialIds[objMaterialId] : defaultMaterialId;
+			usesDefaultMaterial = usesDefaultMaterial || materialId == defaultMaterialId;
+			if (face == 0 || subMeshes->back().materialId != materialId) {
+				SubMesh subMesh;
+				subMesh.firstVertex = static_cast<uint32_t>(3 * face);
+				subMesh.materialId = materialId;
+				subMeshes->push_back(subMesh);
+			}
+			subMeshes->back().vertexCount += 3;
+		}
+		computeSubMeshCenters(vertexData, *subMeshes);
+	}
+
+	if (materials) {
+		fillMaterials(objMaterials, baseDir, usesDefaultMaterial, *materials);
 	}
 
 	return true;
 }
 
-bool ResourceManager::LoadGeometryFromObj(const std::filesystem::path& path, std::vector<VertexAttributes>& vertexData)
+bool ResourceManager::LoadGeometryFromObjTinyObj(const std::filesystem::path& path, std::vector<VertexAttributes>& vertexData, std::vector<SubMesh>* subMeshes,
+	std::vector<Material>* materials)
 {
+	TRACE_ZONE("ResourceManager::LoadGeometryFromObjTinyObj");
 	tinyobj::attrib_t attrib;
 	std::vector<tinyobj::shape_t> shapes;
-	std::vector<tinyobj::material_t> materials;
+	std::vector<tinyobj::material_t> objMaterials;
 
 	std::string warn;
 	std::string err;
 
-	bool ret = tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, path.string().c_str());
+	// The .mtl (and its textures) sit next to the .obj
+	std::filesystem::path baseDir = path.parent_path();
+	std::string mtlBaseDir = baseDir.string() + "/";
+	bool ret = tinyobj::LoadObj(&attrib, &shapes, &objMaterials, &warn, &err, path.string().c_str(), mtlBaseDir.c_str());
 	if (!warn.empty()) {
 		SPDLOG_WARN("{}", warn);
 	}
@@ -83,6 +293,13 @@ bool ResourceManager::LoadGeometryFromObj(const std::filesystem::path& path, std
 		return false;
 	}
 
+	// Faces without a material get a default one at the end of the table
+	uint32_t defaultMaterialId = static_cast<uint32_t>(objMaterials.size());
+	bool usesDefaultMaterial = false;
+	if (subMeshes) {
+		subMeshes->clear();
+	}
+
 	// Filling in vertexData:
 	vertexData.clear();
 	for (const auto& shape : shapes) {
@@ -117,11 +334,500 @@ bool ResourceManager::LoadGeometryFromObj(const std::filesystem::path& path, std
 				1 - attrib.texcoords[2 * idx.texcoord_index + 1] // Invert V axis for modern graphics APIs (Vulkan, DX12, etc.)
 			};
 		}
+
+		// Runs of faces with the same material (faces are triangulated, so 3 vertices each)
+		if (subMeshes) {
+			for (size_t face = 0; face < shape.mesh.material_ids.size(); ++face) {
+				int objMaterialId = shape.mesh.material_ids[face];
+				uint32_t materialId = objMaterialId >= 0 ? static_cast<uint32_t>(objMaterialId) : defaultMaterialId;
+				usesDefaultMaterial = usesDefaultMaterial || objMaterialId < 0;
+				if (face == 0 || subMeshes->back().materialId != materialId) {
+					SubMesh subMesh;
+					subMesh.firstVertex = static_cast<uint32_t>(offset + 3 * face);
+					subMesh.materialId = materialId;
+					subMeshes->push_back(subMesh);
+				}
+				subMeshes->back().vertexCount += 3;
+			}
+		}
+	}
+
+	if (subMeshes) {
+		computeSubMeshCenters(vertexData, *subMeshes);
+	}
+
+	if (materials) {
+		fillMaterials(objMaterials, baseDir, usesDefaultMaterial, *materials);
+	}
+
+	return true;
+}
+
+void ResourceManager::RunObjBenchmark(uint32_t megabytes)
+{
+	// Synthetic OBJ: a height field with normals and texcoords, as triangles, switching between two materials
+	std::filesystem::path directory = std::filesystem::temp_directory_path();
+	std::filesystem::path objPath = directory / "obj_benchmark.obj";
+	std::filesystem::path mtlPath = directory / "obj_benchmark.mtl";
+	{
+		std::ofstream mtl(mtlPath);
+		mtl << "newmtl red\nKd 1 0 0\nnewmtl green\nKd 0 1 0\n";
+	}
+	{
+		constexpr uint32_t ROW_VERTICES = 1024;
+		constexpr uint32_t ROWS_PER_MATERIAL = 64;
+		std::ofstream obj(objPath, std::ios::binary);
+		std::string text = "mtllib obj_benchmark.mtl\n";
+		char number[32];
+		auto append = [&](float value)
+		{
+			text += ' ';
+			text.append(number, std::to_chars(number, number + sizeof(number), value, std::chars_format::fixed, 6).ptr);
+		};
+		auto appendIndex = [&](uint64_t index)
+		{
+			char* end = std::to_chars(number, number + sizeof(number), index).ptr;
+			text += ' ';
+			for (int i = 0; i < 3; ++i) {
+				text.append(number, end);
+				text += i < 2 ? '/' : ' ';
+			}
+			text.pop_back();
+		};
+		uint64_t targetBytes = uint64_t(megabytes) << 20;
+		uint64_t writtenBytes = 0;
+		for (uint32_t row = 0; writtenBytes < targetBytes; ++row) {
+			for (uint32_t column = 0; column < ROW_VERTICES; ++column) {
+				float height = std::sin(column * 0.05f) * std::cos(row * 0.05f);
+				text += 'v';
+				append(float(column));
+				append(height);
+				append(float(row));
+				text += "\nvn";
+				append(0.0f);
+				append(1.0f);
+				append(0.0f);
+				text += "\nvt";
+				append(column / float(ROW_VERTICES));
+				append(row / 1024.0f);
+				text += '\n';
+			}
+			if (row > 0) {
+				if (row % ROWS_PER_MATERIAL == 1) {
+					text += (row / ROWS_PER_MATERIAL) % 2 ? "usemtl green\n" : "usemtl red\n";
+				}
+				uint64_t previous = uint64_t(row - 1) * ROW_VERTICES + 1;
+				uint64_t current = uint64_t(row) * ROW_VERTICES + 1;
+				for (uint32_t column = 0; column + 1 < ROW_VERTICES; ++column) {
+					text += 'f';
+					appendIndex(previous + column);
+					appendIndex(current + column);
+					appendIndex(previous + column + 1);
+					text += "\nf";
+					appendIndex(previous + column + 1);
+					appendIndex(current + column);
+					appendIndex(current + column + 1);
+					text += '\n';
+				}
+			}
+			obj.write(text.data(), text.size());
+			writtenBytes += text.size();
+			text.clear();
+		}
+	}
+
+	double megabytesParsed = std::filesystem::file_size(objPath) / (1024.0 * 1024.0);
+	auto measure = [](auto&& function)
+	{
+		auto start = std::chrono::steady_clock::now();
+		function();
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	};
+	std::vector<VertexAttributes> vertexData;
+	std::vector<SubMesh> subMeshes;
+	std::vector<Material> materials;
+	double tinyObjSeconds = measure([&]() { LoadGeometryFromObjTinyObj(objPath, vertexData, &subMeshes, &materials); });
+	size_t tinyObjVertices = vertexData.size();
+	size_t tinyObjSubMeshes = subMeshes.size();
+	vertexData = {};
+	double loadSeconds = measure([&]() { LoadGeometryFromObj(objPath, vertexData, &subMeshes, &materials); });
+	vertexData = {};
+	MeshParser::ObjMesh mesh;
+	double parseSeconds = measure([&]() { MeshParser::ParseObj(objPath, mesh); });
+
+	SPDLOG_INFO("OBJ benchmark: {:.0f} MB, {} vertices ({} sub-meshes) with tinyobj, {} ({}) with the parallel parser",
+		megabytesParsed, tinyObjVertices, tinyObjSubMeshes, mesh.indices.size(), subMeshes.size());
+	SPDLOG_INFO("  tinyobj:         {:.2f} s, {:.0f} MB/s", tinyObjSeconds, megabytesParsed / tinyObjSeconds);
+	SPDLOG_INFO("  parallel parser: {:.2f} s, {:.0f} MB/s ({:.0f} MB/s parsing only, {} workers)", loadSeconds, megabytesParsed / loadSeconds,
+		megabytesParsed / parseSeconds, JobSystem::GetWorkerCount());
+	std::filesystem::remove(objPath);
+	std::filesystem::remove(mtlPath);
+
+	// The [points]/[indices] format, a 3D point cloud with colors (half of the file) and triangles over it
+	std::filesystem::path geometryPath = directory / "geometry_benchmark.txt";
+	{
+		std::ofstream file(geometryPath, std::ios::binary);
+		std::string text = "[points]\n";
+		char number[32];
+		auto append = [&](auto value, bool last)
+		{
+			if constexpr (std::is_floating_point_v<decltype(value)>) {
+				text.append(number, std::to_chars(number, number + sizeof(number), value, std::chars_format::fixed, 6).ptr);
+			} else {
+				text.append(number, std::to_chars(number, number + sizeof(number), value).ptr);
+			}
+			text += last ? '\n' : ' ';
+		};
+		uint64_t targetBytes = uint64_t(megabytes) << 20;
+		uint64_t writtenBytes = 0;
+		uint32_t pointCount = 0;
+		for (; writtenBytes + text.size() < targetBytes / 2; ++pointCount) {
+			float angle = pointCount * 0.001f;
+			append(std::cos(angle), false);
+			append(std::sin(angle), false);
+			append(pointCount * 1e-6f, false);
+			append(0.5f + 0.5f * std::cos(angle), false);
+			append(0.5f, false);
+			append(0.5f + 0.5f * std::sin(angle), true);
+			if (text.size() > (1 << 20)) {
+				file.write(text.data(), text.size());
+				writtenBytes += text.size();
+				text.clear();
+			}
+		}
+		text += "[indices]\n";
+		for (uint32_t triangle = 0; writtenBytes + text.size() < targetBytes; ++triangle) {
+			append(triangle % pointCount, false);
+			append((triangle + 1) % pointCount, false);
+			append((triangle + 2) % pointCount, true);
+			if (text.size() > (1 << 20)) {
+				file.write(text.data(), text.size());
+				writtenBytes += text.size();
+				text.clear();
+			}
+		}
+		file.write(text.data(), text.size());
+	}
+
+	megabytesParsed = std::filesystem::file_size(geometryPath) / (1024.0 * 1024.0);
+	std::vector<float> iostreamPoints, points;
+	std::vector<uint32_t> iostreamIndices, indices;
+	double iostreamSeconds = measure([&]() { LoadGeometryIostream(geometryPath, iostreamPoints, iostreamIndices, 3); });
+	double geometrySeconds = measure([&]() { LoadGeometry(geometryPath, points, indices, 3); });
+	SPDLOG_INFO("Text geometry benchmark: {:.0f} MB, {} points and {} triangles", megabytesParsed, points.size() / 6, indices.size() / 3);
+	SPDLOG_INFO("  iostream:        {:.2f} s, {:.0f} MB/s", iostreamSeconds, megabytesParsed / iostreamSeconds);
+	SPDLOG_INFO("  parallel parser: {:.2f} s, {:.0f} MB/s ({:.1f}x)", geometrySeconds, megabytesParsed / geometrySeconds, iostreamSeconds / geometrySeconds);
+	if (points != iostreamPoints || indices != iostreamIndices) {
+		SPDLOG_ERROR("The parallel parser and the iostream loader disagree ({} and {} floats, {} and {} indices).", points.size(), iostreamPoints.size(),
+			indices.size(), iostreamIndices.size());
+	}
+	std::filesystem::remove(geometryPath);
+}
+
+namespace
+{
+// Compressed mesh file: header, sub-meshes, materials, then the two GeometryCodec streams
+constexpr char COMPRESSED_GEOMETRY_MAGIC[4] = {'G', 'M', 'S', 'H'};
+constexpr uint32_t COMPRESSED_GEOMETRY_VERSION = 1;
+
+struct CompressedGeometryHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t vertexStride; // sizeof(VertexAttributes) when written
+	uint32_t uniqueVertexCount;
+	uint32_t indexCount;
+	uint32_t subMeshCount;
+	uint32_t materialCount;
+	uint32_t padding;
+	uint64_t vertexBytes;
+	uint64_t indexBytes;
+};
+
+void writeString(std::ofstream& file, const std::string& text)
+{
+	uint32_t size = static_cast<uint32_t>(text.size());
+	file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+	file.write(text.data(), size);
+}
+
+bool readBytes(const char*& p, const char* end, void* destination, size_t size)
+{
+	if (static_cast<size_t>(end - p) < size) {
+		return false;
+	}
+	std::memcpy(destination, p, size);
+	p += size;
+	return true;
+}
+
+bool readString(const char*& p, const char* end, std::string& text)
+{
+	uint32_t size;
+	if (!readBytes(p, end, &size, sizeof(size)) || static_cast<size_t>(end - p) < size) {
+		return false;
+	}
+	text.assign(p, size);
+	p += size;
+	return true;
+}
+}
+
+bool ResourceManager::SaveCompressedGeometry(const std::filesystem::path& path, const std::vector<VertexAttributes>& vertexData,
+	const std::vector<SubMesh>& subMeshes, const std::vector<Material>& materials)
+{
+	TRACE_ZONE("ResourceManager::SaveCompressedGeometry");
+	std::vector<uint8_t> uniqueVertices;
+	std::vector<uint32_t> indices;
+	GeometryCodec::IndexVertices(vertexData.data(), vertexData.size(), sizeof(VertexAttributes), uniqueVertices, indices);
+	uint32_t uniqueVertexCount = static_cast<uint32_t>(uniqueVertices.size() / sizeof(VertexAttributes));
+	std::vector<uint8_t> vertexBytes = GeometryCodec::EncodeVertices(uniqueVertices.data(), uniqueVertexCount, sizeof(VertexAttributes));
+	std::vector<uint8_t> indexBytes = GeometryCodec::EncodeIndices(indices.data(), indices.size());
+
+	// Written next to the cache and renamed over it once complete, so an interrupted write never leaves half a file behind
+	std::filesystem::path tempPath = path;
+	tempPath += ".tmp";
+	std::ofstream file(tempPath, std::ios::binary);
+	if (!file.is_open()) {
+		SPDLOG_ERROR("Could not write \"{}\"!", tempPath.string());
+		return false;
+	}
+	CompressedGeometryHeader header = {};
+	std::memcpy(header.magic, COMPRESSED_GEOMETRY_MAGIC, sizeof(header.magic));
+	header.version = COMPRESSED_GEOMETRY_VERSION;
+	header.vertexStride = sizeof(VertexAttributes);
+	header.uniqueVertexCount = uniqueVertexCount;
+	header.indexCount = static_cast<uint32_t>(indices.size());
+	header.subMeshCount = static_cast<uint32_t>(subMeshes.size());
+	header.materialCount = static_cast<uint32_t>(materials.size());
+	header.vertexBytes = vertexBytes.size();
+	header.indexBytes = indexBytes.size();
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(subMeshes.data()), subMeshes.size() * sizeof(SubMesh));
+	// Texture paths are stored relative to the file, so the folder can move
+	std::filesystem::path baseDir = path.parent_path();
+	for (const Material& material : materials) {
+		writeString(file, material.name);
+		file.write(reinterpret_cast<const char*>(&material.baseColor), sizeof(material.baseColor));
+		writeString(file, material.baseColorTexture.empty() ? std::string() : material.baseColorTexture.lexically_relative(baseDir).generic_string());
+		uint8_t flags = (material.transparent ? 1 : 0) | (material.alphaTest ? 2 : 0);
+		file.write(reinterpret_cast<const char*>(&flags), sizeof(flags));
+	}
+	file.write(reinterpret_cast<const char*>(vertexBytes.data()), vertexBytes.size());
+	file.write(reinterpret_cast<const char*>(indexBytes.data()), indexBytes.size());
+	file.close();
+
+	std::error_code error;
+	if (file.fail()) {
+		SPDLOG_ERROR("Could not write \"{}\"!", tempPath.string());
+	} else {
+		std::filesystem::rename(tempPath, path, error);
+		if (error) {
+			SPDLOG_ERROR("Could not move \"{}\" to \"{}\": {}", tempPath.string(), path.string(), error.message());
+		}
+	}
+	if (file.fail() || error) {
+		std::filesystem::remove(tempPath, error);
+		return false;
+	}
+	SPDLOG_INFO("Wrote \"{}\": {} KB of vertices down to {} KB ({} unique vertices).", path.string(), vertexData.size() * sizeof(VertexAttributes) / 1024,
+		(vertexBytes.size() + indexBytes.size()) / 1024, uniqueVertexCount);
+	return true;
+}
+
+bool ResourceManager::LoadCompressedGeometry(const std::filesystem::path& path, std::vector<VertexAttributes>& vertexData, std::vector<SubMesh>* subMeshes,
+	std::vector<Material>* materials)
+{
+	TRACE_ZONE("ResourceManager::LoadCompressedGeometry");
+	MappedFile file;
+	if (!file.Open(path)) {
+		return false;
+	}
+	const char* p = file.GetData();
+	const char* end = p + file.GetSize();
+	CompressedGeometryHeader header;
+	if (!readBytes(p, end, &header, sizeof(header)) || std::memcmp(header.magic, COMPRESSED_GEOMETRY_MAGIC, sizeof(header.magic)) != 0
+		|| header.version != COMPRESSED_GEOMETRY_VERSION || header.vertexStride != sizeof(VertexAttributes)) {
+		SPDLOG_WARN("\"{}\" is not a compressed mesh of this version", path.string());
+		return false;
 	}
 
+	// The counts decide the allocations below, so they have to fit in the rest of the file first
+	uint64_t remaining = static_cast<uint64_t>(end - p);
+	constexpr uint64_t MIN_MATERIAL_BYTES = 2 * sizeof(uint32_t) + sizeof(glm::vec4) + sizeof(uint8_t); // No name, no texture
+	if (uint64_t(header.subMeshCount) * sizeof(SubMesh) > remaining || header.materialCount * MIN_MATERIAL_BYTES > remaining
+		|| header.vertexBytes > remaining || header.indexBytes > remaining - header.vertexBytes
+		|| header.uniqueVertexCount > GeometryCodec::MaxVertexCount(header.vertexBytes, sizeof(VertexAttributes))
+		|| header.indexCount > GeometryCodec::MaxIndexCount(header.indexBytes)) {
+		SPDLOG_ERROR("\"{}\" is corrupt!", path.string());
+		return false;
+	}
+
+	std::vector<SubMesh> fileSubMeshes(header.subMeshCount);
+	bool valid = readBytes(p, end, fileSubMeshes.data(), fileSubMeshes.size() * sizeof(SubMesh));
+	std::vector<Material> fileMaterials(header.materialCount);
+	std::filesystem::path baseDir = path.parent_path();
+	for (Material& material : fileMaterials) {
+		std::string texture;
+		uint8_t flags = 0;
+		valid = valid && readString(p, end, material.name) && readBytes(p, end, &material.baseColor, sizeof(material.baseColor))
+			&& readString(p, end, texture) && readBytes(p, end, &flags, sizeof(flags));
+		if (!texture.empty()) {
+			material.baseColorTexture = baseDir / texture;
+		}
+		material.transparent = flags & 1;
+		material.alphaTest = flags & 2;
+	}
+
+	std::vector<VertexAttributes> uniqueVertices(header.uniqueVertexCount);
+	std::vector<uint32_t> indices(header.indexCount);
+	valid = valid && static_cast<uint64_t>(end - p) == header.vertexBytes + header.indexBytes
+		&& GeometryCodec::DecodeVertices(reinterpret_cast<const uint8_t*>(p), header.vertexBytes, uniqueVertices.data(), uniqueVertices.size(), sizeof(VertexAttributes))
+		&& GeometryCodec::DecodeIndices(reinterpret_cast<const uint8_t*>(p + header.vertexBytes), header.indexBytes, indices.data(), indices.size());
+	if (!valid) {
+		SPDLOG_ERROR("\"{}\" is corrupt!", path.string());
+		return false;
+	}
+
+	// Back to one vertex per corner, the way the renderer draws
+	vertexData.resize(indices.size());
+	std::atomic<bool> outOfBounds = false;
+	JobSystem::ParallelFor(static_cast<uint32_t>(indices.size()), 64 * 1024, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; ++i) {
+			if (indices[i] >= uniqueVertices.size()) {
+				outOfBounds = true;
+				continue;
+			}
+			vertexData[i] = uniqueVertices[indices[i]];
+		}
+	});
+	if (outOfBounds) {
+		SPDLOG_ERROR("\"{}\" is corrupt!", path.string());
+		return false;
+	}
+	if (subMeshes) {
+		*subMeshes = std::move(fileSubMeshes);
+	}
+	if (materials) {
+		*materials = std::move(fileMaterials);
+	}
 	return true;
 }
 
+void ResourceManager::RunCodecBenchmark(const std::filesystem::path& objPath)
+{
+	// The given OBJ, or a height field with normals and texcoords (1M quads)
+	std::vector<VertexAttributes> vertexData;
+	std::vector<SubMesh> subMeshes;
+	std::vector<Material> materials;
+	if (!objPath.empty()) {
+		if (!LoadGeometryFromObj(objPath, vertexData, &subMeshes, &materials)) {
+			return;
+		}
+	} else {
+		constexpr uint32_t GRID_SIZE = 1024;
+		auto gridVertex = [](uint32_t x, uint32_t y)
+		{
+			float u = x / float(GRID_SIZE);
+			float v = y / float(GRID_SIZE);
+			float height = std::sin(u * 20.0f) * std::cos(v * 20.0f);
+			VertexAttributes vertex;
+			vertex.position = {x * 0.1f, y * 0.1f, height};
+			vertex.normal = glm::normalize(glm::vec3(-20.0f * std::cos(u * 20.0f) * std::cos(v * 20.0f), 20.0f * std::sin(u * 20.0f) * std::sin(v * 20.0f), 1.0f));
+			vertex.color = {1.0f, 1.0f, 1.0f};
+			vertex.uv = {u, v};
+			return vertex;
+		};
+		vertexData.reserve(size_t(GRID_SIZE) * GRID_SIZE * 6);
+		for (uint32_t y = 0; y < GRID_SIZE; ++y) {
+			for (uint32_t x = 0; x < GRID_SIZE; ++x) {
+				vertexData.push_back(gridVertex(x, y));
+				vertexData.push_back(gridVertex(x + 1, y));
+				vertexData.push_back(gridVertex(x, y + 1));
+				vertexData.push_back(gridVertex(x + 1, y));
+				vertexData.push_back(gridVertex(x + 1, y + 1));
+				vertexData.push_back(gridVertex(x, y + 1));
+			}
+		}
+		SubMesh subMesh;
+		subMesh.vertexCount = static_cast<uint32_t>(vertexData.size());
+		subMeshes.push_back(subMesh);
+		Material material;
+		material.name = "Default";
+		materials.push_back(material);
+	}
+
+	auto measure = [](auto&& function)
+	{
+		auto start = std::chrono::steady_clock::now();
+		function();
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	};
+	std::vector<uint8_t> uniqueVertices;
+	std::vector<uint32_t> indices;
+	double indexSeconds = measure([&]() { GeometryCodec::IndexVertices(vertexData.data(), vertexData.size(), sizeof(VertexAttributes), uniqueVertices, indices); });
+	size_t uniqueVertexCount = uniqueVertices.size() / sizeof(VertexAttributes);
+	std::vector<uint8_t> vertexBytes;
+	std::vector<uint8_t> indexBytes;
+	double encodeSeconds = measure([&]()
+	{
+		vertexBytes = GeometryCodec::EncodeVertices(uniqueVertices.data(), uniqueVertexCount, sizeof(VertexAttributes));
+		indexBytes = GeometryCodec::EncodeIndices(indices.data(), indices.size());
+	});
+
+	// Round trips: both streams, then a whole file
+	constexpr int DECODE_ITERATIONS = 10;
+	std::vector<uint8_t> decodedVertices(uniqueVertices.size());
+	std::vector<uint32_t> decodedIndices(indices.size());
+	double vertexSeconds = std::numeric_limits<double>::max();
+	double indexDecodeSeconds = std::numeric_limits<double>::max();
+	bool roundTrip = true;
+	for (int i = 0; i < DECODE_ITERATIONS; ++i) {
+		vertexSeconds = std::min(vertexSeconds, measure([&]()
+		{
+			roundTrip &= GeometryCodec::DecodeVertices(vertexBytes.data(), vertexBytes.size(), decodedVertices.data(), uniqueVertexCount, sizeof(VertexAttributes));
+		}));
+		indexDecodeSeconds = std::min(indexDecodeSeconds, measure([&]()
+		{
+			roundTrip &= GeometryCodec::DecodeIndices(indexBytes.data(), indexBytes.size(), decodedIndices.data(), decodedIndices.size());
+		}));
+	}
+	roundTrip = roundTrip && decodedVertices == uniqueVertices && decodedIndices == indices;
+	// A damaged stream must be refused, not read past
+	bool rejectsTruncated = vertexBytes.empty()
+		|| !GeometryCodec::DecodeVertices(vertexBytes.data(), vertexBytes.size() - 1, decodedVertices.data(), uniqueVertexCount, sizeof(VertexAttributes));
+
+	std::filesystem::path meshPath = std::filesystem::temp_directory_path() / "codec_benchmark.mesh";
+	std::vector<VertexAttributes> loadedVertices;
+	std::vector<SubMesh> loadedSubMeshes;
+	std::vector<Material> loadedMaterials;
+	bool fileRoundTrip = SaveCompressedGeometry(meshPath, vertexData, subMeshes, materials);
+	double loadSeconds = measure([&]() { fileRoundTrip = fileRoundTrip && LoadCompressedGeometry(meshPath, loadedVertices, &loadedSubMeshes, &loadedMaterials); });
+	fileRoundTrip = fileRoundTrip && loadedVertices.size() == vertexData.size() && loadedSubMeshes.size() == subMeshes.size() && loadedMaterials.size() == materials.size()
+		&& std::memcmp(loadedVertices.data(), vertexData.data(), vertexData.size() * sizeof(VertexAttributes)) == 0;
+	std::filesystem::remove(meshPath);
+
+	// What loading would cost from a network share: reading the raw vertices vs reading the file and decoding it
+	constexpr double NETWORK_MB_PER_SECOND = 100.0;
+	double rawBytes = double(vertexData.size()) * sizeof(VertexAttributes);
+	double compressedBytes = double(vertexBytes.size() + indexBytes.size());
+	double megabyte = 1024.0 * 1024.0;
+	SPDLOG_INFO("Geometry codec benchmark: {} vertices, {} unique (indexed in {:.0f} ms)", vertexData.size(), uniqueVertexCount, indexSeconds * 1000.0);
+	SPDLOG_INFO("  vertices: {:.1f} MB -> {:.1f} MB, indices: {:.1f} MB -> {:.1f} MB, {:.1f}x smaller than the raw vertices, encoded in {:.0f} ms",
+		uniqueVertices.size() / megabyte, vertexBytes.size() / megabyte, indices.size() * sizeof(uint32_t) / megabyte, indexBytes.size() / megabyte,
+		rawBytes / compressedBytes, encodeSeconds * 1000.0);
+	SPDLOG_INFO("  decode: vertices {:.2f} GB/s, indices {:.2f} GB/s (of decoded data), whole file {:.0f} ms", uniqueVertices.size() / vertexSeconds / 1e9,
+		indices.size() * sizeof(uint32_t) / indexDecodeSeconds / 1e9, loadSeconds * 1000.0);
+	SPDLOG_INFO("  at {:.0f} MB/s: raw {:.0f} ms, compressed {:.0f} ms (read + decode)", NETWORK_MB_PER_SECOND, rawBytes / megabyte / NETWORK_MB_PER_SECOND * 1000.0,
+		(compressedBytes / megabyte / NETWORK_MB_PER_SECOND + vertexSeconds + indexDecodeSeconds) * 1000.0);
+	if (roundTrip && rejectsTruncated && fileRoundTrip) {
+		SPDLOG_INFO("  round trips: OK");
+	} else {
+		SPDLOG_ERROR("  round trips FAILED (streams {}, truncation check {}, file {})", roundTrip, rejectsTruncated, fileRoundTrip);
+	}
+}
+
 void ResourceManager::writeMipMaps(WGPUDevice device, WGPUTexture texture, WGPUExtent3D textureSize, uint32_t mipLevelCount, const unsigned char* pixelData)
 {
 	WGPUImageCopyTexture destination;
@@ -138,11 +844,13 @@ void ResourceManager::writeMipMaps(WGPUDevice device, WGPUTexture texture, WGPUE
 
 	WGPUQueue queue = wgpuDeviceGetQueue(device);
 	wgpuQueueWriteTexture(queue, &destination, pixelData, 4 * textureSize.width * textureSize.height, &source, &textureSize);
+	Stats::Add(Stats::Counter::BytesUploaded, 4ull * textureSize.width * textureSize.height);
 	wgpuQueueRelease(queue);
 }
 
 WGPUTexture ResourceManager::LoadTexture(const std::filesystem::path& path, WGPUDevice device, WGPUTextureView* pTextureView)
 {
+	TRACE_ZONE("ResourceManager::LoadTexture");
 	int width, height, channels;
 	std::string pathName = path.string();
 	unsigned char* pixelData = stbi_load(pathName.c_str(), &width, &height, &channels, 4); // Force 4 channels
@@ -163,6 +871,7 @@ WGPUTexture ResourceManager::LoadTexture(const std::filesystem::path& path, WGPU
 	textureDesc.viewFormatCount = 0;
 	textureDesc.viewFormats = nullptr;
 	WGPUTexture texture = wgpuDeviceCreateTexture(device, &textureDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::Textures, 4ll * width * height);
 	
 	// Upload data to the GPU texture
 	writeMipMaps(device, texture, textureDesc.size, textureDesc.mipLevelCount, pixelData);
@@ -187,8 +896,96 @@ WGPUTexture ResourceManager::LoadTexture(const std::filesystem::path& path, WGPU
 	return texture;
 }
 
-WGPUShaderModule ResourceManager::LoadShaderModule(const std::filesystem::path& path, WGPUDevice device)
+bool ResourceManager::SavePng(const std::filesystem::path& path, const uint8_t* pixels, uint32_t width, uint32_t height)
 {
+	TRACE_ZONE("ResourceManager::SavePng");
+	static const std::array<uint32_t, 256> crcTable = []()
+	{
+		std::array<uint32_t, 256> table = {};
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k) {
+				c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+			}
+			table[i] = c;
+		}
+		return table;
+	}();
+	auto putU32 = [](std::vector<uint8_t>& out, uint32_t value)
+	{
+		out.insert(out.end(), {(uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value});
+	};
+	std::vector<uint8_t> file = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	auto putChunk = [&](const char* type, const std::vector<uint8_t>& data)
+	{
+		putU32(file, static_cast<uint32_t>(data.size()));
+		size_t crcStart = file.size();
+		file.insert(file.end(), type, type + 4);
+		file.insert(file.end(), data.begin(), data.end());
+		uint32_t crc = 0xFFFFFFFFu;
+		for (size_t i = crcStart; i < file.size(); ++i) {
+			crc = crcTable[(crc ^ file[i]) & 0xFF] ^ (crc >> 8);
+		}
+		putU32(file, crc ^ 0xFFFFFFFFu);
+	};
+
+	std::vector<uint8_t> header;
+	putU32(header, width);
+	putU32(header, height);
+	header.insert(header.end(), {8, 6, 0, 0, 0}); // 8 bits, RGBA, deflate, adaptive filtering, no interlace
+	putChunk("IHDR", header);
+
+	// Scanlines with filter type 0 (none), in a zlib stream of stored deflate blocks
+	size_t rowBytes = 4ull * width;
+	size_t rawSize = (1 + rowBytes) * height;
+	std::vector<uint8_t> zlib;
+	zlib.reserve(2 + rawSize + 5 * (rawSize / 65535 + 1) + 4);
+	zlib.insert(zlib.end(), {0x78, 0x01});
+	uint32_t adlerA = 1, adlerB = 0;
+	size_t rawWritten = 0;
+	size_t blockLeft = 0;
+	auto putRaw = [&](const uint8_t* data, size_t size)
+	{
+		while (size > 0) {
+			if (blockLeft == 0) {
+				size_t left = rawSize - rawWritten;
+				uint16_t length = static_cast<uint16_t>(std::min<size_t>(left, 65535));
+				zlib.insert(zlib.end(), {(uint8_t)(left <= 65535 ? 1 : 0), (uint8_t)length, (uint8_t)(length >> 8), (uint8_t)~length, (uint8_t)(~length >> 8)});
+				blockLeft = length;
+			}
+			size_t count = std::min(size, blockLeft);
+			zlib.insert(zlib.end(), data, data + count);
+			for (size_t i = 0; i < count; ++i) {
+				adlerA = (adlerA + data[i]) % 65521;
+				adlerB = (adlerB + adlerA) % 65521;
+			}
+			data += count;
+			size -= count;
+			blockLeft -= count;
+			rawWritten += count;
+		}
+	};
+	const uint8_t filter = 0;
+	for (uint32_t y = 0; y < height; ++y) {
+		putRaw(&filter, 1);
+		putRaw(pixels + y * rowBytes, rowBytes);
+	}
+	putU32(zlib, (adlerB << 16) | adlerA);
+	putChunk("IDAT", zlib);
+	putChunk("IEND", {});
+
+	std::ofstream out(path, std::ios::binary);
+	out.write(reinterpret_cast<const char*>(file.data()), file.size());
+	if (!out) {
+		SPDLOG_ERROR("Could not write \"{}\"", path.string());
+		return false;
+	}
+	return true;
+}
+
+WGPUShaderModule ResourceManager::LoadShaderModule(const std::filesystem::path& path, WGPUDevice device, const std::vector<std::string>& defines)
+{
+	TRACE_ZONE("ResourceManager::LoadShaderModule");
 	SPDLOG_INFO("Loading shader module...");
 	std::ifstream file(path);
 	if (!file.is_open()) {
@@ -199,6 +996,12 @@ WGPUShaderModule ResourceManager::LoadShaderModule(const std::filesystem::path&
 	std::string shaderSource(size, ' ');
 	file.seekg(0);
 	file.read(shaderSource.data(), size);
+	shaderSource = PreprocessShader(shaderSource, defines);
+
+	std::string label = "Main shader module";
+	for (const std::string& define : defines) {
+		label += " " + define;
+	}
 
 	WGPUShaderModuleWGSLDescriptor shaderCodeDesc = {};
 	shaderCodeDesc.chain.next = nullptr;
@@ -207,7 +1010,64 @@ WGPUShaderModule ResourceManager::LoadShaderModule(const std::filesystem::path&
 
 	WGPUShaderModuleDescriptor shaderDesc = {};
 	shaderDesc.nextInChain = &shaderCodeDesc.chain;
-	shaderDesc.label = "Main shader module";
+	shaderDesc.label = label.c_str();
 
 	return wgpuDeviceCreateShaderModule(device, &shaderDesc);
+}
+
+std::string ResourceManager::PreprocessShader(const std::string& source, const std::vector<std::string>& defines)
+{
+	struct Block
+	{
+		bool parentActive;
+		bool condition;
+	};
+
+	std::unordered_set<std::string> defined(defines.begin(), defines.end());
+	std::vector<Block> blocks;
+	bool active = true;
+
+	std::istringstream input(source);
+	std::string output;
+	output.reserve(source.size());
+	std::string line;
+	uint32_t lineNumber = 0;
+	while (std::getline(input, line)) {
+		++lineNumber;
+		size_t start = line.find_first_not_of(" \t");
+		if (start == std::string::npos || line[start] != '#') {
+			if (active) {
+				output += line;
+			}
+			output += '\n';
+			continue;
+		}
+
+		std::istringstream directiveStream(line.substr(start));
+		std::string directive, name;
+		directiveStream >> directive >> name;
+		if (directive == "#ifdef" || directive == "#ifndef") {
+			bool condition = defined.count(name) > 0;
+			condition = directive == "#ifdef" ? condition : !condition;
+			blocks.push_back({active, condition});
+			active = active && condition;
+		} else if (directive == "#else" && !blocks.empty()) {
+			active = blocks.back().parentActive && !blocks.back().condition;
+		} else if (directive == "#endif" && !blocks.empty()) {
+			active = blocks.back().parentActive;
+			blocks.pop_back();
+		} else if (directive == "#define") {
+			if (active) {
+				defined.insert(name);
+			}
+		} else {
+			SPDLOG_ERROR("Shader line {}: unexpected \"{}\"", lineNumber, directive);
+		}
+		output += '\n';
+	}
+
+	if (!blocks.empty()) {
+		SPDLOG_ERROR("Shader is missing {} #endif", blocks.size());
+	}
+	return output;
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <string>
 #include <vector>
 #include <filesystem>
 
@@ -10,10 +11,35 @@
 class ResourceManager
 {
 public:
-	static bool LoadGeometry(const std::filesystem::path& path, std::vector<float>& pointData, std::vector<uint16_t>& indexData, int dimensions);
-	static bool LoadGeometryFromObj(const std::filesystem::path& path, std::vector<VertexAttributes>& vertexData);
+	// Files derived from a source (compressed meshes, tile files) go to CACHE_DIR instead of next to it, named after the source
+	static std::filesystem::path GetCachePath(const std::filesystem::path& sourcePath, const char* extension);
+	// The cache file exists and isn't older than any of the sources that exist
+	static bool IsCacheCurrent(const std::filesystem::path& cachePath, const std::vector<std::filesystem::path>& sourcePaths);
+	static bool LoadGeometry(const std::filesystem::path& path, std::vector<float>& pointData, std::vector<uint32_t>& indexData, int dimensions);
+	// Same with std::getline and std::istringstream (the loader MeshParser replaced), kept to compare against
+	static bool LoadGeometryIostream(const std::filesystem::path& path, std::vector<float>& pointData, std::vector<uint32_t>& indexData, int dimensions);
+	// Optionally splits the mesh into per-material sub-meshes and returns the .mtl materials (texture paths are absolute)
+	static bool LoadGeometryFromObj(const std::filesystem::path& path, std::vector<VertexAttributes>& vertexData, std::vector<SubMesh>* subMeshes = nullptr,
+		std::vector<Material>* materials = nullptr);
+	// Same through tinyobj (single-threaded), kept to compare against
+	static bool LoadGeometryFromObjTinyObj(const std::filesystem::path& path, std::vector<VertexAttributes>& vertexData, std::vector<SubMesh>* subMeshes = nullptr,
+		std::vector<Material>* materials = nullptr);
+	// MB/s of both OBJ loaders and both [points]/[indices] loaders on generated files: App --bench-obj [MB]
+	static void RunObjBenchmark(uint32_t megabytes);
+	// Deduplicated and GeometryCodec-compressed vertices, with the sub-meshes and materials. Loading gives back one vertex per corner
+	static bool SaveCompressedGeometry(const std::filesystem::path& path, const std::vector<VertexAttributes>& vertexData, const std::vector<SubMesh>& subMeshes,
+		const std::vector<Material>& materials);
+	static bool LoadCompressedGeometry(const std::filesystem::path& path, std::vector<VertexAttributes>& vertexData, std::vector<SubMesh>* subMeshes = nullptr,
+		std::vector<Material>* materials = nullptr);
+	// Round trips, compression ratio and decode GB/s on an OBJ (or a generated grid when empty): App --bench-codec [file.obj]
+	static void RunCodecBenchmark(const std::filesystem::path& objPath);
 	static WGPUTexture LoadTexture(const std::filesystem::path& path, WGPUDevice device, WGPUTextureView* pTextureView = nullptr);
-	static WGPUShaderModule LoadShaderModule(const std::filesystem::path& path, WGPUDevice device);
+	// Tightly packed RGBA8 rows. Stored without compression (there's no zlib around), fast to write but big
+	static bool SavePng(const std::filesystem::path& path, const uint8_t* pixels, uint32_t width, uint32_t height);
+	// defines are fed to PreprocessShader, one module per combination
+	static WGPUShaderModule LoadShaderModule(const std::filesystem::path& path, WGPUDevice device, const std::vector<std::string>& defines = {});
+	// Minimal #define/#ifdef/#ifndef/#else/#endif pass. Removed lines are kept empty so compiler errors still point at the right line
+	static std::string PreprocessShader(const std::string& source, const std::vector<std::string>& defines);
 private:
 	static void writeMipMaps(WGPUDevice device, WGPUTexture texture, WGPUExtent3D textureSize, uint32_t mipLevelCount, const unsigned char* pixelData);
 };
\ No newline at end of file
@@ -0,0 +1,146 @@
+#include <array>
+#include <atomic>
+#include <algorithm>
+
+#include <imgui/imgui.h>
+
+#include "Stats.hpp"
+
+namespace Stats
+{
+// Padded so threads bumping different counters don't fight over a cache line
+struct alignas(64) AtomicCounter
+{
+	std::atomic<int64_t> value = 0;
+};
+
+std::array<AtomicCounter, (size_t)Counter::Count> g_counters;
+std::array<AtomicCounter, (size_t)MemoryCategory::Count> g_gpuMemory;
+std::array<uint64_t, (size_t)Counter::Count> g_lastFrameCounters = {};
+
+// Phases are only recorded from the main thread
+std::array<float, (size_t)Phase::Count> g_phases = {};
+std::array<float, (size_t)Phase::Count> g_lastFramePhases = {};
+
+std::array<float, FRAME_HISTORY_SIZE> g_frameTimes = {};
+uint32_t g_frameIndex = 0;
+uint32_t g_frameCount = 0;
+
+const char* g_counterNames[] = {"Draw calls", "Triangles", "Instances", "Bytes uploaded", "Pipeline changes", "Bind group changes"};
+const char* g_memoryNames[] = {"Vertex buffers", "Index buffers", "Uniform buffers", "Storage buffers", "Textures", "Render targets", "Queries", "Readbacks"};
+const char* g_phaseNames[] = {"Events", "Physics", "Streaming", "Wait for slot", "Update", "Acquire surface", "Encode", "Submit", "Present"};
+static_assert(sizeof(g_counterNames) / sizeof(g_counterNames[0]) == (size_t)Counter::Count);
+static_assert(sizeof(g_memoryNames) / sizeof(g_memoryNames[0]) == (size_t)MemoryCategory::Count);
+static_assert(sizeof(g_phaseNames) / sizeof(g_phaseNames[0]) == (size_t)Phase::Count);
+
+void Add(Counter counter, uint64_t value)
+{
+	g_counters[(size_t)counter].value.fetch_add(static_cast<int64_t>(value), std::memory_order_relaxed);
+}
+
+void TrackGpuMemory(MemoryCategory category, int64_t bytes)
+{
+	g_gpuMemory[(size_t)category].value.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void RecordPhase(Phase phase, float ms)
+{
+	g_phases[(size_t)phase] += ms;
+}
+
+void EndFrame(float frameMs)
+{
+	for (size_t i = 0; i < g_counters.size(); ++i) {
+		g_lastFrameCounters[i] = static_cast<uint64_t>(g_counters[i].value.exchange(0, std::memory_order_relaxed));
+	}
+	g_lastFramePhases = g_phases;
+	g_phases.fill(0.0f);
+
+	g_frameTimes[g_frameIndex] = frameMs;
+	g_frameIndex = (g_frameIndex + 1) % FRAME_HISTORY_SIZE;
+	g_frameCount = std::min(g_frameCount + 1, FRAME_HISTORY_SIZE);
+}
+
+uint64_t GetLastFrameCounter(Counter counter)
+{
+	return g_lastFrameCounters[(size_t)counter];
+}
+
+int64_t GetGpuMemory(MemoryCategory category)
+{
+	return g_gpuMemory[(size_t)category].value.load(std::memory_order_relaxed);
+}
+
+float GetLastFramePhase(Phase phase)
+{
+	return g_lastFramePhases[(size_t)phase];
+}
+
+float percentile(const std::array<float, FRAME_HISTORY_SIZE>& sorted, uint32_t count, float p)
+{
+	if (count == 0) {
+		return 0.0f;
+	}
+	uint32_t index = std::min(static_cast<uint32_t>(p * (count - 1) + 0.5f), count - 1);
+	return sorted[index];
+}
+
+void DrawHud(float gpuFrameMs)
+{
+	std::array<float, FRAME_HISTORY_SIZE> sorted = g_frameTimes;
+	std::sort(sorted.begin(), sorted.begin() + g_frameCount);
+	float p50 = percentile(sorted, g_frameCount, 0.50f);
+	float p95 = percentile(sorted, g_frameCount, 0.95f);
+	float p99 = percentile(sorted, g_frameCount, 0.99f);
+	float maxMs = g_frameCount > 0 ? sorted[g_frameCount - 1] : 0.0f;
+	float lastMs = g_frameTimes[(g_frameIndex + FRAME_HISTORY_SIZE - 1) % FRAME_HISTORY_SIZE];
+
+	ImGui::Begin("Performance", nullptr, ImGuiWindowFlags_AlwaysAutoResize);
+
+	// Frame times
+	ImGui::Text("Frame %.2f ms (%.0f FPS) | GPU %.2f ms", lastMs, lastMs > 0.0f ? 1000.0f / lastMs : 0.0f, gpuFrameMs);
+	ImGui::Text("p50 %.2f | p95 %.2f | p99 %.2f | max %.2f ms", p50, p95, p99, maxMs);
+	float graphMax = std::max(maxMs * 1.1f, 1.0f);
+	ImGui::PlotLines("##frameTimes", g_frameTimes.data(), FRAME_HISTORY_SIZE, g_frameCount < FRAME_HISTORY_SIZE ? 0 : g_frameIndex, nullptr, 0.0f, graphMax, ImVec2(320, 80));
+
+	// Percentile lines on top of the graph
+	ImVec2 graphMin = ImGui::GetItemRectMin();
+	ImVec2 graphMaxCorner = ImGui::GetItemRectMax();
+	ImDrawList* drawList = ImGui::GetWindowDrawList();
+	auto drawPercentile = [&](float ms, ImU32 color)
+	{
+		float y = graphMaxCorner.y - (ms / graphMax) * (graphMaxCorner.y - graphMin.y);
+		drawList->AddLine(ImVec2(graphMin.x, y), ImVec2(graphMaxCorner.x, y), color);
+	};
+	drawPercentile(p50, IM_COL32(80, 220, 80, 255));
+	drawPercentile(p95, IM_COL32(240, 200, 60, 255));
+	drawPercentile(p99, IM_COL32(240, 70, 70, 255));
+
+	// CPU phases
+	if (ImGui::CollapsingHeader("CPU phases", ImGuiTreeNodeFlags_DefaultOpen)) {
+		for (size_t i = 0; i < g_lastFramePhases.size(); ++i) {
+			ImGui::Text("%-16s %6.3f ms", g_phaseNames[i], g_lastFramePhases[i]);
+		}
+	}
+
+	// Per-frame counters
+	if (ImGui::CollapsingHeader("Counters", ImGuiTreeNodeFlags_DefaultOpen)) {
+		for (size_t i = 0; i < g_lastFrameCounters.size(); ++i) {
+			ImGui::Text("%-16s %llu", g_counterNames[i], (unsigned long long)g_lastFrameCounters[i]);
+		}
+	}
+
+	// GPU memory
+	if (ImGui::CollapsingHeader("GPU memory", ImGuiTreeNodeFlags_DefaultOpen)) {
+		int64_t total = 0;
+		for (size_t i = 0; i < g_gpuMemory.size(); ++i) {
+			int64_t bytes = g_gpuMemory[i].value.load(std::memory_order_relaxed);
+			total += bytes;
+			ImGui::Text("%-16s %8.2f MB", g_memoryNames[i], bytes / (1024.0 * 1024.0));
+		}
+		ImGui::Text("%-16s %8.2f MB", "Total", total / (1024.0 * 1024.0));
+	}
+
+	ImGui::End();
+}
+}
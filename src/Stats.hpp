@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+
+// Central registry for the performance HUD. Any thread may call Add/TrackGpuMemory (relaxed atomics, one cache line per counter)
+namespace Stats
+{
+	// Reset every frame
+	enum class Counter : uint32_t
+	{
+		DrawCalls,
+		Triangles,
+		Instances,
+		BytesUploaded,
+		PipelineChanges,
+		BindGroupChanges,
+		Count
+	};
+
+	// Persistent, in bytes
+	enum class MemoryCategory : uint32_t
+	{
+		VertexBuffers,
+		IndexBuffers,
+		UniformBuffers,
+		StorageBuffers,
+		Textures,
+		RenderTargets,
+		Queries,
+		Readbacks,
+		Count
+	};
+
+	// CPU side of a frame (see Application::MainLoop)
+	enum class Phase : uint32_t
+	{
+		Events,
+		Physics,
+		Streaming,
+		WaitForFrameSlot,
+		Update,
+		AcquireSurface,
+		Encode,
+		Submit,
+		Present,
+		Count
+	};
+
+	constexpr uint32_t FRAME_HISTORY_SIZE = 240;
+
+	void Add(Counter counter, uint64_t value);
+	void TrackGpuMemory(MemoryCategory category, int64_t bytes); // Negative when releasing
+	void RecordPhase(Phase phase, float ms);
+
+	// Snapshots and resets the per-frame counters (main thread, once per rendered frame)
+	void EndFrame(float frameMs);
+
+	uint64_t GetLastFrameCounter(Counter counter);
+	int64_t GetGpuMemory(MemoryCategory category);
+	float GetLastFramePhase(Phase phase);
+
+	// Dear ImGui overlay (frame time graph with percentiles, phases, counters, memory)
+	void DrawHud(float gpuFrameMs);
+};
@@ -0,0 +1,252 @@
+#include <map>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+
+#include <stb/stb_image.h>
+#include <spdlog/spdlog.h>
+#include <imgui/imgui.h>
+
+#include "TextureArrays.hpp"
+#include "JobSystem.hpp"
+#include "Trace.hpp"
+#include "Stats.hpp"
+
+namespace
+{
+struct PackedImage
+{
+	std::vector<uint8_t> pixels; // RGBA8
+	uint32_t width = 1;
+	uint32_t height = 1;
+	uint32_t x = 0; // Texel position in the atlas layer, past the gutter
+	uint32_t y = 0;
+	TextureArrays::Entry entry;
+};
+
+// Copies the image into a layer, ATLAS_GUTTER texels around it are filled by wrapping around (repeat addressing)
+void blitWithGutter(const PackedImage& image, std::vector<uint8_t>& layer, uint32_t layerSize, uint32_t gutter)
+{
+	for (uint32_t y = 0; y < image.height + 2 * gutter; ++y) {
+		uint32_t sourceY = (y + image.height * gutter - gutter) % image.height; // Stays positive
+		uint8_t* row = &layer[4ull * ((image.y - gutter + y) * layerSize + image.x - gutter)];
+		for (uint32_t x = 0; x < image.width + 2 * gutter; ++x) {
+			uint32_t sourceX = (x + image.width * gutter - gutter) % image.width;
+			std::memcpy(row + 4 * x, &image.pixels[4ull * (sourceY * image.width + sourceX)], 4);
+		}
+	}
+}
+}
+
+std::vector<TextureArrays::Entry> TextureArrays::Build(WGPUDevice device, WGPUQueue queue, const std::vector<std::filesystem::path>& paths)
+{
+	TRACE_ZONE("TextureArrays::Build");
+	WGPUSupportedLimits deviceLimits = {};
+	deviceLimits.nextInChain = nullptr;
+	wgpuDeviceGetLimits(device, &deviceLimits);
+	uint32_t maxLayers = std::max(1u, deviceLimits.limits.maxTextureArrayLayers);
+	uint32_t atlasSize = std::min(ATLAS_SIZE, deviceLimits.limits.maxTextureDimension2D);
+
+	// Every distinct image once, loaded on the job system
+	std::vector<PackedImage> images;
+	std::vector<std::string> imagePaths;
+	std::vector<uint32_t> pathImages;
+	std::unordered_map<std::string, uint32_t> imageIds;
+	for (const std::filesystem::path& path : paths) {
+		auto [it, inserted] = imageIds.try_emplace(path.string(), static_cast<uint32_t>(imagePaths.size()));
+		if (inserted) {
+			imagePaths.push_back(path.string());
+		}
+		pathImages.push_back(it->second);
+	}
+	images.resize(imagePaths.size());
+	JobSystem::ParallelFor(static_cast<uint32_t>(images.size()), 1, [&](uint32_t begin, uint32_t end)
+	{
+		for (uint32_t i = begin; i < end; ++i) {
+			PackedImage& image = images[i];
+			int width = 0, height = 0, channels;
+			unsigned char* pixelData = imagePaths[i].empty() ? nullptr : stbi_load(imagePaths[i].c_str(), &width, &height, &channels, 4);
+			if (pixelData && static_cast<uint32_t>(std::max(width, height)) <= deviceLimits.limits.maxTextureDimension2D) {
+				image.width = width;
+				image.height = height;
+				image.pixels.assign(pixelData, pixelData + 4ull * width * height);
+			} else {
+				if (!imagePaths[i].empty()) {
+					SPDLOG_ERROR("Failed to load texture \"{}\", using white", imagePaths[i]);
+				}
+				image.pixels.assign(4, 255);
+			}
+			stbi_image_free(pixelData);
+		}
+	});
+
+	// Small images go into atlas layers (shelf packing, tallest first), the rest are grouped by size
+	std::vector<uint32_t> atlasImages;
+	std::map<std::pair<uint32_t, uint32_t>, std::vector<uint32_t>> sizeGroups;
+	for (uint32_t i = 0; i < images.size(); ++i) {
+		if (images[i].width <= MAX_ATLAS_TEXTURE && images[i].height <= MAX_ATLAS_TEXTURE && images[i].width + 2 * ATLAS_GUTTER <= atlasSize
+			&& images[i].height + 2 * ATLAS_GUTTER <= atlasSize) {
+			atlasImages.push_back(i);
+		} else {
+			sizeGroups[{images[i].width, images[i].height}].push_back(i);
+		}
+	}
+	std::stable_sort(atlasImages.begin(), atlasImages.end(), [&images](uint32_t a, uint32_t b) { return images[a].height > images[b].height; });
+
+	// Arrays are planned first (image -> array, layer), then created and filled
+	struct ArrayPlan
+	{
+		uint32_t width, height;
+		bool atlas;
+		std::vector<std::vector<uint32_t>> layers; // Images per layer
+	};
+	std::vector<ArrayPlan> plans;
+	uint32_t shelfX = 0, shelfY = 0, shelfHeight = 0;
+	for (uint32_t imageId : atlasImages) {
+		PackedImage& image = images[imageId];
+		uint32_t cellWidth = image.width + 2 * ATLAS_GUTTER;
+		uint32_t cellHeight = image.height + 2 * ATLAS_GUTTER;
+		if (shelfX + cellWidth > atlasSize) {
+			shelfX = 0;
+			shelfY += shelfHeight;
+			shelfHeight = 0;
+		}
+		if (plans.empty() || shelfY + cellHeight > atlasSize) {
+			if (plans.empty() || plans.back().layers.size() == maxLayers) {
+				plans.push_back({atlasSize, atlasSize, true, {}});
+			}
+			plans.back().layers.emplace_back();
+			shelfX = shelfY = shelfHeight = 0;
+		}
+		image.x = shelfX + ATLAS_GUTTER;
+		image.y = shelfY + ATLAS_GUTTER;
+		image.entry.array = static_cast<uint32_t>(plans.size()) - 1;
+		image.entry.layer = static_cast<uint32_t>(plans.back().layers.size()) - 1;
+		plans.back().layers.back().push_back(imageId);
+		shelfX += cellWidth;
+		shelfHeight = std::max(shelfHeight, cellHeight);
+	}
+	// A single atlas layer only needs to be as big as what's in it (e.g. just the white texture)
+	if (!plans.empty() && plans[0].layers.size() == 1) {
+		plans[0].width = plans[0].height = 0;
+		for (uint32_t imageId : plans[0].layers[0]) {
+			plans[0].width = std::max(plans[0].width, images[imageId].x + images[imageId].width + ATLAS_GUTTER);
+			plans[0].height = std::max(plans[0].height, images[imageId].y + images[imageId].height + ATLAS_GUTTER);
+		}
+	}
+	for (uint32_t imageId : atlasImages) {
+		PackedImage& image = images[imageId];
+		glm::vec2 size = glm::vec2(plans[image.entry.array].width, plans[image.entry.array].height);
+		image.entry.uvTransform = glm::vec4(glm::vec2(image.width, image.height) / size, glm::vec2(image.x, image.y) / size);
+	}
+	for (auto& [size, group] : sizeGroups) {
+		for (size_t first = 0; first < group.size(); first += maxLayers) {
+			ArrayPlan plan = {size.first, size.second, false, {}};
+			for (size_t i = first; i < std::min(group.size(), first + size_t(maxLayers)); ++i) {
+				images[group[i]].entry.array = static_cast<uint32_t>(plans.size());
+				images[group[i]].entry.layer = static_cast<uint32_t>(plan.layers.size());
+				plan.layers.push_back({group[i]});
+			}
+			plans.push_back(std::move(plan));
+		}
+	}
+
+	std::vector<uint8_t> layerPixels;
+	for (const ArrayPlan& plan : plans) {
+		TextureArray array;
+		array.width = plan.width;
+		array.height = plan.height;
+		array.layers = static_cast<uint32_t>(plan.layers.size());
+		array.atlas = plan.atlas;
+
+		WGPUTextureDescriptor textureDesc = {};
+		textureDesc.nextInChain = nullptr;
+		textureDesc.label = plan.atlas ? "Texture atlas array" : "Texture array";
+		textureDesc.usage = WGPUTextureUsage_TextureBinding | WGPUTextureUsage_CopyDst;
+		textureDesc.dimension = WGPUTextureDimension_2D;
+		textureDesc.size = {array.width, array.height, array.layers};
+		textureDesc.format = WGPUTextureFormat_RGBA8Unorm;
+		textureDesc.mipLevelCount = 1;
+		textureDesc.sampleCount = 1;
+		textureDesc.viewFormatCount = 0;
+		textureDesc.viewFormats = nullptr;
+		array.texture = wgpuDeviceCreateTexture(device, &textureDesc);
+		Stats::TrackGpuMemory(Stats::MemoryCategory::Textures, 4ll * array.width * array.height * array.layers);
+
+		WGPUTextureViewDescriptor textureViewDesc = {};
+		textureViewDesc.nextInChain = nullptr;
+		textureViewDesc.label = "Texture array view";
+		textureViewDesc.format = textureDesc.format;
+		textureViewDesc.dimension = WGPUTextureViewDimension_2DArray; // Even with a single layer, the shader declares texture_2d_array
+		textureViewDesc.baseMipLevel = 0;
+		textureViewDesc.mipLevelCount = 1;
+		textureViewDesc.baseArrayLayer = 0;
+		textureViewDesc.arrayLayerCount = array.layers;
+		textureViewDesc.aspect = WGPUTextureAspect_All;
+		array.view = wgpuTextureCreateView(array.texture, &textureViewDesc);
+		if (!array.texture || !array.view) {
+			SPDLOG_ERROR("Failed to create a {}x{}x{} texture array!", array.width, array.height, array.layers);
+			return {};
+		}
+
+		WGPUTextureDataLayout source = {};
+		source.nextInChain = nullptr;
+		source.offset = 0;
+		source.bytesPerRow = 4 * array.width;
+		source.rowsPerImage = array.height;
+		WGPUExtent3D layerSize = {array.width, array.height, 1};
+		for (uint32_t layer = 0; layer < array.layers; ++layer) {
+			const uint8_t* pixels = nullptr;
+			if (plan.atlas) {
+				layerPixels.assign(4ull * array.width * array.height, 0);
+				for (uint32_t imageId : plan.layers[layer]) {
+					blitWithGutter(images[imageId], layerPixels, array.width, ATLAS_GUTTER);
+				}
+				pixels = layerPixels.data();
+			} else {
+				pixels = images[plan.layers[layer][0]].pixels.data();
+			}
+			array.textureCount += static_cast<uint32_t>(plan.layers[layer].size());
+
+			WGPUImageCopyTexture destination = {};
+			destination.texture = array.texture;
+			destination.mipLevel = 0;
+			destination.origin = {0, 0, layer};
+			destination.aspect = WGPUTextureAspect_All;
+			wgpuQueueWriteTexture(queue, &destination, pixels, 4ull * array.width * array.height, &source, &layerSize);
+			Stats::Add(Stats::Counter::BytesUploaded, 4ull * array.width * array.height);
+		}
+		m_arrays.push_back(array);
+	}
+	SPDLOG_INFO("Packed {} textures into {} texture arrays.", images.size(), m_arrays.size());
+
+	std::vector<Entry> entries;
+	entries.reserve(paths.size());
+	for (uint32_t imageId : pathImages) {
+		entries.push_back(images[imageId].entry);
+	}
+	return entries;
+}
+
+void TextureArrays::Terminate()
+{
+	for (TextureArray& array : m_arrays) {
+		wgpuTextureViewRelease(array.view);
+		wgpuTextureDestroy(array.texture);
+		wgpuTextureRelease(array.texture);
+		Stats::TrackGpuMemory(Stats::MemoryCategory::Textures, -4ll * array.width * array.height * array.layers);
+	}
+	m_arrays.clear();
+}
+
+void TextureArrays::DrawImGui()
+{
+	if (m_arrays.empty()) {
+		return;
+	}
+	ImGui::Begin("Texture arrays");
+	for (const TextureArray& array : m_arrays) {
+		ImGui::Text("%s %ux%u, %u layers: %u textures", array.atlas ? "Atlas" : "Array", array.width, array.height, array.layers, array.textureCount);
+	}
+	ImGui::End();
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <filesystem>
+
+#include <webgpu/webgpu.h>
+#include <glm/glm.hpp>
+
+// Packs material textures into a few texture_2d_array textures at load time, so materials that share an array share a bind
+// group and draws with different textures can be batched. Textures of the same size become layers of one array, small ones
+// are packed into atlas layers first (fs_main remaps their UVs). Only the first mip, like ResourceManager::LoadTexture
+class TextureArrays
+{
+public:
+	static constexpr uint32_t ATLAS_SIZE = 2048; // Atlas layer side, clamped to the device limit
+	static constexpr uint32_t MAX_ATLAS_TEXTURE = 512; // Textures up to this size (both sides) go into atlases
+	static constexpr uint32_t ATLAS_GUTTER = 4; // Texels wrapped around each atlas entry, so bilinear filtering repeats
+
+	// Where a texture ended up
+	struct Entry
+	{
+		uint32_t array = 0;
+		uint32_t layer = 0;
+		glm::vec4 uvTransform = {1.0f, 1.0f, 0.0f, 0.0f}; // Scale xy, offset zw, applied to fract(uv)
+	};
+
+	// One entry per path. The same path is only packed once, an empty path (or an image that fails to load) is white
+	std::vector<Entry> Build(WGPUDevice device, WGPUQueue queue, const std::vector<std::filesystem::path>& paths);
+	void Terminate();
+
+	uint32_t GetArrayCount() const { return static_cast<uint32_t>(m_arrays.size()); }
+	WGPUTextureView GetView(uint32_t array) const { return m_arrays[array].view; }
+
+	void DrawImGui();
+private:
+	struct TextureArray
+	{
+		WGPUTexture texture = nullptr;
+		WGPUTextureView view = nullptr;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		uint32_t layers = 0;
+		uint32_t textureCount = 0;
+		bool atlas = false;
+	};
+
+	std::vector<TextureArray> m_arrays;
+};
@@ -0,0 +1,166 @@
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <thread>
+
+#include <spdlog/spdlog.h>
+
+#include "Trace.hpp"
+
+namespace Trace
+{
+// Single producer (the owning thread), read by WriteChromeTrace
+struct ThreadBuffer
+{
+	std::array<Event, EVENTS_PER_THREAD> events;
+	std::atomic<uint64_t> writeIndex = 0;
+	uint32_t threadId = 0;
+	std::string name;
+};
+
+std::mutex g_registryMutex; // Only taken when a thread records for the first time and when dumping
+std::vector<std::unique_ptr<ThreadBuffer>> g_threadBuffers;
+thread_local ThreadBuffer* t_threadBuffer = nullptr;
+
+constexpr uint32_t MAX_GPU_EVENTS = 4096;
+std::mutex g_gpuMutex; // GPU events come in a handful per frame
+std::vector<Event> g_gpuEvents;
+uint64_t g_gpuWriteIndex = 0;
+
+// Anchor so ticks can be turned into nanoseconds since startup
+const uint64_t g_startTicks = Now();
+const std::chrono::steady_clock::time_point g_startTime = std::chrono::steady_clock::now();
+
+double g_nsPerTick = 0.0; // Set by Init, before any other thread starts
+
+void Init()
+{
+#ifdef TRACE_HAS_RDTSC
+	// Measured against steady_clock
+	auto timeBegin = std::chrono::steady_clock::now();
+	uint64_t ticksBegin = Now();
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	auto timeEnd = std::chrono::steady_clock::now();
+	uint64_t ticksEnd = Now();
+	double ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(timeEnd - timeBegin).count();
+	g_nsPerTick = ns / (double)(ticksEnd - ticksBegin);
+#else
+	g_nsPerTick = 1e9 * std::chrono::steady_clock::period::num / std::chrono::steady_clock::period::den;
+#endif
+}
+
+uint64_t TicksToNs(uint64_t ticks)
+{
+	return ticks > g_startTicks ? static_cast<uint64_t>((ticks - g_startTicks) * g_nsPerTick) : 0;
+}
+
+ThreadBuffer& getThreadBuffer()
+{
+	if (!t_threadBuffer) {
+		std::lock_guard<std::mutex> lock(g_registryMutex);
+		auto& buffer = g_threadBuffers.emplace_back(std::make_unique<ThreadBuffer>());
+		buffer->threadId = static_cast<uint32_t>(g_threadBuffers.size());
+		buffer->name = "Thread " + std::to_string(buffer->threadId);
+		t_threadBuffer = buffer.get();
+	}
+	return *t_threadBuffer;
+}
+
+void Record(const char* name, uint64_t start, uint64_t end)
+{
+	ThreadBuffer& buffer = getThreadBuffer();
+	uint64_t index = buffer.writeIndex.load(std::memory_order_relaxed);
+	buffer.events[index & (EVENTS_PER_THREAD - 1)] = {name, start, end};
+	buffer.writeIndex.store(index + 1, std::memory_order_release);
+}
+
+void SetThreadName(const char* name)
+{
+	ThreadBuffer& buffer = getThreadBuffer();
+	std::lock_guard<std::mutex> lock(g_registryMutex);
+	buffer.name = name;
+}
+
+void AddGpuEvent(const char* name, uint64_t startNs, uint64_t endNs)
+{
+	std::lock_guard<std::mutex> lock(g_gpuMutex);
+	if (g_gpuEvents.size() < MAX_GPU_EVENTS) {
+		g_gpuEvents.push_back({name, startNs, endNs});
+	} else {
+		g_gpuEvents[g_gpuWriteIndex % MAX_GPU_EVENTS] = {name, startNs, endNs};
+	}
+	++g_gpuWriteIndex;
+}
+
+void writeEvent(std::ofstream& file, bool& first, const char* name, uint64_t startNs, uint64_t endNs, uint32_t pid, uint32_t tid)
+{
+	// Chrome wants microseconds
+	file << (first ? "\n" : ",\n") << "{\"name\":\"" << name << "\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << tid
+		<< ",\"ts\":" << startNs / 1000.0 << ",\"dur\":" << (endNs > startNs ? endNs - startNs : 0) / 1000.0 << "}";
+	first = false;
+}
+
+void writeThreadName(std::ofstream& file, bool& first, const std::string& name, uint32_t pid, uint32_t tid)
+{
+	file << (first ? "\n" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << tid
+		<< ",\"args\":{\"name\":\"" << name << "\"}}";
+	first = false;
+}
+
+bool WriteChromeTrace(const std::filesystem::path& path)
+{
+	TRACE_ZONE("WriteChromeTrace");
+	std::ofstream file(path);
+	if (!file.is_open()) {
+		SPDLOG_ERROR("Could not write trace to \"{}\"", path.string());
+		return false;
+	}
+
+	file.setf(std::ios::fixed);
+	file.precision(3);
+	file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	bool first = true;
+	size_t eventCount = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(g_registryMutex);
+		std::vector<Event> events;
+		for (const auto& buffer : g_threadBuffers) {
+			// Copy first, then drop whatever the owner may have overwritten while we were copying
+			uint64_t end = buffer->writeIndex.load(std::memory_order_acquire);
+			uint64_t begin = end > EVENTS_PER_THREAD ? end - EVENTS_PER_THREAD : 0;
+			events.clear();
+			for (uint64_t i = begin; i < end; ++i) {
+				events.push_back(buffer->events[i & (EVENTS_PER_THREAD - 1)]);
+			}
+			uint64_t endAfterCopy = buffer->writeIndex.load(std::memory_order_acquire);
+			// The owner may be halfway through writing slot endAfterCopy, which is also where event endAfterCopy - EVENTS_PER_THREAD was
+			uint64_t firstValid = endAfterCopy + 1 > EVENTS_PER_THREAD ? endAfterCopy + 1 - EVENTS_PER_THREAD : 0;
+			size_t skip = firstValid > begin ? static_cast<size_t>(firstValid - begin) : 0;
+
+			writeThreadName(file, first, buffer->name, 0, buffer->threadId);
+			for (size_t i = skip; i < events.size(); ++i) {
+				writeEvent(file, first, events[i].name, TicksToNs(events[i].start), TicksToNs(events[i].end), 0, buffer->threadId);
+			}
+			eventCount += events.size() > skip ? events.size() - skip : 0;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(g_gpuMutex);
+		writeThreadName(file, first, "GPU", 1, 0);
+		for (const Event& event : g_gpuEvents) {
+			writeEvent(file, first, event.name, event.start, event.end, 1, 0);
+		}
+		eventCount += g_gpuEvents.size();
+	}
+
+	file << "\n]}\n";
+	SPDLOG_INFO("Wrote {} trace events to \"{}\"", eventCount, path.string());
+	return true;
+}
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <filesystem>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define TRACE_HAS_RDTSC 1
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TRACE_HAS_RDTSC 1
+#endif
+
+// Lightweight CPU trace zones: TRACE_ZONE("Name") records the scope into a per-thread ring buffer (two tick reads and a store, no locks).
+// Names must be string literals (only the pointer is stored). WriteChromeTrace dumps everything for chrome://tracing or ui.perfetto.dev
+namespace Trace
+{
+	constexpr uint32_t EVENTS_PER_THREAD = 1 << 16; // Power of two, oldest events get overwritten
+
+	struct Event
+	{
+		const char* name;
+		uint64_t start; // Ticks for CPU events, nanoseconds for GPU events
+		uint64_t end;
+	};
+
+	// Raw ticks (TSC where available, which is several times cheaper than steady_clock). Converted to time when dumping
+	inline uint64_t Now()
+	{
+#ifdef TRACE_HAS_RDTSC
+		return __rdtsc();
+#else
+		return static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+	}
+	// Calibrates the tick rate (sleeps 10 ms). Call once at startup, before anything converts ticks
+	void Init();
+	uint64_t TicksToNs(uint64_t ticks);
+	inline uint64_t NowNs() { return TicksToNs(Now()); }
+
+	void Record(const char* name, uint64_t start, uint64_t end);
+	void SetThreadName(const char* name);
+	// GPU work, already converted to the CPU clock with NowNs (see GpuProfiler)
+	void AddGpuEvent(const char* name, uint64_t startNs, uint64_t endNs);
+	bool WriteChromeTrace(const std::filesystem::path& path);
+
+	class Zone
+	{
+	public:
+		explicit Zone(const char* name) : m_name(name), m_start(Now()) {}
+		~Zone() { Record(m_name, m_start, Now()); }
+		Zone(const Zone&) = delete;
+		Zone& operator=(const Zone&) = delete;
+	private:
+		const char* m_name;
+		uint64_t m_start;
+	};
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_ZONE(name) Trace::Zone TRACE_CONCAT(traceZone, __LINE__)(name)
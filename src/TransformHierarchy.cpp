@@ -0,0 +1,259 @@
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <numeric>
+#include <algorithm>
+
+#include <glm/ext.hpp>
+
+#include <spdlog/spdlog.h>
+
+#include "TransformHierarchy.hpp"
+#include "JobSystem.hpp"
+#include "Trace.hpp"
+
+namespace
+{
+glm::mat4x4 composeTransform(const glm::vec3& translation, const glm::quat& rotation, const glm::vec3& scale)
+{
+	glm::mat4x4 matrix = glm::mat4_cast(rotation);
+	matrix[0] *= scale.x;
+	matrix[1] *= scale.y;
+	matrix[2] *= scale.z;
+	matrix[3] = glm::vec4(translation, 1.0f);
+	return matrix;
+}
+}
+
+TransformHierarchy::NodeId TransformHierarchy::AddNode(NodeId parent)
+{
+	if (parent == INVALID_NODE && !m_freeRoots.empty()) {
+		NodeId node = m_freeRoots.back();
+		m_freeRoots.pop_back();
+		SetLocal(node, glm::vec3(0.0f), glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(1.0f));
+		return node;
+	}
+	uint32_t slot = GetNodeCount();
+	uint32_t parentSlot = parent == INVALID_NODE ? INVALID_NODE : m_nodeToSlot[parent];
+	uint32_t depth = parentSlot == INVALID_NODE ? 0 : m_depths[parentSlot] + 1;
+	if (slot > 0 && depth < m_depths.back()) {
+		m_unsorted = true;
+	}
+
+	m_translations.push_back(glm::vec3(0.0f));
+	m_rotations.push_back(glm::quat(1.0f, 0.0f, 0.0f, 0.0f));
+	m_scales.push_back(glm::vec3(1.0f));
+	m_worldMatrices.push_back(parentSlot == INVALID_NODE ? glm::mat4x4(1.0f) : m_worldMatrices[parentSlot]);
+	m_parents.push_back(parentSlot);
+	m_depths.push_back(depth);
+	m_dirty.push_back(0);
+	m_updated.push_back(0);
+	markDirty(slot);
+
+	NodeId node = static_cast<NodeId>(m_nodeToSlot.size());
+	m_nodeToSlot.push_back(slot);
+	m_slotToNode.push_back(node);
+	m_levelsChanged = true;
+	return node;
+}
+
+void TransformHierarchy::SetLocal(NodeId node, const glm::vec3& translation, const glm::quat& rotation, const glm::vec3& scale)
+{
+	uint32_t slot = m_nodeToSlot[node];
+	m_translations[slot] = translation;
+	m_rotations[slot] = rotation;
+	m_scales[slot] = scale;
+	markDirty(slot);
+}
+
+void TransformHierarchy::SetLocal(NodeId node, const glm::mat4x4& localMatrix)
+{
+	glm::vec3 axes[3] = {glm::vec3(localMatrix[0]), glm::vec3(localMatrix[1]), glm::vec3(localMatrix[2])};
+	glm::vec3 scale = {glm::length(axes[0]), glm::length(axes[1]), glm::length(axes[2])};
+	if (glm::determinant(glm::mat3x3(axes[0], axes[1], axes[2])) < 0.0f) {
+		scale.x = -scale.x; // Mirrored
+	}
+	glm::mat3x3 rotation(1.0f);
+	for (int i = 0; i < 3; ++i) {
+		if (scale[i] != 0.0f) {
+			rotation[i] = axes[i] / scale[i];
+		}
+	}
+	SetLocal(node, glm::vec3(localMatrix[3]), glm::quat_cast(rotation), scale);
+}
+
+void TransformHierarchy::SetTranslation(NodeId node, const glm::vec3& translation)
+{
+	uint32_t slot = m_nodeToSlot[node];
+	m_translations[slot] = translation;
+	markDirty(slot);
+}
+
+void TransformHierarchy::SetRotation(NodeId node, const glm::quat& rotation)
+{
+	uint32_t slot = m_nodeToSlot[node];
+	m_rotations[slot] = rotation;
+	markDirty(slot);
+}
+
+void TransformHierarchy::SetScale(NodeId node, const glm::vec3& scale)
+{
+	uint32_t slot = m_nodeToSlot[node];
+	m_scales[slot] = scale;
+	markDirty(slot);
+}
+
+void TransformHierarchy::Clear()
+{
+	*this = TransformHierarchy();
+}
+
+void TransformHierarchy::ReleaseNode(NodeId node)
+{
+	m_freeRoots.push_back(node);
+}
+
+uint32_t TransformHierarchy::Update()
+{
+	TRACE_ZONE("TransformHierarchy::Update");
+	if (m_unsorted) {
+		sortByDepth();
+	}
+	if (m_levelsChanged) {
+		rebuildLevels();
+	}
+	if (!m_anyDirty) {
+		std::fill(m_updated.begin(), m_updated.end(), uint8_t(0));
+		return 0;
+	}
+
+	// Every level only reads the one above it, so the nodes within a level can go in any order (or at the same time)
+	uint32_t updatedCount = 0;
+	for (uint32_t level = 0; level < GetLevelCount(); ++level) {
+		uint32_t begin = m_levelStarts[level];
+		uint32_t end = m_levelStarts[level + 1];
+		if (!m_parallel || end - begin < PARALLEL_MIN_NODES) {
+			updatedCount += updateRange(begin, end);
+			continue;
+		}
+		std::atomic<uint32_t> levelCount = 0;
+		JobSystem::ParallelFor(end - begin, NODES_PER_JOB, [this, begin, &levelCount](uint32_t jobBegin, uint32_t jobEnd)
+		{
+			levelCount += updateRange(begin + jobBegin, begin + jobEnd);
+		});
+		updatedCount += levelCount;
+	}
+	m_anyDirty = false;
+	return updatedCount;
+}
+
+uint32_t TransformHierarchy::updateRange(uint32_t begin, uint32_t end)
+{
+	uint32_t updatedCount = 0;
+	for (uint32_t slot = begin; slot < end; ++slot) {
+		uint32_t parent = m_parents[slot];
+		bool parentUpdated = parent != INVALID_NODE && m_updated[parent];
+		if (!m_dirty[slot] && !parentUpdated) {
+			m_updated[slot] = 0;
+			continue;
+		}
+		glm::mat4x4 local = composeTransform(m_translations[slot], m_rotations[slot], m_scales[slot]);
+		m_worldMatrices[slot] = parent == INVALID_NODE ? local : m_worldMatrices[parent] * local;
+		m_dirty[slot] = 0;
+		m_updated[slot] = 1;
+		++updatedCount;
+	}
+	return updatedCount;
+}
+
+void TransformHierarchy::sortByDepth()
+{
+	TRACE_ZONE("TransformHierarchy::Sort");
+	std::vector<uint32_t> order(GetNodeCount()); // New slot -> old slot
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) { return m_depths[a] < m_depths[b]; });
+	std::vector<uint32_t> newSlots(order.size());
+	for (uint32_t i = 0; i < order.size(); ++i) {
+		newSlots[order[i]] = i;
+	}
+
+	auto permute = [&order](auto& values)
+	{
+		std::remove_reference_t<decltype(values)> sorted(values.size());
+		for (size_t i = 0; i < order.size(); ++i) {
+			sorted[i] = values[order[i]];
+		}
+		values = std::move(sorted);
+	};
+	permute(m_translations);
+	permute(m_rotations);
+	permute(m_scales);
+	permute(m_worldMatrices);
+	permute(m_parents);
+	permute(m_depths);
+	permute(m_dirty);
+	permute(m_updated);
+	permute(m_slotToNode);
+
+	for (uint32_t& parent : m_parents) {
+		if (parent != INVALID_NODE) {
+			parent = newSlots[parent];
+		}
+	}
+	for (uint32_t slot = 0; slot < m_slotToNode.size(); ++slot) {
+		m_nodeToSlot[m_slotToNode[slot]] = slot;
+	}
+	m_unsorted = false;
+	m_levelsChanged = true;
+}
+
+void TransformHierarchy::rebuildLevels()
+{
+	m_levelStarts.clear();
+	for (uint32_t slot = 0; slot < m_depths.size(); ++slot) {
+		while (m_levelStarts.size() <= m_depths[slot]) {
+			m_levelStarts.push_back(slot);
+		}
+	}
+	m_levelStarts.push_back(GetNodeCount());
+	m_levelsChanged = false;
+}
+
+void TransformHierarchy::RunBenchmark(uint32_t nodeCount)
+{
+	constexpr uint32_t ITERATIONS = 100;
+	constexpr uint32_t BRANCHING = 8; // Nested scene: every node gets up to this many children
+	std::mt19937 random(42);
+	std::uniform_int_distribution<uint32_t> pickNode(0, nodeCount - 1);
+
+	for (bool nested : {false, true}) {
+		TransformHierarchy hierarchy;
+		for (uint32_t i = 0; i < nodeCount; ++i) {
+			NodeId node = hierarchy.AddNode(nested && i > 0 ? (i - 1) / BRANCHING : INVALID_NODE);
+			hierarchy.SetTranslation(node, glm::vec3(float(i % 100), float(i / 100 % 100), float(i / 10000)));
+		}
+		hierarchy.Update();
+
+		for (float dirtyFraction : {0.01f, 1.0f}) {
+			uint32_t dirtyCount = std::max(1u, static_cast<uint32_t>(nodeCount * dirtyFraction));
+			double ms[2] = {};
+			uint32_t updatedCount = 0;
+			for (bool parallel : {false, true}) {
+				hierarchy.SetParallel(parallel);
+				double seconds = 0.0;
+				for (uint32_t iteration = 0; iteration < ITERATIONS; ++iteration) {
+					glm::quat rotation = glm::angleAxis(0.01f * iteration, glm::vec3(0.0f, 0.0f, 1.0f));
+					for (uint32_t i = 0; i < dirtyCount; ++i) {
+						hierarchy.SetRotation(dirtyCount == nodeCount ? i : pickNode(random), rotation);
+					}
+					auto start = std::chrono::steady_clock::now();
+					updatedCount = hierarchy.Update();
+					seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				}
+				ms[parallel] = seconds * 1000.0 / ITERATIONS;
+			}
+			SPDLOG_INFO("Transform benchmark: {} nodes {} ({} levels), {:g}% dirty: {} recomputed, {:.3f} ms serial, {:.3f} ms on {} workers",
+				nodeCount, nested ? "nested" : "flat", hierarchy.GetLevelCount(), dirtyFraction * 100.0f, updatedCount, ms[0], ms[1], JobSystem::GetWorkerCount());
+		}
+	}
+}
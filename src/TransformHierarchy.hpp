@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+// Scene transforms as parallel arrays (local TRS, world matrix, parent) sorted by hierarchy depth, so parents are always
+// updated before their children. Setting a local transform marks the node dirty and Update only recomputes dirty nodes and
+// whatever hangs below them, one depth level at a time (wide levels are split across the job system)
+class TransformHierarchy
+{
+public:
+	using NodeId = uint32_t; // Stable, unlike the slot a node lives in
+	static constexpr NodeId INVALID_NODE = UINT32_MAX;
+	static constexpr uint32_t PARALLEL_MIN_NODES = 4096; // Narrower levels are not worth waking the workers for
+	static constexpr uint32_t NODES_PER_JOB = 1024;
+
+	NodeId AddNode(NodeId parent = INVALID_NODE);
+	// Roots without children only: the node is handed out again by the next AddNode without a parent
+	void ReleaseNode(NodeId node);
+	void SetLocal(NodeId node, const glm::vec3& translation, const glm::quat& rotation, const glm::vec3& scale);
+	// Decomposed into TRS, so shear is lost
+	void SetLocal(NodeId node, const glm::mat4x4& localMatrix);
+	void SetTranslation(NodeId node, const glm::vec3& translation);
+	void SetRotation(NodeId node, const glm::quat& rotation);
+	void SetScale(NodeId node, const glm::vec3& scale);
+	void Clear();
+
+	// Returns how many world matrices were recomputed
+	uint32_t Update();
+	void SetParallel(bool parallel) { m_parallel = parallel; }
+
+	// Up to date after Update
+	const glm::mat4x4& GetWorldMatrix(NodeId node) const { return m_worldMatrices[m_nodeToSlot[node]]; }
+	// The world matrix changed in the last Update (moved itself or an ancestor did)
+	bool WasUpdated(NodeId node) const { return m_updated[m_nodeToSlot[node]] != 0; }
+	uint32_t GetNodeCount() const { return static_cast<uint32_t>(m_parents.size()); }
+	uint32_t GetLevelCount() const { return m_levelStarts.empty() ? 0 : static_cast<uint32_t>(m_levelStarts.size() - 1); }
+
+	// Offline timing of Update on a flat and a nested scene, with 1% and 100% of the nodes moving: App --bench-transforms [nodes]
+	static void RunBenchmark(uint32_t nodeCount);
+private:
+	// Indexed by slot
+	std::vector<glm::vec3> m_translations;
+	std::vector<glm::quat> m_rotations;
+	std::vector<glm::vec3> m_scales;
+	std::vector<glm::mat4x4> m_worldMatrices;
+	std::vector<uint32_t> m_parents; // Slot of the parent, INVALID_NODE for roots
+	std::vector<uint32_t> m_depths;
+	std::vector<uint8_t> m_dirty; // Local transform set since the last Update
+	std::vector<uint8_t> m_updated; // World matrix recomputed by the last Update, children look at this
+	std::vector<uint32_t> m_levelStarts; // First slot of every depth, plus the node count
+	std::vector<uint32_t> m_nodeToSlot;
+	std::vector<uint32_t> m_slotToNode;
+	std::vector<NodeId> m_freeRoots; // Released, still in their depth 0 slot
+	bool m_unsorted = false; // A node was added below a deeper one
+	bool m_levelsChanged = false;
+	bool m_anyDirty = false;
+	bool m_parallel = true;
+
+	void markDirty(uint32_t slot) { m_dirty[slot] = 1; m_anyDirty = true; }
+	void sortByDepth();
+	void rebuildLevels();
+	uint32_t updateRange(uint32_t begin, uint32_t end);
+};
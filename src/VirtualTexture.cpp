@@ -0,0 +1,679 @@
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+
+#include <stb/stb_image.h>
+#include <spdlog/spdlog.h>
+#include <imgui/imgui.h>
+
+#include "VirtualTexture.hpp"
+#include "ResourceManager.hpp"
+#include "Trace.hpp"
+#include "Stats.hpp"
+
+constexpr char TILE_FILE_MAGIC[4] = {'V', 'T', 'E', 'X'};
+constexpr uint32_t TILE_FILE_VERSION = 1;
+
+// Followed by the tiles, mip 0 first and row by row, PADDED_TILE_SIZE^2 RGBA8 texels each
+struct TileFileHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t size; // Texels per side at mip 0, a power of two
+	uint32_t mipCount; // Down to a single tile
+	uint32_t tileSize;
+	uint32_t tileBorder;
+};
+
+// Bilinear, for images that aren't a power-of-two square
+std::vector<uint8_t> resampleImage(const uint8_t* pixels, uint32_t width, uint32_t height, uint32_t size)
+{
+	std::vector<uint8_t> result(4ull * size * size);
+	for (uint32_t y = 0; y < size; ++y) {
+		float sourceY = std::max((y + 0.5f) * height / size - 0.5f, 0.0f);
+		uint32_t y0 = std::min(static_cast<uint32_t>(sourceY), height - 1);
+		uint32_t y1 = std::min(y0 + 1, height - 1);
+		float fy = sourceY - y0;
+		for (uint32_t x = 0; x < size; ++x) {
+			float sourceX = std::max((x + 0.5f) * width / size - 0.5f, 0.0f);
+			uint32_t x0 = std::min(static_cast<uint32_t>(sourceX), width - 1);
+			uint32_t x1 = std::min(x0 + 1, width - 1);
+			float fx = sourceX - x0;
+			for (uint32_t c = 0; c < 4; ++c) {
+				float top = pixels[4 * (y0 * width + x0) + c] * (1.0f - fx) + pixels[4 * (y0 * width + x1) + c] * fx;
+				float bottom = pixels[4 * (y1 * width + x0) + c] * (1.0f - fx) + pixels[4 * (y1 * width + x1) + c] * fx;
+				result[4 * (y * size + x) + c] = static_cast<uint8_t>(top * (1.0f - fy) + bottom * fy + 0.5f);
+			}
+		}
+	}
+	return result;
+}
+
+// 2x2 box filter
+std::vector<uint8_t> downsampleImage(const std::vector<uint8_t>& pixels, uint32_t size)
+{
+	uint32_t half = size / 2;
+	std::vector<uint8_t> result(4ull * half * half);
+	for (uint32_t y = 0; y < half; ++y) {
+		for (uint32_t x = 0; x < half; ++x) {
+			for (uint32_t c = 0; c < 4; ++c) {
+				uint32_t sum = pixels[4 * ((2 * y) * size + 2 * x) + c] + pixels[4 * ((2 * y) * size + 2 * x + 1) + c]
+					+ pixels[4 * ((2 * y + 1) * size + 2 * x) + c] + pixels[4 * ((2 * y + 1) * size + 2 * x + 1) + c];
+				result[4 * (y * half + x) + c] = static_cast<uint8_t>((sum + 2) / 4);
+			}
+		}
+	}
+	return result;
+}
+
+bool VirtualTextureCache::BuildTileFile(const std::filesystem::path& imagePath, const std::filesystem::path& tilePath)
+{
+	TRACE_ZONE("VirtualTextureCache::BuildTileFile");
+	int width, height, channels;
+	std::string pathName = imagePath.string();
+	unsigned char* pixelData = stbi_load(pathName.c_str(), &width, &height, &channels, 4);
+	if (pixelData == nullptr) {
+		SPDLOG_ERROR("Failed to load texture \"{}\"", pathName);
+		return false;
+	}
+	uint32_t size = std::max(TILE_SIZE, std::bit_ceil(static_cast<uint32_t>(std::max(width, height))));
+	std::vector<uint8_t> pixels;
+	if (static_cast<uint32_t>(width) == size && static_cast<uint32_t>(height) == size) {
+		pixels.assign(pixelData, pixelData + 4ull * size * size);
+	} else {
+		pixels = resampleImage(pixelData, width, height, size);
+	}
+	stbi_image_free(pixelData);
+
+	std::ofstream file(tilePath, std::ios::binary);
+	if (!file.is_open()) {
+		SPDLOG_ERROR("Could not write \"{}\"!", tilePath.string());
+		return false;
+	}
+	TileFileHeader header = {};
+	std::memcpy(header.magic, TILE_FILE_MAGIC, sizeof(header.magic));
+	header.version = TILE_FILE_VERSION;
+	header.size = size;
+	header.mipCount = std::countr_zero(size / TILE_SIZE) + 1;
+	header.tileSize = TILE_SIZE;
+	header.tileBorder = TILE_BORDER;
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	// The border wraps around, like the repeat addressing the shader applies to the UVs
+	std::vector<uint8_t> tile(TILE_BYTES);
+	uint32_t mipSize = size;
+	for (uint32_t mip = 0; mip < header.mipCount; ++mip) {
+		uint32_t pages = mipSize / TILE_SIZE;
+		for (uint32_t pageY = 0; pageY < pages; ++pageY) {
+			for (uint32_t pageX = 0; pageX < pages; ++pageX) {
+				for (uint32_t y = 0; y < PADDED_TILE_SIZE; ++y) {
+					uint32_t sourceY = (pageY * TILE_SIZE + y + mipSize - TILE_BORDER) % mipSize;
+					for (uint32_t x = 0; x < PADDED_TILE_SIZE; ++x) {
+						uint32_t sourceX = (pageX * TILE_SIZE + x + mipSize - TILE_BORDER) % mipSize;
+						std::memcpy(&tile[4 * (y * PADDED_TILE_SIZE + x)], &pixels[4ull * (sourceY * mipSize + sourceX)], 4);
+					}
+				}
+				file.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+			}
+		}
+		if (mip + 1 < header.mipCount) {
+			pixels = downsampleImage(pixels, mipSize);
+			mipSize /= 2;
+		}
+	}
+	SPDLOG_INFO("Tiled \"{}\" ({}x{}, {} mips) into \"{}\".", pathName, size, size, header.mipCount, tilePath.string());
+	return file.good();
+}
+
+bool VirtualTextureCache::Init(WGPUDevice device, WGPUQueue queue, uint64_t budgetBytes)
+{
+	m_device = device;
+	m_queue = queue;
+
+	// Written by fs_main (atomicOr), cleared after every copy to a readback buffer
+	m_feedbackBufferSize = budgetBytes > 0 ? MAX_FEEDBACK_PAGES / 8 : sizeof(uint32_t);
+	WGPUBufferDescriptor bufferDesc = {};
+	bufferDesc.nextInChain = nullptr;
+	bufferDesc.label = "Virtual texture feedback buffer";
+	bufferDesc.usage = WGPUBufferUsage_Storage | WGPUBufferUsage_CopySrc | WGPUBufferUsage_CopyDst;
+	bufferDesc.size = m_feedbackBufferSize;
+	bufferDesc.mappedAtCreation = false;
+	m_feedbackBuffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers, bufferDesc.size);
+	if (budgetBytes == 0) {
+		return m_feedbackBuffer != nullptr;
+	}
+
+	WGPUSupportedLimits deviceLimits = {};
+	deviceLimits.nextInChain = nullptr;
+	wgpuDeviceGetLimits(device, &deviceLimits);
+	uint32_t maxSide = std::min(MAX_CACHE_SIDE, deviceLimits.limits.maxTextureDimension2D / PADDED_TILE_SIZE);
+	uint32_t budgetSide = static_cast<uint32_t>(std::sqrt(static_cast<double>(budgetBytes / TILE_BYTES)));
+	if (budgetSide > maxSide) {
+		SPDLOG_WARN("Virtual texture budget of {} MB clamped to {} MB ({}x{} tiles, maxTextureDimension2D is {}).", budgetBytes >> 20,
+			maxSide * maxSide * TILE_BYTES >> 20, maxSide, maxSide, deviceLimits.limits.maxTextureDimension2D);
+	}
+	m_cacheSide = std::min(maxSide, budgetSide);
+	if (m_cacheSide < 2) {
+		SPDLOG_WARN("Virtual texture budget of {} bytes is too small, virtual texturing disabled.", budgetBytes);
+		m_cacheSide = 0;
+		return m_feedbackBuffer != nullptr;
+	}
+
+	WGPUTextureDescriptor textureDesc = {};
+	textureDesc.nextInChain = nullptr;
+	textureDesc.label = "Virtual texture tile cache";
+	textureDesc.usage = WGPUTextureUsage_TextureBinding | WGPUTextureUsage_CopyDst;
+	textureDesc.dimension = WGPUTextureDimension_2D;
+	textureDesc.size = {m_cacheSide * PADDED_TILE_SIZE, m_cacheSide * PADDED_TILE_SIZE, 1};
+	textureDesc.format = WGPUTextureFormat_RGBA8Unorm;
+	textureDesc.mipLevelCount = 1;
+	textureDesc.sampleCount = 1;
+	textureDesc.viewFormatCount = 0;
+	textureDesc.viewFormats = nullptr;
+	m_cacheTexture = wgpuDeviceCreateTexture(device, &textureDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::Textures, 4ll * textureDesc.size.width * textureDesc.size.height);
+
+	WGPUTextureViewDescriptor textureViewDesc = {};
+	textureViewDesc.nextInChain = nullptr;
+	textureViewDesc.label = "Virtual texture tile cache view";
+	textureViewDesc.format = textureDesc.format;
+	textureViewDesc.dimension = WGPUTextureViewDimension_2D;
+	textureViewDesc.baseMipLevel = 0;
+	textureViewDesc.mipLevelCount = 1;
+	textureViewDesc.baseArrayLayer = 0;
+	textureViewDesc.arrayLayerCount = 1;
+	textureViewDesc.aspect = WGPUTextureAspect_All;
+	m_cacheView = wgpuTextureCreateView(m_cacheTexture, &textureViewDesc);
+
+	m_tiles.assign(m_cacheSide * m_cacheSide, CacheTile());
+	m_freeTiles.clear();
+	for (uint32_t tile = m_cacheSide * m_cacheSide; tile > 0; --tile) {
+		m_freeTiles.push_back(tile - 1); // Handed out from the back, so tile 0 goes first
+	}
+
+	bufferDesc.label = "Virtual texture feedback readback buffer";
+	bufferDesc.usage = WGPUBufferUsage_MapRead | WGPUBufferUsage_CopyDst;
+	for (Readback& readback : m_readbacks) {
+		readback.cache = this;
+		readback.buffer = wgpuDeviceCreateBuffer(device, &bufferDesc);
+	}
+	m_feedbackBits.assign(MAX_FEEDBACK_PAGES / 32, 0);
+
+	m_stopLoader = false;
+	m_loader = std::thread(&VirtualTextureCache::loaderMain, this);
+	SPDLOG_INFO("Virtual texture cache: {}x{} tiles ({} MB).", m_cacheSide, m_cacheSide, m_cacheSide * m_cacheSide * TILE_BYTES >> 20);
+	return m_cacheTexture != nullptr && m_cacheView != nullptr && m_feedbackBuffer != nullptr;
+}
+
+void VirtualTextureCache::Terminate()
+{
+	if (m_loader.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopLoader = true;
+		}
+		m_condition.notify_one();
+		m_loader.join();
+	}
+	m_requests.clear();
+	m_loaded.clear();
+	m_pendingPages.clear();
+
+	for (VirtualTexture& texture : m_textures) {
+		wgpuTextureViewRelease(texture.pageTableView);
+		wgpuTextureDestroy(texture.pageTable);
+		wgpuTextureRelease(texture.pageTable);
+		Stats::TrackGpuMemory(Stats::MemoryCategory::Textures, -4ll * static_cast<int64_t>(texture.tiles.size()));
+	}
+	m_textures.clear();
+	m_textureIds.clear();
+	m_pageCount = 0;
+	for (Readback& readback : m_readbacks) {
+		if (readback.buffer) {
+			wgpuBufferDestroy(readback.buffer);
+			wgpuBufferRelease(readback.buffer);
+			readback.buffer = nullptr;
+		}
+	}
+	if (m_cacheTexture) {
+		wgpuTextureViewRelease(m_cacheView);
+		wgpuTextureDestroy(m_cacheTexture);
+		wgpuTextureRelease(m_cacheTexture);
+		Stats::TrackGpuMemory(Stats::MemoryCategory::Textures, -4ll * m_cacheSide * PADDED_TILE_SIZE * m_cacheSide * PADDED_TILE_SIZE);
+		m_cacheView = nullptr;
+		m_cacheTexture = nullptr;
+	}
+	if (m_feedbackBuffer) {
+		wgpuBufferDestroy(m_feedbackBuffer);
+		wgpuBufferRelease(m_feedbackBuffer);
+		Stats::TrackGpuMemory(Stats::MemoryCategory::StorageBuffers, -static_cast<int64_t>(m_feedbackBufferSize));
+		m_feedbackBuffer = nullptr;
+	}
+	m_tiles.clear();
+	m_freeTiles.clear();
+	m_lru.clear();
+}
+
+uint32_t VirtualTextureCache::Register(const std::filesystem::path& imagePath)
+{
+	if (!IsEnabled()) {
+		return INVALID_TEXTURE;
+	}
+	auto it = m_textureIds.find(imagePath.string());
+	if (it != m_textureIds.end()) {
+		return it->second;
+	}
+
+	std::filesystem::path tilePath = ResourceManager::GetCachePath(imagePath, ".vtex");
+	if (!ResourceManager::IsCacheCurrent(tilePath, {imagePath}) && !BuildTileFile(imagePath, tilePath)) {
+		return INVALID_TEXTURE;
+	}
+
+	VirtualTexture texture;
+	texture.file = std::make_unique<MappedFile>();
+	if (!texture.file->Open(tilePath)) {
+		return INVALID_TEXTURE;
+	}
+	TileFileHeader header;
+	if (texture.file->GetSize() < sizeof(header)) {
+		SPDLOG_ERROR("\"{}\" is corrupt!", tilePath.string());
+		return INVALID_TEXTURE;
+	}
+	std::memcpy(&header, texture.file->GetData(), sizeof(header));
+	if (std::memcmp(header.magic, TILE_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != TILE_FILE_VERSION || header.tileSize != TILE_SIZE
+		|| header.tileBorder != TILE_BORDER || header.size < TILE_SIZE || !std::has_single_bit(header.size)
+		|| header.mipCount != static_cast<uint32_t>(std::countr_zero(header.size / TILE_SIZE)) + 1) {
+		SPDLOG_WARN("\"{}\" is not a tile file of this version", tilePath.string());
+		return INVALID_TEXTURE;
+	}
+	texture.pages = header.size / TILE_SIZE;
+	texture.mipCount = header.mipCount;
+	uint32_t pageCount = 0;
+	for (uint32_t mip = 0; mip < texture.mipCount; ++mip) {
+		texture.mipFirstPages.push_back(pageCount);
+		pageCount += (texture.pages >> mip) * (texture.pages >> mip);
+	}
+	if (texture.file->GetSize() != sizeof(header) + pageCount * TILE_BYTES) {
+		SPDLOG_ERROR("\"{}\" is corrupt!", tilePath.string());
+		return INVALID_TEXTURE;
+	}
+	if (m_pageCount + pageCount > MAX_FEEDBACK_PAGES) {
+		SPDLOG_WARN("Out of virtual texture pages, \"{}\" is not virtualized.", imagePath.string());
+		return INVALID_TEXTURE;
+	}
+	// The coarsest mip is loaded right away and never evicted, so every page has something to fall back to
+	uint32_t topTile = allocateTile();
+	if (topTile == NO_TILE) {
+		SPDLOG_WARN("Virtual texture cache is full, \"{}\" is not virtualized.", imagePath.string());
+		return INVALID_TEXTURE;
+	}
+	texture.firstPage = m_pageCount;
+	m_pageCount += pageCount;
+	texture.tiles.assign(pageCount, NO_TILE);
+
+	// One texel per page, RGBA8: tile x, tile y, mip of the tile, 255
+	WGPUTextureDescriptor textureDesc = {};
+	textureDesc.nextInChain = nullptr;
+	textureDesc.label = "Virtual texture page table";
+	textureDesc.usage = WGPUTextureUsage_TextureBinding | WGPUTextureUsage_CopyDst;
+	textureDesc.dimension = WGPUTextureDimension_2D;
+	textureDesc.size = {texture.pages, texture.pages, 1};
+	textureDesc.format = WGPUTextureFormat_RGBA8Unorm;
+	textureDesc.mipLevelCount = texture.mipCount;
+	textureDesc.sampleCount = 1;
+	textureDesc.viewFormatCount = 0;
+	textureDesc.viewFormats = nullptr;
+	texture.pageTable = wgpuDeviceCreateTexture(m_device, &textureDesc);
+	Stats::TrackGpuMemory(Stats::MemoryCategory::Textures, 4ll * pageCount);
+
+	WGPUTextureViewDescriptor textureViewDesc = {};
+	textureViewDesc.nextInChain = nullptr;
+	textureViewDesc.label = "Virtual texture page table view";
+	textureViewDesc.format = textureDesc.format;
+	textureViewDesc.dimension = WGPUTextureViewDimension_2D;
+	textureViewDesc.baseMipLevel = 0;
+	textureViewDesc.mipLevelCount = textureDesc.mipLevelCount;
+	textureViewDesc.baseArrayLayer = 0;
+	textureViewDesc.arrayLayerCount = 1;
+	textureViewDesc.aspect = WGPUTextureAspect_All;
+	texture.pageTableView = wgpuTextureCreateView(texture.pageTable, &textureViewDesc);
+
+	uint32_t textureId = static_cast<uint32_t>(m_textures.size());
+	m_textures.push_back(std::move(texture));
+	m_textureIds[imagePath.string()] = textureId;
+
+	VirtualTexture& registered = m_textures[textureId];
+	uint32_t topPage = registered.mipFirstPages.back();
+	uploadTile(textureId, topPage, topTile, getTileData(registered, topPage));
+	m_lru.erase(m_tiles[topTile].lruPosition);
+	m_tiles[topTile].pinned = true;
+	writePageTable(registered);
+	return textureId;
+}
+
+glm::uvec4 VirtualTextureCache::GetShaderParameters(uint32_t texture) const
+{
+	const VirtualTexture& virtualTexture = m_textures[texture];
+	return {virtualTexture.pages, virtualTexture.mipCount, virtualTexture.firstPage, 0};
+}
+
+bool VirtualTextureCache::Update()
+{
+	if (!IsEnabled()) {
+		return false;
+	}
+	TRACE_ZONE("VirtualTextureCache::Update");
+	if (m_feedbackReceived) {
+		m_feedbackReceived = false;
+		++m_feedbackGeneration;
+		processFeedback();
+	}
+
+	// A few tiles per frame, so a camera cut doesn't turn into one long frame
+	std::vector<LoadedTile> loaded;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		while (!m_loaded.empty() && loaded.size() < MAX_UPLOADS_PER_FRAME) {
+			loaded.push_back(std::move(m_loaded.front()));
+			m_loaded.pop_front();
+		}
+	}
+	for (LoadedTile& loadedTile : loaded) {
+		m_pendingPages.erase(uint64_t(loadedTile.texture) << 32 | loadedTile.page);
+		if (m_textures[loadedTile.texture].tiles[loadedTile.page] != NO_TILE) {
+			continue;
+		}
+		uint32_t tile = allocateTile();
+		if (tile == NO_TILE) {
+			++m_droppedCount; // Asked for again by the next feedback if it's still needed
+			continue;
+		}
+		uploadTile(loadedTile.texture, loadedTile.page, tile, loadedTile.texels.data());
+	}
+
+	bool changed = false;
+	for (VirtualTexture& texture : m_textures) {
+		if (texture.pageTableChanged) {
+			writePageTable(texture);
+			changed = true;
+		}
+	}
+	return changed || !m_pendingPages.empty();
+}
+
+void VirtualTextureCache::ResolveFeedback(WGPUCommandEncoder encoder)
+{
+	m_currentReadback = nullptr;
+	if (!IsEnabled() || m_pageCount == 0) {
+		return;
+	}
+	// If every readback is still mapping, the bits just keep accumulating on the GPU until one is free
+	Readback& readback = m_readbacks[m_readbackIndex];
+	if (readback.state != ReadbackState::Free) {
+		return;
+	}
+	readback.state = ReadbackState::Recording;
+	readback.size = (m_pageCount + 31) / 32 * sizeof(uint32_t);
+	m_currentReadback = &readback;
+	m_readbackIndex = (m_readbackIndex + 1) % READBACK_COUNT;
+	wgpuCommandEncoderCopyBufferToBuffer(encoder, m_feedbackBuffer, 0, readback.buffer, 0, readback.size);
+	wgpuCommandEncoderClearBuffer(encoder, m_feedbackBuffer, 0, readback.size);
+}
+
+void VirtualTextureCache::EndFrame()
+{
+	if (!m_currentReadback) {
+		return;
+	}
+	Readback& readback = *m_currentReadback;
+	m_currentReadback = nullptr;
+
+	// Resolves once the GPU is done with the frame (callback fires from wgpuInstanceProcessEvents/wgpuDeviceTick)
+	auto onMapped = [](WGPUBufferMapAsyncStatus status, void* pUserData)
+	{
+		Readback& readback = *reinterpret_cast<Readback*>(pUserData);
+		if (status == WGPUBufferMapAsyncStatus_Success) {
+			readback.cache->onReadbackMapped(readback);
+			wgpuBufferUnmap(readback.buffer);
+		}
+		readback.state = ReadbackState::Free;
+	};
+	readback.state = ReadbackState::Mapping;
+	wgpuBufferMapAsync(readback.buffer, WGPUMapMode_Read, 0, readback.size, onMapped, (void*)&readback);
+}
+
+void VirtualTextureCache::onReadbackMapped(Readback& readback)
+{
+	const uint32_t* bits = reinterpret_cast<const uint32_t*>(wgpuBufferGetConstMappedRange(readback.buffer, 0, readback.size));
+	if (!bits) {
+		return;
+	}
+	for (size_t word = 0; word < readback.size / sizeof(uint32_t); ++word) {
+		m_feedbackBits[word] |= bits[word];
+	}
+	m_feedbackReceived = true;
+}
+
+void VirtualTextureCache::processFeedback()
+{
+	TRACE_ZONE("VirtualTextureCache::ProcessFeedback");
+	std::vector<LoadRequest> requests;
+	uint32_t wordCount = (m_pageCount + 31) / 32;
+	for (uint32_t word = 0; word < wordCount; ++word) {
+		uint32_t bits = m_feedbackBits[word];
+		m_feedbackBits[word] = 0;
+		while (bits != 0) {
+			uint32_t globalPage = word * 32 + std::countr_zero(bits);
+			bits &= bits - 1;
+			// Textures are in feedback page order
+			auto it = std::upper_bound(m_textures.begin(), m_textures.end(), globalPage, [](uint32_t page, const VirtualTexture& texture) { return page < texture.firstPage; });
+			uint32_t textureId = static_cast<uint32_t>(it - m_textures.begin()) - 1;
+			uint32_t page = globalPage - m_textures[textureId].firstPage;
+			if (page < m_textures[textureId].tiles.size()) {
+				requestPage(textureId, page, requests);
+			}
+		}
+	}
+
+	// Coarse tiles first, they cover more of the screen and are the fallback of the finer ones
+	std::stable_sort(requests.begin(), requests.end(), [this](const LoadRequest& a, const LoadRequest& b)
+	{
+		return getPageMip(m_textures[a.texture], a.page) > getPageMip(m_textures[b.texture], b.page);
+	});
+	uint32_t queued = 0;
+	for (const LoadRequest& request : requests) {
+		if (m_pendingPages.size() >= MAX_PENDING_LOADS) {
+			break;
+		}
+		if (m_pendingPages.insert(uint64_t(request.texture) << 32 | request.page).second) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_requests.push_back(request);
+			++queued;
+		}
+	}
+	if (queued > 0) {
+		m_condition.notify_one();
+	}
+}
+
+void VirtualTextureCache::requestPage(uint32_t textureId, uint32_t page, std::vector<LoadRequest>& requests)
+{
+	// The missing coarser pages as well, so the fallback gets sharper one mip at a time. The first resident one is in use
+	// (as the fallback), so it counts as recently used
+	const VirtualTexture& texture = m_textures[textureId];
+	uint32_t mip = getPageMip(texture, page);
+	uint32_t pages = texture.pages >> mip;
+	uint32_t x = (page - texture.mipFirstPages[mip]) % pages;
+	uint32_t y = (page - texture.mipFirstPages[mip]) / pages;
+	while (true) {
+		page = texture.mipFirstPages[mip] + y * (texture.pages >> mip) + x;
+		if (texture.tiles[page] != NO_TILE) {
+			touchTile(texture.tiles[page]);
+			return;
+		}
+		if (!m_pendingPages.count(uint64_t(textureId) << 32 | page)) {
+			requests.push_back({textureId, page, getTileData(texture, page)});
+		}
+		if (++mip == texture.mipCount) {
+			return;
+		}
+		x /= 2;
+		y /= 2;
+	}
+}
+
+uint32_t VirtualTextureCache::getPageMip(const VirtualTexture& texture, uint32_t page) const
+{
+	auto it = std::upper_bound(texture.mipFirstPages.begin(), texture.mipFirstPages.end(), page);
+	return static_cast<uint32_t>(it - texture.mipFirstPages.begin()) - 1;
+}
+
+const uint8_t* VirtualTextureCache::getTileData(const VirtualTexture& texture, uint32_t page) const
+{
+	return reinterpret_cast<const uint8_t*>(texture.file->GetData()) + sizeof(TileFileHeader) + page * TILE_BYTES;
+}
+
+uint32_t VirtualTextureCache::allocateTile()
+{
+	if (!m_freeTiles.empty()) {
+		uint32_t tile = m_freeTiles.back();
+		m_freeTiles.pop_back();
+		return tile;
+	}
+	if (m_lru.empty()) {
+		return NO_TILE;
+	}
+	uint32_t tile = m_lru.back();
+	CacheTile& cacheTile = m_tiles[tile];
+	if (cacheTile.lastUsed == m_feedbackGeneration) {
+		return NO_TILE; // Everything in the cache is on screen, evicting would only trade one blurry tile for another
+	}
+	m_lru.pop_back();
+	VirtualTexture& texture = m_textures[cacheTile.texture];
+	texture.tiles[cacheTile.page] = NO_TILE;
+	texture.pageTableChanged = true;
+	cacheTile.texture = INVALID_TEXTURE;
+	++m_evictionCount;
+	return tile;
+}
+
+void VirtualTextureCache::uploadTile(uint32_t textureId, uint32_t page, uint32_t tile, const uint8_t* texels)
+{
+	WGPUImageCopyTexture destination = {};
+	destination.texture = m_cacheTexture;
+	destination.mipLevel = 0;
+	destination.origin = {tile % m_cacheSide * PADDED_TILE_SIZE, tile / m_cacheSide * PADDED_TILE_SIZE, 0};
+	destination.aspect = WGPUTextureAspect_All;
+	WGPUTextureDataLayout source = {};
+	source.nextInChain = nullptr;
+	source.offset = 0;
+	source.bytesPerRow = 4 * PADDED_TILE_SIZE;
+	source.rowsPerImage = PADDED_TILE_SIZE;
+	WGPUExtent3D size = {PADDED_TILE_SIZE, PADDED_TILE_SIZE, 1};
+	wgpuQueueWriteTexture(m_queue, &destination, texels, TILE_BYTES, &source, &size);
+	Stats::Add(Stats::Counter::BytesUploaded, TILE_BYTES);
+
+	CacheTile& cacheTile = m_tiles[tile];
+	cacheTile.texture = textureId;
+	cacheTile.page = page;
+	cacheTile.lastUsed = m_feedbackGeneration;
+	cacheTile.pinned = false;
+	m_lru.push_front(tile);
+	cacheTile.lruPosition = m_lru.begin();
+	VirtualTexture& texture = m_textures[textureId];
+	texture.tiles[page] = tile;
+	texture.pageTableChanged = true;
+	++m_uploadCount;
+}
+
+void VirtualTextureCache::touchTile(uint32_t tile)
+{
+	CacheTile& cacheTile = m_tiles[tile];
+	if (cacheTile.pinned) {
+		return;
+	}
+	cacheTile.lastUsed = m_feedbackGeneration;
+	m_lru.splice(m_lru.begin(), m_lru, cacheTile.lruPosition);
+}
+
+void VirtualTextureCache::writePageTable(VirtualTexture& texture)
+{
+	TRACE_ZONE("VirtualTextureCache::WritePageTable");
+	// Coarsest mip first, pages that aren't resident copy the entry of their parent
+	std::vector<uint32_t> entries;
+	std::vector<uint32_t> coarserEntries;
+	for (uint32_t mip = texture.mipCount; mip-- > 0;) {
+		uint32_t pages = texture.pages >> mip;
+		entries.resize(pages * pages);
+		for (uint32_t y = 0; y < pages; ++y) {
+			for (uint32_t x = 0; x < pages; ++x) {
+				uint32_t tile = texture.tiles[texture.mipFirstPages[mip] + y * pages + x];
+				if (tile != NO_TILE) {
+					entries[y * pages + x] = tile % m_cacheSide | (tile / m_cacheSide) << 8 | mip << 16 | 0xffu << 24;
+				} else {
+					entries[y * pages + x] = coarserEntries[(y / 2) * (pages / 2) + x / 2]; // The coarsest mip is always resident
+				}
+			}
+		}
+
+		WGPUImageCopyTexture destination = {};
+		destination.texture = texture.pageTable;
+		destination.mipLevel = mip;
+		destination.origin = {0, 0, 0};
+		destination.aspect = WGPUTextureAspect_All;
+		WGPUTextureDataLayout source = {};
+		source.nextInChain = nullptr;
+		source.offset = 0;
+		source.bytesPerRow = 4 * pages;
+		source.rowsPerImage = pages;
+		WGPUExtent3D size = {pages, pages, 1};
+		wgpuQueueWriteTexture(m_queue, &destination, entries.data(), entries.size() * sizeof(uint32_t), &source, &size);
+		Stats::Add(Stats::Counter::BytesUploaded, entries.size() * sizeof(uint32_t));
+		std::swap(entries, coarserEntries);
+	}
+	texture.pageTableChanged = false;
+}
+
+void VirtualTextureCache::loaderMain()
+{
+	Trace::SetThreadName("Tile loader");
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		m_condition.wait(lock, [this]() { return m_stopLoader || !m_requests.empty(); });
+		if (m_stopLoader) {
+			return;
+		}
+		LoadRequest request = m_requests.front();
+		m_requests.pop_front();
+		lock.unlock();
+
+		LoadedTile loadedTile;
+		{
+			TRACE_ZONE("LoadTile");
+			loadedTile.texture = request.texture;
+			loadedTile.page = request.page;
+			loadedTile.texels.assign(request.source, request.source + TILE_BYTES); // Page faults (the actual disk reads) happen here
+		}
+
+		lock.lock();
+		m_loaded.push_back(std::move(loadedTile));
+	}
+}
+
+void VirtualTextureCache::DrawImGui()
+{
+	if (!IsEnabled()) {
+		return;
+	}
+	uint32_t tileCount = m_cacheSide * m_cacheSide;
+	ImGui::Begin("Virtual textures");
+	ImGui::Text("Textures: %zu (%u pages)", m_textures.size(), m_pageCount);
+	ImGui::Text("Cache: %zu / %u tiles resident (%.0f MB)", tileCount - m_freeTiles.size(), tileCount, tileCount * TILE_BYTES / (1024.0 * 1024.0));
+	ImGui::Text("Pending loads: %zu", m_pendingPages.size());
+	ImGui::Text("Uploaded %llu, evicted %llu, dropped %llu", static_cast<unsigned long long>(m_uploadCount), static_cast<unsigned long long>(m_evictionCount),
+		static_cast<unsigned long long>(m_droppedCount));
+	ImGui::End();
+}
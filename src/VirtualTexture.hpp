@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstdint>
+#include <array>
+#include <list>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
+#include <condition_variable>
+
+#include <webgpu/webgpu.h>
+#include <glm/glm.hpp>
+
+#include "MappedFile.hpp"
+
+// Sparse virtual texturing. Images are cut once into a tile file in the cache directory (.vtex: every mip down to a single
+// tile, each tile with a border copied from its neighbours). Only the tiles the camera needs live in one tile cache texture
+// shared by all virtual textures, and each virtual texture has a page table texture (one mip per virtual mip) that points
+// every page at its tile in the cache, or at the closest coarser tile that is resident.
+// fs_main marks the pages it samples in a feedback bit buffer, read back a few frames later. Missing pages are read by a
+// loader thread and uploaded a few per frame, evicting the least recently used tiles
+class VirtualTextureCache
+{
+public:
+	static constexpr uint32_t TILE_SIZE = 128; // Texels per tile side. Must match res/shader.wgsl
+	static constexpr uint32_t TILE_BORDER = 4; // Texels of the neighbouring tiles on each side, so bilinear filtering stays in the tile
+	static constexpr uint32_t PADDED_TILE_SIZE = TILE_SIZE + 2 * TILE_BORDER;
+	static constexpr uint64_t TILE_BYTES = 4ull * PADDED_TILE_SIZE * PADDED_TILE_SIZE; // RGBA8
+	static constexpr uint32_t MAX_FEEDBACK_PAGES = 1 << 20; // One bit per page, over every virtual texture and mip
+	static constexpr uint32_t MAX_CACHE_SIDE = 255; // Tiles per side, page table entries store the tile position in 8 bits
+	static constexpr uint32_t MAX_UPLOADS_PER_FRAME = 16;
+	static constexpr uint32_t MAX_PENDING_LOADS = 256;
+	static constexpr uint32_t READBACK_COUNT = 3; // More than the frames in flight
+	static constexpr uint32_t INVALID_TEXTURE = UINT32_MAX;
+
+	// Cuts an image into a tile file. Images that aren't a power-of-two square are resampled to one
+	static bool BuildTileFile(const std::filesystem::path& imagePath, const std::filesystem::path& tilePath);
+
+	// The cache gets as many tiles as fit in budgetBytes. 0 turns virtual texturing off (Register fails), the feedback buffer is
+	// still created since the main bind group layout has it
+	bool Init(WGPUDevice device, WGPUQueue queue, uint64_t budgetBytes);
+	void Terminate();
+	bool IsEnabled() const { return m_cacheTexture != nullptr; }
+
+	// Tiles the image on first use (and whenever it is newer than its tile file). INVALID_TEXTURE on failure
+	uint32_t Register(const std::filesystem::path& imagePath);
+
+	// Bound by the main pipeline
+	WGPUTextureView GetCacheView() const { return m_cacheView; }
+	WGPUTextureView GetPageTableView(uint32_t texture) const { return m_textures[texture].pageTableView; }
+	WGPUBuffer GetFeedbackBuffer() const { return m_feedbackBuffer; }
+	uint64_t GetFeedbackBufferSize() const { return m_feedbackBufferSize; }
+	// MaterialUniforms::virtualTexture: pages per side at mip 0, mip count, first feedback page
+	glm::uvec4 GetShaderParameters(uint32_t texture) const;
+
+	// Every frame before encoding: takes in the latest feedback, uploads finished tiles and rewrites the page tables that
+	// changed. Returns true when a page table changed or tiles are on their way (worth redrawing for)
+	bool Update();
+	// Copies the feedback out and clears it, call right before finishing the frame's command encoder
+	void ResolveFeedback(WGPUCommandEncoder encoder);
+	// Call after the frame got submitted
+	void EndFrame();
+
+	void DrawImGui();
+private:
+	static constexpr uint32_t NO_TILE = UINT32_MAX;
+
+	struct VirtualTexture
+	{
+		std::unique_ptr<MappedFile> file; // Stays mapped until Terminate, the loader thread reads tiles straight from it
+		uint32_t pages = 0; // Per side at mip 0
+		uint32_t mipCount = 0;
+		uint32_t firstPage = 0; // Feedback bit of its first page
+		std::vector<uint32_t> mipFirstPages; // Per mip, relative to firstPage
+		std::vector<uint32_t> tiles; // Cache tile of each page, NO_TILE when it isn't resident
+		WGPUTexture pageTable = nullptr;
+		WGPUTextureView pageTableView = nullptr;
+		bool pageTableChanged = false;
+	};
+
+	struct CacheTile
+	{
+		uint32_t texture = INVALID_TEXTURE;
+		uint32_t page = 0;
+		uint64_t lastUsed = 0; // Feedback generation
+		bool pinned = false; // Coarsest mip, so every page always has a fallback. Never in m_lru
+		std::list<uint32_t>::iterator lruPosition;
+	};
+
+	struct LoadRequest
+	{
+		uint32_t texture;
+		uint32_t page;
+		const uint8_t* source; // In the texture's mapping
+	};
+
+	struct LoadedTile
+	{
+		uint32_t texture;
+		uint32_t page;
+		std::vector<uint8_t> texels;
+	};
+
+	enum class ReadbackState
+	{
+		Free,
+		Recording, // Copied into by the frame being encoded
+		Mapping // Waiting on MapAsync
+	};
+
+	struct Readback
+	{
+		VirtualTextureCache* cache = nullptr;
+		WGPUBuffer buffer = nullptr;
+		ReadbackState state = ReadbackState::Free;
+		uint64_t size = 0; // Textures may be registered in between, so the copied size is kept
+	};
+
+	WGPUDevice m_device = nullptr;
+	WGPUQueue m_queue = nullptr;
+	WGPUTexture m_cacheTexture = nullptr;
+	WGPUTextureView m_cacheView = nullptr;
+	uint32_t m_cacheSide = 0; // In tiles
+
+	std::vector<VirtualTexture> m_textures;
+	std::unordered_map<std::string, uint32_t> m_textureIds; // By image path
+	uint32_t m_pageCount = 0; // Feedback pages handed out so far
+
+	std::vector<CacheTile> m_tiles;
+	std::vector<uint32_t> m_freeTiles;
+	std::list<uint32_t> m_lru; // Most recently used first
+	uint64_t m_feedbackGeneration = 0;
+
+	// Feedback
+	WGPUBuffer m_feedbackBuffer = nullptr;
+	uint64_t m_feedbackBufferSize = 0;
+	std::array<Readback, READBACK_COUNT> m_readbacks;
+	uint32_t m_readbackIndex = 0;
+	Readback* m_currentReadback = nullptr;
+	std::vector<uint32_t> m_feedbackBits; // ORed together from the readbacks that arrived since the last Update
+	bool m_feedbackReceived = false;
+
+	// Loader thread
+	std::thread m_loader;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::deque<LoadRequest> m_requests;
+	std::deque<LoadedTile> m_loaded;
+	bool m_stopLoader = false;
+	std::unordered_set<uint64_t> m_pendingPages; // Requested and not uploaded yet (texture << 32 | page), main thread only
+
+	// Stats
+	uint64_t m_uploadCount = 0;
+	uint64_t m_evictionCount = 0;
+	uint64_t m_droppedCount = 0; // Loaded while every tile in the cache was in use
+
+	void loaderMain();
+	void onReadbackMapped(Readback& readback);
+	void processFeedback();
+	void requestPage(uint32_t texture, uint32_t page, std::vector<LoadRequest>& requests);
+	uint32_t getPageMip(const VirtualTexture& texture, uint32_t page) const;
+	const uint8_t* getTileData(const VirtualTexture& texture, uint32_t page) const;
+	uint32_t allocateTile(); // NO_TILE when every tile was used by the latest feedback
+	void uploadTile(uint32_t texture, uint32_t page, uint32_t tile, const uint8_t* texels);
+	void touchTile(uint32_t tile);
+	void writePageTable(VirtualTexture& texture);
+};
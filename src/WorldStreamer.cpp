@@ -0,0 +1,387 @@
+#include <cmath>
+#include <random>
+#include <cstring>
+#include <fstream>
+
+#include <glm/ext.hpp>
+#include <spdlog/spdlog.h>
+#include <imgui/imgui.h>
+
+#include "WorldStreamer.hpp"
+#include "Physics.hpp"
+#include "Trace.hpp"
+
+namespace
+{
+constexpr char WORLD_FILE_MAGIC[4] = {'W', 'R', 'L', 'D'};
+constexpr uint32_t WORLD_FILE_VERSION = 1;
+
+// Followed by cellsPerSide^2 WorldFileCells (row by row, from -x -y), then the records of every cell
+struct WorldFileHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t cellsPerSide;
+	float cellSize;
+};
+
+struct WorldFileCell
+{
+	uint64_t offset; // From the start of the file
+	uint32_t objectCount;
+	uint32_t reserved;
+};
+
+static_assert(sizeof(WorldStreamer::ObjectRecord) == 32, "Stored as is");
+
+// Rendering is Z-up while PhysX is Y-up (same as applyBodyPose, inverted)
+physx::PxTransform toPhysicsPose(const WorldStreamer::ObjectRecord& record)
+{
+	physx::PxVec3 position(record.position.x, record.position.z, -record.position.y);
+	return physx::PxTransform(position, physx::PxQuat(record.rotation, physx::PxVec3(0.0f, 1.0f, 0.0f)));
+}
+}
+
+bool WorldStreamer::GenerateWorld(const std::filesystem::path& path, uint32_t cellsPerSide, float cellSize, uint32_t objectsPerCell, uint32_t seed)
+{
+	TRACE_ZONE("WorldStreamer::GenerateWorld");
+	std::ofstream file(path, std::ios::binary);
+	if (!file) {
+		SPDLOG_ERROR("Could not write world file \"{}\"", path.string());
+		return false;
+	}
+	WorldFileHeader header;
+	std::memcpy(header.magic, WORLD_FILE_MAGIC, sizeof(header.magic));
+	header.version = WORLD_FILE_VERSION;
+	header.cellsPerSide = cellsPerSide;
+	header.cellSize = cellSize;
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	uint64_t cellCount = static_cast<uint64_t>(cellsPerSide) * cellsPerSide;
+	uint64_t recordsOffset = sizeof(WorldFileHeader) + cellCount * sizeof(WorldFileCell);
+	for (uint64_t i = 0; i < cellCount; ++i) {
+		WorldFileCell cell = {recordsOffset + i * objectsPerCell * sizeof(ObjectRecord), objectsPerCell, 0};
+		file.write(reinterpret_cast<const char*>(&cell), sizeof(cell));
+	}
+
+	// Boats scattered on the ground, every fourth one gets a collider roughly its size
+	std::mt19937 random(seed);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	std::vector<ObjectRecord> records(objectsPerCell);
+	float worldOrigin = -0.5f * cellsPerSide * cellSize;
+	for (uint32_t y = 0; y < cellsPerSide; ++y) {
+		for (uint32_t x = 0; x < cellsPerSide; ++x) {
+			for (uint32_t i = 0; i < objectsPerCell; ++i) {
+				ObjectRecord& record = records[i];
+				record.position = {worldOrigin + (x + unit(random)) * cellSize, worldOrigin + (y + unit(random)) * cellSize, 0.0f};
+				record.rotation = unit(random) * 2.0f * glm::pi<float>();
+				record.scale = 0.5f + unit(random);
+				record.colliderHalfExtents = i % 4 == 0 ? glm::vec3(0.5f * record.scale) : glm::vec3(0.0f);
+			}
+			file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(ObjectRecord));
+		}
+	}
+	SPDLOG_INFO("Generated world \"{}\": {}x{} cells of {} objects.", path.string(), cellsPerSide, cellsPerSide, objectsPerCell);
+	return file.good();
+}
+
+bool WorldStreamer::Open(const std::filesystem::path& path, const SceneCallbacks& callbacks)
+{
+	Close();
+	m_file = std::make_unique<MappedFile>();
+	if (!m_file->Open(path) || m_file->GetSize() < sizeof(WorldFileHeader)) {
+		SPDLOG_ERROR("Could not open world file \"{}\"", path.string());
+		m_file.reset();
+		return false;
+	}
+	WorldFileHeader header;
+	std::memcpy(&header, m_file->GetData(), sizeof(header));
+	uint64_t cellCount = static_cast<uint64_t>(header.cellsPerSide) * header.cellsPerSide;
+	if (std::memcmp(header.magic, WORLD_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != WORLD_FILE_VERSION || cellCount == 0
+		|| m_file->GetSize() < sizeof(WorldFileHeader) + cellCount * sizeof(WorldFileCell)) {
+		SPDLOG_ERROR("\"{}\" is not a world file", path.string());
+		m_file.reset();
+		return false;
+	}
+
+	m_cells.resize(cellCount);
+	float worldOrigin = -0.5f * header.cellsPerSide * header.cellSize;
+	for (uint64_t i = 0; i < cellCount; ++i) {
+		WorldFileCell fileCell;
+		std::memcpy(&fileCell, m_file->GetData() + sizeof(WorldFileHeader) + i * sizeof(WorldFileCell), sizeof(fileCell));
+		if (fileCell.offset + fileCell.objectCount * sizeof(ObjectRecord) > m_file->GetSize()) {
+			SPDLOG_ERROR("World file \"{}\" is truncated", path.string());
+			m_cells.clear();
+			m_file.reset();
+			return false;
+		}
+		Cell& cell = m_cells[i];
+		cell.center = glm::vec2(worldOrigin) + (glm::vec2(i % header.cellsPerSide, i / header.cellsPerSide) + 0.5f) * header.cellSize;
+		cell.offset = fileCell.offset;
+		cell.objectCount = fileCell.objectCount;
+	}
+	m_callbacks = callbacks;
+
+	m_stopLoaders = false;
+	for (uint32_t i = 0; i < LOADER_THREAD_COUNT; ++i) {
+		m_loaders.emplace_back(&WorldStreamer::loaderMain, this);
+	}
+	SPDLOG_INFO("Opened world \"{}\": {}x{} cells of {} m.", path.string(), header.cellsPerSide, header.cellsPerSide, header.cellSize);
+	return true;
+}
+
+void WorldStreamer::Close()
+{
+	if (!m_loaders.empty()) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stopLoaders = true;
+		}
+		m_condition.notify_all();
+		for (std::thread& loader : m_loaders) {
+			loader.join();
+		}
+		m_loaders.clear();
+	}
+	m_requests.clear();
+	m_loaded.clear();
+
+	for (Cell& cell : m_cells) {
+		removeAll(cell);
+	}
+	m_cells.clear();
+	m_addQueue.clear();
+	m_removeQueue.clear();
+	m_residentCellCount = 0;
+	m_residentObjectCount = 0;
+	m_file.reset();
+}
+
+bool WorldStreamer::Update(const glm::vec3& cameraPosition)
+{
+	TRACE_ZONE("WorldStreamer::Update");
+	if (!IsOpen()) {
+		return false;
+	}
+	uint64_t startNs = Trace::NowNs();
+	glm::vec2 camera = glm::vec2(cameraPosition);
+	bool loading = false;
+	bool requested = false;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (Cell& cell : m_cells) {
+			cell.distance = glm::distance(cell.center, camera);
+			cell.wanted = cell.distance <= m_loadRadius || (cell.wanted && cell.distance <= m_unloadRadius);
+		}
+
+		// Cells that went out of range before getting decoded are simply dropped
+		for (LoadedCell& loadedCell : m_loaded) {
+			Cell& cell = m_cells[loadedCell.cell];
+			if (cell.wanted) {
+				cell.records = std::move(loadedCell.records);
+				cell.modelMatrices = std::move(loadedCell.modelMatrices);
+				cell.state = CellState::Loaded;
+				++m_loadedCellCount;
+			} else {
+				cell.state = CellState::Unloaded;
+			}
+		}
+		m_loaded.clear();
+
+		// Requests are redone every frame, nearest first, so the loaders always work on what's closest to the camera
+		for (uint32_t cellId : m_requests) {
+			m_cells[cellId].state = CellState::Unloaded;
+		}
+		m_requests.clear();
+		for (uint32_t i = 0; i < m_cells.size(); ++i) {
+			if (m_cells[i].wanted && m_cells[i].state == CellState::Unloaded) {
+				m_cells[i].state = CellState::Queued;
+				m_requests.push_back(i);
+			}
+			loading = loading || m_cells[i].state == CellState::Loading;
+		}
+		std::sort(m_requests.begin(), m_requests.end(), [this](uint32_t a, uint32_t b) { return m_cells[a].distance < m_cells[b].distance; });
+		requested = !m_requests.empty();
+
+		m_addQueue.clear();
+		m_removeQueue.clear();
+		for (uint32_t i = 0; i < m_cells.size(); ++i) {
+			Cell& cell = m_cells[i];
+			bool inScene = cell.state == CellState::Adding || cell.state == CellState::Resident || cell.state == CellState::Removing;
+			if (cell.wanted && (cell.state == CellState::Loaded || cell.state == CellState::Adding)) {
+				m_addQueue.push_back(i);
+			} else if (inScene && (!cell.wanted || cell.state == CellState::Removing)) { // Back in range while removing: finish, then reload
+				m_removeQueue.push_back(i);
+			} else if (!cell.wanted && cell.state == CellState::Loaded) {
+				cell.records.clear();
+				cell.modelMatrices.clear();
+				cell.state = CellState::Unloaded;
+			}
+		}
+	}
+	if (requested) {
+		m_condition.notify_all();
+	}
+	std::sort(m_addQueue.begin(), m_addQueue.end(), [this](uint32_t a, uint32_t b) { return m_cells[a].distance > m_cells[b].distance; });
+
+	// Removing first, it's cheaper and keeps the scene from growing. The budget is checked after every object
+	bool changed = !m_addQueue.empty() || !m_removeQueue.empty();
+	auto withinBudget = [this, startNs]() { return m_budgetMs <= 0.0f || (Trace::NowNs() - startNs) * 1e-6f < m_budgetMs; };
+	while (!m_removeQueue.empty() && withinBudget()) {
+		if (!removeObject(m_cells[m_removeQueue.back()])) {
+			m_removeQueue.pop_back();
+		}
+	}
+	while (!m_addQueue.empty() && withinBudget()) {
+		if (!addObject(m_cells[m_addQueue.back()])) {
+			m_addQueue.pop_back();
+		}
+	}
+
+	m_lastUpdateMs = (Trace::NowNs() - startNs) * 1e-6f;
+	m_maxUpdateMs = std::max(m_maxUpdateMs, m_lastUpdateMs);
+	return changed || loading || requested;
+}
+
+bool WorldStreamer::IsSettled()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (const Cell& cell : m_cells) {
+		if (cell.wanted ? cell.state != CellState::Resident : cell.state != CellState::Unloaded) {
+			return false;
+		}
+	}
+	return m_loaded.empty();
+}
+
+bool WorldStreamer::addObject(Cell& cell)
+{
+	if (cell.state == CellState::Loaded) {
+		setState(cell, CellState::Adding);
+		cell.progress = 0;
+		cell.objects.reserve(cell.objectCount);
+	}
+	if (cell.progress < cell.objectCount) {
+		const ObjectRecord& record = cell.records[cell.progress];
+		cell.objects.push_back(m_callbacks.addObject(cell.modelMatrices[cell.progress]));
+		if (record.colliderHalfExtents != glm::vec3(0.0f)) {
+			physx::PxRigidStatic* actor = Physics::CreateStaticBox(toPhysicsPose(record),
+				physx::PxVec3(record.colliderHalfExtents.x, record.colliderHalfExtents.z, record.colliderHalfExtents.y));
+			Physics::GetWorld().GetScene()->addActor(*actor);
+			cell.actors.push_back(actor);
+		}
+		++cell.progress;
+		++m_residentObjectCount;
+	}
+	if (cell.progress < cell.objectCount) {
+		return true;
+	}
+	cell.records = {};
+	cell.modelMatrices = {};
+	setState(cell, CellState::Resident);
+	++m_residentCellCount;
+	return false;
+}
+
+bool WorldStreamer::removeObject(Cell& cell)
+{
+	if (cell.state == CellState::Resident) {
+		--m_residentCellCount;
+	}
+	if (cell.state != CellState::Removing) {
+		setState(cell, CellState::Removing);
+		cell.records = {};
+		cell.modelMatrices = {};
+	}
+	// An object and (if it has one) an actor at a time
+	if (!cell.actors.empty()) {
+		Physics::GetWorld().GetScene()->removeActor(*cell.actors.back());
+		cell.actors.back()->release();
+		cell.actors.pop_back();
+	}
+	if (!cell.objects.empty()) {
+		m_callbacks.removeObject(cell.objects.back());
+		cell.objects.pop_back();
+		--m_residentObjectCount;
+	}
+	if (!cell.objects.empty() || !cell.actors.empty()) {
+		return true;
+	}
+	cell.objects = {};
+	setState(cell, CellState::Unloaded);
+	++m_evictedCellCount;
+	return false;
+}
+
+void WorldStreamer::removeAll(Cell& cell)
+{
+	if (cell.state == CellState::Adding || cell.state == CellState::Resident || cell.state == CellState::Removing) {
+		while (removeObject(cell)) {
+		}
+	}
+	cell.records = {};
+	cell.modelMatrices = {};
+	setState(cell, CellState::Unloaded);
+}
+
+void WorldStreamer::setState(Cell& cell, CellState state)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	cell.state = state;
+}
+
+void WorldStreamer::loaderMain()
+{
+	Trace::SetThreadName("Cell loader");
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		m_condition.wait(lock, [this]() { return m_stopLoaders || !m_requests.empty(); });
+		if (m_stopLoaders) {
+			return;
+		}
+		uint32_t cellId = m_requests.front();
+		m_requests.pop_front();
+		Cell& cell = m_cells[cellId];
+		cell.state = CellState::Loading;
+		uint64_t offset = cell.offset;
+		uint32_t objectCount = cell.objectCount;
+		lock.unlock();
+
+		LoadedCell loadedCell;
+		{
+			TRACE_ZONE("LoadCell");
+			loadedCell.cell = cellId;
+			loadedCell.records.resize(objectCount);
+			std::memcpy(loadedCell.records.data(), m_file->GetData() + offset, objectCount * sizeof(ObjectRecord)); // Page faults (the disk reads) happen here
+			loadedCell.modelMatrices.reserve(objectCount);
+			for (const ObjectRecord& record : loadedCell.records) {
+				glm::mat4x4 modelMatrix = glm::translate(glm::mat4x4(1.0f), record.position);
+				modelMatrix = glm::rotate(modelMatrix, record.rotation, glm::vec3(0.0f, 0.0f, 1.0f));
+				loadedCell.modelMatrices.push_back(glm::scale(modelMatrix, glm::vec3(record.scale)));
+			}
+		}
+
+		lock.lock();
+		m_loaded.push_back(std::move(loadedCell));
+	}
+}
+
+void WorldStreamer::DrawImGui()
+{
+	if (!IsOpen()) {
+		return;
+	}
+	ImGui::Begin("World streaming");
+	ImGui::Text("Cells: %u / %zu resident, %zu to add, %zu to remove", m_residentCellCount, m_cells.size(), m_addQueue.size(), m_removeQueue.size());
+	ImGui::Text("Objects: %u", m_residentObjectCount);
+	ImGui::Text("Loaded: %llu cells, evicted: %llu", (unsigned long long)m_loadedCellCount, (unsigned long long)m_evictedCellCount);
+	ImGui::Text("Main thread: %.2f ms (max %.2f ms)", m_lastUpdateMs, m_maxUpdateMs);
+	ImGui::SliderFloat("Budget (ms)", &m_budgetMs, 0.0f, 8.0f, "%.2f");
+	if (ImGui::SliderFloat("Load radius", &m_loadRadius, 8.0f, 96.0f) || ImGui::SliderFloat("Unload radius", &m_unloadRadius, 8.0f, 128.0f)) {
+		m_unloadRadius = std::max(m_loadRadius, m_unloadRadius);
+	}
+	if (ImGui::Button("Reset max")) {
+		m_maxUpdateMs = 0.0f;
+	}
+	ImGui::End();
+}
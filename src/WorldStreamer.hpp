@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include <thread>
+#include <memory>
+#include <functional>
+#include <filesystem>
+#include <condition_variable>
+
+#include <glm/glm.hpp>
+
+#include "EntityStore.hpp"
+#include "MappedFile.hpp"
+
+namespace physx { class PxRigidStatic; }
+
+// Streams a world bigger than what fits in the scene. The world file (.world) splits it into a grid of square cells, each
+// listing its objects (instances of the loaded mesh, some with a static box collider). Cells near the camera are read and
+// decoded by loader threads, then added to the scene (objects and PhysX actors) on the main thread within a per-frame
+// budget, so a cell with many objects is spread over several frames. Cells past the unload radius are removed the same way
+class WorldStreamer
+{
+public:
+	static constexpr uint32_t LOADER_THREAD_COUNT = 2;
+	static constexpr float DEFAULT_LOAD_RADIUS = 32.0f; // To the cell center, in the ground plane
+	static constexpr float DEFAULT_UNLOAD_RADIUS = 40.0f; // Past the load radius, so cells on the edge don't come and go
+	static constexpr float DEFAULT_BUDGET_MS = 1.0f; // Main thread time per frame, 0 has no limit (whole cells at once)
+
+	// As stored in the world file (Z-up)
+	struct ObjectRecord
+	{
+		glm::vec3 position;
+		float rotation; // Around Z, in radians
+		float scale;
+		glm::vec3 colliderHalfExtents; // Static box collider centered on the object, none if zero
+	};
+
+	// Scene side of the objects, called on the main thread
+	struct SceneCallbacks
+	{
+		std::function<EntityStore::Entity(const glm::mat4x4& modelMatrix)> addObject;
+		std::function<void(EntityStore::Entity)> removeObject;
+	};
+
+	// A random world of cellsPerSide^2 cells centered on the origin
+	static bool GenerateWorld(const std::filesystem::path& path, uint32_t cellsPerSide, float cellSize, uint32_t objectsPerCell, uint32_t seed = 1);
+
+	bool Open(const std::filesystem::path& path, const SceneCallbacks& callbacks);
+	// Removes whatever is in the scene right away (no budget)
+	void Close();
+	bool IsOpen() const { return !m_cells.empty(); }
+
+	void SetRadii(float loadRadius, float unloadRadius) { m_loadRadius = loadRadius; m_unloadRadius = std::max(loadRadius, unloadRadius); }
+	void SetBudget(float budgetMs) { m_budgetMs = budgetMs; }
+
+	// Every frame on the main thread: queues the cells around the camera, then adds and removes objects until the budget is
+	// spent. Returns true when the scene changed or cells are still on their way
+	bool Update(const glm::vec3& cameraPosition);
+
+	// Main thread time of the last Update
+	float GetLastUpdateMs() const { return m_lastUpdateMs; }
+	uint32_t GetResidentCellCount() const { return m_residentCellCount; }
+	uint32_t GetResidentObjectCount() const { return m_residentObjectCount; }
+	bool IsSettled(); // Everything within the load radius is in the scene and nothing past the unload radius is
+
+	void DrawImGui();
+private:
+	enum class CellState
+	{
+		Unloaded,
+		Queued, // Waiting for a loader thread
+		Loading,
+		Loaded, // Decoded, waiting for the main thread
+		Adding,
+		Resident,
+		Removing
+	};
+
+	struct Cell
+	{
+		glm::vec2 center;
+		uint64_t offset = 0; // Of its records in the file
+		uint32_t objectCount = 0;
+		CellState state = CellState::Unloaded; // Only changed under m_mutex, the loaders do Queued -> Loading
+		bool wanted = false; // Within the load radius (or not yet past the unload radius once in)
+		float distance = 0.0f; // To the camera at the last Update
+		// Main thread only
+		std::vector<glm::mat4x4> modelMatrices; // Decoded by the loader
+		std::vector<ObjectRecord> records;
+		std::vector<EntityStore::Entity> objects;
+		std::vector<physx::PxRigidStatic*> actors;
+		uint32_t progress = 0; // Objects added so far (Adding) or left to remove (Removing)
+	};
+
+	struct LoadedCell
+	{
+		uint32_t cell;
+		std::vector<ObjectRecord> records;
+		std::vector<glm::mat4x4> modelMatrices;
+	};
+
+	std::unique_ptr<MappedFile> m_file;
+	SceneCallbacks m_callbacks;
+	std::vector<Cell> m_cells;
+	float m_loadRadius = DEFAULT_LOAD_RADIUS;
+	float m_unloadRadius = DEFAULT_UNLOAD_RADIUS;
+	float m_budgetMs = DEFAULT_BUDGET_MS;
+	std::vector<uint32_t> m_addQueue; // Loaded cells by distance, nearest last
+	std::vector<uint32_t> m_removeQueue;
+
+	// Loader threads
+	std::vector<std::thread> m_loaders;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::deque<uint32_t> m_requests; // Nearest first
+	std::deque<LoadedCell> m_loaded;
+	bool m_stopLoaders = false;
+
+	// Stats
+	float m_lastUpdateMs = 0.0f;
+	float m_maxUpdateMs = 0.0f;
+	uint32_t m_residentCellCount = 0;
+	uint32_t m_residentObjectCount = 0;
+	uint64_t m_loadedCellCount = 0;
+	uint64_t m_evictedCellCount = 0;
+
+	void loaderMain();
+	bool addObject(Cell& cell); // Adds the next one, false when the cell is complete
+	bool removeObject(Cell& cell);
+	void removeAll(Cell& cell);
+	void setState(Cell& cell, CellState state); // Takes m_mutex
+};